@@ -26,8 +26,16 @@
  * This file contains the Asterisk API for Kafka. Connections are configured
  * in \c kafka.conf. You can get a producer by name using \ref
  * ast_kafka_get_producer(), or a consumer using \ref ast_kafka_get_consumer().
+ * \ref ast_kafka_get_idempotent_producer() gets a producer whose retries
+ * cannot duplicate or reorder messages.
  *
- * Producer support uses \ref ast_kafka_produce().
+ * Producer support uses \ref ast_kafka_produce(); \ref ast_kafka_produce_batch()
+ * hands several messages for one topic to the client at once, and
+ * \ref ast_kafka_produce_owned() hands a payload over without copying it.
+ * \ref ast_kafka_produce_partition() and \ref ast_kafka_produce_batch_partition()
+ * bypass the client's partitioner for callers that pick partitions themselves,
+ * using \ref ast_kafka_partition_count().
+ * \ref ast_kafka_producer_stats() reports how far the producer is behind.
  *
  * Consumer support uses a callback-based model: subscribe to topics with
  * \ref ast_kafka_consumer_subscribe() and messages are delivered via callback
@@ -80,6 +88,24 @@ typedef void (*ast_kafka_message_cb)(
  */
 struct ast_kafka_producer *ast_kafka_get_producer(const char *name);
 
+/*!
+ * \brief Gets the given Kafka producer with idempotence enabled.
+ *
+ * Like \ref ast_kafka_get_producer(), but the client of the connection is
+ * created with \c enable.idempotence, which implies \c acks=all, at most
+ * five requests in flight per broker and unlimited retries, so a message
+ * the client retries is written once and in order. Both kinds of producer
+ * may be used on the same connection; each has its own client.
+ *
+ * The returned producer is an AO2 managed object, which must be freed with
+ * \ref ao2_cleanup().
+ *
+ * \param name The name of the connection.
+ * \return The producer object.
+ * \return \c NULL if connection not found, or some other error.
+ */
+struct ast_kafka_producer *ast_kafka_get_idempotent_producer(const char *name);
+
 /*!
  * \brief Produces a message to a Kafka topic.
  *
@@ -133,6 +159,241 @@ int ast_kafka_produce_hdrs(struct ast_kafka_producer *producer,
 	const struct ast_kafka_header *headers,
 	size_t header_count);
 
+/*!
+ * \brief Callback releasing a payload given to \ref ast_kafka_produce_owned().
+ *
+ * \param payload The payload that was produced.
+ * \param userdata User-supplied pointer from the produce call.
+ */
+typedef void (*ast_kafka_free_cb)(void *payload, void *userdata);
+
+/*!
+ * \brief Produces a message to a Kafka topic, taking over its payload.
+ *
+ * Behaves like \ref ast_kafka_produce_hdrs(), but the payload is not
+ * copied. On success the producer owns \a payload and calls \a free_cb
+ * once the message has been delivered or has finally failed, usually
+ * from the thread serving delivery reports. On failure nothing is taken
+ * over and \a free_cb is not called. The key and headers are copied.
+ *
+ * \param producer The producer to use.
+ * \param topic The topic to produce to.
+ * \param key The message key (may be NULL).
+ * \param payload The message payload.
+ * \param len The length of the payload.
+ * \param headers Array of key-value header pairs (may be NULL).
+ * \param header_count Number of headers in the array.
+ * \param free_cb Called with \a payload and \a userdata when it is released.
+ * \param userdata Opaque pointer passed to \a free_cb.
+ * \return 0 on success.
+ * \return -1 on failure; the caller still owns \a payload.
+ */
+int ast_kafka_produce_owned(struct ast_kafka_producer *producer,
+	const char *topic,
+	const char *key,
+	void *payload,
+	size_t len,
+	const struct ast_kafka_header *headers,
+	size_t header_count,
+	ast_kafka_free_cb free_cb,
+	void *userdata);
+
+/*!
+ * \brief A message for \ref ast_kafka_produce_batch().
+ *
+ * \c key, \c payload and \c headers follow the same rules as for
+ * \ref ast_kafka_produce_hdrs(). \c result is set by the producer.
+ */
+struct ast_kafka_message {
+	const char *key;
+	const void *payload;
+	size_t len;
+	const struct ast_kafka_header *headers;
+	size_t header_count;
+	/*! \brief 0 if the message was enqueued, -1 on failure */
+	int result;
+};
+
+/*!
+ * \brief Produces several messages to a Kafka topic in one call.
+ *
+ * Equivalent to calling \ref ast_kafka_produce_hdrs() for each message,
+ * but the topic is looked up once and the messages are handed to the
+ * client library together. Payloads are copied before this returns.
+ *
+ * \param producer The producer to use.
+ * \param topic The topic to produce to.
+ * \param messages Array of messages; each \c result is filled in.
+ * \param count Number of messages in the array.
+ * \return The number of messages enqueued.
+ */
+size_t ast_kafka_produce_batch(struct ast_kafka_producer *producer,
+	const char *topic,
+	struct ast_kafka_message *messages,
+	size_t count);
+
+/*!
+ * \brief Partition that leaves the choice to the client's partitioner.
+ */
+#define AST_KAFKA_PARTITION_ANY -1
+
+/*!
+ * \brief Gets the number of partitions of a topic.
+ *
+ * Answered from the metadata the client already holds; no broker is
+ * contacted, so a topic the producer has not used yet may be unknown.
+ *
+ * \param producer The producer to use.
+ * \param topic The topic.
+ * \return The number of partitions.
+ * \return -1 if it is not known.
+ */
+int ast_kafka_partition_count(struct ast_kafka_producer *producer,
+	const char *topic);
+
+/*!
+ * \brief Produces a message to a given partition of a Kafka topic.
+ *
+ * Behaves like \ref ast_kafka_produce_owned() when \a free_cb is set and
+ * like \ref ast_kafka_produce_hdrs() when it is NULL, in which case the
+ * payload is copied. The message goes to \a partition instead of the one
+ * the client's partitioner would pick for \a key.
+ *
+ * \param producer The producer to use.
+ * \param topic The topic to produce to.
+ * \param partition The partition, or \ref AST_KAFKA_PARTITION_ANY.
+ * \param key The message key (may be NULL).
+ * \param payload The message payload.
+ * \param len The length of the payload.
+ * \param headers Array of key-value header pairs (may be NULL).
+ * \param header_count Number of headers in the array.
+ * \param free_cb Called with \a payload and \a userdata when it is released,
+ *        or NULL to have the payload copied.
+ * \param userdata Opaque pointer passed to \a free_cb.
+ * \return 0 on success.
+ * \return -1 on failure, including a partition the topic does not have;
+ *         the caller still owns \a payload.
+ */
+int ast_kafka_produce_partition(struct ast_kafka_producer *producer,
+	const char *topic,
+	int32_t partition,
+	const char *key,
+	void *payload,
+	size_t len,
+	const struct ast_kafka_header *headers,
+	size_t header_count,
+	ast_kafka_free_cb free_cb,
+	void *userdata);
+
+/*!
+ * \brief Produces several messages to one partition of a Kafka topic.
+ *
+ * Equivalent to \ref ast_kafka_produce_batch(), but every message goes to
+ * \a partition, so the client can put them in a single request.
+ *
+ * \param producer The producer to use.
+ * \param topic The topic to produce to.
+ * \param partition The partition, or \ref AST_KAFKA_PARTITION_ANY.
+ * \param messages Array of messages; each \c result is filled in.
+ * \param count Number of messages in the array.
+ * \return The number of messages enqueued.
+ */
+size_t ast_kafka_produce_batch_partition(struct ast_kafka_producer *producer,
+	const char *topic,
+	int32_t partition,
+	struct ast_kafka_message *messages,
+	size_t count);
+
+/*!
+ * \brief Outcome of a message, passed to an \ref ast_kafka_delivery_cb.
+ */
+struct ast_kafka_delivery {
+	/*! \brief 0 if the broker acknowledged the message, -1 if it finally failed */
+	int result;
+	/*! \brief Partition the message went to, or -1 if it never got one */
+	int32_t partition;
+	/*! \brief Offset of the message in the partition, or -1 on failure */
+	int64_t offset;
+	/*! \brief Broker timestamp of the message in ms since the epoch, or -1 */
+	int64_t timestamp_ms;
+	/*! \brief Error description on failure, NULL on success */
+	const char *error;
+};
+
+/*!
+ * \brief Callback invoked once the outcome of a message is known.
+ *
+ * Called from the thread serving delivery reports, exactly once per
+ * message enqueued by \ref ast_kafka_produce_report(). The payload is
+ * the caller's again when it is called; \a report is only valid during
+ * the call.
+ *
+ * \param payload The payload passed to \ref ast_kafka_produce_report().
+ * \param report The delivery result.
+ * \param userdata Opaque pointer passed to \ref ast_kafka_produce_report().
+ */
+typedef void (*ast_kafka_delivery_cb)(void *payload,
+	const struct ast_kafka_delivery *report, void *userdata);
+
+/*!
+ * \brief Produces a message to a Kafka topic and reports its delivery.
+ *
+ * Behaves like \ref ast_kafka_produce_partition() with a free callback,
+ * but \a delivery_cb is also told whether the broker acknowledged the
+ * message, and when, after the client has given up retrying. On failure
+ * nothing is taken over and \a delivery_cb is not called.
+ *
+ * \param producer The producer to use.
+ * \param topic The topic to produce to.
+ * \param partition The partition, or \ref AST_KAFKA_PARTITION_ANY.
+ * \param key The message key (may be NULL).
+ * \param payload The message payload.
+ * \param len The length of the payload.
+ * \param headers Array of key-value header pairs (may be NULL).
+ * \param header_count Number of headers in the array.
+ * \param delivery_cb Called with \a payload, the result and \a userdata
+ *        once the message is delivered or has finally failed.
+ * \param userdata Opaque pointer passed to \a delivery_cb.
+ * \return 0 on success.
+ * \return -1 on failure; the caller still owns \a payload.
+ */
+int ast_kafka_produce_report(struct ast_kafka_producer *producer,
+	const char *topic,
+	int32_t partition,
+	const char *key,
+	void *payload,
+	size_t len,
+	const struct ast_kafka_header *headers,
+	size_t header_count,
+	ast_kafka_delivery_cb delivery_cb,
+	void *userdata);
+
+/*!
+ * \brief State of a producer's queue, from \ref ast_kafka_producer_stats().
+ */
+struct ast_kafka_producer_stats {
+	/*! \brief Messages produced and not yet delivered or failed */
+	size_t queue_len;
+	/*! \brief Payload bytes of those messages */
+	size_t queue_bytes;
+	/*! \brief Mean time from produce to delivery report of recently delivered
+	 *         messages, in microseconds; 0 if none were delivered lately */
+	uint64_t delivery_latency_us;
+};
+
+/*!
+ * \brief Gets the state of a producer's queue.
+ *
+ * Cheap enough to call several times a second; no broker is contacted.
+ *
+ * \param producer The producer to query.
+ * \param stats Filled in on success.
+ * \return 0 on success.
+ * \return -1 on failure.
+ */
+int ast_kafka_producer_stats(struct ast_kafka_producer *producer,
+	struct ast_kafka_producer_stats *stats);
+
 /*!
  * \brief Gets the given Kafka consumer.
  *
@@ -206,4 +467,19 @@ int ast_kafka_ensure_topic(struct ast_kafka_producer *producer,
 int ast_kafka_ensure_topic_async(struct ast_kafka_producer *producer,
 	const char *topic, int num_partitions, int replication_factor);
 
+/*!
+ * \brief Prepare a producer for a topic without producing to it.
+ *
+ * Creates the client's handle for the topic and asks the brokers for its
+ * metadata in the background, so the first message to it does not wait
+ * for either. \ref ast_kafka_partition_count() answers for the topic once
+ * the metadata has arrived.
+ *
+ * \param producer The producer to prepare.
+ * \param topic The topic name.
+ * \return 0 if the metadata request was queued.
+ * \return -1 on failure.
+ */
+int ast_kafka_preload_topic(struct ast_kafka_producer *producer, const char *topic);
+
 #endif /* _ASTERISK_KAFKA_H */
@@ -51,12 +51,19 @@
 					<synopsis>Name of the connection from kafka.conf to use</synopsis>
 					<description>
 						<para>Specifies the name of the connection from kafka.conf to use</para>
+						<para>Up to four comma separated connections may be listed, in
+						order of preference. See connection_mode.</para>
 					</description>
 				</configOption>
 				<configOption name="topic">
 					<synopsis>Name of the topic to publish to</synopsis>
 					<description>
 						<para>Defaults to asterisk_cdr</para>
+						<para>May reference text fields of the CDR as ${field}, for
+						example cdr_${tenantid}, to give each tenant its own
+						topic. Characters Kafka does not allow in topic names are
+						replaced by an underscore, and a name that comes out empty
+						falls back to asterisk_cdr.</para>
 					</description>
 				</configOption>
 				<configOption name="key">
@@ -67,20 +74,589 @@
 						linkedid, uniqueid, channel, dstchannel, accountcode,
 						src, dst, dcontext, tenantid, peertenantid.
 						Empty (default) means no key.</para>
+						<para>Up to four fields may be given separated by
+						commas, e.g. <literal>tenantid,linkedid</literal>.
+						Their values are joined with ':' to form the key.</para>
+					</description>
+				</configOption>
+				<configOption name="async">
+					<synopsis>Publish CDRs from separate threads</synopsis>
+					<description>
+						<para>When enabled, the CDR engine thread only copies each CDR
+						onto a bounded in-memory queue and returns. Publisher
+						threads serialize the records and hand them to the Kafka
+						producer, so a slow broker or a full librdkafka queue no
+						longer holds up CDR dispatch for other backends.</para>
+						<para>Default is no.</para>
+					</description>
+				</configOption>
+				<configOption name="queue_size">
+					<synopsis>Capacity of the async queue</synopsis>
+					<description>
+						<para>Maximum number of CDRs waiting in the async queue. Rounded
+						up to a power of two.</para>
+						<para>Default is 8192.</para>
+					</description>
+				</configOption>
+				<configOption name="publisher_threads">
+					<synopsis>Number of async publisher threads</synopsis>
+					<description>
+						<para>Each thread has its own queue. CDRs are spread over them
+						by a hash of their key, or of their linkedid when key is
+						empty, so the CDRs of a key are published in order by one
+						thread. queue_size is shared between the threads.</para>
+						<para>Default is 1.</para>
+					</description>
+				</configOption>
+				<configOption name="overflow">
+					<synopsis>What to do when the async queue is full</synopsis>
+					<description>
+						<para>Default is block.</para>
+						<enumlist>
+							<enum name="block"><para>Wait until a publisher thread makes room.</para></enum>
+							<enum name="drop_oldest"><para>Discard the oldest queued CDR to make room for the new one.</para></enum>
+							<enum name="spool"><para>Write the new CDR to the disk spool. A CDR the spool cannot take is dropped. Without spool enabled, behaves like block.</para></enum>
+						</enumlist>
+					</description>
+				</configOption>
+				<configOption name="batch_size">
+					<synopsis>Maximum number of CDRs produced in one batch</synopsis>
+					<description>
+						<para>Publisher threads hand up to this many queued CDRs to
+						res_kafka in a single ast_kafka_produce_batch() call. Only
+						applies when async is enabled. The default of 1 produces
+						each CDR on its own.</para>
+						<para>With spool enabled the CDRs of a batch are produced one
+						by one instead, each with a delivery report, so those the
+						broker finally fails can be spooled.</para>
+					</description>
+				</configOption>
+				<configOption name="batch_linger_ms">
+					<synopsis>How long a partial batch waits for more CDRs</synopsis>
+					<description>
+						<para>Once a publisher thread has taken the first CDR of a
+						batch, it waits up to this many milliseconds for the batch
+						to fill before producing it. The default of 0 produces
+						whatever is queued right away.</para>
+					</description>
+				</configOption>
+				<configOption name="spool">
+					<synopsis>Spool CDRs Kafka does not take to disk</synopsis>
+					<description>
+						<para>When enabled, a CDR the producer rejects (or that overflow
+						= spool pushes out of a full queue) is appended to a
+						memory-mapped segment file under the Asterisk spool
+						directory (cdr_kafka/) instead of being lost. A background
+						thread replays the spooled CDRs in order once producing
+						works again, and segments left over from a crash are
+						replayed on the next start. Default is no.</para>
+					</description>
+				</configOption>
+				<configOption name="spool_segment_size">
+					<synopsis>Size of a spool segment file in bytes</synopsis>
+					<description>
+						<para>Spool segments are allocated at this size up front and
+						trimmed when sealed. A CDR larger than a segment cannot be
+						spooled. Default is 16777216.</para>
+					</description>
+				</configOption>
+				<configOption name="spool_replay_rate">
+					<synopsis>Spooled CDRs replayed per second</synopsis>
+					<description>
+						<para>Limits how fast the spool is replayed so catching up does
+						not crowd out live traffic. 0 replays as fast as the
+						producer takes them. Default is 500.</para>
+					</description>
+				</configOption>
+				<configOption name="fields">
+					<synopsis>Payload fields and their order</synopsis>
+					<description>
+						<para>Comma-separated list of the fields written to the JSON
+						payload, in that order. Valid names are the core fields
+						(clid, src, dst, dcontext, channel, dstchannel, lastapp,
+						lastdata, start, answer, end, durationsec, billsec,
+						disposition, accountcode, amaflags, peeraccount, linkedid,
+						sequence, tenantid, peertenantid, EntityID, SystemName)
+						plus uniqueid and userfield, matched case-insensitively.</para>
+						<para>A field may be renamed with name:key, e.g.
+						<literal>linkedid:call_id</literal>. Unknown fields and
+						repeated keys are ignored with a warning. When set,
+						loguniqueid and loguserfield are ignored and CDR variables
+						no longer replace fields of the same name.</para>
+						<para>The list is compiled once per reload. Empty (default)
+						keeps the standard layout.</para>
+					</description>
+				</configOption>
+				<configOption name="variables">
+					<synopsis>CDR variables written to the payload</synopsis>
+					<description>
+						<para>Comma-separated list of the CDR variables to include, in
+						that order, each optionally renamed with name:key. A
+						variable set more than once carries its last value.
+						<literal>*</literal> (default) includes every variable; an
+						empty value includes none. An item ending in
+						<literal>*</literal>, such as X_*, includes every variable
+						whose name starts with what comes before it.</para>
+					</description>
+				</configOption>
+				<configOption name="headers">
+					<synopsis>Kafka headers sent with every CDR</synopsis>
+					<description>
+						<para>Comma-separated list of the Kafka headers attached to each
+						message. Built-in headers are entity_id, system_name (only
+						sent when systemname is set in asterisk.conf),
+						asterisk_version, timestamp, hostname and dedupe_id (see
+						idempotent). Text fields of
+						the CDR, such as disposition, tenantid or accountcode, can
+						be added as well. Any header may be sent under another
+						name with name:header, e.g.
+						<literal>tenantid:tenant</literal>. At most 16 headers are
+						sent.</para>
+						<para>The fixed headers are built once per reload and shared by
+						all messages. Spooled CDRs keep the headers they were
+						spooled with and are replayed with them.</para>
+						<para>Default is
+						entity_id,system_name,asterisk_version,timestamp,hostname.
+						An empty value sends no headers.</para>
+					</description>
+				</configOption>
+				<configOption name="format">
+					<synopsis>Payload encoding</synopsis>
+					<description>
+						<para>Default is json. The binary formats use the fixed schemas
+						shipped in schemas/ (cdr.avsc and cdr.proto), which hold
+						the same fields as the JSON payload. Timestamps are
+						microseconds since the epoch, and CDR variables go in a
+						variables map. Messages use the Confluent wire format: a
+						zero byte, then the schema id as 4 big-endian bytes, then
+						for protobuf the message index 0, then the encoded record.
+						The fields and variables options only apply to json.</para>
+						<enumlist>
+							<enum name="json"><para>JSON object.</para></enum>
+							<enum name="avro"><para>Avro binary record (schemas/cdr.avsc).</para></enum>
+							<enum name="protobuf"><para>Protobuf message (schemas/cdr.proto).</para></enum>
+						</enumlist>
+					</description>
+				</configOption>
+				<configOption name="schema_id">
+					<synopsis>Schema registry id of the binary schema</synopsis>
+					<description>
+						<para>Id under which the schema for format has been registered
+						in the schema registry. It is written in front of every
+						binary payload. Default is 0.</para>
+					</description>
+				</configOption>
+				<configOption name="route_by">
+					<synopsis>CDR field the route option matches against</synopsis>
+					<description>
+						<para>Name of a text field of the CDR, such as accountcode or
+						tenantid. A CDR whose value of this field has a route is
+						published to the topic of that route instead of topic.
+						Empty (default) disables routing.</para>
+					</description>
+				</configOption>
+				<configOption name="route">
+					<synopsis>Topic for one value of the route_by field</synopsis>
+					<description>
+						<para>Given as value => topic, for example acct-100 =>
+						billing_cdr. May be repeated, once per value. Values must
+						match exactly.</para>
+					</description>
+				</configOption>
+				<configOption name="aggregate">
+					<synopsis>Publish all CDRs of a call as one message</synopsis>
+					<description>
+						<para>When enabled, CDRs sharing a linkedid are buffered and
+						published together as one JSON message of the form
+						{"linkedid": ..., "legs": [...]}, each leg being the CDR
+						as it would have been published on its own. The key, topic
+						and headers are those of the first CDR of the call.</para>
+						<para>A call is published shortly after CEL reports the
+						LINKEDID_END event for it, after aggregate_timeout
+						milliseconds without a new CDR, or as soon as it holds
+						aggregate_max_legs CDRs. LINKEDID_END must be enabled in
+						cel.conf for the first of these; otherwise only the other
+						two apply.</para>
+						<para>Only applies to format = json.</para>
+					</description>
+				</configOption>
+				<configOption name="aggregate_timeout">
+					<synopsis>How long a call waits for more CDRs, in milliseconds</synopsis>
+					<description>
+						<para>Buffered calls that get no new CDR for this long are
+						published. Must be between 100 and 3600000. Defaults to
+						30000.</para>
+					</description>
+				</configOption>
+				<configOption name="aggregate_max_legs">
+					<synopsis>Most CDRs in one call message</synopsis>
+					<description>
+						<para>A call is published as soon as it holds this many CDRs;
+						later CDRs of the same call start a new message. Must be
+						between 2 and 1024. Defaults to 64.</para>
+					</description>
+				</configOption>
+				<configOption name="filter">
+					<synopsis>Rule deciding whether a CDR is published</synopsis>
+					<description>
+						<para>A rule of the form "conditions => action". May be given
+						more than once; the rules are tried in order and the first
+						one whose conditions all hold decides. CDRs no rule
+						matches are published.</para>
+						<para>Conditions are joined with "&amp;" and compare a payload
+						field, named as in fields, with a value: "=", "!=" and
+						"^=" (starts with) for text fields such as disposition,
+						dcontext or channel, and "=", "!=", "&lt;", "&lt;=",
+						"&gt;" and "&gt;=" for billsec, durationsec and sequence.</para>
+						<para>The action is "keep", "drop", or "sample N" to publish the
+						CDRs of N percent of the calls. Sampling is decided by a
+						hash of the linkedid, so all CDRs of a call are kept or
+						dropped together.</para>
+						<para>Rules are checked before any copying or encoding. Dropped
+						CDRs are counted as Filtered in the statistics.</para>
+					</description>
+				</configOption>
+				<configOption name="max_variables">
+					<synopsis>Most CDR variables written to one payload</synopsis>
+					<description>
+						<para>Variables past this many are left out. 0 (default) means
+						no limit. Only applies to format = json.</para>
+					</description>
+				</configOption>
+				<configOption name="max_variable_length">
+					<synopsis>Longest CDR variable value written, in bytes</synopsis>
+					<description>
+						<para>Longer values are cut to this many bytes, never inside a
+						UTF-8 sequence. 0 (default) means no limit. Only applies
+						to format = json.</para>
+					</description>
+				</configOption>
+				<configOption name="nest_variables">
+					<synopsis>Write CDR variables in a vars object</synopsis>
+					<description>
+						<para>When enabled, the CDR variables are written as members of
+						a "vars" object instead of next to the fields, so a
+						variable can never replace or hide a field such as
+						EntityID. Defaults to no. Only applies to format = json.</para>
+					</description>
+				</configOption>
+				<configOption name="timestamps">
+					<synopsis>How JSON payloads write the CDR timestamps</synopsis>
+					<description>
+						<para>iso8601 (the default) writes start, answer and end as ISO
+						8601 strings in local time, e.g.
+						"2026-01-15T10:30:00.000-0300". epoch_ms and epoch_us
+						write them as integers: milliseconds or microseconds
+						since the epoch, 0 when not set.</para>
+						<para>The binary formats always use microseconds and ignore this
+						option.</para>
+					</description>
+				</configOption>
+				<configOption name="connection_mode">
+					<synopsis>How CDRs are spread over several connections</synopsis>
+					<description>
+						<para>With failover (the default) CDRs are published through the
+						first listed connection while it is healthy, and through
+						the next healthy one otherwise. A message the connection
+						in use does not take is retried on the next one. With
+						fanout every CDR is published through every connection,
+						and counts as published once any of them took it.</para>
+					</description>
+				</configOption>
+				<configOption name="idempotent">
+					<synopsis>Publish through idempotent producers</synopsis>
+					<description>
+						<para>When enabled, the producers of the connections are created
+						with enable.idempotence, so a message the client retries after
+						a timeout or a lost acknowledgement is written once and in
+						order. The producers then wait for all in-sync replicas.</para>
+						<para>Every message also gets a dedupe_id header, unless the
+						headers option lists it already: 16 hex digits of a 64-bit
+						hash of the entity id, uniqueid and sequence of the CDR. It
+						is the same whenever the CDR is published again, e.g. on
+						another connection after a failover, so consumers can drop
+						duplicates from the headers alone. Spooled CDRs keep it and
+						are replayed with it.</para>
+						<para>Default is no.</para>
+					</description>
+				</configOption>
+				<configOption name="failover_queue_depth">
+					<synopsis>Backlog that makes a connection unhealthy</synopsis>
+					<description>
+						<para>With connection_mode = failover, a connection whose
+						producer queue holds this many messages, or that holds this
+						many CDR payloads that were handed over and not yet
+						delivered, is failed over from. 0 ignores the backlog.
+						Default 50000.</para>
+					</description>
+				</configOption>
+				<configOption name="failover_error_rate">
+					<synopsis>Percentage of failed produce calls that makes a connection unhealthy</synopsis>
+					<description>
+						<para>With connection_mode = failover, a connection is failed
+						over from once this share of its produce calls in the last
+						second failed, out of 10 or more. 0 ignores errors.
+						Default 20.</para>
+					</description>
+				</configOption>
+				<configOption name="failover_recovery">
+					<synopsis>How long an unhealthy connection is left alone, in milliseconds</synopsis>
+					<description>
+						<para>A connection failed over from is switched back to once
+						this long has passed and its backlog is below
+						failover_queue_depth. Connections whose producer could not
+						be obtained are looked up again this often. Default 30000.</para>
+					</description>
+				</configOption>
+				<configOption name="backpressure_low">
+					<synopsis>Producer queue length below which CDRs are published directly</synopsis>
+					<description>
+						<para>Below this many messages in the producer queue, as
+						reported by res_kafka, CDRs are published as they come and
+						async batches do not wait for batch_linger_ms. From it,
+						batches wait to fill. With backpressure_high, spooling
+						stops once the queue is below it again. 0 disables.
+						Default 0.</para>
+					</description>
+				</configOption>
+				<configOption name="backpressure_high">
+					<synopsis>Producer queue length from which CDRs are spooled</synopsis>
+					<description>
+						<para>From this many messages in the producer queue CDRs are
+						written to the disk spool instead of being produced, until
+						the queue is below backpressure_low. Spool replay waits
+						for that as well. Needs spool = yes. 0 disables. Default
+						0.</para>
+					</description>
+				</configOption>
+				<configOption name="partitioner">
+					<synopsis>Who picks the partition of keyed CDRs</synopsis>
+					<description>
+						<para>With murmur2 the partition is computed in the module from
+						the message key, exactly as the Java Kafka client does,
+						and the message is produced to it directly. Async batches
+						are then split by partition, so each produce call fills a
+						single partition. Messages without a key, and topics whose
+						partition count res_kafka does not know yet, are left to
+						the client partitioner. Default default.</para>
+						<enumlist>
+							<enum name="default"><para>The partitioner configured for the connection in res_kafka.</para></enum>
+							<enum name="murmur2"><para>murmur2 of the key, positive, modulo the partition count.</para></enum>
+						</enumlist>
+					</description>
+				</configOption>
+				<configOption name="publisher_cpus">
+					<synopsis>CPUs the async publisher threads are pinned to</synopsis>
+					<description>
+						<para>Comma separated CPU numbers and ranges, such as 2-5,8.
+						Publisher thread i is pinned to the i-th CPU listed,
+						wrapping around when there are more threads than CPUs.
+						Empty leaves the threads to the scheduler. Linux only.
+						Default empty.</para>
+					</description>
+				</configOption>
+				<configOption name="warmup">
+					<synopsis>Prepare the Kafka connections and topics while loading</synopsis>
+					<description>
+						<para>When enabled, loading and reloading the module asks every
+						connection to create the topic and each route target if
+						they are missing, and to fetch their metadata, in the
+						background. CDRs are accepted right away; the first ones
+						just no longer wait for librdkafka.</para>
+						<para>Topics built from CDR fields are only known per CDR and
+						are not warmed up. The progress is shown by cdr kafka show
+						stats.</para>
+					</description>
+				</configOption>
+				<configOption name="warmup_timeout">
+					<synopsis>How long the warm-up waits for topic metadata, in milliseconds</synopsis>
+					<description>
+						<para>Once this passes, the warm-up is reported as timed out
+						with the number of topics whose metadata is known.
+						Publishing is not affected. Default is 10000.</para>
+					</description>
+				</configOption>
+				<configOption name="partitions">
+					<synopsis>Partitions of topics the warm-up creates</synopsis>
+					<description>
+						<para>Used only when warmup creates a topic that does not exist
+						yet. Default is 1.</para>
+					</description>
+				</configOption>
+				<configOption name="replication">
+					<synopsis>Replication factor of topics the warm-up creates</synopsis>
+					<description>
+						<para>Used only when warmup creates a topic that does not exist
+						yet. Default is 1.</para>
+					</description>
+				</configOption>
+				<configOption name="compression">
+					<synopsis>Compression of each payload</synopsis>
+					<description>
+						<para>Compresses every payload on its own, before it is handed
+						to Kafka. A zstd payload gets a content_encoding header
+						with the value zstd. This is independent of the
+						compression.codec of the librdkafka producer, which
+						compresses whole batches.</para>
+						<enumlist>
+							<enum name="none"><para>Payloads are sent as encoded.</para></enum>
+							<enum name="zstd"><para>Each payload is a zstd frame. Needs the module built with WITH_ZSTD=1, otherwise payloads are sent as encoded and a warning is logged.</para></enum>
+						</enumlist>
+					</description>
+				</configOption>
+				<configOption name="compression_level">
+					<synopsis>zstd compression level</synopsis>
+					<description>
+						<para>zstd level from 1 (fastest) to 19 (smallest). Default is
+						3.</para>
+					</description>
+				</configOption>
+				<configOption name="compression_dictionary">
+					<synopsis>zstd dictionary file</synopsis>
+					<description>
+						<para>Dictionary used to compress payloads with compression =
+						zstd, for example one trained with "zstd --train" on
+						sample payloads. A relative path is taken from the
+						Asterisk configuration directory. The dictionary is loaded
+						once per reload. The ID of a trained dictionary is sent in
+						a zstd_dict_id header so consumers can pick the dictionary
+						to decompress with. Empty (default) compresses without a
+						dictionary.</para>
+					</description>
+				</configOption>
+				<configOption name="summary_topic">
+					<synopsis>Topic compact summary records are published to</synopsis>
+					<description>
+						<para>When set, every CDR that is published is also sent to this
+						topic as a small JSON record that holds only the
+						summary_fields, for consumers such as live dashboards that
+						do not need the full CDR. The summary is built from the
+						same CDR right after the full payload, with the same key
+						and headers. A summary Kafka does not take is counted as
+						SummaryFailed. It is dropped and never spooled. CDRs
+						replayed from the spool get no summary. Empty (default)
+						sends no summaries.</para>
+					</description>
+				</configOption>
+				<configOption name="summary_fields">
+					<synopsis>Fields of the summary records</synopsis>
+					<description>
+						<para>CDR fields written to the summary records, in order, with
+						the same names and "name:key" renames as fields. CDR
+						variables are never included. The timestamps option
+						applies. Default is
+						disposition,billsec,tenantid,accountcode,start,answer,end.</para>
+					</description>
+				</configOption>
+				<configOption name="priority">
+					<synopsis>Rule giving the CDRs it matches a priority class in the async queue</synopsis>
+					<description>
+						<para>A rule of the form "conditions => class", with conditions
+						as in filter and a class of "high", "normal" or "low". May
+						be given more than once; the first rule whose conditions
+						all hold decides, and CDRs no rule matches are normal.
+						Only applies when async is enabled.</para>
+						<para>Each class has a ring of its own in every publisher
+						thread, all sharing the room queue_size gives the thread.
+						The thread takes priority_weights records from each class
+						in turn. With overflow = drop_oldest or spool, a full
+						queue sheds the oldest record of the lowest class below
+						the new CDR first (with drop_oldest, also of its own
+						class), and only sheds the new CDR when every queued
+						record ranks above it. Shed records are spooled with
+						overflow = spool and dropped otherwise. With
+						backpressure_high set, low class CDRs are shed as they
+						come while the producer queue is above it. The statistics
+						count shed records as ShedHigh, ShedNormal and ShedLow.</para>
+						<para>CDRs of one key keep their order within a class, but not
+						across classes.</para>
+					</description>
+				</configOption>
+				<configOption name="priority_weights">
+					<synopsis>Records taken from the high, normal and low classes in turn</synopsis>
+					<description>
+						<para>Three comma separated weights from 1 to 1000. A publisher
+						thread takes up to that many records from each priority
+						class before moving to the next, and moves on early when a
+						class is empty, so no class is starved. Defaults to 8,4,1.</para>
+					</description>
+				</configOption>
+				<configOption name="field_limits">
+					<synopsis>Longest value of each text field written, in bytes</synopsis>
+					<description>
+						<para>Comma separated field:bytes items, e.g.
+						"lastdata:256,userfield:1024", with the fields named as in
+						fields. Longer values are cut to that many bytes, never
+						inside a UTF-8 sequence. Only text fields can be capped.
+						Empty (default) caps none. Only applies to format = json.</para>
+						<para>The keys of the members cut by field_limits,
+						max_variable_length or max_payload_size are sent in a
+						"truncated" Kafka header, e.g. "lastdata,X_NOTES".</para>
+					</description>
+				</configOption>
+				<configOption name="max_payload_size">
+					<synopsis>Largest JSON payload written, in bytes</synopsis>
+					<description>
+						<para>Variables that would take the payload past this size,
+						before compression, are left out; later, smaller ones are
+						still written. The fields are always written. A record
+						whose fields alone are larger is counted as Oversized and
+						goes to oversize_topic, or is dropped and counted as
+						OversizeDrop. 0
+						(default) means no limit. Only applies to format = json.</para>
+						<para>Set it below the message.max.bytes of the broker, less the
+						size of the headers, so that no CDR is rejected as too
+						large.</para>
+					</description>
+				</configOption>
+				<configOption name="oversize_topic">
+					<synopsis>Topic records too large for max_payload_size go to whole</synopsis>
+					<description>
+						<para>A record whose fields alone are over max_payload_size is
+						published whole, without a truncated header, to this topic
+						instead of its own, so that nothing is lost. The topic
+						must not reference CDR fields. Empty (default) drops such
+						records. max_variable_length still
+						applies to them.</para>
 					</description>
 				</configOption>
 			</configObject>
 		</configFile>
 	</configInfo>
+	<manager name="CDRKafkaStats" language="en_US">
+		<synopsis>
+			Show CDR Kafka publish statistics.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+		</syntax>
+		<description>
+			<para>Returns the counters and stage latencies shown by
+			<literal>cdr kafka show stats</literal>. Latencies are in
+			nanoseconds, payload sizes in bytes.</para>
+		</description>
+	</manager>
  ***/
 
 #include "asterisk.h"
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "asterisk/cdr.h"
+#include "asterisk/cel.h"
+#include "asterisk/cli.h"
 #include "asterisk/config_options.h"
-#include "asterisk/json.h"
+#include "asterisk/dlinkedlists.h"
+#include "asterisk/localtime.h"
+#include "asterisk/manager.h"
 #include "asterisk/module.h"
 #include "asterisk/kafka.h"
 #include "asterisk/paths.h"
@@ -94,21 +670,230 @@
 /*! \brief Cached hostname, set once during load_module(). */
 static char cached_hostname[256];
 
+/*! \brief Cached entity id as text, set once during load_module(). */
+static char cached_eid[20];
+
+/*! \brief Action taken when the async queue is full. */
+enum cdr_kafka_overflow {
+	/*! \brief Wait for the publisher threads to make room */
+	CDR_KAFKA_OVERFLOW_BLOCK,
+	/*! \brief Discard the oldest queued record */
+	CDR_KAFKA_OVERFLOW_DROP_OLDEST,
+	/*! Write the CDR to the spool */
+	CDR_KAFKA_OVERFLOW_SPOOL,
+};
+
+/*! \brief Priority classes of the async queue, most important first. */
+enum cdr_kafka_priority {
+	CDR_KAFKA_PRIORITY_HIGH,
+	/*! \brief Class of the CDRs no priority rule matches */
+	CDR_KAFKA_PRIORITY_NORMAL,
+	CDR_KAFKA_PRIORITY_LOW,
+	CDR_KAFKA_PRIORITY_COUNT,
+};
+
+static const char * const priority_names[] = {
+	[CDR_KAFKA_PRIORITY_HIGH] = "high",
+	[CDR_KAFKA_PRIORITY_NORMAL] = "normal",
+	[CDR_KAFKA_PRIORITY_LOW] = "low",
+};
+
+/*! \brief Records taken from the high, normal and low classes in turn. */
+#define CDR_KAFKA_PRIORITY_WEIGHTS "8,4,1"
+
+/*! \brief Payload encoding. */
+enum cdr_kafka_format {
+	/*! \brief JSON object */
+	CDR_KAFKA_FORMAT_JSON,
+	/*! \brief Avro record in the Confluent wire format */
+	CDR_KAFKA_FORMAT_AVRO,
+	/*! \brief Protobuf message in the Confluent wire format */
+	CDR_KAFKA_FORMAT_PROTOBUF,
+};
+
+/*! \brief How timestamps are written in JSON payloads. */
+enum cdr_kafka_timestamps {
+	/*! \brief Local time text, as ast_json_timeval() writes it */
+	CDR_KAFKA_TS_ISO8601,
+	/*! \brief Milliseconds since the epoch */
+	CDR_KAFKA_TS_EPOCH_MS,
+	/*! \brief Microseconds since the epoch */
+	CDR_KAFKA_TS_EPOCH_US,
+};
+
+/*! \brief Who picks the partition of a message. */
+enum cdr_kafka_partitioner {
+	/*! \brief The client's partitioner, from the key */
+	CDR_KAFKA_PARTITIONER_DEFAULT,
+	/*! \brief This module, with the Java client's murmur2 key hash */
+	CDR_KAFKA_PARTITIONER_MURMUR2,
+};
+
+/*! \brief How each payload is compressed before it is produced. */
+enum cdr_kafka_compression {
+	/*! \brief Payloads are sent as encoded */
+	CDR_KAFKA_COMPRESSION_NONE,
+	/*! \brief Every payload is a zstd frame, optionally with a dictionary */
+	CDR_KAFKA_COMPRESSION_ZSTD,
+};
+
+/*! \brief How CDRs are spread over the configured connections. */
+enum cdr_kafka_connection_mode {
+	/*! \brief Publish through the first healthy connection */
+	CDR_KAFKA_CONNECTIONS_FAILOVER,
+	/*! \brief Publish through every connection */
+	CDR_KAFKA_CONNECTIONS_FANOUT,
+};
+
+/*! \brief Maximum number of connections CDRs are published through. */
+#define CDR_KAFKA_CONNECTIONS_MAX 4
+
+/*! \brief Most CPUs publisher_cpus may list. */
+#define CDR_KAFKA_CPUS_MAX 256
+
+/*! \brief Maximum number of CDR fields in a composite key. */
+#define CDR_KAFKA_KEY_FIELDS_MAX 4
+
+/*!
+ * \brief Size of the buffer a composite key is built in.
+ *
+ * Every key field is at most AST_MAX_UNIQUEID long, so a full composite
+ * key always fits.
+ */
+#define CDR_KAFKA_KEY_LEN (CDR_KAFKA_KEY_FIELDS_MAX * (AST_MAX_UNIQUEID + 1))
+
+/*! \brief Longest topic name Kafka accepts. */
+#define CDR_KAFKA_TOPIC_LEN 249
+
+/*! \brief What a real-time dashboard needs of a CDR. */
+#define CDR_KAFKA_SUMMARY_FIELDS "disposition,billsec,tenantid,accountcode,start,answer,end"
+
 /*! \brief global config structure */
 struct cdr_kafka_global_conf {
 	AST_DECLARE_STRING_FIELDS(
-		/*! \brief connection name */
+		/*! \brief connection names, in order of preference */
 		AST_STRING_FIELD(connection);
-		/*! \brief topic name */
+		/*! \brief topic name, may reference CDR fields as ${field} */
 		AST_STRING_FIELD(topic);
+		/*! \brief CDR field the routes are matched against */
+		AST_STRING_FIELD(route_by);
+		/*! \brief "value => topic" routes, one per line */
+		AST_STRING_FIELD(routes);
+		/*! \brief "conditions => action" filter rules, one per line */
+		AST_STRING_FIELD(filter);
+		/*! \brief "conditions => class" priority rules, one per line */
+		AST_STRING_FIELD(priority);
 		/*! \brief CDR field name to use as Kafka key */
 		AST_STRING_FIELD(key);
+		/*! \brief payload fields, in order */
+		AST_STRING_FIELD(fields);
+		/*! \brief CDR variables to include, "*" for all */
+		AST_STRING_FIELD(variables);
+		/*! \brief Kafka headers to send */
+		AST_STRING_FIELD(headers);
+		/*! \brief CPUs the publisher threads are pinned to, e.g. "2-5,8" */
+		AST_STRING_FIELD(publisher_cpus);
+		/*! \brief zstd dictionary file, relative to the configuration directory */
+		AST_STRING_FIELD(compression_dictionary);
+		/*! \brief topic summary records go to, empty for none */
+		AST_STRING_FIELD(summary_topic);
+		/*! \brief summary record fields, in order */
+		AST_STRING_FIELD(summary_fields);
+		/*! \brief caps on text fields, "field:bytes,..." */
+		AST_STRING_FIELD(field_limits);
+		/*! \brief topic oversized records go to whole, empty to send them cut */
+		AST_STRING_FIELD(oversize_topic);
 	);
+	/*! \brief how CDRs are spread over the connections */
+	enum cdr_kafka_connection_mode connection_mode;
+	/*! \brief whether the producers retry without duplicates, adds a dedupe_id header */
+	int idempotent;
+	/*! \brief messages in flight that make a connection unhealthy, 0 to ignore */
+	unsigned int failover_queue_depth;
+	/*! \brief percentage of failed produce calls that makes a connection unhealthy */
+	unsigned int failover_error_rate;
+	/*! \brief how long an unhealthy connection is not used, in milliseconds */
+	unsigned int failover_recovery;
+	/*! \brief producer queue length below which CDRs are published directly */
+	unsigned int backpressure_low;
+	/*! \brief producer queue length from which CDRs are spooled, 0 to disable */
+	unsigned int backpressure_high;
 	/*! \brief whether to log the unique id */
 	int loguniqueid;
 	/*! \brief whether to log the user field */
 	int loguserfield;
-
+	/*! \brief whether CDRs are queued and published by separate threads */
+	int async;
+	/*! \brief capacity of the async queue */
+	unsigned int queue_size;
+	/*! \brief number of async publisher threads */
+	unsigned int publisher_threads;
+	/*! \brief what to do when the async queue is full */
+	enum cdr_kafka_overflow overflow;
+	/*! \brief records drained from each priority class in turn */
+	unsigned int priority_weights[CDR_KAFKA_PRIORITY_COUNT];
+	/*! \brief payload encoding */
+	enum cdr_kafka_format format;
+	/*! \brief how JSON payloads write timestamps */
+	enum cdr_kafka_timestamps timestamps;
+	/*! \brief who picks the partition of keyed messages */
+	enum cdr_kafka_partitioner partitioner;
+	/*! \brief how each payload is compressed */
+	enum cdr_kafka_compression compression;
+	/*! \brief zstd compression level */
+	int compression_level;
+	/*! \brief schema registry id put in front of binary payloads */
+	unsigned int schema_id;
+	/*! \brief maximum number of CDRs handed to Kafka in one batch */
+	unsigned int batch_size;
+	/*! \brief how long to wait for a batch to fill, in milliseconds */
+	unsigned int batch_linger_ms;
+	/*! \brief whether CDRs Kafka does not take are spooled to disk */
+	int spool;
+	/*! \brief size of a spool segment file in bytes */
+	unsigned int spool_segment_size;
+	/*! \brief spooled CDRs replayed per second, 0 for unlimited */
+	unsigned int spool_replay_rate;
+	/*! \brief most CDR variables written to a payload, 0 for no limit */
+	unsigned int max_variables;
+	/*! \brief longest CDR variable value written in bytes, 0 for no limit */
+	unsigned int max_variable_length;
+	/*! \brief whether CDR variables are written in a "vars" object */
+	int nest_variables;
+	/*! \brief largest JSON payload in bytes before compression, 0 for no limit */
+	unsigned int max_payload_size;
+	/*! \brief whether the CDRs of a call are published as one message */
+	int aggregate;
+	/*! \brief how long a call waits for more CDRs, in milliseconds */
+	unsigned int aggregate_timeout;
+	/*! \brief most CDRs in one call message */
+	unsigned int aggregate_max_legs;
+	/*! \brief whether topics and producers are prepared before CDRs arrive */
+	int warmup;
+	/*! \brief how long the warm-up waits for topic metadata, in milliseconds */
+	unsigned int warmup_timeout;
+	/*! \brief partitions of topics the warm-up creates */
+	unsigned int partitions;
+	/*! \brief replication factor of topics the warm-up creates */
+	unsigned int replication;
+	/*! \brief offsets in struct ast_cdr of the key fields, resolved from \c key */
+	size_t key_offsets[CDR_KAFKA_KEY_FIELDS_MAX];
+	/*! \brief number of entries in \c key_offsets */
+	size_t key_field_count;
+	/*! \brief payload layout compiled from \c fields and \c variables; NULL for the default */
+	struct cdr_kafka_plan *plan;
+	/*! \brief summary layout compiled from \c summary_fields; NULL without summary_topic */
+	struct cdr_kafka_plan *summary;
+	/*! \brief Kafka headers compiled from \c headers */
+	struct cdr_kafka_headers *header_block;
+	/*! \brief topic selection compiled from \c topic, \c route_by and \c routes */
+	struct cdr_kafka_topics *topics;
+	/*! \brief filter rules compiled from \c filter; NULL if there are none */
+	struct cdr_kafka_filters *filters;
+	/*! \brief priority rules compiled from \c priority; NULL if there are none */
+	struct cdr_kafka_filters *priorities;
+	/*! \brief zstd dictionary loaded for \c compression; NULL without compression */
+	struct cdr_kafka_zstd *zstd;
 };
 
 /*! \brief cdr_kafka configuration */
@@ -119,8 +904,11 @@ struct cdr_kafka_conf {
 /*! \brief Locking container for safe configuration access. */
 static AO2_GLOBAL_OBJ_STATIC(confs);
 
-/*! \brief Cached Kafka producer for fast access from CDR threads. */
-static AO2_GLOBAL_OBJ_STATIC(cached_producer);
+/*! \brief Async publish queue; empty when publishing synchronously. */
+static AO2_GLOBAL_OBJ_STATIC(async_queue);
+
+/*! \brief The running or finished warm-up, NULL with warmup = no */
+static AO2_GLOBAL_OBJ_STATIC(cdr_warmup);
 
 static struct aco_type global_option = {
 	.type = ACO_GLOBAL,
@@ -132,305 +920,10709 @@ static struct aco_type global_option = {
 
 static struct aco_type *global_options[] = ACO_TYPES(&global_option);
 
-static void conf_global_dtor(void *obj)
+static int overflow_handler(const struct aco_option *opt,
+	struct ast_variable *var, void *obj)
 {
 	struct cdr_kafka_global_conf *global = obj;
-	ast_string_field_free_memory(global);
+
+	if (!strcasecmp(var->value, "block")) {
+		global->overflow = CDR_KAFKA_OVERFLOW_BLOCK;
+	} else if (!strcasecmp(var->value, "drop_oldest")) {
+		global->overflow = CDR_KAFKA_OVERFLOW_DROP_OLDEST;
+	} else if (!strcasecmp(var->value, "spool")) {
+		global->overflow = CDR_KAFKA_OVERFLOW_SPOOL;
+	} else {
+		ast_log(LOG_ERROR, "Invalid overflow value '%s'\n", var->value);
+		return -1;
+	}
+
+	return 0;
 }
 
-static struct cdr_kafka_global_conf *conf_global_create(void)
+static int connection_mode_handler(const struct aco_option *opt,
+	struct ast_variable *var, void *obj)
+{
+	struct cdr_kafka_global_conf *global = obj;
+
+	if (!strcasecmp(var->value, "failover")) {
+		global->connection_mode = CDR_KAFKA_CONNECTIONS_FAILOVER;
+	} else if (!strcasecmp(var->value, "fanout")) {
+		global->connection_mode = CDR_KAFKA_CONNECTIONS_FANOUT;
+	} else {
+		ast_log(LOG_ERROR, "Invalid connection_mode value '%s'\n", var->value);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int format_handler(const struct aco_option *opt,
+	struct ast_variable *var, void *obj)
+{
+	struct cdr_kafka_global_conf *global = obj;
+
+	if (!strcasecmp(var->value, "json")) {
+		global->format = CDR_KAFKA_FORMAT_JSON;
+	} else if (!strcasecmp(var->value, "avro")) {
+		global->format = CDR_KAFKA_FORMAT_AVRO;
+	} else if (!strcasecmp(var->value, "protobuf")) {
+		global->format = CDR_KAFKA_FORMAT_PROTOBUF;
+	} else {
+		ast_log(LOG_ERROR, "Invalid format value '%s'\n", var->value);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int timestamps_handler(const struct aco_option *opt,
+	struct ast_variable *var, void *obj)
+{
+	struct cdr_kafka_global_conf *global = obj;
+
+	if (!strcasecmp(var->value, "iso8601")) {
+		global->timestamps = CDR_KAFKA_TS_ISO8601;
+	} else if (!strcasecmp(var->value, "epoch_ms")) {
+		global->timestamps = CDR_KAFKA_TS_EPOCH_MS;
+	} else if (!strcasecmp(var->value, "epoch_us")) {
+		global->timestamps = CDR_KAFKA_TS_EPOCH_US;
+	} else {
+		ast_log(LOG_ERROR, "Invalid timestamps value '%s'\n", var->value);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int compression_handler(const struct aco_option *opt,
+	struct ast_variable *var, void *obj)
+{
+	struct cdr_kafka_global_conf *global = obj;
+
+	if (!strcasecmp(var->value, "none")) {
+		global->compression = CDR_KAFKA_COMPRESSION_NONE;
+	} else if (!strcasecmp(var->value, "zstd")) {
+#ifdef HAVE_ZSTD
+		global->compression = CDR_KAFKA_COMPRESSION_ZSTD;
+#else
+		ast_log(LOG_WARNING, "cdr_kafka was built without zstd, payloads are not compressed\n");
+		global->compression = CDR_KAFKA_COMPRESSION_NONE;
+#endif
+	} else {
+		ast_log(LOG_ERROR, "Invalid compression value '%s'\n", var->value);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int partitioner_handler(const struct aco_option *opt,
+	struct ast_variable *var, void *obj)
+{
+	struct cdr_kafka_global_conf *global = obj;
+
+	if (!strcasecmp(var->value, "default")) {
+		global->partitioner = CDR_KAFKA_PARTITIONER_DEFAULT;
+	} else if (!strcasecmp(var->value, "murmur2")) {
+		global->partitioner = CDR_KAFKA_PARTITIONER_MURMUR2;
+	} else {
+		ast_log(LOG_ERROR, "Invalid partitioner value '%s'\n", var->value);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int route_handler(const struct aco_option *opt,
+	struct ast_variable *var, void *obj)
+{
+	struct cdr_kafka_global_conf *global = obj;
+	char *prev;
+
+	/* Every route line adds to the ones before it */
+	if (ast_strlen_zero(var->value)) {
+		return 0;
+	}
+	if (ast_strlen_zero(global->routes)) {
+		return ast_string_field_set(global, routes, var->value);
+	}
+
+	prev = ast_strdupa(global->routes);
+	return ast_string_field_build(global, routes, "%s\n%s", prev, var->value);
+}
+
+static int filter_handler(const struct aco_option *opt,
+	struct ast_variable *var, void *obj)
+{
+	struct cdr_kafka_global_conf *global = obj;
+	char *prev;
+
+	/* Every filter line adds a rule after the ones before it */
+	if (ast_strlen_zero(var->value)) {
+		return 0;
+	}
+	if (ast_strlen_zero(global->filter)) {
+		return ast_string_field_set(global, filter, var->value);
+	}
+
+	prev = ast_strdupa(global->filter);
+	return ast_string_field_build(global, filter, "%s\n%s", prev, var->value);
+}
+
+static int priority_handler(const struct aco_option *opt,
+	struct ast_variable *var, void *obj)
+{
+	struct cdr_kafka_global_conf *global = obj;
+	char *prev;
+
+	/* Every priority line adds a rule after the ones before it */
+	if (ast_strlen_zero(var->value)) {
+		return 0;
+	}
+	if (ast_strlen_zero(global->priority)) {
+		return ast_string_field_set(global, priority, var->value);
+	}
+
+	prev = ast_strdupa(global->priority);
+	return ast_string_field_build(global, priority, "%s\n%s", prev, var->value);
+}
+
+static int priority_weights_handler(const struct aco_option *opt,
+	struct ast_variable *var, void *obj)
+{
+	struct cdr_kafka_global_conf *global = obj;
+	char *copy = ast_strdupa(var->value);
+	char *weight;
+	size_t count = 0;
+
+	while ((weight = strsep(&copy, ","))) {
+		unsigned long value;
+		char *end;
+
+		weight = ast_strip(weight);
+		errno = 0;
+		value = strtoul(weight, &end, 10);
+		if (count == CDR_KAFKA_PRIORITY_COUNT || errno || end == weight || *end
+			|| value < 1 || value > 1000) {
+			count = 0;
+			break;
+		}
+		global->priority_weights[count++] = value;
+	}
+	if (count != CDR_KAFKA_PRIORITY_COUNT) {
+		ast_log(LOG_ERROR, "Invalid priority_weights '%s', expected three weights "
+			"from 1 to 1000 such as %s\n", var->value, CDR_KAFKA_PRIORITY_WEIGHTS);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void conf_global_dtor(void *obj)
+{
+	struct cdr_kafka_global_conf *global = obj;
+	ao2_cleanup(global->plan);
+	ao2_cleanup(global->summary);
+	ao2_cleanup(global->header_block);
+	ao2_cleanup(global->topics);
+	ao2_cleanup(global->filters);
+	ao2_cleanup(global->priorities);
+	ao2_cleanup(global->zstd);
+	ast_string_field_free_memory(global);
+}
+
+static struct cdr_kafka_global_conf *conf_global_create(void)
+{
+	RAII_VAR(struct cdr_kafka_global_conf *, global, NULL, ao2_cleanup);
+
+	global = ao2_alloc(sizeof(*global), conf_global_dtor);
+	if (!global) {
+		return NULL;
+	}
+
+	if (ast_string_field_init(global, 64) != 0) {
+		return NULL;
+	}
+
+	aco_set_defaults(&global_option, "global", global);
+
+	return ao2_bump(global);
+}
+
+/*! \brief The conf file that's processed for the module. */
+static struct aco_file conf_file = {
+	/*! The config file name. */
+	.filename = CONF_FILENAME,
+	/*! The mapping object types to be processed. */
+	.types = ACO_TYPES(&global_option),
+};
+
+static void conf_dtor(void *obj)
+{
+	struct cdr_kafka_conf *conf = obj;
+
+	ao2_cleanup(conf->global);
+}
+
+static void *conf_alloc(void)
+{
+	RAII_VAR(struct cdr_kafka_conf *, conf, NULL, ao2_cleanup);
+
+	conf = ao2_alloc_options(sizeof(*conf), conf_dtor,
+		AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!conf) {
+		return NULL;
+	}
+
+	conf->global = conf_global_create();
+	if (!conf->global) {
+		return NULL;
+	}
+
+	return ao2_bump(conf);
+}
+
+static int setup_kafka(void);
+static int plan_compile(struct cdr_kafka_global_conf *global);
+static int summary_compile(struct cdr_kafka_global_conf *global);
+static int headers_compile(struct cdr_kafka_global_conf *global);
+static int topics_compile(struct cdr_kafka_global_conf *global);
+static int filters_compile(struct cdr_kafka_global_conf *global);
+static int zstd_compile(struct cdr_kafka_global_conf *global);
+
+CONFIG_INFO_STANDARD(cfg_info, confs, conf_alloc,
+	.files = ACO_FILES(&conf_file),
+	.pre_apply_config = setup_kafka,
+);
+
+/*! \brief A CDR field that can be used as (part of) the Kafka key. */
+struct cdr_kafka_key_field {
+	const char *name;
+	size_t offset;
+};
+
+#define CDR_KEY_FIELD(field) { #field, offsetof(struct ast_cdr, field) }
+
+static const struct cdr_kafka_key_field key_fields[] = {
+	CDR_KEY_FIELD(linkedid),
+	CDR_KEY_FIELD(uniqueid),
+	CDR_KEY_FIELD(channel),
+	CDR_KEY_FIELD(dstchannel),
+	CDR_KEY_FIELD(accountcode),
+	CDR_KEY_FIELD(src),
+	CDR_KEY_FIELD(dst),
+	CDR_KEY_FIELD(dcontext),
+	CDR_KEY_FIELD(tenantid),
+	CDR_KEY_FIELD(peertenantid),
+};
+
+/*! \return The key field called \a name (case-insensitive), or NULL. */
+static const struct cdr_kafka_key_field *key_field_find(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_LEN(key_fields); i++) {
+		if (!strcasecmp(name, key_fields[i].name)) {
+			return &key_fields[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*!
+ * \brief Extract the value of a named CDR field for use as Kafka key.
+ *
+ * \param cdr The CDR record.
+ * \param field_name The CDR field name (e.g. "linkedid", "src").
+ * \return The field value string, or NULL if field_name is empty/unknown.
+ */
+const char *cdr_get_key_value(struct ast_cdr *cdr, const char *field_name);
+const char *cdr_get_key_value(struct ast_cdr *cdr, const char *field_name)
+{
+	const struct cdr_kafka_key_field *field;
+
+	if (ast_strlen_zero(field_name)) {
+		return NULL;
+	}
+
+	field = key_field_find(field_name);
+	if (!field) {
+		return NULL;
+	}
+
+	return (const char *) cdr + field->offset;
+}
+
+/*!
+ * \brief Resolve the comma separated \c key option into field offsets.
+ *
+ * Unknown fields are reported and left out of the key.
+ */
+static void resolve_key(struct cdr_kafka_global_conf *global)
+{
+	char *spec = ast_strdupa(global->key);
+	char *name;
+
+	global->key_field_count = 0;
+
+	while ((name = strsep(&spec, ","))) {
+		const struct cdr_kafka_key_field *field;
+
+		name = ast_strip(name);
+		if (ast_strlen_zero(name)) {
+			continue;
+		}
+
+		field = key_field_find(name);
+		if (!field) {
+			ast_log(LOG_WARNING, "Unknown CDR field '%s' in key, ignoring it\n", name);
+			continue;
+		}
+		if (global->key_field_count == CDR_KAFKA_KEY_FIELDS_MAX) {
+			ast_log(LOG_WARNING, "Key has more than %d fields, ignoring '%s'\n",
+				CDR_KAFKA_KEY_FIELDS_MAX, name);
+			continue;
+		}
+		global->key_offsets[global->key_field_count++] = field->offset;
+	}
+}
+
+/*!
+ * \brief Get the Kafka key of a CDR.
+ *
+ * A single field key points straight into the CDR. The fields of a
+ * composite key are joined with ':' in \a buf.
+ *
+ * \param global Configuration with the resolved key.
+ * \param cdr The CDR record.
+ * \param buf Buffer of at least CDR_KAFKA_KEY_LEN bytes.
+ * \return The key, or NULL if no key is configured.
+ */
+static const char *cdr_kafka_key(const struct cdr_kafka_global_conf *global,
+	struct ast_cdr *cdr, char *buf)
+{
+	char *pos = buf;
+	size_t i;
+
+	if (!global->key_field_count) {
+		return NULL;
+	} else if (global->key_field_count == 1) {
+		return (const char *) cdr + global->key_offsets[0];
+	}
+
+	for (i = 0; i < global->key_field_count; i++) {
+		const char *value = (const char *) cdr + global->key_offsets[i];
+		size_t len = strlen(value);
+
+		if (i) {
+			*pos++ = ':';
+		}
+		memcpy(pos, value, len);
+		pos += len;
+	}
+	*pos = '\0';
+
+	return buf;
+}
+
+/*!
+ * \brief Parse a CPU list such as "2-5,8".
+ *
+ * \param[out] cpus CPUs in the order listed.
+ * \return Number of CPUs, 0 for an empty list, -1 if it is invalid.
+ */
+static int cpus_parse(const char *spec, int *cpus, size_t max)
+{
+	char *list = ast_strdupa(spec);
+	char *item;
+	size_t count = 0;
+
+	while ((item = strsep(&list, ","))) {
+		unsigned int first;
+		unsigned int last;
+		char extra;
+
+		item = ast_strip(item);
+		if (ast_strlen_zero(item)) {
+			continue;
+		}
+		if (sscanf(item, "%u-%u%c", &first, &last, &extra) != 2) {
+			if (sscanf(item, "%u%c", &first, &extra) != 1) {
+				return -1;
+			}
+			last = first;
+		}
+		if (first > last || last > 1023) {
+			return -1;
+		}
+		for (; first <= last; first++) {
+			if (count == max) {
+				return -1;
+			}
+			cpus[count++] = first;
+		}
+	}
+
+	return count;
+}
+
+static int setup_kafka(void)
+{
+	struct cdr_kafka_conf *conf = aco_pending_config(&cfg_info);
+
+	if (!conf) {
+		return 0;
+	}
+
+	if (!conf->global) {
+		ast_log(LOG_ERROR, "Invalid cdr_kafka.conf\n");
+		return -1;
+	}
+
+	resolve_key(conf->global);
+
+	if (plan_compile(conf->global)) {
+		ast_log(LOG_ERROR, "Failed to compile the payload layout\n");
+		return -1;
+	}
+
+	if (summary_compile(conf->global)) {
+		ast_log(LOG_ERROR, "Failed to compile the summary layout\n");
+		return -1;
+	}
+
+	/* Before the headers, which name the dictionary */
+	if (zstd_compile(conf->global)) {
+		ast_log(LOG_ERROR, "Failed to set up zstd compression\n");
+		return -1;
+	}
+
+	if (headers_compile(conf->global)) {
+		ast_log(LOG_ERROR, "Failed to build the Kafka headers\n");
+		return -1;
+	}
+
+	if (topics_compile(conf->global)) {
+		ast_log(LOG_ERROR, "Failed to compile the topic routes\n");
+		return -1;
+	}
+
+	if (filters_compile(conf->global)) {
+		ast_log(LOG_ERROR, "Failed to compile the filter rules\n");
+		return -1;
+	}
+
+	if (conf->global->priorities && !conf->global->async) {
+		ast_log(LOG_NOTICE, "priority only applies when async is enabled\n");
+	}
+
+	if (!ast_strlen_zero(conf->global->oversize_topic)) {
+		if (strlen(conf->global->oversize_topic) > CDR_KAFKA_TOPIC_LEN
+			|| strchr(conf->global->oversize_topic, '$')) {
+			ast_log(LOG_ERROR, "Invalid oversize_topic '%s'\n", conf->global->oversize_topic);
+			return -1;
+		}
+		if (!conf->global->max_payload_size) {
+			ast_log(LOG_NOTICE, "oversize_topic only applies with max_payload_size\n");
+		}
+	}
+
+	if (conf->global->format != CDR_KAFKA_FORMAT_JSON) {
+		if (conf->global->plan) {
+			ast_log(LOG_NOTICE, "fields, field_limits and the variable and payload size "
+				"options only apply to format = json\n");
+		}
+		if (!conf->global->schema_id) {
+			ast_log(LOG_WARNING, "No schema_id set, binary CDRs are framed with schema id 0\n");
+		}
+	}
+
+	if (!conf->global->async && conf->global->batch_size > 1) {
+		ast_log(LOG_NOTICE, "batch_size only applies when async is enabled\n");
+	}
+
+	if (!ast_strlen_zero(conf->global->publisher_cpus)) {
+		int cpus[CDR_KAFKA_CPUS_MAX];
+
+		if (cpus_parse(conf->global->publisher_cpus, cpus, ARRAY_LEN(cpus)) < 0) {
+			ast_log(LOG_ERROR, "Invalid publisher_cpus '%s', expected a list such as 2-5,8\n",
+				conf->global->publisher_cpus);
+			return -1;
+		}
+		if (!conf->global->async) {
+			ast_log(LOG_NOTICE, "publisher_cpus only applies when async is enabled\n");
+		}
+	}
+
+	if (conf->global->overflow == CDR_KAFKA_OVERFLOW_SPOOL && !conf->global->spool) {
+		ast_log(LOG_WARNING, "overflow = spool needs spool = yes, blocking instead\n");
+	}
+
+	if (conf->global->backpressure_high
+		&& conf->global->backpressure_low >= conf->global->backpressure_high) {
+		conf->global->backpressure_low = conf->global->backpressure_high / 2;
+		ast_log(LOG_WARNING, "backpressure_low must be below backpressure_high, using %u\n",
+			conf->global->backpressure_low);
+	}
+
+	if (conf->global->backpressure_high && !conf->global->spool) {
+		ast_log(LOG_NOTICE, "backpressure_high only spools CDRs with spool = yes\n");
+	}
+
+	if (conf->global->partitioner == CDR_KAFKA_PARTITIONER_MURMUR2
+		&& ast_strlen_zero(conf->global->key)) {
+		ast_log(LOG_NOTICE, "partitioner = murmur2 needs a key, partitions are left to res_kafka\n");
+	}
+
+	if (conf->global->aggregate && conf->global->format != CDR_KAFKA_FORMAT_JSON) {
+		ast_log(LOG_WARNING, "aggregate only applies to format = json, CDRs are published one by one\n");
+	}
+
+	return 0;
+}
+
+/*! \brief Growable output buffer used by the JSON encoder. */
+struct cdr_kafka_buf {
+	/*! \brief Encoded bytes (always NUL terminated once encoding succeeds) */
+	char *data;
+	/*! \brief Number of bytes written */
+	size_t len;
+	/*! \brief Allocated size of \c data */
+	size_t size;
+};
+
+/*!
+ * \brief Link at the start of thread storage that has a destructor in this module.
+ *
+ * Asterisk and res_kafka threads outlive the module, and a thread runs the
+ * destructors of its storage when it exits, possibly after the module was
+ * unloaded. So each such storage is put on \c tls_threads by its init
+ * function, and tls_release() frees all of it at unload and deletes the
+ * keys, after which no destructor of the module runs any more.
+ */
+struct cdr_kafka_tls {
+	/*! \brief Frees what the storage holds, but not the storage itself */
+	void (*release)(struct cdr_kafka_tls *tls);
+	AST_LIST_ENTRY(cdr_kafka_tls) entry;
+};
+
+/*! \brief Thread storage of all threads, see struct cdr_kafka_tls. */
+static AST_LIST_HEAD_STATIC(tls_threads, cdr_kafka_tls);
+
+/*! \brief Most keys with tracked storage. */
+#define CDR_KAFKA_TLS_KEYS 8
+
+/*! \brief Keys some thread has tracked storage for, guarded by the \c tls_threads lock. */
+static struct ast_threadstorage *tls_keys[CDR_KAFKA_TLS_KEYS];
+static size_t tls_key_count;
+
+/*! \brief Set once tls_release() freed the storage, guarded by the \c tls_threads lock. */
+static int tls_released;
+
+/*!
+ * \brief Track the new storage \a tls of \a key, from the init function of \a key.
+ *
+ * \return 0, as the init function returns.
+ */
+static int tls_track(struct ast_threadstorage *key, struct cdr_kafka_tls *tls,
+	void (*release)(struct cdr_kafka_tls *tls))
+{
+	size_t i;
+
+	tls->release = release;
+
+	AST_LIST_LOCK(&tls_threads);
+	for (i = 0; i < tls_key_count && tls_keys[i] != key; i++) {
+	}
+	ast_assert(i < CDR_KAFKA_TLS_KEYS);
+	if (i == tls_key_count && i < CDR_KAFKA_TLS_KEYS) {
+		tls_keys[tls_key_count++] = key;
+	}
+	AST_LIST_INSERT_TAIL(&tls_threads, tls, entry);
+	AST_LIST_UNLOCK(&tls_threads);
+
+	return 0;
+}
+
+/*! \brief Destructor of every tracked thread storage. */
+static void tls_cleanup(void *data)
+{
+	struct cdr_kafka_tls *tls = data;
+
+	AST_LIST_LOCK(&tls_threads);
+	if (tls_released) {
+		/* Freed by tls_release() already */
+		AST_LIST_UNLOCK(&tls_threads);
+		return;
+	}
+	AST_LIST_REMOVE(&tls_threads, tls, entry);
+	AST_LIST_UNLOCK(&tls_threads);
+
+	tls->release(tls);
+	ast_free(tls);
+}
+
+/*!
+ * \brief Free the tracked storage of every thread and delete its keys.
+ *
+ * Only called at unload, once no thread runs the module's code any more.
+ */
+static void tls_release(void)
+{
+	static const pthread_once_t once_init = THREADSTORAGE_ONCE_INIT;
+	AST_LIST_HEAD_NOLOCK(, cdr_kafka_tls) released = AST_LIST_HEAD_NOLOCK_INIT_VALUE;
+	struct cdr_kafka_tls *tls;
+	size_t i;
+
+	AST_LIST_LOCK(&tls_threads);
+	for (i = 0; i < tls_key_count; i++) {
+		pthread_key_delete(tls_keys[i]->key);
+		/* A module loaded again without being unmapped creates the key anew */
+		tls_keys[i]->once = once_init;
+	}
+	tls_key_count = 0;
+	AST_LIST_APPEND_LIST(&released, &tls_threads, entry);
+	tls_released = 1;
+	AST_LIST_UNLOCK(&tls_threads);
+
+	while ((tls = AST_LIST_REMOVE_HEAD(&released, entry))) {
+		tls->release(tls);
+		ast_free(tls);
+	}
+}
+
+/*! \brief Initial size of a thread's encoder buffer. */
+#define CDR_KAFKA_BUF_INITIAL 1024
+
+/*! \brief A thread's encoder buffer, see encoder_buf_get(). */
+struct cdr_kafka_encoder_tls {
+	struct cdr_kafka_tls link;
+	struct cdr_kafka_buf buf;
+};
+
+static void encoder_tls_release(struct cdr_kafka_tls *tls)
+{
+	ast_free(((struct cdr_kafka_encoder_tls *) tls)->buf.data);
+}
+
+#ifdef TEST_FRAMEWORK
+/*! \brief Allocations made on the publish path, for the perf tests. */
+static unsigned long test_allocations;
+
+#define TEST_COUNT_ALLOCATION() __atomic_add_fetch(&test_allocations, 1, __ATOMIC_RELAXED)
+#else
+#define TEST_COUNT_ALLOCATION()
+#endif
+
+static int encoder_tls_init(void *data);
+
+/*! \brief Per-thread encoder buffer, reused across CDRs. */
+AST_THREADSTORAGE_CUSTOM(encoder_buf, encoder_tls_init, tls_cleanup);
+
+static int encoder_tls_init(void *data)
+{
+	return tls_track(&encoder_buf, data, encoder_tls_release);
+}
+
+/*! \return The calling thread's encoder buffer, or NULL if it cannot be allocated. */
+static struct cdr_kafka_buf *encoder_buf_get(void)
+{
+	struct cdr_kafka_encoder_tls *tls = ast_threadstorage_get(&encoder_buf, sizeof(*tls));
+
+	return tls ? &tls->buf : NULL;
+}
+
+/*!
+ * \brief Make room for \a extra more bytes plus a NUL terminator.
+ *
+ * \return 0 on success, -1 on allocation failure.
+ */
+static int buf_reserve(struct cdr_kafka_buf *buf, size_t extra)
+{
+	size_t need = buf->len + extra + 1;
+	size_t size;
+	char *data;
+
+	if (need <= buf->size) {
+		return 0;
+	}
+
+	size = buf->size ? buf->size : CDR_KAFKA_BUF_INITIAL;
+	while (size < need) {
+		size *= 2;
+	}
+
+	TEST_COUNT_ALLOCATION();
+	data = ast_realloc(buf->data, size);
+	if (!data) {
+		return -1;
+	}
+
+	buf->data = data;
+	buf->size = size;
+	return 0;
+}
+
+static int buf_append(struct cdr_kafka_buf *buf, const char *src, size_t len)
+{
+	if (buf_reserve(buf, len)) {
+		return -1;
+	}
+
+	memcpy(buf->data + buf->len, src, len);
+	buf->len += len;
+	return 0;
+}
+
+static int buf_putc(struct cdr_kafka_buf *buf, char c)
+{
+	if (buf_reserve(buf, 1)) {
+		return -1;
+	}
+
+	buf->data[buf->len++] = c;
+	return 0;
+}
+
+/*!
+ * \brief Length of the UTF-8 sequence starting at \a s, or 0 if invalid.
+ *
+ * Applies the same rules as jansson: no overlong forms, no surrogates and
+ * nothing above U+10FFFF.
+ */
+static size_t utf8_sequence_len(const unsigned char *s)
+{
+	unsigned int cp;
+	size_t len;
+	size_t i;
+
+	if (*s < 0x80) {
+		return 1;
+	} else if (*s < 0xC2) {
+		return 0;
+	} else if (*s < 0xE0) {
+		len = 2;
+		cp = *s & 0x1F;
+	} else if (*s < 0xF0) {
+		len = 3;
+		cp = *s & 0x0F;
+	} else if (*s < 0xF5) {
+		len = 4;
+		cp = *s & 0x07;
+	} else {
+		return 0;
+	}
+
+	for (i = 1; i < len; i++) {
+		if ((s[i] & 0xC0) != 0x80) {
+			return 0;
+		}
+		cp = (cp << 6) | (s[i] & 0x3F);
+	}
+
+	if ((len == 3 && (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF)))
+		|| (len == 4 && (cp < 0x10000 || cp > 0x10FFFF))) {
+		return 0;
+	}
+
+	return len;
+}
+
+/*! \brief Whether \a str would be accepted by ast_json_string_create(). */
+static int utf8_valid(const char *str)
+{
+	const unsigned char *s = (const unsigned char *) str;
+
+	while (*s) {
+		size_t len = utf8_sequence_len(s);
+
+		if (!len) {
+			return 0;
+		}
+		s += len;
+	}
+
+	return 1;
+}
+
+/*!
+ * \brief Append \a str as a quoted, escaped JSON string.
+ *
+ * Escaping matches ast_json_dump_string() (jansson in compact mode).
+ *
+ * \param end Where to stop if before the end of \a str, or NULL. Must be
+ *            the start of a UTF-8 sequence.
+ * \return 0 on success, -1 on invalid UTF-8 or allocation failure.
+ */
+static int json_append_string_until(struct cdr_kafka_buf *buf, const char *str,
+	const char *end)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	const unsigned char *s = (const unsigned char *) str;
+	const unsigned char *stop = (const unsigned char *) end;
+	const unsigned char *run;
+
+	if (buf_putc(buf, '"')) {
+		return -1;
+	}
+
+	while (*s && s != stop) {
+		char esc[6];
+		size_t esc_len = 2;
+
+		/* Copy runs of bytes that need no escaping in one go */
+		run = s;
+		while (s != stop && *s >= 0x20 && *s != '"' && *s != '\\') {
+			if (*s < 0x80) {
+				s++;
+			} else {
+				size_t len = utf8_sequence_len(s);
+
+				if (!len) {
+					return -1;
+				}
+				s += len;
+			}
+		}
+		if (s != run && buf_append(buf, (const char *) run, s - run)) {
+			return -1;
+		}
+		if (s == stop || !*s) {
+			break;
+		}
+
+		esc[0] = '\\';
+		switch (*s) {
+		case '"':
+			esc[1] = '"';
+			break;
+		case '\\':
+			esc[1] = '\\';
+			break;
+		case '\b':
+			esc[1] = 'b';
+			break;
+		case '\f':
+			esc[1] = 'f';
+			break;
+		case '\n':
+			esc[1] = 'n';
+			break;
+		case '\r':
+			esc[1] = 'r';
+			break;
+		case '\t':
+			esc[1] = 't';
+			break;
+		default:
+			esc[1] = 'u';
+			esc[2] = '0';
+			esc[3] = '0';
+			esc[4] = hex[*s >> 4];
+			esc[5] = hex[*s & 0x0F];
+			esc_len = 6;
+			break;
+		}
+		if (buf_append(buf, esc, esc_len)) {
+			return -1;
+		}
+		s++;
+	}
+
+	return buf_putc(buf, '"');
+}
+
+/*! \brief Append \a str as a quoted, escaped JSON string. */
+static int json_append_string(struct cdr_kafka_buf *buf, const char *str)
+{
+	return json_append_string_until(buf, str, NULL);
+}
+
+static int json_append_integer(struct cdr_kafka_buf *buf, long long value)
+{
+	char tmp[24];
+	char *p = tmp + sizeof(tmp);
+	unsigned long long v = value < 0 ? -(unsigned long long) value : (unsigned long long) value;
+
+	do {
+		*--p = '0' + (v % 10);
+		v /= 10;
+	} while (v);
+	if (value < 0) {
+		*--p = '-';
+	}
+
+	return buf_append(buf, p, tmp + sizeof(tmp) - p);
+}
+
+/*! \brief Minutes each thread keeps formatted timestamps for, a power of two. */
+#define CDR_KAFKA_TS_CACHE_SLOTS 4
+
+/*!
+ * \brief A local minute a thread formatted a timestamp in.
+ *
+ * Everything but the seconds and milliseconds of a timestamp is the same
+ * throughout a minute, so within it a timestamp is put together from the
+ * cached text instead of going through ast_localtime() and
+ * ast_strftime(). Time zone changes happen on minute boundaries. A few
+ * minutes are kept, so the start and end of long calls do not keep
+ * pushing each other out.
+ */
+struct cdr_kafka_ts_cache {
+	/*! \brief Epoch second at which the cached minute starts */
+	time_t minute;
+	int valid;
+	/*! \brief "YYYY-MM-DDTHH:MM:" */
+	char prefix[AST_ISO8601_LEN];
+	size_t prefix_len;
+	/*! \brief UTC offset, "+HHMM" */
+	char suffix[AST_ISO8601_LEN];
+	size_t suffix_len;
+};
+
+AST_THREADSTORAGE(ts_cache);
+
+/*! \brief The cache slot for \a tv in this thread, or NULL. */
+static struct cdr_kafka_ts_cache *ts_cache_slot(struct timeval tv)
+{
+	struct cdr_kafka_ts_cache *slots = ast_threadstorage_get(&ts_cache,
+		CDR_KAFKA_TS_CACHE_SLOTS * sizeof(*slots));
+
+	return slots ? &slots[(tv.tv_sec / 60) & (CDR_KAFKA_TS_CACHE_SLOTS - 1)] : NULL;
+}
+
+/*!
+ * \brief Format \a tv as ast_json_timeval() does, into \a str.
+ *
+ * Fills in \a cache when the result has the expected layout.
+ *
+ * \return Length of the text in \a str.
+ */
+static size_t timeval_format(struct cdr_kafka_ts_cache *cache, struct timeval tv, char *str,
+	size_t size)
+{
+	struct ast_tm tm = {};
+	const char *dot;
+	size_t len;
+
+	ast_localtime(&tv, &tm, NULL);
+	ast_strftime(str, size, AST_ISO8601_FORMAT, &tm);
+	len = strlen(str);
+
+	/* "...:SS.mmm+HHMM" */
+	dot = strchr(str, '.');
+	if (!cache || !dot || dot - str < 3 || !isdigit((unsigned char) dot[-1])
+		|| !isdigit((unsigned char) dot[-2]) || dot[-3] != ':' || strlen(dot) < 4
+		|| tm.tm_sec < 0 || tm.tm_sec > 59) {
+		return len;
+	}
+
+	cache->prefix_len = dot - 2 - str;
+	memcpy(cache->prefix, str, cache->prefix_len);
+	cache->suffix_len = len - (dot + 4 - str);
+	memcpy(cache->suffix, dot + 4, cache->suffix_len);
+	cache->minute = tv.tv_sec - tm.tm_sec;
+	cache->valid = 1;
+
+	return len;
+}
+
+/*! \brief Append a timestamp formatted the same way as ast_json_timeval(). */
+static int json_append_timeval(struct cdr_kafka_buf *buf, struct timeval tv)
+{
+	struct cdr_kafka_ts_cache *cache = ts_cache_slot(tv);
+	char str[AST_ISO8601_LEN];
+	unsigned int sec;
+	unsigned int ms;
+	char *out;
+	size_t len;
+
+	if (!cache || !cache->valid || tv.tv_sec < cache->minute || tv.tv_sec - cache->minute >= 60) {
+		len = timeval_format(cache, tv, str, sizeof(str));
+		if (buf_reserve(buf, len + 2)) {
+			return -1;
+		}
+		buf->data[buf->len++] = '"';
+		memcpy(buf->data + buf->len, str, len);
+		buf->len += len;
+		buf->data[buf->len++] = '"';
+		return 0;
+	}
+
+	/* ast_strftime() truncates %q to milliseconds */
+	sec = tv.tv_sec - cache->minute;
+	ms = tv.tv_usec / 1000;
+	if (buf_reserve(buf, cache->prefix_len + cache->suffix_len + 8)) {
+		return -1;
+	}
+	out = buf->data + buf->len;
+	*out++ = '"';
+	memcpy(out, cache->prefix, cache->prefix_len);
+	out += cache->prefix_len;
+	*out++ = '0' + sec / 10;
+	*out++ = '0' + sec % 10;
+	*out++ = '.';
+	*out++ = '0' + ms / 100;
+	*out++ = '0' + ms / 10 % 10;
+	*out++ = '0' + ms % 10;
+	memcpy(out, cache->suffix, cache->suffix_len);
+	out += cache->suffix_len;
+	*out++ = '"';
+	buf->len = out - buf->data;
+
+	return 0;
+}
+
+/*! \brief Append a timestamp in the configured form; epoch values are 0 when unset. */
+static int json_append_timestamp(struct cdr_kafka_buf *buf, struct timeval tv,
+	enum cdr_kafka_timestamps timestamps)
+{
+	switch (timestamps) {
+	case CDR_KAFKA_TS_EPOCH_MS:
+		return json_append_integer(buf, (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000);
+	case CDR_KAFKA_TS_EPOCH_US:
+		return json_append_integer(buf, (long long) tv.tv_sec * 1000000 + tv.tv_usec);
+	case CDR_KAFKA_TS_ISO8601:
+		break;
+	}
+
+	return json_append_timeval(buf, tv);
+}
+
+/*! \brief How a core JSON field is read from a CDR. */
+enum cdr_kafka_field_type {
+	/*! \brief char array at \c offset */
+	CDR_FIELD_STRING,
+	/*! \brief struct timeval at \c offset */
+	CDR_FIELD_TIMEVAL,
+	/*! \brief long at \c offset */
+	CDR_FIELD_LONG,
+	/*! \brief int at \c offset */
+	CDR_FIELD_INT,
+	/*! \brief disposition, as text */
+	CDR_FIELD_DISPOSITION,
+	/*! \brief AMA flags, as text */
+	CDR_FIELD_AMAFLAGS,
+	/*! \brief ast_eid_default, as text */
+	CDR_FIELD_ENTITYID,
+	/*! \brief ast_config_AST_SYSTEM_NAME */
+	CDR_FIELD_SYSTEMNAME,
+};
+
+/*! \brief A core JSON field of the CDR payload. */
+struct cdr_kafka_field {
+	/*! \brief JSON key */
+	const char *name;
+	/*! \brief Pre-rendered "name": prefix */
+	const char *prefix;
+	enum cdr_kafka_field_type type;
+	size_t offset;
+};
+
+#define CDR_JSON_FIELD(name, type, member) \
+	{ name, "\"" name "\":", type, offsetof(struct ast_cdr, member) }
+
+/*!
+ * \brief Core fields in the order they appear in the payload.
+ *
+ * This is the key order historically produced by ast_json_pack() followed
+ * by the EntityID/SystemName injection.
+ */
+static const struct cdr_kafka_field core_fields[] = {
+	CDR_JSON_FIELD("clid", CDR_FIELD_STRING, clid),
+	CDR_JSON_FIELD("src", CDR_FIELD_STRING, src),
+	CDR_JSON_FIELD("dst", CDR_FIELD_STRING, dst),
+	CDR_JSON_FIELD("dcontext", CDR_FIELD_STRING, dcontext),
+	CDR_JSON_FIELD("channel", CDR_FIELD_STRING, channel),
+	CDR_JSON_FIELD("dstchannel", CDR_FIELD_STRING, dstchannel),
+	CDR_JSON_FIELD("lastapp", CDR_FIELD_STRING, lastapp),
+	CDR_JSON_FIELD("lastdata", CDR_FIELD_STRING, lastdata),
+	CDR_JSON_FIELD("start", CDR_FIELD_TIMEVAL, start),
+	CDR_JSON_FIELD("answer", CDR_FIELD_TIMEVAL, answer),
+	CDR_JSON_FIELD("end", CDR_FIELD_TIMEVAL, end),
+	CDR_JSON_FIELD("durationsec", CDR_FIELD_LONG, duration),
+	CDR_JSON_FIELD("billsec", CDR_FIELD_LONG, billsec),
+	CDR_JSON_FIELD("disposition", CDR_FIELD_DISPOSITION, disposition),
+	CDR_JSON_FIELD("accountcode", CDR_FIELD_STRING, accountcode),
+	CDR_JSON_FIELD("amaflags", CDR_FIELD_AMAFLAGS, amaflags),
+	CDR_JSON_FIELD("peeraccount", CDR_FIELD_STRING, peeraccount),
+	CDR_JSON_FIELD("linkedid", CDR_FIELD_STRING, linkedid),
+	CDR_JSON_FIELD("sequence", CDR_FIELD_INT, sequence),
+	CDR_JSON_FIELD("tenantid", CDR_FIELD_STRING, tenantid),
+	CDR_JSON_FIELD("peertenantid", CDR_FIELD_STRING, peertenantid),
+	{ "EntityID", "\"EntityID\":", CDR_FIELD_ENTITYID, 0 },
+	{ "SystemName", "\"SystemName\":", CDR_FIELD_SYSTEMNAME, 0 },
+};
+
+/*! \brief Index of the core field named \a name, or -1. */
+static int core_field_index(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_LEN(core_fields); i++) {
+		if (core_fields[i].name[0] == name[0] && !strcmp(core_fields[i].name, name)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/*!
+ * \brief Write the value of a core field.
+ *
+ * \return 0 on success, -1 on invalid UTF-8 or allocation failure.
+ */
+static int encode_core_field(struct cdr_kafka_buf *buf,
+	const struct cdr_kafka_field *field, struct ast_cdr *cdr,
+	enum cdr_kafka_timestamps timestamps)
+{
+	const char *base = (const char *) cdr;
+
+	switch (field->type) {
+	case CDR_FIELD_STRING:
+		return json_append_string(buf, base + field->offset);
+	case CDR_FIELD_TIMEVAL:
+		return json_append_timestamp(buf, *(const struct timeval *) (base + field->offset),
+			timestamps);
+	case CDR_FIELD_LONG:
+		return json_append_integer(buf, *(const long *) (base + field->offset));
+	case CDR_FIELD_INT:
+		return json_append_integer(buf, *(const int *) (base + field->offset));
+	case CDR_FIELD_DISPOSITION:
+		return json_append_string(buf, ast_cdr_disp2str(cdr->disposition));
+	case CDR_FIELD_AMAFLAGS:
+		return json_append_string(buf, ast_channel_amaflags2string(cdr->amaflags));
+	case CDR_FIELD_ENTITYID:
+		return json_append_string(buf, cached_eid);
+	case CDR_FIELD_SYSTEMNAME:
+		return json_append_string(buf, ast_config_AST_SYSTEM_NAME);
+	}
+
+	return -1;
+}
+
+/*!
+ * \brief Append one ,"key":"value" member, or nothing if it cannot be encoded.
+ *
+ * Like ast_json_object_set(), a key or value that is not valid UTF-8 is
+ * silently skipped.
+ */
+static int encode_member(struct cdr_kafka_buf *buf, const char *key, const char *value)
+{
+	size_t mark = buf->len;
+
+	/* Reserve the worst case up front so that a failure below can only
+	 * mean invalid UTF-8 */
+	if (buf_reserve(buf, 6 * (strlen(key) + strlen(value)) + 6)) {
+		return -1;
+	}
+
+	if (buf_putc(buf, ',')
+		|| json_append_string(buf, key)
+		|| buf_putc(buf, ':')
+		|| json_append_string(buf, value)) {
+		buf->len = mark;
+	}
+
+	return 0;
+}
+
+static uint64_t metrics_now(void);
+
+/*!
+ * \brief Append the JSON representation of a CDR to \a buf.
+ *
+ * Produces exactly what ast_json_dump_string() used to produce for the
+ * object built by kafka_cdr_log(): the core fields, EntityID, SystemName,
+ * then the CDR variables and finally the optional uniqueid/userfield. As
+ * with ast_json_object_set(), a variable whose name is already present
+ * replaces that member's value in place instead of adding a new member.
+ *
+ * \param[out] fields_ns Set to when the core fields were written, for a
+ *        trace, or NULL.
+ * \return 0 on success.
+ * \return -1 on error, with \a buf left at its original length.
+ */
+static int encode_cdr_json(struct cdr_kafka_buf *buf, struct ast_cdr *cdr,
+	int loguniqueid, int loguserfield, enum cdr_kafka_timestamps timestamps,
+	uint64_t *fields_ns)
+{
+	size_t start = buf->len;
+	const char *overrides[ARRAY_LEN(core_fields)] = { NULL, };
+	size_t field_count = ARRAY_LEN(core_fields);
+	int uniqueid_pending = loguniqueid && utf8_valid(cdr->uniqueid);
+	int userfield_pending = loguserfield && utf8_valid(cdr->userfield);
+	struct ast_var_t *var;
+	size_t i;
+
+	if (ast_strlen_zero(ast_config_AST_SYSTEM_NAME)
+		|| !utf8_valid(ast_config_AST_SYSTEM_NAME)) {
+		/* SystemName is always the last core field */
+		field_count--;
+	}
+
+	/* Variables named after a core field replace its value in place */
+	AST_LIST_TRAVERSE(&cdr->varshead, var, entries) {
+		int idx = core_field_index(var->name);
+
+		if (idx >= 0 && idx < (int) field_count && utf8_valid(var->value)) {
+			overrides[idx] = var->value;
+		}
+	}
+
+	if (buf_putc(buf, '{')) {
+		goto error;
+	}
+	for (i = 0; i < field_count; i++) {
+		if ((i && buf_putc(buf, ','))
+			|| buf_append(buf, core_fields[i].prefix, strlen(core_fields[i].prefix))) {
+			goto error;
+		}
+		if (overrides[i]) {
+			/* The packed value must still have been valid */
+			if ((core_fields[i].type == CDR_FIELD_STRING
+					&& !utf8_valid((const char *) cdr + core_fields[i].offset))
+				|| json_append_string(buf, overrides[i])) {
+				goto error;
+			}
+		} else if (encode_core_field(buf, &core_fields[i], cdr, timestamps)) {
+			/* Same as ast_json_pack() refusing invalid UTF-8 */
+			goto error;
+		}
+	}
+	if (fields_ns) {
+		*fields_ns = metrics_now();
+	}
+
+	AST_LIST_TRAVERSE(&cdr->varshead, var, entries) {
+		const char *value = var->value;
+		struct ast_var_t *other;
+		int idx = core_field_index(var->name);
+
+		if (idx >= 0 && idx < (int) field_count) {
+			continue;
+		}
+
+		/* Only the first occurrence of a name creates the member ... */
+		for (other = AST_LIST_FIRST(&cdr->varshead); other != var;
+			other = AST_LIST_NEXT(other, entries)) {
+			if (!strcmp(other->name, var->name) && utf8_valid(other->value)) {
+				break;
+			}
+		}
+		if (other != var) {
+			continue;
+		}
+
+		/* ... and it carries the last value assigned to that name */
+		for (other = AST_LIST_NEXT(var, entries); other;
+			other = AST_LIST_NEXT(other, entries)) {
+			if (!strcmp(other->name, var->name) && utf8_valid(other->value)) {
+				value = other->value;
+			}
+		}
+
+		if (uniqueid_pending && !strcmp(var->name, "uniqueid")) {
+			value = cdr->uniqueid;
+		} else if (userfield_pending && !strcmp(var->name, "userfield")) {
+			value = cdr->userfield;
+		}
+
+		/* A member is only created by a variable that could be set itself */
+		if (value != var->value && !utf8_valid(var->value)) {
+			continue;
+		}
+		if (value == cdr->uniqueid) {
+			uniqueid_pending = 0;
+		} else if (value == cdr->userfield) {
+			userfield_pending = 0;
+		}
+
+		if (encode_member(buf, var->name, value)) {
+			goto error;
+		}
+	}
+
+	if ((uniqueid_pending && encode_member(buf, "uniqueid", cdr->uniqueid))
+		|| (userfield_pending && encode_member(buf, "userfield", cdr->userfield))
+		|| buf_putc(buf, '}')) {
+		goto error;
+	}
+
+	return 0;
+
+error:
+	buf->len = start;
+	return -1;
+}
+
+/*!
+ * \brief Serialize a CDR to JSON in the calling thread's encoder buffer.
+ *
+ * \param cdr The CDR record.
+ * \param loguniqueid Whether to add the uniqueid member.
+ * \param loguserfield Whether to add the userfield member.
+ * \param[out] len Length of the encoded payload.
+ * \return The NUL terminated payload, valid until the next call on this thread.
+ * \return NULL on error.
+ */
+const char *cdr_kafka_json_encode(struct ast_cdr *cdr, int loguniqueid,
+	int loguserfield, size_t *len);
+const char *cdr_kafka_json_encode(struct ast_cdr *cdr, int loguniqueid,
+	int loguserfield, size_t *len)
+{
+	struct cdr_kafka_buf *buf = encoder_buf_get();
+
+	if (!buf) {
+		return NULL;
+	}
+
+	buf->len = 0;
+	if (encode_cdr_json(buf, cdr, loguniqueid, loguserfield, CDR_KAFKA_TS_ISO8601, NULL)) {
+		return NULL;
+	}
+
+	buf->data[buf->len] = '\0';
+	*len = buf->len;
+	return buf->data;
+}
+
+/*! \brief Fields that are only part of the default layout on request. */
+static const struct cdr_kafka_field optional_fields[] = {
+	CDR_JSON_FIELD("uniqueid", CDR_FIELD_STRING, uniqueid),
+	CDR_JSON_FIELD("userfield", CDR_FIELD_STRING, userfield),
+};
+
+/*! \brief A member of the payload written by a serialization plan. */
+struct cdr_kafka_plan_member {
+	/*! \brief Core field, or NULL for a CDR variable */
+	const struct cdr_kafka_field *field;
+	/*! \brief Variable name */
+	char *name;
+	/*! \brief JSON key */
+	char *key;
+	/*! \brief Pre-rendered "key": */
+	char *prefix;
+	size_t prefix_len;
+	/*! \brief Whether \c name is a prefix, for "name*" variables */
+	int name_prefix;
+	size_t name_len;
+	/*! \brief Longest text field value written in bytes, 0 for no limit */
+	unsigned int max_len;
+};
+
+/*!
+ * \brief Payload layout compiled from the fields and variables options.
+ *
+ * Fields are written in order with no name lookups. Variables are either
+ * all written, as in the default layout, or only those on the allowlist,
+ * in its order. The names a variable cannot be written under are put in
+ * a hash table here, so that is not worked out again for every CDR.
+ */
+struct cdr_kafka_plan {
+	struct cdr_kafka_plan_member *fields;
+	size_t field_count;
+	struct cdr_kafka_plan_member *vars;
+	size_t var_count;
+	/*! \brief Whether every CDR variable is written */
+	int all_vars;
+	/*! \brief Whether variables are written in a "vars" object of their own */
+	int nest_vars;
+	/*! \brief Most variables written, 0 for no limit */
+	unsigned int max_vars;
+	/*! \brief Longest variable value written in bytes, 0 for no limit */
+	unsigned int max_value_len;
+	/*! \brief Largest payload written in bytes, 0 for no limit */
+	unsigned int max_payload;
+	/*! \brief Whether any value may be cut or left out, see struct cdr_kafka_cuts */
+	int limited;
+	/*!
+	 * \brief Open addressing table of names only written by other members
+	 *
+	 * Field keys unless variables are nested, and the names and keys of
+	 * the variables on the allowlist.
+	 */
+	const char **taken;
+	size_t taken_mask;
+};
+
+static void plan_member_free(struct cdr_kafka_plan_member *member)
+{
+	ast_free(member->name);
+	ast_free(member->key);
+	ast_free(member->prefix);
+}
+
+static void plan_dtor(void *obj)
+{
+	struct cdr_kafka_plan *plan = obj;
+	size_t i;
+
+	for (i = 0; i < plan->field_count; i++) {
+		plan_member_free(&plan->fields[i]);
+	}
+	for (i = 0; i < plan->var_count; i++) {
+		plan_member_free(&plan->vars[i]);
+	}
+	ast_free(plan->fields);
+	ast_free(plan->vars);
+	ast_free(plan->taken);
+}
+
+/*! \brief Look up a field by name (case-insensitive), or NULL. */
+static const struct cdr_kafka_field *plan_find_field(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_LEN(core_fields); i++) {
+		if (!strcasecmp(core_fields[i].name, name)) {
+			return &core_fields[i];
+		}
+	}
+	for (i = 0; i < ARRAY_LEN(optional_fields); i++) {
+		if (!strcasecmp(optional_fields[i].name, name)) {
+			return &optional_fields[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*!
+ * \brief Whether a plan member already writes \a key.
+ *
+ * Nested variables only clash with each other.
+ */
+static int plan_has_key(const struct cdr_kafka_plan *plan, const char *key, int var)
+{
+	size_t i;
+
+	for (i = 0; (!var || !plan->nest_vars) && i < plan->field_count; i++) {
+		if (!strcmp(plan->fields[i].key, key)) {
+			return 1;
+		}
+	}
+	for (i = 0; (var || !plan->nest_vars) && i < plan->var_count; i++) {
+		if (!plan->vars[i].name_prefix && !strcmp(plan->vars[i].key, key)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Append a member to \a members.
+ *
+ * \return 0 on success or if the member was skipped, -1 on allocation failure.
+ */
+static int plan_add(struct cdr_kafka_plan *plan, struct cdr_kafka_plan_member *members,
+	size_t *count, const struct cdr_kafka_field *field, const char *name, const char *key)
+{
+	struct cdr_kafka_plan_member *member = &members[*count];
+	struct cdr_kafka_buf prefix = { NULL, };
+
+	if (!utf8_valid(key)) {
+		ast_log(LOG_WARNING, "Payload key '%s' is not valid UTF-8, ignoring it\n", key);
+		return 0;
+	}
+	if (plan_has_key(plan, key, !field)) {
+		ast_log(LOG_WARNING, "Payload key '%s' given twice, ignoring the second one\n", key);
+		return 0;
+	}
+
+	if (json_append_string(&prefix, key) || buf_putc(&prefix, ':')) {
+		ast_free(prefix.data);
+		return -1;
+	}
+
+	member->field = field;
+	member->name = ast_strdup(name);
+	member->key = ast_strdup(key);
+	member->prefix = prefix.data;
+	member->prefix_len = prefix.len;
+	(*count)++;
+	if (!member->name || !member->key) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*! \brief Number of comma separated items in \a list, at most. */
+static size_t plan_list_len(const char *list)
+{
+	size_t count = 1;
+
+	for (; *list; list++) {
+		count += *list == ',';
+	}
+
+	return count;
+}
+
+/*!
+ * \brief Compile one of the fields/variables lists.
+ *
+ * Each item is "name" or "name:key", the latter writing the member under
+ * a different key. A variable item may also be "prefix*", for every
+ * variable whose name starts with prefix.
+ */
+static int plan_compile_list(struct cdr_kafka_plan *plan, const char *list, int vars)
+{
+	struct cdr_kafka_plan_member **members = vars ? &plan->vars : &plan->fields;
+	size_t *count = vars ? &plan->var_count : &plan->field_count;
+	char *items = ast_strdupa(list);
+	char *item;
+
+	*members = ast_calloc(plan_list_len(list), sizeof(**members));
+	if (!*members) {
+		return -1;
+	}
+
+	while ((item = strsep(&items, ","))) {
+		const struct cdr_kafka_field *field = NULL;
+		char *name = ast_strip(strsep(&item, ":"));
+		char *key = item ? ast_strip(item) : NULL;
+
+		if (ast_strlen_zero(name)) {
+			continue;
+		}
+		if (vars && name[strlen(name) - 1] == '*') {
+			if (!ast_strlen_zero(key)) {
+				ast_log(LOG_WARNING, "Variables matched by '%s' cannot be renamed\n", name);
+			}
+			if (plan_add(plan, *members, count, NULL, name, name)) {
+				return -1;
+			}
+			(*members)[*count - 1].name_prefix = 1;
+			(*members)[*count - 1].name_len = strlen(name) - 1;
+			continue;
+		}
+		if (!vars) {
+			field = plan_find_field(name);
+			if (!field) {
+				ast_log(LOG_WARNING, "Unknown CDR field '%s' in fields, ignoring it\n", name);
+				continue;
+			}
+			name = (char *) field->name;
+		}
+		if (ast_strlen_zero(key)) {
+			key = name;
+		}
+
+		if (plan_add(plan, *members, count, field, name, key)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*! \brief Whether variables named \a name are written by another member. */
+static int plan_taken(const struct cdr_kafka_plan *plan, const char *name)
+{
+	size_t i = ast_str_hash(name) & plan->taken_mask;
+
+	while (plan->taken[i]) {
+		if (!strcmp(plan->taken[i], name)) {
+			return 1;
+		}
+		i = (i + 1) & plan->taken_mask;
+	}
+
+	return 0;
+}
+
+static void plan_take(struct cdr_kafka_plan *plan, const char *name)
+{
+	size_t i = ast_str_hash(name) & plan->taken_mask;
+
+	while (plan->taken[i]) {
+		if (!strcmp(plan->taken[i], name)) {
+			return;
+		}
+		i = (i + 1) & plan->taken_mask;
+	}
+	plan->taken[i] = name;
+}
+
+/*!
+ * \brief Fill in the names variables matched by "*" or a prefix skip.
+ *
+ * \return 0 on success, -1 on allocation failure.
+ */
+static int plan_compile_taken(struct cdr_kafka_plan *plan)
+{
+	size_t size = 2;
+	size_t i;
+
+	/* At most half full */
+	while (size < 2 * (plan->field_count + 2 * plan->var_count + 1)) {
+		size <<= 1;
+	}
+	plan->taken = ast_calloc(size, sizeof(*plan->taken));
+	if (!plan->taken) {
+		return -1;
+	}
+	plan->taken_mask = size - 1;
+
+	for (i = 0; !plan->nest_vars && i < plan->field_count; i++) {
+		plan_take(plan, plan->fields[i].key);
+	}
+	for (i = 0; i < plan->var_count; i++) {
+		if (!plan->vars[i].name_prefix) {
+			plan_take(plan, plan->vars[i].name);
+			plan_take(plan, plan->vars[i].key);
+		}
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Apply the "field:bytes" caps of field_limits to the fields of \a plan.
+ *
+ * Fields are named as in the fields option, before any rename. Only text
+ * fields can be capped; other items are ignored with a warning.
+ */
+static void plan_compile_limits(struct cdr_kafka_plan *plan, const char *limits)
+{
+	char *items = ast_strdupa(limits);
+	char *item;
+
+	while ((item = strsep(&items, ","))) {
+		char *name = ast_strip(strsep(&item, ":"));
+		unsigned int max;
+		size_t i;
+
+		if (ast_strlen_zero(name)) {
+			continue;
+		}
+		if (!item || sscanf(item, "%u", &max) != 1 || !max) {
+			ast_log(LOG_WARNING, "Invalid field limit '%s', expected field:bytes\n", name);
+			continue;
+		}
+		for (i = 0; i < plan->field_count; i++) {
+			if (!strcasecmp(plan->fields[i].field->name, name)) {
+				break;
+			}
+		}
+		if (i == plan->field_count || plan->fields[i].field->type != CDR_FIELD_STRING) {
+			ast_log(LOG_WARNING, "'%s' is not a text field of the payload, ignoring its limit\n",
+				name);
+			continue;
+		}
+		plan->fields[i].max_len = max;
+		plan->limited = 1;
+	}
+}
+
+/*!
+ * \brief Build the serialization plan for a configuration.
+ *
+ * Without fields, with all variables and no limits, no plan is built
+ * and the default layout is used.
+ *
+ * \return 0 on success, -1 on allocation failure.
+ */
+static int plan_compile(struct cdr_kafka_global_conf *global)
+{
+	RAII_VAR(struct cdr_kafka_plan *, plan, NULL, ao2_cleanup);
+	int all_vars = !strcmp(global->variables, "*");
+
+	ao2_cleanup(global->plan);
+	global->plan = NULL;
+
+	if (ast_strlen_zero(global->fields) && all_vars && !global->nest_variables
+		&& !global->max_variables && !global->max_variable_length
+		&& ast_strlen_zero(global->field_limits) && !global->max_payload_size) {
+		return 0;
+	}
+
+	plan = ao2_alloc_options(sizeof(*plan), plan_dtor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!plan) {
+		return -1;
+	}
+	plan->all_vars = all_vars;
+	plan->nest_vars = global->nest_variables;
+	plan->max_vars = global->max_variables;
+	plan->max_value_len = global->max_variable_length;
+	plan->max_payload = global->max_payload_size;
+	plan->limited = plan->max_value_len || plan->max_payload;
+
+	if (!ast_strlen_zero(global->fields)) {
+		if (plan_compile_list(plan, global->fields, 0)) {
+			return -1;
+		}
+	} else {
+		/* Only the variables are restricted; keep the default fields */
+		size_t i;
+
+		plan->fields = ast_calloc(ARRAY_LEN(core_fields) + ARRAY_LEN(optional_fields),
+			sizeof(*plan->fields));
+		if (!plan->fields) {
+			return -1;
+		}
+		for (i = 0; i < ARRAY_LEN(core_fields); i++) {
+			if (plan_add(plan, plan->fields, &plan->field_count, &core_fields[i],
+				core_fields[i].name, core_fields[i].name)) {
+				return -1;
+			}
+		}
+		if ((global->loguniqueid && plan_add(plan, plan->fields, &plan->field_count,
+				&optional_fields[0], "uniqueid", "uniqueid"))
+			|| (global->loguserfield && plan_add(plan, plan->fields, &plan->field_count,
+				&optional_fields[1], "userfield", "userfield"))) {
+			return -1;
+		}
+	}
+
+	if (!all_vars && plan_compile_list(plan, global->variables, 1)) {
+		return -1;
+	}
+	plan_compile_limits(plan, global->field_limits);
+	if (plan->nest_vars && plan_has_key(plan, "vars", 0)) {
+		ast_log(LOG_WARNING, "A field is written as 'vars', next to the nested variables\n");
+	}
+	if (plan_compile_taken(plan)) {
+		return -1;
+	}
+
+	global->plan = ao2_bump(plan);
+
+	return 0;
+}
+
+/*!
+ * \brief Build the layout of the summary records from \c summary_fields.
+ *
+ * Summary records carry fields only, so the plan has no variables.
+ *
+ * \return 0 on success or without summary_topic, -1 on error.
+ */
+static int summary_compile(struct cdr_kafka_global_conf *global)
+{
+	RAII_VAR(struct cdr_kafka_plan *, plan, NULL, ao2_cleanup);
+
+	ao2_cleanup(global->summary);
+	global->summary = NULL;
+
+	if (ast_strlen_zero(global->summary_topic)) {
+		return 0;
+	}
+	if (strlen(global->summary_topic) > CDR_KAFKA_TOPIC_LEN
+		|| strchr(global->summary_topic, '$')) {
+		ast_log(LOG_ERROR, "Invalid summary_topic '%s'\n", global->summary_topic);
+		return -1;
+	}
+
+	plan = ao2_alloc_options(sizeof(*plan), plan_dtor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!plan) {
+		return -1;
+	}
+	if (plan_compile_list(plan, global->summary_fields, 0)) {
+		return -1;
+	}
+	if (!plan->field_count) {
+		ast_log(LOG_ERROR, "summary_fields lists no CDR field\n");
+		return -1;
+	}
+	if (plan_compile_taken(plan)) {
+		return -1;
+	}
+
+	global->summary = ao2_bump(plan);
+
+	return 0;
+}
+
+/*!
+ * \brief Where to cut \a str to at most \a max bytes, or NULL if it fits.
+ *
+ * \a str must be valid UTF-8; it is never cut inside a sequence.
+ */
+static const char *utf8_truncate(const char *str, size_t max)
+{
+	if (strnlen(str, max + 1) <= max) {
+		return NULL;
+	}
+	while (max && ((unsigned char) str[max] & 0xC0) == 0x80) {
+		max--;
+	}
+
+	return str + max;
+}
+
+/*! \brief Room for the keys listed in the truncated header. */
+#define CDR_KAFKA_CUTS_LEN 256
+
+/*! \brief Name of the Kafka header listing the members of a payload that were cut. */
+#define CDR_KAFKA_TRUNCATED_HEADER "truncated"
+
+/*!
+ * \brief What encoding a payload under field_limits and max_payload_size cut.
+ *
+ * Filled by encode_cdr_plan() and sent in the truncated header.
+ */
+struct cdr_kafka_cuts {
+	/*! \brief Keys of the members cut or left out, comma separated */
+	char keys[CDR_KAFKA_CUTS_LEN];
+	size_t len;
+	/*! \brief Whether \c keys ran out of room and ends in "..." */
+	int full;
+	/*! \brief Whether the fields alone did not fit max_payload_size */
+	int oversized;
+	/*! \brief Whether the record is traced, so the encoder notes \c fields_ns */
+	int traced;
+	/*! \brief When the encoder was done with the fields, 0 if it did not say */
+	uint64_t fields_ns;
+};
+
+static void cuts_init(struct cdr_kafka_cuts *cuts)
+{
+	cuts->keys[0] = '\0';
+	cuts->len = 0;
+	cuts->full = 0;
+	cuts->oversized = 0;
+	cuts->traced = 0;
+	cuts->fields_ns = 0;
+}
+
+/*! \brief Note that the member \a key of a payload was cut or left out. */
+static void cuts_add(struct cdr_kafka_cuts *cuts, const char *key)
+{
+	size_t len = strlen(key);
+
+	if (cuts->full) {
+		return;
+	}
+	/* Keep room for a closing ",..." */
+	if (cuts->len + len + 5 >= sizeof(cuts->keys)) {
+		strcpy(cuts->keys + cuts->len, cuts->len ? ",..." : "...");
+		cuts->len += cuts->len ? 4 : 3;
+		cuts->full = 1;
+		return;
+	}
+	if (cuts->len) {
+		cuts->keys[cuts->len++] = ',';
+	}
+	memcpy(cuts->keys + cuts->len, key, len + 1);
+	cuts->len += len;
+}
+
+/*!
+ * \brief Append the member of a CDR variable known to be valid UTF-8.
+ *
+ * The value is cut to \c max_value_len. Under \c max_payload_size, a member
+ * that would take the payload begun at \a start past the budget, keeping
+ * room for the closing braces, is taken back out. Both are noted in
+ * \a cuts; without \a cuts there is no budget.
+ *
+ * \param member Allowlist member giving the key, or NULL to write \a name.
+ * \return 0 on success, -1 on allocation failure.
+ */
+static int plan_append_var(struct cdr_kafka_buf *buf, const struct cdr_kafka_plan *plan,
+	size_t start, const struct cdr_kafka_plan_member *member, const char *name,
+	const char *value, int *comma, unsigned int *written, struct cdr_kafka_cuts *cuts)
+{
+	const char *end = plan->max_value_len ? utf8_truncate(value, plan->max_value_len) : NULL;
+	size_t mark = buf->len;
+
+	if ((*comma && buf_putc(buf, ','))
+		|| (member ? buf_append(buf, member->prefix, member->prefix_len)
+			: (json_append_string(buf, name) || buf_putc(buf, ':')))
+		|| json_append_string_until(buf, value, end)) {
+		return -1;
+	}
+	if (cuts && plan->max_payload
+		&& buf->len - start + 1 + plan->nest_vars > plan->max_payload) {
+		buf->len = mark;
+		cuts_add(cuts, member ? member->key : name);
+		return 0;
+	}
+	if (cuts && end) {
+		cuts_add(cuts, member ? member->key : name);
+	}
+	*comma = 1;
+	(*written)++;
+
+	return 0;
+}
+
+/*! \brief Append the value of the field \a member, cut to its field_limits cap. */
+static int plan_append_field(struct cdr_kafka_buf *buf, const struct cdr_kafka_plan_member *member,
+	struct ast_cdr *cdr, enum cdr_kafka_timestamps timestamps, struct cdr_kafka_cuts *cuts)
+{
+	const char *value;
+	const char *end;
+
+	if (!cuts || !member->max_len) {
+		return encode_core_field(buf, member->field, cdr, timestamps);
+	}
+
+	/* Only text fields are capped */
+	value = (const char *) cdr + member->field->offset;
+	if (!utf8_valid(value)) {
+		return -1;
+	}
+	end = utf8_truncate(value, member->max_len);
+	if (end) {
+		cuts_add(cuts, member->key);
+	}
+
+	return json_append_string_until(buf, value, end);
+}
+
+/*!
+ * \brief The value written for CDR variable \a var, or NULL.
+ *
+ * A name set more than once is written at its first occurrence, with the
+ * last value that is valid UTF-8. Invalid names are not written.
+ */
+static const char *plan_var_value(struct ast_cdr *cdr, struct ast_var_t *var)
+{
+	const char *value = NULL;
+	struct ast_var_t *other;
+
+	if (!utf8_valid(var->name)) {
+		return NULL;
+	}
+	for (other = AST_LIST_FIRST(&cdr->varshead); other != var;
+		other = AST_LIST_NEXT(other, entries)) {
+		if (!strcmp(other->name, var->name)) {
+			return NULL;
+		}
+	}
+	for (other = var; other; other = AST_LIST_NEXT(other, entries)) {
+		if (!strcmp(other->name, var->name) && utf8_valid(other->value)) {
+			value = other->value;
+		}
+	}
+
+	return value;
+}
+
+/*!
+ * \brief Append the variables matched by the prefix member \a index.
+ *
+ * Variables an earlier prefix matched, or that another member writes,
+ * are left out.
+ *
+ * \return 0 on success, -1 on allocation failure.
+ */
+static int plan_append_prefixed(struct cdr_kafka_buf *buf, const struct cdr_kafka_plan *plan,
+	size_t start, size_t index, struct ast_cdr *cdr, int *comma, unsigned int *written,
+	struct cdr_kafka_cuts *cuts)
+{
+	const struct cdr_kafka_plan_member *member = &plan->vars[index];
+	struct ast_var_t *var;
+
+	AST_LIST_TRAVERSE(&cdr->varshead, var, entries) {
+		const char *value;
+		size_t i;
+
+		if (plan->max_vars && *written == plan->max_vars) {
+			break;
+		}
+		if (strncmp(var->name, member->name, member->name_len)) {
+			continue;
+		}
+		for (i = 0; i < index; i++) {
+			if (plan->vars[i].name_prefix
+				&& !strncmp(var->name, plan->vars[i].name, plan->vars[i].name_len)) {
+				break;
+			}
+		}
+		if (i < index || plan_taken(plan, var->name) || !(value = plan_var_value(cdr, var))) {
+			continue;
+		}
+
+		if (plan_append_var(buf, plan, start, NULL, var->name, value, comma, written, cuts)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Append the JSON representation of a CDR laid out by \a plan.
+ *
+ * Fields are written in plan order. A field that is not valid UTF-8 fails
+ * the record, like in the default layout, and an empty SystemName is left
+ * out. Variables never replace fields here; with all variables or a
+ * prefix, one named like a member of the plan is left out instead, unless
+ * variables are nested. At most \c max_vars variables are written.
+ *
+ * With \a cuts, text fields are cut to their field_limits caps and the
+ * variables that do not fit \c max_payload are left out, after the fields,
+ * which are always written. Without, the record is written whole.
+ *
+ * \return 0 on success.
+ * \return -1 on error, with \a buf left at its original length.
+ */
+static int encode_cdr_plan(struct cdr_kafka_buf *buf, const struct cdr_kafka_plan *plan,
+	struct ast_cdr *cdr, enum cdr_kafka_timestamps timestamps, struct cdr_kafka_cuts *cuts)
+{
+	size_t start = buf->len;
+	unsigned int written = 0;
+	int comma = 0;
+	struct ast_var_t *var;
+	size_t i;
+
+	if (buf_putc(buf, '{')) {
+		goto error;
+	}
+
+	for (i = 0; i < plan->field_count; i++) {
+		const struct cdr_kafka_plan_member *member = &plan->fields[i];
+
+		if (member->field->type == CDR_FIELD_SYSTEMNAME
+			&& (ast_strlen_zero(ast_config_AST_SYSTEM_NAME)
+				|| !utf8_valid(ast_config_AST_SYSTEM_NAME))) {
+			continue;
+		}
+		if ((comma && buf_putc(buf, ','))
+			|| buf_append(buf, member->prefix, member->prefix_len)
+			|| plan_append_field(buf, member, cdr, timestamps, cuts)) {
+			goto error;
+		}
+		comma = 1;
+	}
+	if (cuts && plan->max_payload && buf->len - start + 1 > plan->max_payload) {
+		cuts->oversized = 1;
+	}
+	if (cuts && cuts->traced) {
+		cuts->fields_ns = metrics_now();
+	}
+
+	if (plan->nest_vars) {
+		if ((comma && buf_putc(buf, ',')) || buf_append(buf, "\"vars\":{", 8)) {
+			goto error;
+		}
+		comma = 0;
+	}
+
+	if (plan->all_vars) {
+		AST_LIST_TRAVERSE(&cdr->varshead, var, entries) {
+			const char *value;
+
+			if (plan->max_vars && written == plan->max_vars) {
+				break;
+			}
+			if (plan_taken(plan, var->name) || !(value = plan_var_value(cdr, var))) {
+				continue;
+			}
+
+			if (plan_append_var(buf, plan, start, NULL, var->name, value, &comma, &written,
+				cuts)) {
+				goto error;
+			}
+		}
+	} else {
+		for (i = 0; i < plan->var_count; i++) {
+			const struct cdr_kafka_plan_member *member = &plan->vars[i];
+			const char *value = NULL;
+
+			if (plan->max_vars && written == plan->max_vars) {
+				break;
+			}
+
+			if (member->name_prefix) {
+				if (plan_append_prefixed(buf, plan, start, i, cdr, &comma, &written, cuts)) {
+					goto error;
+				}
+				continue;
+			}
+
+			AST_LIST_TRAVERSE(&cdr->varshead, var, entries) {
+				if (!strcmp(var->name, member->name) && utf8_valid(var->value)) {
+					value = var->value;
+				}
+			}
+			if (!value) {
+				continue;
+			}
+
+			if (plan_append_var(buf, plan, start, member, NULL, value, &comma, &written, cuts)) {
+				goto error;
+			}
+		}
+	}
+
+	if ((plan->nest_vars && buf_putc(buf, '}')) || buf_putc(buf, '}')) {
+		goto error;
+	}
+
+	return 0;
+
+error:
+	buf->len = start;
+	return -1;
+}
+
+/*! \brief Confluent wire format: magic byte and big-endian schema id. */
+#define CDR_KAFKA_WIRE_HEADER_LEN 5
+
+/*! \brief Protobuf field number of the variables map, see schemas/cdr.proto. */
+#define CDR_KAFKA_PB_VARIABLES (ARRAY_LEN(core_fields) + 3)
+
+/*! \brief Protobuf wire types. */
+enum cdr_kafka_pb_wire {
+	CDR_PB_VARINT = 0,
+	CDR_PB_LEN = 2,
+};
+
+/*! \brief Append \a value as a base 128 varint. */
+static int buf_varint(struct cdr_kafka_buf *buf, uint64_t value)
+{
+	if (buf_reserve(buf, 10)) {
+		return -1;
+	}
+
+	while (value >= 0x80) {
+		buf->data[buf->len++] = (char) (value | 0x80);
+		value >>= 7;
+	}
+	buf->data[buf->len++] = (char) value;
+
+	return 0;
+}
+
+/*! \brief Number of bytes buf_varint() writes for \a value. */
+static size_t varint_len(uint64_t value)
+{
+	size_t len = 1;
+
+	while (value >= 0x80) {
+		value >>= 7;
+		len++;
+	}
+
+	return len;
+}
+
+/*! \brief Append an Avro int or long (zigzag varint). */
+static int avro_long(struct cdr_kafka_buf *buf, int64_t value)
+{
+	return buf_varint(buf, ((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+}
+
+/*! \brief Append an Avro string, or fail on invalid UTF-8. */
+static int avro_string(struct cdr_kafka_buf *buf, const char *str)
+{
+	size_t len = strlen(str);
+
+	if (!utf8_valid(str)) {
+		return -1;
+	}
+
+	return avro_long(buf, len) || buf_append(buf, str, len);
+}
+
+/*! \brief Append an Avro ["null", "string"] union. */
+static int avro_optional_string(struct cdr_kafka_buf *buf, const char *str)
+{
+	if (!str) {
+		return avro_long(buf, 0);
+	}
+
+	return avro_long(buf, 1) || avro_string(buf, str);
+}
+
+/*! \brief Microseconds since the epoch, 0 when \a tv is not set. */
+static int64_t timeval_us(struct timeval tv)
+{
+	return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*! \brief Value of a core text field, or NULL if it is not a text field. */
+static const char *core_field_text(const struct cdr_kafka_field *field,
+	struct ast_cdr *cdr)
+{
+	switch (field->type) {
+	case CDR_FIELD_STRING:
+		return (const char *) cdr + field->offset;
+	case CDR_FIELD_DISPOSITION:
+		return ast_cdr_disp2str(cdr->disposition);
+	case CDR_FIELD_AMAFLAGS:
+		return ast_channel_amaflags2string(cdr->amaflags);
+	case CDR_FIELD_ENTITYID:
+		return cached_eid;
+	case CDR_FIELD_SYSTEMNAME:
+		return ast_config_AST_SYSTEM_NAME;
+	case CDR_FIELD_TIMEVAL:
+	case CDR_FIELD_LONG:
+	case CDR_FIELD_INT:
+		break;
+	}
+
+	return NULL;
+}
+
+/*! \brief Value of a core numeric field; timestamps in microseconds. */
+static int64_t core_field_number(const struct cdr_kafka_field *field,
+	struct ast_cdr *cdr)
+{
+	const char *base = (const char *) cdr;
+
+	switch (field->type) {
+	case CDR_FIELD_TIMEVAL:
+		return timeval_us(*(const struct timeval *) (base + field->offset));
+	case CDR_FIELD_LONG:
+		return *(const long *) (base + field->offset);
+	case CDR_FIELD_INT:
+		return *(const int *) (base + field->offset);
+	default:
+		return 0;
+	}
+}
+
+/*!
+ * \brief Whether \a var is the member that represents its name in the
+ *        variables map, and the value it carries.
+ *
+ * As in the JSON payload, a name set more than once appears once, with
+ * the last value that is valid UTF-8.
+ */
+static const char *binary_var_value(struct ast_cdr *cdr, struct ast_var_t *var)
+{
+	const char *value = NULL;
+	struct ast_var_t *other;
+
+	if (!utf8_valid(var->name)) {
+		return NULL;
+	}
+	for (other = AST_LIST_FIRST(&cdr->varshead); other != var;
+		other = AST_LIST_NEXT(other, entries)) {
+		if (!strcmp(other->name, var->name)) {
+			return NULL;
+		}
+	}
+	for (other = var; other; other = AST_LIST_NEXT(other, entries)) {
+		if (!strcmp(other->name, var->name) && utf8_valid(other->value)) {
+			value = other->value;
+		}
+	}
+
+	return value;
+}
+
+/*! \brief Append the Confluent wire format header. */
+static int encode_wire_header(struct cdr_kafka_buf *buf, unsigned int schema_id)
+{
+	char header[CDR_KAFKA_WIRE_HEADER_LEN] = {
+		0,
+		(char) (schema_id >> 24),
+		(char) (schema_id >> 16),
+		(char) (schema_id >> 8),
+		(char) schema_id,
+	};
+
+	return buf_append(buf, header, sizeof(header));
+}
+
+/*!
+ * \brief Append a CDR as an Avro record in the schemas/cdr.avsc layout.
+ *
+ * \return 0 on success.
+ * \return -1 on error, with \a buf left at its original length.
+ */
+static int encode_cdr_avro(struct cdr_kafka_buf *buf, const struct cdr_kafka_global_conf *global,
+	struct ast_cdr *cdr)
+{
+	size_t start = buf->len;
+	struct ast_var_t *var;
+	size_t count = 0;
+	size_t i;
+
+	if (encode_wire_header(buf, global->schema_id)) {
+		goto error;
+	}
+
+	for (i = 0; i < ARRAY_LEN(core_fields); i++) {
+		const struct cdr_kafka_field *field = &core_fields[i];
+		const char *text = core_field_text(field, cdr);
+
+		if (field->type == CDR_FIELD_SYSTEMNAME) {
+			if (avro_optional_string(buf, ast_strlen_zero(text) || !utf8_valid(text) ? NULL : text)) {
+				goto error;
+			}
+		} else if (text ? avro_string(buf, text) : avro_long(buf, core_field_number(field, cdr))) {
+			goto error;
+		}
+	}
+
+	if (avro_optional_string(buf, global->loguniqueid && utf8_valid(cdr->uniqueid) ? cdr->uniqueid : NULL)
+		|| avro_optional_string(buf, global->loguserfield && utf8_valid(cdr->userfield) ? cdr->userfield : NULL)) {
+		goto error;
+	}
+
+	/* A map is written as one block of entries followed by an empty block */
+	AST_LIST_TRAVERSE(&cdr->varshead, var, entries) {
+		count += binary_var_value(cdr, var) != NULL;
+	}
+	if (count) {
+		if (avro_long(buf, count)) {
+			goto error;
+		}
+		AST_LIST_TRAVERSE(&cdr->varshead, var, entries) {
+			const char *value = binary_var_value(cdr, var);
+
+			if (value && (avro_string(buf, var->name) || avro_string(buf, value))) {
+				goto error;
+			}
+		}
+	}
+	if (avro_long(buf, 0)) {
+		goto error;
+	}
+
+	return 0;
+
+error:
+	buf->len = start;
+	return -1;
+}
+
+/*! \brief Append a protobuf length-delimited field, or fail on invalid UTF-8. */
+static int pb_string(struct cdr_kafka_buf *buf, unsigned int number, const char *str)
+{
+	size_t len = strlen(str);
+
+	if (!utf8_valid(str)) {
+		return -1;
+	}
+	if (!len) {
+		/* proto3 leaves out default values */
+		return 0;
+	}
+
+	return buf_varint(buf, (number << 3) | CDR_PB_LEN)
+		|| buf_varint(buf, len)
+		|| buf_append(buf, str, len);
+}
+
+/*! \brief Append a protobuf int64 field. */
+static int pb_int64(struct cdr_kafka_buf *buf, unsigned int number, int64_t value)
+{
+	if (!value) {
+		return 0;
+	}
+
+	return buf_varint(buf, (number << 3) | CDR_PB_VARINT)
+		|| buf_varint(buf, (uint64_t) value);
+}
+
+/*!
+ * \brief Append a CDR as a protobuf CdrRecord message, see schemas/cdr.proto.
+ *
+ * Field numbers follow core_fields, then uniqueid, userfield and the
+ * variables map.
+ *
+ * \return 0 on success.
+ * \return -1 on error, with \a buf left at its original length.
+ */
+static int encode_cdr_protobuf(struct cdr_kafka_buf *buf, const struct cdr_kafka_global_conf *global,
+	struct ast_cdr *cdr)
+{
+	size_t start = buf->len;
+	unsigned int number = 1;
+	struct ast_var_t *var;
+	size_t i;
+
+	/* The message index list [0], for the first message of the schema */
+	if (encode_wire_header(buf, global->schema_id) || buf_putc(buf, 0)) {
+		goto error;
+	}
+
+	for (i = 0; i < ARRAY_LEN(core_fields); i++, number++) {
+		const struct cdr_kafka_field *field = &core_fields[i];
+		const char *text = core_field_text(field, cdr);
+
+		if (field->type == CDR_FIELD_SYSTEMNAME) {
+			if (utf8_valid(text) && pb_string(buf, number, text)) {
+				goto error;
+			}
+		} else if (text ? pb_string(buf, number, text)
+			: pb_int64(buf, number, core_field_number(field, cdr))) {
+			goto error;
+		}
+	}
+
+	if ((global->loguniqueid && utf8_valid(cdr->uniqueid) && pb_string(buf, number, cdr->uniqueid))
+		|| (global->loguserfield && utf8_valid(cdr->userfield) && pb_string(buf, number + 1, cdr->userfield))) {
+		goto error;
+	}
+
+	AST_LIST_TRAVERSE(&cdr->varshead, var, entries) {
+		const char *value = binary_var_value(cdr, var);
+		size_t name_len;
+		size_t value_len;
+
+		if (!value) {
+			continue;
+		}
+
+		/* A map entry is a nested message with key = 1 and value = 2 */
+		name_len = strlen(var->name);
+		value_len = strlen(value);
+		if (buf_varint(buf, (CDR_KAFKA_PB_VARIABLES << 3) | CDR_PB_LEN)
+			|| buf_varint(buf, 2 + varint_len(name_len) + name_len + varint_len(value_len) + value_len)
+			|| buf_varint(buf, (1 << 3) | CDR_PB_LEN)
+			|| buf_varint(buf, name_len)
+			|| buf_append(buf, var->name, name_len)
+			|| buf_varint(buf, (2 << 3) | CDR_PB_LEN)
+			|| buf_varint(buf, value_len)
+			|| buf_append(buf, value, value_len)) {
+			goto error;
+		}
+	}
+
+	return 0;
+
+error:
+	buf->len = start;
+	return -1;
+}
+
+/*!
+ * \brief Append a CDR to \a buf in the format and layout configured in \a global.
+ *
+ * \param cuts Filled with what field_limits and max_payload_size cut, or
+ *        NULL to write the record whole. Only JSON payloads are cut.
+ */
+static int encode_cdr(struct cdr_kafka_buf *buf, const struct cdr_kafka_global_conf *global,
+	struct ast_cdr *cdr, struct cdr_kafka_cuts *cuts)
+{
+	switch (global->format) {
+	case CDR_KAFKA_FORMAT_AVRO:
+		return encode_cdr_avro(buf, global, cdr);
+	case CDR_KAFKA_FORMAT_PROTOBUF:
+		return encode_cdr_protobuf(buf, global, cdr);
+	case CDR_KAFKA_FORMAT_JSON:
+		break;
+	}
+
+	if (global->plan) {
+		return encode_cdr_plan(buf, global->plan, cdr, global->timestamps, cuts);
+	}
+
+	return encode_cdr_json(buf, cdr, global->loguniqueid, global->loguserfield,
+		global->timestamps, cuts && cuts->traced ? &cuts->fields_ns : NULL);
+}
+
+/*! \brief Largest zstd dictionary file loaded. */
+#define CDR_KAFKA_ZSTD_DICT_MAX (16 * 1024 * 1024)
+
+/*!
+ * \brief zstd settings of a configuration, loaded once per reload.
+ *
+ * The dictionary is digested into \c cdict up front, so compressing a
+ * payload with it costs no more than compressing without one.
+ */
+struct cdr_kafka_zstd {
+#ifdef HAVE_ZSTD
+	/*! \brief Digested dictionary, NULL without compression_dictionary */
+	ZSTD_CDict *cdict;
+#endif
+	/*! \brief ID the dictionary declares, 0 for none or a raw content dictionary */
+	unsigned int dict_id;
+	int level;
+};
+
+#ifdef HAVE_ZSTD
+static void zstd_dtor(void *obj)
+{
+	struct cdr_kafka_zstd *zstd = obj;
+
+	ZSTD_freeCDict(zstd->cdict);
+}
+
+/*! \brief Read and digest the dictionary file at \a path. */
+static int zstd_load_dictionary(struct cdr_kafka_zstd *zstd, const char *path)
+{
+	struct stat st;
+	char *dict;
+	FILE *file;
+	int res = -1;
+
+	file = fopen(path, "rb");
+	if (!file) {
+		ast_log(LOG_ERROR, "Cannot open zstd dictionary %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fileno(file), &st) || !st.st_size || st.st_size > CDR_KAFKA_ZSTD_DICT_MAX) {
+		ast_log(LOG_ERROR, "zstd dictionary %s is empty or larger than %d bytes\n", path,
+			CDR_KAFKA_ZSTD_DICT_MAX);
+		fclose(file);
+		return -1;
+	}
+
+	dict = ast_malloc(st.st_size);
+	if (dict && fread(dict, 1, st.st_size, file) == (size_t) st.st_size) {
+		zstd->cdict = ZSTD_createCDict(dict, st.st_size, zstd->level);
+		zstd->dict_id = ZSTD_getDictID_fromDict(dict, st.st_size);
+		res = zstd->cdict ? 0 : -1;
+	} else if (dict) {
+		ast_log(LOG_ERROR, "Cannot read zstd dictionary %s\n", path);
+	}
+	ast_free(dict);
+	fclose(file);
+
+	return res;
+}
+#endif
+
+/*!
+ * \brief Load the zstd settings of \a global for \c compression = zstd.
+ *
+ * \return 0 on success, -1 if the dictionary cannot be loaded.
+ */
+static int zstd_compile(struct cdr_kafka_global_conf *global)
+{
+#ifdef HAVE_ZSTD
+	RAII_VAR(struct cdr_kafka_zstd *, zstd, NULL, ao2_cleanup);
+	const char *name = global->compression_dictionary;
+	char path[PATH_MAX];
+
+	ao2_cleanup(global->zstd);
+	global->zstd = NULL;
+	if (global->compression != CDR_KAFKA_COMPRESSION_ZSTD) {
+		return 0;
+	}
+
+	zstd = ao2_alloc_options(sizeof(*zstd), zstd_dtor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!zstd) {
+		return -1;
+	}
+	zstd->level = global->compression_level;
+
+	if (!ast_strlen_zero(name)) {
+		if (name[0] == '/') {
+			ast_copy_string(path, name, sizeof(path));
+		} else {
+			snprintf(path, sizeof(path), "%s/%s", ast_config_AST_CONFIG_DIR, name);
+		}
+		if (zstd_load_dictionary(zstd, path)) {
+			return -1;
+		}
+		if (!zstd->dict_id) {
+			ast_log(LOG_NOTICE, "zstd dictionary %s has no ID, consumers cannot tell it "
+				"from another one\n", path);
+		}
+	}
+
+	global->zstd = ao2_bump(zstd);
+#else
+	if (!ast_strlen_zero(global->compression_dictionary)) {
+		ast_log(LOG_NOTICE, "compression_dictionary only applies to compression = zstd\n");
+	}
+#endif
+
+	return 0;
+}
+
+#ifdef HAVE_ZSTD
+/*! \brief A publishing thread's zstd context and output buffer. */
+struct cdr_kafka_zstd_tls {
+	struct cdr_kafka_tls link;
+	ZSTD_CCtx *cctx;
+	struct cdr_kafka_buf out;
+};
+
+static void zstd_tls_release(struct cdr_kafka_tls *link)
+{
+	struct cdr_kafka_zstd_tls *tls = (struct cdr_kafka_zstd_tls *) link;
+
+	ZSTD_freeCCtx(tls->cctx);
+	ast_free(tls->out.data);
+}
+
+static int zstd_tls_init(void *data);
+
+/*! \brief Compression context of each publishing thread, reused across CDRs. */
+AST_THREADSTORAGE_CUSTOM(zstd_tls, zstd_tls_init, tls_cleanup);
+
+static int zstd_tls_init(void *data)
+{
+	return tls_track(&zstd_tls, data, zstd_tls_release);
+}
+#endif
+
+/*!
+ * \brief Compress the payload at \a start of \a buf in place, as \c compression says.
+ *
+ * \return 0 on success, leaving the payload as is without compression.
+ * \return -1 on error; \a buf is cut back to \a start.
+ */
+static int payload_compress(struct cdr_kafka_buf *buf, size_t start,
+	const struct cdr_kafka_global_conf *global)
+{
+#ifdef HAVE_ZSTD
+	struct cdr_kafka_zstd *zstd = global->zstd;
+	struct cdr_kafka_zstd_tls *tls;
+	size_t len = buf->len - start;
+	size_t res;
+
+	if (!zstd) {
+		return 0;
+	}
+
+	tls = ast_threadstorage_get(&zstd_tls, sizeof(*tls));
+	if (!tls || (!tls->cctx && !(tls->cctx = ZSTD_createCCtx()))) {
+		buf->len = start;
+		return -1;
+	}
+
+	tls->out.len = 0;
+	if (buf_reserve(&tls->out, ZSTD_compressBound(len))) {
+		buf->len = start;
+		return -1;
+	}
+	res = zstd->cdict
+		? ZSTD_compress_usingCDict(tls->cctx, tls->out.data, tls->out.size, buf->data + start,
+			len, zstd->cdict)
+		: ZSTD_compressCCtx(tls->cctx, tls->out.data, tls->out.size, buf->data + start,
+			len, zstd->level);
+	buf->len = start;
+	if (ZSTD_isError(res)) {
+		ast_log(LOG_ERROR, "zstd failed to compress a CDR: %s\n", ZSTD_getErrorName(res));
+		return -1;
+	}
+
+	return buf_append(buf, tls->out.data, res);
+#else
+	return 0;
+#endif
+}
+
+/*! \brief Most payload buffers kept around for reuse. */
+#define CDR_KAFKA_POOL_MAX 1024
+
+/*! \brief Payload buffers that grew beyond this are not kept for reuse. */
+#define CDR_KAFKA_POOL_BUF_MAX 65536
+
+/*! \brief How long unloading waits for the producer to release payloads. */
+#define CDR_KAFKA_POOL_DRAIN_MS 5000
+
+/*!
+ * \brief A payload buffer handed over to the producer.
+ *
+ * Taken from the pool before encoding and returned by the producer's
+ * delivery callback once the message is delivered or has failed, so the
+ * steady state neither allocates nor copies payloads.
+ */
+struct cdr_kafka_pool_buf {
+	struct cdr_kafka_buf buf;
+	/*! \brief In flight counter of the connection holding the buffer, or NULL */
+	unsigned int *inflight;
+	/*! \brief When the producer took the buffer, for the Delivery stage */
+	uint64_t produced_ns;
+	/*! \brief Trace the delivery span goes to, 0 if the record is not traced */
+	uint64_t trace_seq;
+	/*! \brief Whether a failed delivery is spooled; copies are set only then */
+	int respool;
+	/*! \brief Whether \c key holds a key */
+	int keyed;
+	char key[CDR_KAFKA_KEY_LEN];
+	char topic[CDR_KAFKA_TOPIC_LEN + 1];
+	/*! \brief Size of the headers_pack() copy of the headers after the payload, 0 if none */
+	size_t headers_len;
+	AST_LIST_ENTRY(cdr_kafka_pool_buf) entry;
+};
+
+/*! \brief Free payload buffers, most recently used first. */
+static AST_LIST_HEAD_STATIC(payload_pool, cdr_kafka_pool_buf);
+
+/*! \brief Number of buffers in \c payload_pool, guarded by its lock. */
+static size_t payload_pool_free;
+
+/*! \brief Buffers taken from the pool and not returned yet. */
+static unsigned int payload_pool_used;
+
+/*! \brief Take an empty payload buffer from the pool. */
+static struct cdr_kafka_pool_buf *pool_get(void)
+{
+	struct cdr_kafka_pool_buf *pool_buf;
+
+	AST_LIST_LOCK(&payload_pool);
+	pool_buf = AST_LIST_REMOVE_HEAD(&payload_pool, entry);
+	if (pool_buf) {
+		payload_pool_free--;
+	}
+	AST_LIST_UNLOCK(&payload_pool);
+
+	if (!pool_buf) {
+		TEST_COUNT_ALLOCATION();
+		pool_buf = ast_calloc(1, sizeof(*pool_buf));
+		if (!pool_buf) {
+			return NULL;
+		}
+	}
+
+	pool_buf->buf.len = 0;
+	pool_buf->trace_seq = 0;
+	__atomic_add_fetch(&payload_pool_used, 1, __ATOMIC_RELAXED);
+	return pool_buf;
+}
+
+/*! \brief Give a payload buffer back to the pool. */
+static void pool_put(struct cdr_kafka_pool_buf *pool_buf)
+{
+	if (pool_buf->buf.size <= CDR_KAFKA_POOL_BUF_MAX) {
+		AST_LIST_LOCK(&payload_pool);
+		if (payload_pool_free < CDR_KAFKA_POOL_MAX) {
+			AST_LIST_INSERT_HEAD(&payload_pool, pool_buf, entry);
+			payload_pool_free++;
+			pool_buf = NULL;
+		}
+		AST_LIST_UNLOCK(&payload_pool);
+	}
+
+	if (pool_buf) {
+		ast_free(pool_buf->buf.data);
+		ast_free(pool_buf);
+	}
+
+	/* Last, so unloading never frees the pool under us */
+	__atomic_sub_fetch(&payload_pool_used, 1, __ATOMIC_RELEASE);
+}
+
+/*! \brief Take a payload back from the producer once its delivery is final. */
+static void pool_release(struct cdr_kafka_pool_buf *pool_buf)
+{
+	if (pool_buf->inflight) {
+		__atomic_sub_fetch(pool_buf->inflight, 1, __ATOMIC_RELAXED);
+		pool_buf->inflight = NULL;
+	}
+	pool_put(pool_buf);
+}
+
+/*!
+ * \brief Wait for the producer to release every payload, then empty the pool.
+ *
+ * \return 0 on success.
+ * \return -1 if payloads are still held by the producer.
+ */
+static int pool_drain(void)
+{
+	struct cdr_kafka_pool_buf *pool_buf;
+	unsigned int used;
+	int waited = 0;
+
+	while ((used = __atomic_load_n(&payload_pool_used, __ATOMIC_ACQUIRE))
+		&& waited < CDR_KAFKA_POOL_DRAIN_MS) {
+		usleep(10000);
+		waited += 10;
+	}
+	if (used) {
+		ast_log(LOG_ERROR, "Kafka still holds %u CDR payloads\n", used);
+		return -1;
+	}
+
+	AST_LIST_LOCK(&payload_pool);
+	while ((pool_buf = AST_LIST_REMOVE_HEAD(&payload_pool, entry))) {
+		ast_free(pool_buf->buf.data);
+		ast_free(pool_buf);
+	}
+	payload_pool_free = 0;
+	AST_LIST_UNLOCK(&payload_pool);
+
+	return 0;
+}
+
+/*! \brief Publish path stages timed by the metrics. */
+enum cdr_kafka_stage {
+	/*! Taking the configuration and producer references */
+	CDR_KAFKA_STAGE_REF,
+	/*! Serializing the CDR */
+	CDR_KAFKA_STAGE_ENCODE,
+	/*! Handing the message(s) to res_kafka */
+	CDR_KAFKA_STAGE_PRODUCE,
+	/*! Copying the CDR onto the async queue */
+	CDR_KAFKA_STAGE_ENQUEUE,
+	/*! From handing a pooled payload over to its delivery report */
+	CDR_KAFKA_STAGE_DELIVERY,
+	CDR_KAFKA_STAGE_COUNT,
+};
+
+static const char * const stage_names[] = {
+	[CDR_KAFKA_STAGE_REF] = "Ref",
+	[CDR_KAFKA_STAGE_ENCODE] = "Encode",
+	[CDR_KAFKA_STAGE_PRODUCE] = "Produce",
+	[CDR_KAFKA_STAGE_ENQUEUE] = "Enqueue",
+	[CDR_KAFKA_STAGE_DELIVERY] = "Delivery",
+};
+
+/*! \brief Event counters kept by the metrics. */
+enum cdr_kafka_counter {
+	/*! CDRs taken by the producer */
+	CDR_KAFKA_COUNTER_PUBLISHED,
+	/*! CDRs lost because they could not be produced or spooled */
+	CDR_KAFKA_COUNTER_FAILED,
+	/*! CDRs that could not be serialized */
+	CDR_KAFKA_COUNTER_ENCODE_FAILED,
+	/*! CDRs written to the spool */
+	CDR_KAFKA_COUNTER_SPOOLED,
+	/*! Spooled CDRs produced by the replay thread */
+	CDR_KAFKA_COUNTER_REPLAYED,
+	/*! CDRs the full async queue discarded, by overflow = drop_oldest or shedding */
+	CDR_KAFKA_COUNTER_DROPPED,
+	/*! Payload bytes taken by the producer */
+	CDR_KAFKA_COUNTER_BYTES,
+	/*! CDRs published as part of a call message */
+	CDR_KAFKA_COUNTER_AGGREGATED,
+	/*! CDRs dropped by the filter rules */
+	CDR_KAFKA_COUNTER_FILTERED,
+	/*! Pooled payloads the broker acknowledged */
+	CDR_KAFKA_COUNTER_DELIVERED,
+	/*! Pooled payloads the producer took but finally failed to deliver */
+	CDR_KAFKA_COUNTER_DELIVERY_FAILED,
+	/*! Summary records taken by the producer */
+	CDR_KAFKA_COUNTER_SUMMARIES,
+	/*! Summary records dropped because they could not be built or produced */
+	CDR_KAFKA_COUNTER_SUMMARY_FAILED,
+	/*! High, normal and low class CDRs shed from the async queue under overload */
+	CDR_KAFKA_COUNTER_SHED_HIGH,
+	CDR_KAFKA_COUNTER_SHED_NORMAL,
+	CDR_KAFKA_COUNTER_SHED_LOW,
+	/*! Payloads written with members cut or left out by field_limits and the budgets */
+	CDR_KAFKA_COUNTER_TRUNCATED,
+	/*! Records whose fields alone are over max_payload_size */
+	CDR_KAFKA_COUNTER_OVERSIZED,
+	/*! Oversized records dropped because there is no oversize_topic */
+	CDR_KAFKA_COUNTER_OVERSIZE_DROPPED,
+	CDR_KAFKA_COUNTER_FANOUT_FAILED,
+	CDR_KAFKA_COUNTER_COUNT,
+};
+
+static const char * const counter_names[] = {
+	[CDR_KAFKA_COUNTER_PUBLISHED] = "Published",
+	[CDR_KAFKA_COUNTER_FAILED] = "Failed",
+	[CDR_KAFKA_COUNTER_ENCODE_FAILED] = "EncodeFailed",
+	[CDR_KAFKA_COUNTER_SPOOLED] = "Spooled",
+	[CDR_KAFKA_COUNTER_REPLAYED] = "Replayed",
+	[CDR_KAFKA_COUNTER_DROPPED] = "Dropped",
+	[CDR_KAFKA_COUNTER_BYTES] = "Bytes",
+	[CDR_KAFKA_COUNTER_AGGREGATED] = "Aggregated",
+	[CDR_KAFKA_COUNTER_FILTERED] = "Filtered",
+	[CDR_KAFKA_COUNTER_DELIVERED] = "Delivered",
+	[CDR_KAFKA_COUNTER_DELIVERY_FAILED] = "DeliveryFailed",
+	[CDR_KAFKA_COUNTER_SUMMARIES] = "Summaries",
+	[CDR_KAFKA_COUNTER_SUMMARY_FAILED] = "SummaryFailed",
+	[CDR_KAFKA_COUNTER_SHED_HIGH] = "ShedHigh",
+	[CDR_KAFKA_COUNTER_SHED_NORMAL] = "ShedNormal",
+	[CDR_KAFKA_COUNTER_SHED_LOW] = "ShedLow",
+	[CDR_KAFKA_COUNTER_TRUNCATED] = "Truncated",
+	[CDR_KAFKA_COUNTER_OVERSIZED] = "Oversized",
+	[CDR_KAFKA_COUNTER_OVERSIZE_DROPPED] = "OversizeDrop",
+	[CDR_KAFKA_COUNTER_FANOUT_FAILED] = "FanoutFailed",
+};
+
+/*! \brief Sub-buckets per power of two; 2 bits keeps values within 25%. */
+#define CDR_KAFKA_HIST_SUB_BITS 2
+
+#define CDR_KAFKA_HIST_BUCKETS (64 << CDR_KAFKA_HIST_SUB_BITS)
+
+/*!
+ * \brief Log-linear histogram.
+ *
+ * Every power of two is split into 2^CDR_KAFKA_HIST_SUB_BITS buckets, like
+ * an HDR histogram with two significant bits, so any 64-bit value is
+ * recorded with a shift and an increment.
+ */
+struct cdr_kafka_hist {
+	uint64_t buckets[CDR_KAFKA_HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+};
+
+/*!
+ * \brief Metrics of one thread.
+ *
+ * Only the owning thread writes them, with plain relaxed loads and stores,
+ * so recording is free of locked instructions. Readers sum all threads
+ * under the \c metrics_threads lock.
+ */
+struct cdr_kafka_metrics {
+	uint64_t counters[CDR_KAFKA_COUNTER_COUNT];
+	struct cdr_kafka_hist stages[CDR_KAFKA_STAGE_COUNT];
+	/*! \brief Payload sizes in bytes */
+	struct cdr_kafka_hist payload;
+	AST_LIST_ENTRY(cdr_kafka_metrics) entry;
+};
+
+/*! \brief Metrics of all live threads. */
+static AST_LIST_HEAD_STATIC(metrics_threads, cdr_kafka_metrics);
+
+/*! \brief Metrics of threads that have exited, guarded by the \c metrics_threads lock. */
+static struct cdr_kafka_metrics metrics_retired;
+
+/*!
+ * \brief Metrics recorded by delivery reports, guarded by the \c metrics_threads lock.
+ *
+ * Reports arrive on res_kafka's threads, which outlive this module, so
+ * they cannot be given thread storage with a destructor in it.
+ */
+static struct cdr_kafka_metrics metrics_reported;
+
+static void metric_add(uint64_t *slot, uint64_t value)
+{
+	__atomic_store_n(slot, __atomic_load_n(slot, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static unsigned int hist_bucket(uint64_t value)
+{
+	unsigned int msb;
+
+	if (value < (1 << CDR_KAFKA_HIST_SUB_BITS)) {
+		return value;
+	}
+
+	msb = 63 - __builtin_clzll(value);
+	return ((msb - CDR_KAFKA_HIST_SUB_BITS + 1) << CDR_KAFKA_HIST_SUB_BITS)
+		| ((value >> (msb - CDR_KAFKA_HIST_SUB_BITS)) & ((1 << CDR_KAFKA_HIST_SUB_BITS) - 1));
+}
+
+/*! \return The largest value recorded in \a bucket. */
+static uint64_t hist_bucket_max(unsigned int bucket)
+{
+	unsigned int msb;
+	uint64_t sub;
+
+	if (bucket < (1 << CDR_KAFKA_HIST_SUB_BITS)) {
+		return bucket;
+	}
+
+	msb = (bucket >> CDR_KAFKA_HIST_SUB_BITS) + CDR_KAFKA_HIST_SUB_BITS - 1;
+	sub = bucket & ((1 << CDR_KAFKA_HIST_SUB_BITS) - 1);
+	return (((uint64_t) 1 << msb) | (sub << (msb - CDR_KAFKA_HIST_SUB_BITS)))
+		+ ((uint64_t) 1 << (msb - CDR_KAFKA_HIST_SUB_BITS)) - 1;
+}
+
+static void hist_record(struct cdr_kafka_hist *hist, uint64_t value)
+{
+	metric_add(&hist->buckets[hist_bucket(value)], 1);
+	metric_add(&hist->count, 1);
+	metric_add(&hist->sum, value);
+	if (value > __atomic_load_n(&hist->max, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+	}
+}
+
+static void hist_merge(struct cdr_kafka_hist *to, const struct cdr_kafka_hist *from)
+{
+	uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+	size_t i;
+
+	for (i = 0; i < CDR_KAFKA_HIST_BUCKETS; i++) {
+		to->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+	}
+	to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+	to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+	to->max = MAX(to->max, max);
+}
+
+/*! \return The value below which a \a fraction of the recorded values fall. */
+static uint64_t hist_percentile(const struct cdr_kafka_hist *hist, double fraction)
+{
+	uint64_t rank = fraction * hist->count + 0.5;
+	uint64_t seen = 0;
+	size_t i;
+
+	rank = MAX(rank, 1);
+	for (i = 0; i < CDR_KAFKA_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank) {
+			return MIN(hist_bucket_max(i), hist->max);
+		}
+	}
+
+	return hist->max;
+}
+
+static void metrics_merge(struct cdr_kafka_metrics *to, const struct cdr_kafka_metrics *from)
+{
+	size_t i;
+
+	for (i = 0; i < CDR_KAFKA_COUNTER_COUNT; i++) {
+		to->counters[i] += __atomic_load_n(&from->counters[i], __ATOMIC_RELAXED);
+	}
+	for (i = 0; i < CDR_KAFKA_STAGE_COUNT; i++) {
+		hist_merge(&to->stages[i], &from->stages[i]);
+	}
+	hist_merge(&to->payload, &from->payload);
+}
+
+/*! \brief A thread's metrics, see metrics_get(). */
+struct cdr_kafka_metrics_tls {
+	struct cdr_kafka_tls link;
+	struct cdr_kafka_metrics metrics;
+};
+
+static void metrics_tls_release(struct cdr_kafka_tls *link)
+{
+	struct cdr_kafka_metrics *metrics = &((struct cdr_kafka_metrics_tls *) link)->metrics;
+
+	AST_LIST_LOCK(&metrics_threads);
+	AST_LIST_REMOVE(&metrics_threads, metrics, entry);
+	metrics_merge(&metrics_retired, metrics);
+	AST_LIST_UNLOCK(&metrics_threads);
+}
+
+static int metrics_tls_init(void *data);
+
+AST_THREADSTORAGE_CUSTOM(metrics_tls, metrics_tls_init, tls_cleanup);
+
+static int metrics_tls_init(void *data)
+{
+	struct cdr_kafka_metrics_tls *tls = data;
+
+	AST_LIST_LOCK(&metrics_threads);
+	AST_LIST_INSERT_TAIL(&metrics_threads, &tls->metrics, entry);
+	AST_LIST_UNLOCK(&metrics_threads);
+
+	return tls_track(&metrics_tls, &tls->link, metrics_tls_release);
+}
+
+/*! \return The calling thread's metrics, or NULL if they cannot be allocated. */
+static struct cdr_kafka_metrics *metrics_get(void)
+{
+	struct cdr_kafka_metrics_tls *tls = ast_threadstorage_get(&metrics_tls, sizeof(*tls));
+
+	return tls ? &tls->metrics : NULL;
+}
+
+/*! \brief Monotonic clock in nanoseconds. */
+static uint64_t metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void metrics_count(struct cdr_kafka_metrics *metrics,
+	enum cdr_kafka_counter counter, uint64_t value)
+{
+	if (metrics) {
+		metric_add(&metrics->counters[counter], value);
+	}
+}
+
+/*! \brief Record that \a stage took \a ns nanoseconds. */
+static void metrics_time(struct cdr_kafka_metrics *metrics,
+	enum cdr_kafka_stage stage, uint64_t ns)
+{
+	if (metrics) {
+		hist_record(&metrics->stages[stage], ns);
+	}
+}
+
+static void metrics_payload(struct cdr_kafka_metrics *metrics, size_t len)
+{
+	if (metrics) {
+		hist_record(&metrics->payload, len);
+	}
+}
+
+/*! \brief Spans of a traced publish. */
+enum cdr_kafka_span {
+	/*! Waiting in the async queue */
+	CDR_KAFKA_SPAN_QUEUE,
+	/*! Taking the snapshot and connecting its producers */
+	CDR_KAFKA_SPAN_REF,
+	/*! Serializing the fields, or the whole record for avro and protobuf */
+	CDR_KAFKA_SPAN_FIELDS,
+	/*! Serializing the variables */
+	CDR_KAFKA_SPAN_VARIABLES,
+	/*! Compressing the payload */
+	CDR_KAFKA_SPAN_COMPRESS,
+	/*! Building the Kafka headers */
+	CDR_KAFKA_SPAN_HEADERS,
+	/*! Handing the message(s) to res_kafka */
+	CDR_KAFKA_SPAN_PRODUCE,
+	/*! From handing a pooled payload over to its delivery report */
+	CDR_KAFKA_SPAN_DELIVERY,
+	CDR_KAFKA_SPAN_COUNT,
+};
+
+static const char * const span_names[] = {
+	[CDR_KAFKA_SPAN_QUEUE] = "Queue",
+	[CDR_KAFKA_SPAN_REF] = "Ref",
+	[CDR_KAFKA_SPAN_FIELDS] = "Fields",
+	[CDR_KAFKA_SPAN_VARIABLES] = "Vars",
+	[CDR_KAFKA_SPAN_COMPRESS] = "Compress",
+	[CDR_KAFKA_SPAN_HEADERS] = "Headers",
+	[CDR_KAFKA_SPAN_PRODUCE] = "Produce",
+	[CDR_KAFKA_SPAN_DELIVERY] = "Delivery",
+};
+
+/*! \brief Traces kept, a power of two; older ones are overwritten. */
+#define CDR_KAFKA_TRACE_SLOTS 1024
+
+/*! \brief Room for the key of a trace; longer keys are cut. */
+#define CDR_KAFKA_TRACE_KEY_LEN 128
+
+/*! \brief \c seq of a ring slot while it is being written. */
+#define CDR_KAFKA_TRACE_BUSY UINT64_MAX
+
+/*!
+ * \brief Timeline of one sampled publish.
+ *
+ * Filled on the stack of the CDR thread, or in the async record, and
+ * copied into \c trace_ring once the record was handed to the producer.
+ */
+struct cdr_kafka_trace {
+	/*! \brief Position in \c trace_ring, claimed when sampled */
+	uint64_t seq;
+	/*! \brief When kafka_cdr_log() took the CDR */
+	uint64_t start_ns;
+	/*! \brief When the CDR was put on the async queue */
+	uint64_t queued_ns;
+	/*! \brief From \c start_ns until the producer returned */
+	uint64_t total_ns;
+	uint64_t spans[CDR_KAFKA_SPAN_COUNT];
+	/*! \brief Payload size */
+	size_t len;
+	/*! \brief Whether the record got as far as the producer */
+	int published;
+	/*! \brief Whether the producer took it */
+	int taken;
+	char key[CDR_KAFKA_TRACE_KEY_LEN];
+	char topic[CDR_KAFKA_TOPIC_LEN + 1];
+};
+
+/*! \brief Every trace_every-th CDR is traced; 0 when tracing is off. */
+static unsigned int trace_every;
+
+/*! \brief CDRs seen since tracing was turned on. */
+static unsigned int trace_tick;
+
+/*! \brief Last ring position claimed. */
+static uint64_t trace_head;
+
+/*! \brief Positions up to this one were cleared. */
+static uint64_t trace_floor;
+
+/*!
+ * \brief The last CDR_KAFKA_TRACE_SLOTS traces.
+ *
+ * Slots are written without locks: a writer takes a slot by swapping
+ * its \c seq for CDR_KAFKA_TRACE_BUSY and stores its own position once
+ * done, and readers keep a copy only if \c seq is the same before and
+ * after it.
+ */
+static struct cdr_kafka_trace trace_ring[CDR_KAFKA_TRACE_SLOTS];
+
+/*!
+ * \brief Delivery span of each slot, tagged with the position it belongs to.
+ *
+ * Kept apart from \c trace_ring since a delivery report may arrive before
+ * the trace is written.
+ */
+static struct {
+	uint64_t seq;
+	uint64_t ns;
+} trace_deliveries[CDR_KAFKA_TRACE_SLOTS];
+
+/*!
+ * \brief Whether to trace the CDR at hand; only called while tracing is on.
+ *
+ * \param[out] trace Started if the CDR is sampled.
+ */
+static int trace_sample(struct cdr_kafka_trace *trace)
+{
+	unsigned int every = __atomic_load_n(&trace_every, __ATOMIC_RELAXED);
+
+	if (!every || __atomic_fetch_add(&trace_tick, 1, __ATOMIC_RELAXED) % every) {
+		return 0;
+	}
+
+	memset(trace, 0, sizeof(*trace));
+	trace->seq = __atomic_add_fetch(&trace_head, 1, __ATOMIC_RELAXED);
+	trace->start_ns = metrics_now();
+	return 1;
+}
+
+/*! \brief Note what a traced record was published as. */
+static void trace_publish(struct cdr_kafka_trace *trace, const char *key, const char *topic,
+	size_t len, int taken)
+{
+	trace->total_ns = metrics_now() - trace->start_ns;
+	trace->len = len;
+	trace->taken = taken;
+	trace->published = 1;
+	ast_copy_string(trace->key, S_OR(key, ""), sizeof(trace->key));
+	ast_copy_string(trace->topic, topic, sizeof(trace->topic));
+}
+
+/*! \brief Copy a trace into its ring slot, unless a newer one took the slot. */
+static void trace_commit(const struct cdr_kafka_trace *trace)
+{
+	struct cdr_kafka_trace *slot = &trace_ring[(trace->seq - 1) & (CDR_KAFKA_TRACE_SLOTS - 1)];
+	uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+
+	if (!trace->published || seq == CDR_KAFKA_TRACE_BUSY || seq > trace->seq
+		|| !__atomic_compare_exchange_n(&slot->seq, &seq, CDR_KAFKA_TRACE_BUSY, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	memcpy((char *) slot + sizeof(slot->seq), (const char *) trace + sizeof(trace->seq),
+		sizeof(*trace) - sizeof(trace->seq));
+	__atomic_store_n(&slot->seq, trace->seq, __ATOMIC_RELEASE);
+}
+
+/*! \brief Record the delivery span of the trace at \a seq. */
+static void trace_delivered(uint64_t seq, uint64_t ns)
+{
+	size_t i = (seq - 1) & (CDR_KAFKA_TRACE_SLOTS - 1);
+
+	__atomic_store_n(&trace_deliveries[i].seq, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&trace_deliveries[i].ns, ns, __ATOMIC_RELEASE);
+	__atomic_store_n(&trace_deliveries[i].seq, seq, __ATOMIC_RELEASE);
+}
+
+/*!
+ * \brief Turn tracing on for every \a every-th CDR, or off with 0.
+ *
+ * Turning it on starts over with an empty ring; turning it off keeps the
+ * traces for dumping.
+ */
+static void trace_set(unsigned int every)
+{
+	if (every) {
+		__atomic_store_n(&trace_floor, __atomic_load_n(&trace_head, __ATOMIC_RELAXED),
+			__ATOMIC_RELAXED);
+		__atomic_store_n(&trace_tick, 0, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&trace_every, every, __ATOMIC_RELAXED);
+}
+
+/*! \brief Slowest first. */
+static int trace_cmp(const void *a, const void *b)
+{
+	const struct cdr_kafka_trace *left = a;
+	const struct cdr_kafka_trace *right = b;
+
+	return left->total_ns < right->total_ns ? 1 : left->total_ns > right->total_ns ? -1 : 0;
+}
+
+/*!
+ * \brief Copy the traces in the ring, slowest first.
+ *
+ * \param traces Array of CDR_KAFKA_TRACE_SLOTS entries.
+ * \return Number of traces copied.
+ */
+static size_t trace_collect(struct cdr_kafka_trace *traces)
+{
+	uint64_t cleared = __atomic_load_n(&trace_floor, __ATOMIC_RELAXED);
+	size_t count = 0;
+	size_t i;
+
+	for (i = 0; i < CDR_KAFKA_TRACE_SLOTS; i++) {
+		struct cdr_kafka_trace *trace = &traces[count];
+		uint64_t seq = __atomic_load_n(&trace_ring[i].seq, __ATOMIC_ACQUIRE);
+		uint64_t delivered;
+
+		if (seq <= cleared || seq == CDR_KAFKA_TRACE_BUSY) {
+			continue;
+		}
+		memcpy(trace, &trace_ring[i], sizeof(*trace));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&trace_ring[i].seq, __ATOMIC_RELAXED) != seq) {
+			continue;
+		}
+		trace->seq = seq;
+
+		delivered = __atomic_load_n(&trace_deliveries[i].seq, __ATOMIC_ACQUIRE);
+		trace->spans[CDR_KAFKA_SPAN_DELIVERY] = __atomic_load_n(&trace_deliveries[i].ns,
+			__ATOMIC_ACQUIRE);
+		if (delivered != seq
+			|| __atomic_load_n(&trace_deliveries[i].seq, __ATOMIC_RELAXED) != seq) {
+			trace->spans[CDR_KAFKA_SPAN_DELIVERY] = 0;
+		}
+		count++;
+	}
+
+	qsort(traces, count, sizeof(*traces), trace_cmp);
+	return count;
+}
+
+/*!
+ * \brief Serialize and compress a CDR within field_limits and max_payload_size.
+ *
+ * A record whose fields alone are over max_payload_size is written again
+ * whole for oversize_topic, if there is one, and dropped otherwise: no
+ * payload over the budget goes to the record's own topic.
+ *
+ * \param buf Buffer the payload is appended to, from \a start.
+ * \param[out] cuts What was cut, for the truncated header.
+ * \param[out] oversize Set to oversize_topic for a record to send there,
+ *        NULL otherwise.
+ * \param trace Gets the encoding and compression spans, or NULL.
+ * \return 0 on success.
+ * \return 1 if the record was dropped, with \a buf cut back to \a start.
+ * \return -1 on error, with \a buf cut back to \a start.
+ */
+static int encode_cdr_bounded(struct cdr_kafka_buf *buf, size_t start,
+	const struct cdr_kafka_global_conf *global, struct ast_cdr *cdr,
+	struct cdr_kafka_cuts *cuts, const char **oversize, struct cdr_kafka_trace *trace)
+{
+	uint64_t begin = trace ? metrics_now() : 0;
+	uint64_t now;
+	int res;
+
+	*oversize = NULL;
+	cuts_init(cuts);
+	cuts->traced = !!trace;
+	if (encode_cdr(buf, global, cdr, cuts)) {
+		return -1;
+	}
+	if (cuts->oversized) {
+		metrics_count(metrics_get(), CDR_KAFKA_COUNTER_OVERSIZED, 1);
+		buf->len = start;
+		if (ast_strlen_zero(global->oversize_topic)) {
+			metrics_count(metrics_get(), CDR_KAFKA_COUNTER_OVERSIZE_DROPPED, 1);
+			ast_log(LOG_WARNING, "CDR %s is over max_payload_size with its fields alone, dropped\n",
+				cdr->uniqueid);
+			return 1;
+		}
+		cuts_init(cuts);
+		if (encode_cdr(buf, global, cdr, NULL)) {
+			return -1;
+		}
+		*oversize = global->oversize_topic;
+	}
+	if (cuts->len) {
+		metrics_count(metrics_get(), CDR_KAFKA_COUNTER_TRUNCATED, 1);
+	}
+	if (!trace) {
+		return payload_compress(buf, start, global);
+	}
+
+	now = metrics_now();
+	if (cuts->fields_ns) {
+		trace->spans[CDR_KAFKA_SPAN_FIELDS] = cuts->fields_ns - begin;
+		trace->spans[CDR_KAFKA_SPAN_VARIABLES] = now - cuts->fields_ns;
+	} else {
+		trace->spans[CDR_KAFKA_SPAN_FIELDS] = now - begin;
+	}
+	res = payload_compress(buf, start, global);
+	trace->spans[CDR_KAFKA_SPAN_COMPRESS] = metrics_now() - now;
+
+	return res;
+}
+
+/*!
+ * \brief Serialize a CDR in the configured format into the thread's encoder buffer.
+ *
+ * \return The NUL terminated payload (binary formats may contain NUL bytes
+ *         too), valid until the next call on this thread.
+ * \return An empty payload if the record was dropped as oversized.
+ * \return NULL on error.
+ */
+static const char *encode_cdr_tls(const struct cdr_kafka_global_conf *global,
+	struct ast_cdr *cdr, size_t *len)
+{
+	struct cdr_kafka_buf *buf = encoder_buf_get();
+	struct cdr_kafka_cuts cuts;
+	const char *topic;
+
+	if (!buf) {
+		return NULL;
+	}
+
+	buf->len = 0;
+	if (encode_cdr_bounded(buf, 0, global, cdr, &cuts, &topic, NULL) < 0) {
+		return NULL;
+	}
+
+	buf->data[buf->len] = '\0';
+	*len = buf->len;
+	return buf->data;
+}
+
+/*! \brief Sum the metrics of all threads into \a total. */
+static void metrics_snapshot(struct cdr_kafka_metrics *total)
+{
+	struct cdr_kafka_metrics *metrics;
+
+	memset(total, 0, sizeof(*total));
+	AST_LIST_LOCK(&metrics_threads);
+	metrics_merge(total, &metrics_retired);
+	metrics_merge(total, &metrics_reported);
+	AST_LIST_TRAVERSE(&metrics_threads, metrics, entry) {
+		metrics_merge(total, metrics);
+	}
+	AST_LIST_UNLOCK(&metrics_threads);
+}
+
+/*! \brief Maximum number of Kafka headers attached to a CDR message. */
+#define CDR_KAFKA_MAX_HEADERS 16
+
+/*! \brief Default value of the headers option. */
+#define CDR_KAFKA_DEFAULT_HEADERS "entity_id,system_name,asterisk_version,timestamp,hostname"
+
+/*! \brief Where the value of a Kafka header comes from. */
+enum cdr_kafka_header_source {
+	/*! \brief Fixed for the lifetime of the configuration */
+	CDR_HEADER_STATIC,
+	/*! \brief Time the message is produced, in seconds */
+	CDR_HEADER_TIMESTAMP,
+	/*! \brief A field of the CDR */
+	CDR_HEADER_FIELD,
+	/*! \brief Members cut from the payload, left out when nothing was */
+	CDR_HEADER_TRUNCATED,
+	/*! \brief Hash identifying the CDR, see dedupe_id() */
+	CDR_HEADER_DEDUPE,
+};
+
+/*! \brief Name of the header carrying dedupe_id(). */
+#define CDR_KAFKA_DEDUPE_HEADER "dedupe_id"
+
+/*! \brief Size of a dedupe_id() value as 16 hex digits. */
+#define CDR_KAFKA_DEDUPE_LEN 17
+
+/*! \brief FNV-1a 64-bit offset basis and prime. */
+#define CDR_KAFKA_FNV64_BASIS 14695981039346656037ULL
+#define CDR_KAFKA_FNV64_PRIME 1099511628211ULL
+
+/*! \brief Continue a 64-bit FNV-1a hash over \a str and its terminator. */
+static uint64_t dedupe_hash(uint64_t hash, const char *str)
+{
+	do {
+		hash = (hash ^ (unsigned char) *str) * CDR_KAFKA_FNV64_PRIME;
+	} while (*str++);
+
+	return hash;
+}
+
+/*!
+ * \brief The dedupe ID of a CDR.
+ *
+ * FNV-1a of the uniqueid and sequence, continued from \a seed, the hash of
+ * the entity id, and finished with the murmur3 mixer so that CDRs a
+ * sequence apart differ in every digit. Each CDR of a channel has its own
+ * sequence, so the ID only repeats when the same CDR is published again.
+ */
+static uint64_t dedupe_id(uint64_t seed, const struct ast_cdr *cdr)
+{
+	uint64_t hash = dedupe_hash(seed, cdr->uniqueid);
+	uint32_t sequence = cdr->sequence;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		hash = (hash ^ ((sequence >> (i * 8)) & 0xff)) * CDR_KAFKA_FNV64_PRIME;
+	}
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+/*! \brief Write \a id as 16 lowercase hex digits into \a out. */
+static void dedupe_format(uint64_t id, char out[CDR_KAFKA_DEDUPE_LEN])
+{
+	static const char digits[] = "0123456789abcdef";
+	int i;
+
+	for (i = CDR_KAFKA_DEDUPE_LEN - 2; i >= 0; i--) {
+		out[i] = digits[id & 0xf];
+		id >>= 4;
+	}
+	out[CDR_KAFKA_DEDUPE_LEN - 1] = '\0';
+}
+
+/*!
+ * \brief Kafka headers attached to every message, built once per reload.
+ *
+ * \c hdrs holds every header with the static values filled in. When all
+ * of them are static the array is handed to the producer as is; otherwise
+ * it is copied and the timestamp and CDR field values are filled in.
+ */
+struct cdr_kafka_headers {
+	struct ast_kafka_header hdrs[CDR_KAFKA_MAX_HEADERS];
+	enum cdr_kafka_header_source sources[CDR_KAFKA_MAX_HEADERS];
+	/*! \brief CDR field of each CDR_HEADER_FIELD header */
+	const struct cdr_kafka_field *fields[CDR_KAFKA_MAX_HEADERS];
+	/*! \brief Header names given as name:header */
+	char *names[CDR_KAFKA_MAX_HEADERS];
+	size_t count;
+	/*! \brief Whether any header is not CDR_HEADER_STATIC */
+	int dynamic;
+	/*! \brief Whether any header is CDR_HEADER_FIELD or CDR_HEADER_TRUNCATED */
+	int per_cdr;
+	/*! \brief Name of the CDR_HEADER_TRUNCATED header, always the last one; NULL if none */
+	const char *truncated;
+	/*! \brief Value of the zstd_dict_id header */
+	char dict_id[11];
+	/*! \brief dedupe_hash() of the entity id, where dedupe_id() starts */
+	uint64_t dedupe_seed;
+};
+
+static void headers_dtor(void *obj)
+{
+	struct cdr_kafka_headers *headers = obj;
+	size_t i;
+
+	for (i = 0; i < headers->count; i++) {
+		ast_free(headers->names[i]);
+	}
+}
+
+/*!
+ * \brief Add a header the module always sends with the configuration, after the configured ones.
+ *
+ * \return 0 on success, -1 if there is no room for it or on allocation failure.
+ */
+static int headers_add_static(struct cdr_kafka_headers *headers, const char *name,
+	const char *value)
+{
+	if (headers->count == CDR_KAFKA_MAX_HEADERS) {
+		ast_log(LOG_ERROR, "No room for the Kafka header '%s' after %d configured ones\n",
+			name, CDR_KAFKA_MAX_HEADERS);
+		return -1;
+	}
+
+	headers->names[headers->count] = ast_strdup(name);
+	if (!headers->names[headers->count]) {
+		return -1;
+	}
+	headers->hdrs[headers->count].name = headers->names[headers->count];
+	headers->hdrs[headers->count].value = value;
+	headers->sources[headers->count] = CDR_HEADER_STATIC;
+	headers->fields[headers->count] = NULL;
+	headers->count++;
+
+	return 0;
+}
+
+/*!
+ * \brief Build the header block for a configuration from its headers option.
+ *
+ * Each item is one of the built-in headers (entity_id, system_name,
+ * asterisk_version, timestamp, hostname, dedupe_id) or a text field of the
+ * CDR, and may be sent under a different name with name:header. With
+ * \c idempotent a dedupe_id header is added if none is configured.
+ *
+ * \return 0 on success, -1 on allocation failure.
+ */
+static int headers_compile(struct cdr_kafka_global_conf *global)
+{
+	RAII_VAR(struct cdr_kafka_headers *, headers, NULL, ao2_cleanup);
+	char *items = ast_strdupa(global->headers);
+	char *item;
+
+	ao2_cleanup(global->header_block);
+	global->header_block = NULL;
+
+	headers = ao2_alloc_options(sizeof(*headers), headers_dtor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!headers) {
+		return -1;
+	}
+
+	while ((item = strsep(&items, ","))) {
+		char *name = ast_strip(strsep(&item, ":"));
+		char *alias = item ? ast_strip(item) : NULL;
+		const char *value = NULL;
+		enum cdr_kafka_header_source source = CDR_HEADER_STATIC;
+		const struct cdr_kafka_field *field = NULL;
+		size_t i;
+
+		if (ast_strlen_zero(name)) {
+			continue;
+		}
+
+		if (!strcasecmp(name, "entity_id")) {
+			value = cached_eid;
+		} else if (!strcasecmp(name, "system_name")) {
+			if (ast_strlen_zero(ast_config_AST_SYSTEM_NAME)) {
+				continue;
+			}
+			value = ast_config_AST_SYSTEM_NAME;
+		} else if (!strcasecmp(name, "asterisk_version")) {
+			value = ast_get_version();
+		} else if (!strcasecmp(name, "timestamp")) {
+			source = CDR_HEADER_TIMESTAMP;
+		} else if (!strcasecmp(name, "hostname")) {
+			value = cached_hostname;
+		} else if (!strcasecmp(name, CDR_KAFKA_DEDUPE_HEADER)) {
+			source = CDR_HEADER_DEDUPE;
+		} else {
+			field = plan_find_field(name);
+			if (!field || (field->type != CDR_FIELD_STRING
+				&& field->type != CDR_FIELD_DISPOSITION
+				&& field->type != CDR_FIELD_AMAFLAGS)) {
+				ast_log(LOG_WARNING, "'%s' cannot be sent as a Kafka header, ignoring it\n", name);
+				continue;
+			}
+			source = CDR_HEADER_FIELD;
+			name = (char *) field->name;
+		}
+		if (ast_strlen_zero(alias)) {
+			alias = name;
+		}
+
+		for (i = 0; i < headers->count; i++) {
+			if (!strcmp(headers->hdrs[i].name, alias)) {
+				break;
+			}
+		}
+		if (i < headers->count) {
+			ast_log(LOG_WARNING, "Kafka header '%s' given twice, ignoring the second one\n", alias);
+			continue;
+		}
+		if (headers->count == CDR_KAFKA_MAX_HEADERS) {
+			ast_log(LOG_WARNING, "Only %d Kafka headers are supported, ignoring '%s'\n",
+				CDR_KAFKA_MAX_HEADERS, alias);
+			break;
+		}
+
+		headers->names[headers->count] = ast_strdup(alias);
+		if (!headers->names[headers->count]) {
+			return -1;
+		}
+		headers->hdrs[headers->count].name = headers->names[headers->count];
+		headers->hdrs[headers->count].value = value;
+		headers->sources[headers->count] = source;
+		headers->fields[headers->count] = field;
+		headers->dynamic |= source != CDR_HEADER_STATIC;
+		headers->per_cdr |= source == CDR_HEADER_FIELD || source == CDR_HEADER_DEDUPE;
+		headers->count++;
+	}
+	headers->dedupe_seed = dedupe_hash(CDR_KAFKA_FNV64_BASIS, cached_eid);
+
+	if (global->idempotent) {
+		size_t i;
+
+		for (i = 0; i < headers->count; i++) {
+			if (headers->sources[i] == CDR_HEADER_DEDUPE) {
+				break;
+			}
+			if (!strcmp(headers->hdrs[i].name, CDR_KAFKA_DEDUPE_HEADER)) {
+				ast_log(LOG_WARNING, "Kafka header '%s' is configured as another header, "
+					"idempotent sends no dedupe ID\n", CDR_KAFKA_DEDUPE_HEADER);
+				break;
+			}
+		}
+		if (i == headers->count) {
+			if (headers_add_static(headers, CDR_KAFKA_DEDUPE_HEADER, NULL)) {
+				return -1;
+			}
+			headers->sources[headers->count - 1] = CDR_HEADER_DEDUPE;
+			headers->dynamic = 1;
+			headers->per_cdr = 1;
+		}
+	}
+
+	if (global->zstd) {
+		/* Consumers learn from the headers alone how to decode the payload */
+		if (headers_add_static(headers, "content_encoding", "zstd")) {
+			return -1;
+		}
+		if (global->zstd->dict_id) {
+			snprintf(headers->dict_id, sizeof(headers->dict_id), "%u", global->zstd->dict_id);
+			if (headers_add_static(headers, "zstd_dict_id", headers->dict_id)) {
+				return -1;
+			}
+		}
+	}
+
+	if (global->format == CDR_KAFKA_FORMAT_JSON && global->plan && global->plan->limited) {
+		size_t i;
+
+		for (i = 0; i < headers->count; i++) {
+			if (!strcmp(headers->hdrs[i].name, CDR_KAFKA_TRUNCATED_HEADER)) {
+				ast_log(LOG_ERROR, "Kafka header '%s' is sent by field_limits and the payload "
+					"budgets, rename the configured one\n", CDR_KAFKA_TRUNCATED_HEADER);
+				return -1;
+			}
+		}
+		/* Last, so the summary records can leave it out */
+		if (headers_add_static(headers, CDR_KAFKA_TRUNCATED_HEADER, NULL)) {
+			return -1;
+		}
+		headers->sources[headers->count - 1] = CDR_HEADER_TRUNCATED;
+		headers->truncated = headers->names[headers->count - 1];
+		headers->dynamic = 1;
+		headers->per_cdr = 1;
+	}
+
+	global->header_block = ao2_bump(headers);
+
+	return 0;
+}
+
+/*!
+ * \brief Get the Kafka headers for a message.
+ *
+ * \param headers Header block of the configuration.
+ * \param hdrs Array of at least CDR_KAFKA_MAX_HEADERS entries, used if any
+ *        header varies.
+ * \param ts_str Timestamp header value, at least 32 bytes.
+ * \param dedupe_str Dedupe ID header value, CDR_KAFKA_DEDUPE_LEN bytes; may be
+ *        NULL without \a cdr.
+ * \param cdr CDR the message carries, or NULL if it is not known, in which
+ *        case the headers taken from CDR fields and the dedupe ID are left out.
+ * \param truncated Members cut from the payload, see struct cdr_kafka_cuts,
+ *        or NULL. The truncated header is only sent if this is not empty.
+ * \param[out] count Number of headers.
+ * \return The headers, either \a hdrs or the shared static block.
+ */
+static const struct ast_kafka_header *headers_get(const struct cdr_kafka_headers *headers,
+	struct ast_kafka_header *hdrs, char *ts_str, char *dedupe_str, const struct ast_cdr *cdr,
+	const char *truncated, size_t *count)
+{
+	size_t n = 0;
+	size_t i;
+
+	if (!headers->dynamic) {
+		*count = headers->count;
+		return headers->hdrs;
+	}
+
+	for (i = 0; i < headers->count; i++) {
+		const struct cdr_kafka_field *field = headers->fields[i];
+
+		switch (headers->sources[i]) {
+		case CDR_HEADER_STATIC:
+			hdrs[n] = headers->hdrs[i];
+			break;
+		case CDR_HEADER_TIMESTAMP:
+			if (!*ts_str) {
+				snprintf(ts_str, 32, "%ld", (long) time(NULL));
+			}
+			hdrs[n].name = headers->hdrs[i].name;
+			hdrs[n].value = ts_str;
+			break;
+		case CDR_HEADER_FIELD:
+			if (!cdr) {
+				continue;
+			}
+			hdrs[n].name = headers->hdrs[i].name;
+			if (field->type == CDR_FIELD_DISPOSITION) {
+				hdrs[n].value = ast_cdr_disp2str(cdr->disposition);
+			} else if (field->type == CDR_FIELD_AMAFLAGS) {
+				hdrs[n].value = ast_channel_amaflags2string(cdr->amaflags);
+			} else {
+				hdrs[n].value = (const char *) cdr + field->offset;
+			}
+			break;
+		case CDR_HEADER_TRUNCATED:
+			if (ast_strlen_zero(truncated)) {
+				continue;
+			}
+			hdrs[n].name = headers->hdrs[i].name;
+			hdrs[n].value = truncated;
+			break;
+		case CDR_HEADER_DEDUPE:
+			if (!cdr) {
+				continue;
+			}
+			dedupe_format(dedupe_id(headers->dedupe_seed, cdr), dedupe_str);
+			hdrs[n].name = headers->hdrs[i].name;
+			hdrs[n].value = dedupe_str;
+			break;
+		}
+		n++;
+	}
+
+	*count = n;
+	return hdrs;
+}
+
+/*!
+ * \brief Append \a hdrs to \a buf as the spool keeps them.
+ *
+ * Each header is written as its NUL terminated name and value, and the
+ * list ends with an empty name.
+ *
+ * \return 0 on success, -1 on allocation failure.
+ */
+static int headers_pack(struct cdr_kafka_buf *buf, const struct ast_kafka_header *hdrs,
+	size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		const char *value = S_OR(hdrs[i].value, "");
+
+		if (buf_append(buf, hdrs[i].name, strlen(hdrs[i].name) + 1)
+			|| buf_append(buf, value, strlen(value) + 1)) {
+			return -1;
+		}
+	}
+
+	return buf_append(buf, "", 1);
+}
+
+/*!
+ * \brief Read back headers written by headers_pack().
+ *
+ * \param data The packed headers, followed by anything.
+ * \param size Bytes readable at \a data.
+ * \param hdrs Array of CDR_KAFKA_MAX_HEADERS entries, left pointing into \a data.
+ * \param[out] count Number of headers.
+ * \return Bytes the packed headers take, or 0 if they are malformed.
+ */
+static size_t headers_unpack(const char *data, size_t size, struct ast_kafka_header *hdrs,
+	size_t *count)
+{
+	const char *end = data + size;
+	const char *pos = data;
+
+	*count = 0;
+	while (pos < end && *pos) {
+		const char *name_end = memchr(pos, '\0', end - pos);
+		const char *value_end;
+
+		if (!name_end || *count == CDR_KAFKA_MAX_HEADERS) {
+			return 0;
+		}
+		value_end = memchr(name_end + 1, '\0', end - name_end - 1);
+		if (!value_end) {
+			return 0;
+		}
+		hdrs[*count].name = pos;
+		hdrs[*count].value = name_end + 1;
+		(*count)++;
+		pos = value_end + 1;
+	}
+	if (pos == end) {
+		return 0;
+	}
+
+	return pos + 1 - data;
+}
+
+/*! \brief Default value of the topic option. */
+#define CDR_KAFKA_DEFAULT_TOPIC "asterisk_cdr"
+
+/*! \brief A literal piece or a CDR field of the topic template. */
+struct cdr_kafka_topic_part {
+	const char *text;
+	size_t len;
+	/*! \brief Field substituted after \c text, or NULL */
+	const struct cdr_kafka_field *field;
+};
+
+/*! \brief A route from a value of the route_by field to a topic. */
+struct cdr_kafka_route {
+	/*! \brief NULL for an empty slot */
+	char *value;
+	char *topic;
+};
+
+/*!
+ * \brief Topic selection compiled from topic, route_by and route.
+ *
+ * Built once per reload and never modified afterwards, so it is read
+ * without locks. The routes form an open addressing hash table.
+ */
+struct cdr_kafka_topics {
+	/*! \brief Template pieces; none when topic is a plain name */
+	struct cdr_kafka_topic_part *parts;
+	size_t part_count;
+	/*! \brief Copy of the template the parts point into */
+	char *template;
+	const struct cdr_kafka_field *route_field;
+	struct cdr_kafka_route *routes;
+	/*! \brief Size of \c routes minus one */
+	size_t route_mask;
+	/*! \brief Whether records may go to different topics */
+	int dynamic;
+};
+
+static void topics_dtor(void *obj)
+{
+	struct cdr_kafka_topics *topics = obj;
+	size_t i;
+
+	for (i = 0; topics->routes && i <= topics->route_mask; i++) {
+		ast_free(topics->routes[i].value);
+		ast_free(topics->routes[i].topic);
+	}
+	ast_free(topics->routes);
+	ast_free(topics->parts);
+	ast_free(topics->template);
+}
+
+/*! \brief Find a field that can be used in a topic, or NULL. */
+static const struct cdr_kafka_field *topic_field_find(const char *name)
+{
+	const struct cdr_kafka_field *field = plan_find_field(name);
+
+	if (!field || field->type == CDR_FIELD_TIMEVAL || field->type == CDR_FIELD_LONG
+		|| field->type == CDR_FIELD_INT) {
+		return NULL;
+	}
+
+	return field;
+}
+
+/*!
+ * \brief Split a topic containing ${field} references into parts.
+ *
+ * \return 0 on success, -1 on allocation failure.
+ */
+static int topics_compile_template(struct cdr_kafka_topics *topics, const char *topic)
+{
+	char *pos;
+	char *ref;
+
+	if (!strstr(topic, "${")) {
+		return 0;
+	}
+
+	topics->template = ast_strdup(topic);
+	/* Every reference adds a part, and there is one trailing part */
+	topics->parts = ast_calloc(strlen(topic) / 3 + 1, sizeof(*topics->parts));
+	if (!topics->template || !topics->parts) {
+		return -1;
+	}
+
+	pos = topics->template;
+	while ((ref = strstr(pos, "${"))) {
+		struct cdr_kafka_topic_part *part = &topics->parts[topics->part_count];
+		char *close = strchr(ref + 2, '}');
+
+		if (!close) {
+			ast_log(LOG_WARNING, "Unterminated ${ in topic '%s'\n", topic);
+			break;
+		}
+		*ref = '\0';
+		*close = '\0';
+
+		part->text = pos;
+		part->len = ref - pos;
+		part->field = topic_field_find(ref + 2);
+		if (!part->field) {
+			ast_log(LOG_WARNING, "Unknown CDR field '%s' in topic, ignoring it\n", ref + 2);
+		}
+		topics->part_count++;
+		pos = close + 1;
+	}
+	topics->parts[topics->part_count].text = pos;
+	topics->parts[topics->part_count].len = strlen(pos);
+	topics->part_count++;
+	topics->dynamic = 1;
+
+	return 0;
+}
+
+/*! \brief The route for \a value, or NULL. */
+static const struct cdr_kafka_route *topics_route_find(const struct cdr_kafka_topics *topics,
+	const char *value)
+{
+	size_t i = ast_str_hash(value) & topics->route_mask;
+
+	while (topics->routes[i].value) {
+		if (!strcmp(topics->routes[i].value, value)) {
+			return &topics->routes[i];
+		}
+		i = (i + 1) & topics->route_mask;
+	}
+
+	return NULL;
+}
+
+/*!
+ * \brief Build the route table from the "value => topic" lines of \a routes.
+ *
+ * \return 0 on success, -1 on allocation failure.
+ */
+static int topics_compile_routes(struct cdr_kafka_topics *topics, const char *route_by,
+	const char *routes)
+{
+	char *lines = ast_strdupa(routes);
+	char *line;
+	size_t count = 1;
+	size_t size = 2;
+	const char *pos;
+
+	if (ast_strlen_zero(route_by)) {
+		if (!ast_strlen_zero(routes)) {
+			ast_log(LOG_WARNING, "route is set without route_by, ignoring the routes\n");
+		}
+		return 0;
+	}
+	topics->route_field = topic_field_find(route_by);
+	if (!topics->route_field) {
+		ast_log(LOG_WARNING, "Unknown route_by field '%s', ignoring the routes\n", route_by);
+		return 0;
+	}
+
+	/* At most half full, so probes stay short */
+	for (pos = routes; *pos; pos++) {
+		count += *pos == '\n';
+	}
+	while (size < 2 * count) {
+		size <<= 1;
+	}
+	topics->routes = ast_calloc(size, sizeof(*topics->routes));
+	if (!topics->routes) {
+		return -1;
+	}
+	topics->route_mask = size - 1;
+
+	while ((line = strsep(&lines, "\n"))) {
+		char *arrow = strstr(line, "=>");
+		char *value;
+		char *topic;
+		size_t i;
+
+		if (ast_strlen_zero(ast_strip(line))) {
+			continue;
+		}
+		if (!arrow) {
+			ast_log(LOG_WARNING, "Invalid route '%s', expected 'value => topic'\n", line);
+			continue;
+		}
+		*arrow = '\0';
+		value = ast_strip(line);
+		topic = ast_strip(arrow + 2);
+		if (ast_strlen_zero(topic) || strlen(topic) > CDR_KAFKA_TOPIC_LEN) {
+			ast_log(LOG_WARNING, "Invalid topic in route for '%s'\n", value);
+			continue;
+		}
+		if (topics_route_find(topics, value)) {
+			ast_log(LOG_WARNING, "Route for '%s' given twice, ignoring the second one\n", value);
+			continue;
+		}
+
+		i = ast_str_hash(value) & topics->route_mask;
+		while (topics->routes[i].value) {
+			i = (i + 1) & topics->route_mask;
+		}
+		topics->routes[i].topic = ast_strdup(topic);
+		topics->routes[i].value = ast_strdup(value);
+		if (!topics->routes[i].value || !topics->routes[i].topic) {
+			return -1;
+		}
+		topics->dynamic = 1;
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Compile the topic selection of a configuration.
+ *
+ * \return 0 on success, -1 on allocation failure.
+ */
+static int topics_compile(struct cdr_kafka_global_conf *global)
+{
+	RAII_VAR(struct cdr_kafka_topics *, topics, NULL, ao2_cleanup);
+
+	ao2_cleanup(global->topics);
+	global->topics = NULL;
+
+	topics = ao2_alloc_options(sizeof(*topics), topics_dtor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!topics) {
+		return -1;
+	}
+
+	if (topics_compile_template(topics, global->topic)
+		|| topics_compile_routes(topics, global->route_by, global->routes)) {
+		return -1;
+	}
+
+	global->topics = ao2_bump(topics);
+
+	return 0;
+}
+
+/*!
+ * \brief Get the topic a CDR is published to.
+ *
+ * A route matching the route_by field wins. Otherwise, the topic template
+ * is expanded into \a buf, with characters Kafka does not allow in topic
+ * names replaced by '_'; an expansion that comes out empty falls back to
+ * the default topic.
+ *
+ * \param global Configuration.
+ * \param cdr The CDR, or NULL if it is not known.
+ * \param buf Buffer of at least CDR_KAFKA_TOPIC_LEN + 1 bytes.
+ * \return The topic, pointing into \a global or \a buf.
+ */
+static const char *cdr_kafka_topic(const struct cdr_kafka_global_conf *global,
+	struct ast_cdr *cdr, char *buf)
+{
+	const struct cdr_kafka_topics *topics = global->topics;
+	size_t len = 0;
+	size_t i;
+
+	if (!topics->dynamic) {
+		return global->topic;
+	}
+
+	if (topics->route_field && cdr) {
+		const struct cdr_kafka_route *route =
+			topics_route_find(topics, core_field_text(topics->route_field, cdr));
+
+		if (route) {
+			return route->topic;
+		}
+	}
+
+	if (!topics->part_count) {
+		return global->topic;
+	}
+
+	for (i = 0; i < topics->part_count; i++) {
+		const struct cdr_kafka_topic_part *part = &topics->parts[i];
+		const char *value;
+
+		size_t n = MIN(part->len, CDR_KAFKA_TOPIC_LEN - len);
+
+		memcpy(buf + len, part->text, n);
+		len += n;
+		if (!part->field || !cdr) {
+			continue;
+		}
+
+		for (value = core_field_text(part->field, cdr); *value && len < CDR_KAFKA_TOPIC_LEN; value++) {
+			buf[len++] = isalnum((unsigned char) *value) || *value == '.'
+				|| *value == '_' || *value == '-' ? *value : '_';
+		}
+	}
+	buf[len] = '\0';
+
+	/* Kafka has no use for an empty topic name */
+	return len ? buf : CDR_KAFKA_DEFAULT_TOPIC;
+}
+
+/*! \brief Comparison made by a filter condition. */
+enum cdr_kafka_filter_op {
+	CDR_FILTER_EQ,
+	CDR_FILTER_NE,
+	/*! \brief text field starts with the value */
+	CDR_FILTER_PREFIX,
+	CDR_FILTER_LT,
+	CDR_FILTER_LE,
+	CDR_FILTER_GT,
+	CDR_FILTER_GE,
+};
+
+/*! \brief What a filter rule does with the CDRs it matches. */
+enum cdr_kafka_filter_action {
+	CDR_FILTER_KEEP,
+	CDR_FILTER_DROP,
+	/*! \brief keep the CDRs of a share of the calls, picked by linkedid */
+	CDR_FILTER_SAMPLE,
+};
+
+/*! \brief One "field op value" test of a filter rule. */
+struct cdr_kafka_filter_cond {
+	const struct cdr_kafka_field *field;
+	enum cdr_kafka_filter_op op;
+	/*! \brief Value compared with text fields */
+	char *text;
+	size_t text_len;
+	/*! \brief Value compared with numeric fields */
+	long number;
+};
+
+/*! \brief A filter rule, matching when all its conditions hold. */
+struct cdr_kafka_filter_rule {
+	/*! \brief Conditions of the rule, following those of the rules before it */
+	size_t cond_count;
+	enum cdr_kafka_filter_action action;
+	/*! \brief Calls kept by a sample rule, out of 2^32 */
+	uint64_t threshold;
+	/*! \brief Class given by a priority rule */
+	enum cdr_kafka_priority priority;
+};
+
+/*!
+ * \brief Filter rules compiled from the \c filter or \c priority lines.
+ *
+ * The conditions of all rules are laid out back to back in \c conds, so
+ * evaluating the rules is a single walk over two arrays.
+ */
+struct cdr_kafka_filters {
+	struct cdr_kafka_filter_rule *rules;
+	size_t rule_count;
+	struct cdr_kafka_filter_cond *conds;
+	size_t cond_count;
+};
+
+static void filters_dtor(void *obj)
+{
+	struct cdr_kafka_filters *filters = obj;
+	size_t i;
+
+	for (i = 0; i < filters->cond_count; i++) {
+		ast_free(filters->conds[i].text);
+	}
+	ast_free(filters->conds);
+	ast_free(filters->rules);
+}
+
+/*!
+ * \brief Parse a "field op value" condition.
+ *
+ * \return 0 on success, -1 if the condition is invalid.
+ */
+static int filter_parse_cond(struct cdr_kafka_filter_cond *cond, char *str)
+{
+	size_t split = strcspn(str, "!^<>=");
+	char *op = str + split;
+	char *value;
+	char *end;
+
+	if (!*op) {
+		ast_log(LOG_WARNING, "No comparison in filter condition '%s'\n", ast_strip(str));
+		return -1;
+	}
+
+	if (op[0] == '!' && op[1] == '=') {
+		cond->op = CDR_FILTER_NE;
+		value = op + 2;
+	} else if (op[0] == '^' && op[1] == '=') {
+		cond->op = CDR_FILTER_PREFIX;
+		value = op + 2;
+	} else if (op[0] == '<' || op[0] == '>') {
+		cond->op = op[0] == '<' ? CDR_FILTER_LT : CDR_FILTER_GT;
+		value = op + 1;
+		if (*value == '=') {
+			cond->op++;
+			value++;
+		}
+	} else if (op[0] == '=') {
+		cond->op = CDR_FILTER_EQ;
+		value = op + 1;
+	} else {
+		ast_log(LOG_WARNING, "Invalid comparison in filter condition '%s'\n", ast_strip(str));
+		return -1;
+	}
+	*op = '\0';
+	str = ast_strip(str);
+	value = ast_strip(value);
+
+	cond->field = plan_find_field(str);
+	if (!cond->field || cond->field->type == CDR_FIELD_TIMEVAL) {
+		ast_log(LOG_WARNING, "Unknown filter field '%s'\n", str);
+		return -1;
+	}
+
+	if (cond->field->type != CDR_FIELD_LONG && cond->field->type != CDR_FIELD_INT) {
+		if (cond->op > CDR_FILTER_PREFIX) {
+			ast_log(LOG_WARNING, "Filter field '%s' is text and cannot be ordered\n", str);
+			return -1;
+		}
+		cond->text = ast_strdup(value);
+		if (!cond->text) {
+			return -1;
+		}
+		cond->text_len = strlen(value);
+		return 0;
+	}
+
+	if (cond->op == CDR_FILTER_PREFIX) {
+		ast_log(LOG_WARNING, "Filter field '%s' is a number, '^=' does not apply\n", str);
+		return -1;
+	}
+	errno = 0;
+	cond->number = strtol(value, &end, 10);
+	if (errno || end == value || *end) {
+		ast_log(LOG_WARNING, "Invalid number '%s' in filter on '%s'\n", value, str);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Parse the action of a rule: "keep", "drop" or "sample <percent>".
+ *
+ * \return 0 on success, -1 if the action is invalid.
+ */
+static int filter_parse_action(struct cdr_kafka_filter_rule *rule, char *str)
+{
+	double percent;
+	char *end;
+
+	if (!strcasecmp(str, "keep")) {
+		rule->action = CDR_FILTER_KEEP;
+		return 0;
+	}
+	if (!strcasecmp(str, "drop")) {
+		rule->action = CDR_FILTER_DROP;
+		return 0;
+	}
+	if (strncasecmp(str, "sample", 6)) {
+		ast_log(LOG_WARNING, "Invalid filter action '%s', expected keep, drop or sample\n", str);
+		return -1;
+	}
+
+	percent = strtod(str + 6, &end);
+	if (end == str + 6 || (*end && strcmp(end, "%")) || !(percent >= 0 && percent <= 100)) {
+		ast_log(LOG_WARNING, "Invalid filter action '%s', expected a percentage to sample\n", str);
+		return -1;
+	}
+	rule->action = CDR_FILTER_SAMPLE;
+	rule->threshold = (uint64_t) (percent / 100 * 4294967296.0);
+
+	return 0;
+}
+
+/*!
+ * \brief Parse the class of a priority rule: "high", "normal" or "low".
+ *
+ * \return 0 on success, -1 if the class is invalid.
+ */
+static int priority_parse_class(struct cdr_kafka_filter_rule *rule, char *str)
+{
+	size_t i;
+
+	for (i = 0; i < CDR_KAFKA_PRIORITY_COUNT; i++) {
+		if (!strcasecmp(str, priority_names[i])) {
+			rule->priority = i;
+			return 0;
+		}
+	}
+	ast_log(LOG_WARNING, "Invalid priority class '%s', expected high, normal or low\n", str);
+
+	return -1;
+}
+
+/*!
+ * \brief Compile the "conditions => action" lines of \a lines into \a filters.
+ *
+ * Invalid rules are logged and left out.
+ *
+ * \param parse_action Parses what follows the "=>" of a rule.
+ * \param what Kind of rule, for the log.
+ * \return 0 on success, -1 on allocation failure.
+ */
+static int filters_compile_rules(struct cdr_kafka_filters *filters, const char *lines,
+	int (*parse_action)(struct cdr_kafka_filter_rule *rule, char *str), const char *what)
+{
+	char *copy = ast_strdupa(lines);
+	char *line;
+	size_t max_rules = 1;
+	size_t max_conds = 1;
+	const char *pos;
+
+	for (pos = lines; *pos; pos++) {
+		max_rules += *pos == '\n';
+		max_conds += *pos == '\n' || *pos == '&';
+	}
+	filters->rules = ast_calloc(max_rules, sizeof(*filters->rules));
+	filters->conds = ast_calloc(max_conds, sizeof(*filters->conds));
+	if (!filters->rules || !filters->conds) {
+		return -1;
+	}
+
+	while ((line = strsep(&copy, "\n"))) {
+		struct cdr_kafka_filter_rule *rule = &filters->rules[filters->rule_count];
+		size_t first = filters->cond_count;
+		char *arrow = NULL;
+		char *cond;
+		int res = 0;
+
+		if (ast_strlen_zero(ast_strip(line))) {
+			continue;
+		}
+		/* The conditions may contain ">=", the action cannot */
+		for (pos = strstr(line, "=>"); pos; pos = strstr(pos + 1, "=>")) {
+			arrow = (char *) pos;
+		}
+		if (!arrow) {
+			ast_log(LOG_WARNING, "Invalid %s '%s', expected 'conditions => action'\n",
+				what, line);
+			continue;
+		}
+		*arrow = '\0';
+
+		if (parse_action(rule, ast_strip(arrow + 2))) {
+			continue;
+		}
+		while (!res && (cond = strsep(&line, "&"))) {
+			res = filter_parse_cond(&filters->conds[filters->cond_count++], cond);
+		}
+		if (res) {
+			/* Drop the rule, keeping what was allocated for it from leaking */
+			while (filters->cond_count > first) {
+				ast_free(filters->conds[--filters->cond_count].text);
+				filters->conds[filters->cond_count].text = NULL;
+			}
+			continue;
+		}
+
+		rule->cond_count = filters->cond_count - first;
+		filters->rule_count++;
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Compile the rules of \a lines into \a compiled.
+ *
+ * \a compiled is left NULL when there are no rules.
+ *
+ * \return 0 on success, -1 on allocation failure.
+ */
+static int filters_compile_lines(struct cdr_kafka_filters **compiled, const char *lines,
+	int (*parse_action)(struct cdr_kafka_filter_rule *rule, char *str), const char *what)
+{
+	RAII_VAR(struct cdr_kafka_filters *, filters, NULL, ao2_cleanup);
+
+	ao2_cleanup(*compiled);
+	*compiled = NULL;
+
+	if (ast_strlen_zero(lines)) {
+		return 0;
+	}
+
+	filters = ao2_alloc_options(sizeof(*filters), filters_dtor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!filters || filters_compile_rules(filters, lines, parse_action, what)) {
+		return -1;
+	}
+
+	if (filters->rule_count) {
+		*compiled = ao2_bump(filters);
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Compile the filter and priority rules of a configuration.
+ *
+ * \c global->filters and \c global->priorities are left NULL when there
+ * are no rules.
+ *
+ * \return 0 on success, -1 on allocation failure.
+ */
+static int filters_compile(struct cdr_kafka_global_conf *global)
+{
+	if (filters_compile_lines(&global->filters, global->filter, filter_parse_action, "filter")
+		|| filters_compile_lines(&global->priorities, global->priority,
+			priority_parse_class, "priority")) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Hash of a linkedid for sampling.
+ *
+ * FNV-1a followed by the MurmurHash3 finalizer, so that linkedids that
+ * only differ in their last digits spread over the whole range.
+ */
+static uint32_t filter_sample_hash(const char *str)
+{
+	uint32_t hash = 2166136261u;
+
+	for (; *str; str++) {
+		hash = (hash ^ (unsigned char) *str) * 16777619u;
+	}
+
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+static int filter_cond_match(const struct cdr_kafka_filter_cond *cond, struct ast_cdr *cdr)
+{
+	const char *text = core_field_text(cond->field, cdr);
+	long number;
+
+	if (text) {
+		switch (cond->op) {
+		case CDR_FILTER_EQ:
+			return !strcmp(text, cond->text);
+		case CDR_FILTER_NE:
+			return strcmp(text, cond->text) != 0;
+		case CDR_FILTER_PREFIX:
+			return !strncmp(text, cond->text, cond->text_len);
+		default:
+			return 0;
+		}
+	}
+
+	number = core_field_number(cond->field, cdr);
+	switch (cond->op) {
+	case CDR_FILTER_EQ:
+		return number == cond->number;
+	case CDR_FILTER_NE:
+		return number != cond->number;
+	case CDR_FILTER_LT:
+		return number < cond->number;
+	case CDR_FILTER_LE:
+		return number <= cond->number;
+	case CDR_FILTER_GT:
+		return number > cond->number;
+	case CDR_FILTER_GE:
+		return number >= cond->number;
+	case CDR_FILTER_PREFIX:
+		break;
+	}
+
+	return 0;
+}
+
+/*! \return The first rule whose conditions all hold for \a cdr, or NULL. */
+static const struct cdr_kafka_filter_rule *filters_match(const struct cdr_kafka_filters *filters,
+	struct ast_cdr *cdr)
+{
+	const struct cdr_kafka_filter_cond *cond = filters->conds;
+	size_t i;
+
+	for (i = 0; i < filters->rule_count; i++) {
+		const struct cdr_kafka_filter_rule *rule = &filters->rules[i];
+		const struct cdr_kafka_filter_cond *end = cond + rule->cond_count;
+
+		while (cond < end && filter_cond_match(cond, cdr)) {
+			cond++;
+		}
+		if (cond == end) {
+			return rule;
+		}
+		cond = end;
+	}
+
+	return NULL;
+}
+
+/*!
+ * \brief Whether the filter rules drop \a cdr.
+ *
+ * The first rule whose conditions all hold decides; a CDR no rule matches
+ * is kept. Sampling keeps or drops all CDRs of a call alike.
+ */
+static int filters_drop(const struct cdr_kafka_filters *filters, struct ast_cdr *cdr)
+{
+	const struct cdr_kafka_filter_rule *rule = filters_match(filters, cdr);
+
+	if (!rule) {
+		return 0;
+	}
+
+	switch (rule->action) {
+	case CDR_FILTER_KEEP:
+		return 0;
+	case CDR_FILTER_DROP:
+		return 1;
+	case CDR_FILTER_SAMPLE:
+		return filter_sample_hash(cdr->linkedid) >= rule->threshold;
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Priority class of \a cdr.
+ *
+ * The first priority rule whose conditions all hold decides; a CDR no
+ * rule matches is of the normal class.
+ */
+static enum cdr_kafka_priority priorities_class(const struct cdr_kafka_filters *priorities,
+	struct ast_cdr *cdr)
+{
+	const struct cdr_kafka_filter_rule *rule;
+
+	if (!priorities) {
+		return CDR_KAFKA_PRIORITY_NORMAL;
+	}
+	rule = filters_match(priorities, cdr);
+
+	return rule ? rule->priority : CDR_KAFKA_PRIORITY_NORMAL;
+}
+
+#ifdef TEST_FRAMEWORK
+/*!
+ * \brief Stand-in for ast_kafka_produce_hdrs() installed by the perf tests.
+ *
+ * \return 0 on success, -1 on failure.
+ * \return 1 to take a pooled payload and report its delivery as failed.
+ */
+typedef int (*cdr_kafka_test_produce_fn)(const char *topic, const char *key,
+	const void *payload, size_t len, const struct ast_kafka_header *headers,
+	size_t header_count);
+
+static cdr_kafka_test_produce_fn test_produce;
+#endif
+
+/*! \brief ast_kafka_produce_hdrs(), unless a test replaced it. */
+static int produce_hdrs(struct ast_kafka_producer *producer, const char *topic,
+	const char *key, const void *payload, size_t len,
+	const struct ast_kafka_header *headers, size_t header_count)
+{
+#ifdef TEST_FRAMEWORK
+	cdr_kafka_test_produce_fn produce = __atomic_load_n(&test_produce, __ATOMIC_ACQUIRE);
+
+	if (produce) {
+		return produce(topic, key, payload, len, headers, header_count);
+	}
+#endif
+
+	return ast_kafka_produce_hdrs(producer, topic, key, payload, len, headers, header_count);
+}
+
+/*! \brief ast_kafka_produce_batch(), unless a test replaced produce. */
+static size_t produce_batch(struct ast_kafka_producer *producer, const char *topic,
+	struct ast_kafka_message *messages, size_t count)
+{
+#ifdef TEST_FRAMEWORK
+	cdr_kafka_test_produce_fn produce = __atomic_load_n(&test_produce, __ATOMIC_ACQUIRE);
+
+	if (produce) {
+		size_t sent = 0;
+		size_t i;
+
+		for (i = 0; i < count; i++) {
+			messages[i].result = produce(topic, messages[i].key, messages[i].payload,
+				messages[i].len, messages[i].headers, messages[i].header_count);
+			sent += !messages[i].result;
+		}
+		return sent;
+	}
+#endif
+
+	return ast_kafka_produce_batch(producer, topic, messages, count);
+}
+
+/*! \brief ast_kafka_produce_report(), unless a test replaced produce. */
+static int produce_report(struct ast_kafka_producer *producer, const char *topic,
+	int32_t partition, const char *key, void *payload, size_t len,
+	const struct ast_kafka_header *headers, size_t header_count,
+	ast_kafka_delivery_cb delivery_cb, void *userdata)
+{
+#ifdef TEST_FRAMEWORK
+	cdr_kafka_test_produce_fn produce = __atomic_load_n(&test_produce, __ATOMIC_ACQUIRE);
+
+	if (produce) {
+		int res = produce(topic, key, payload, len, headers, header_count);
+		struct ast_kafka_delivery report = {
+			.result = res ? -1 : 0,
+			.partition = partition,
+			.offset = -1,
+			.timestamp_ms = -1,
+			.error = res ? "Stand-in delivery failure" : NULL,
+		};
+
+		if (res < 0) {
+			return -1;
+		}
+		/* The stand-in is done with the payload as soon as it returns */
+		delivery_cb(payload, &report, userdata);
+		return 0;
+	}
+#endif
+
+	return ast_kafka_produce_report(producer, topic, partition, key, payload, len,
+		headers, header_count, delivery_cb, userdata);
+}
+
+#ifdef TEST_FRAMEWORK
+/*! \brief Partitions every topic has while set by a test, -1 for unknown. */
+static int test_partitions;
+#endif
+
+/*! \brief ast_kafka_partition_count(), unless a test replaced it or produce. */
+static int partition_count(struct ast_kafka_producer *producer, const char *topic)
+{
+#ifdef TEST_FRAMEWORK
+	int partitions = __atomic_load_n(&test_partitions, __ATOMIC_RELAXED);
+
+	if (partitions) {
+		return partitions;
+	}
+	if (__atomic_load_n(&test_produce, __ATOMIC_ACQUIRE)) {
+		return -1;
+	}
+#endif
+
+	return ast_kafka_partition_count(producer, topic);
+}
+
+/*! \brief ast_kafka_produce_partition() of a copied payload, unless a test replaced produce. */
+static int produce_partition(struct ast_kafka_producer *producer, const char *topic,
+	int32_t partition, const char *key, const void *payload, size_t len,
+	const struct ast_kafka_header *headers, size_t header_count)
+{
+#ifdef TEST_FRAMEWORK
+	if (__atomic_load_n(&test_produce, __ATOMIC_ACQUIRE)) {
+		return produce_hdrs(producer, topic, key, payload, len, headers, header_count);
+	}
+#endif
+
+	/* Without a free callback the payload is copied, never written */
+	return ast_kafka_produce_partition(producer, topic, partition, key, (void *) payload,
+		len, headers, header_count, NULL, NULL);
+}
+
+/*! \brief ast_kafka_produce_batch_partition(), unless a test replaced produce. */
+static size_t produce_batch_partition(struct ast_kafka_producer *producer, const char *topic,
+	int32_t partition, struct ast_kafka_message *messages, size_t count)
+{
+	if (partition == AST_KAFKA_PARTITION_ANY) {
+		return produce_batch(producer, topic, messages, count);
+	}
+#ifdef TEST_FRAMEWORK
+	if (__atomic_load_n(&test_produce, __ATOMIC_ACQUIRE)) {
+		return produce_batch(producer, topic, messages, count);
+	}
+#endif
+
+	return ast_kafka_produce_batch_partition(producer, topic, partition, messages, count);
+}
+
+/*!
+ * \brief murmur2 hash of \a data, as the Java Kafka client computes it.
+ *
+ * Partitions picked from it match those of Java producers for the same
+ * key, so CDRs land next to records other services keyed the same way.
+ */
+static uint32_t murmur2(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	const uint32_t m = 0x5bd1e995;
+	uint32_t h = 0x9747b28c ^ (uint32_t) len;
+	size_t i;
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		uint32_t k = p[i] | (uint32_t) p[i + 1] << 8 | (uint32_t) p[i + 2] << 16
+			| (uint32_t) p[i + 3] << 24;
+
+		k *= m;
+		k ^= k >> 24;
+		k *= m;
+		h *= m;
+		h ^= k;
+	}
+
+	switch (len & 3) {
+	case 3:
+		h ^= (uint32_t) p[i + 2] << 16;
+		/* Fall through */
+	case 2:
+		h ^= (uint32_t) p[i + 1] << 8;
+		/* Fall through */
+	case 1:
+		h ^= p[i];
+		h *= m;
+	}
+
+	h ^= h >> 13;
+	h *= m;
+	h ^= h >> 15;
+
+	return h;
+}
+
+/*! \brief Partition of \a key among \a partitions, as the Java client picks it. */
+static int32_t key_partition(const char *key, int partitions)
+{
+	/* Java's Utils.toPositive() */
+	return (murmur2(key, strlen(key)) & 0x7fffffff) % (uint32_t) partitions;
+}
+
+/*!
+ * \brief Partition this module picks for a message.
+ *
+ * \return The partition, or AST_KAFKA_PARTITION_ANY to leave it to res_kafka.
+ */
+static int32_t message_partition(const struct cdr_kafka_global_conf *global,
+	struct ast_kafka_producer *producer, const char *topic, const char *key)
+{
+	int partitions;
+
+	if (global->partitioner != CDR_KAFKA_PARTITIONER_MURMUR2 || !key
+		|| (partitions = partition_count(producer, topic)) <= 0) {
+		return AST_KAFKA_PARTITION_ANY;
+	}
+
+	return key_partition(key, partitions);
+}
+
+/*!
+ * \brief Produce a copy of a message, to the partition picked by \c partitioner.
+ */
+static int message_produce(const struct cdr_kafka_global_conf *global,
+	struct ast_kafka_producer *producer, const char *topic, const char *key,
+	const void *payload, size_t len, const struct ast_kafka_header *headers,
+	size_t header_count)
+{
+	int32_t partition = message_partition(global, producer, topic, key);
+
+	if (partition != AST_KAFKA_PARTITION_ANY) {
+		return produce_partition(producer, topic, partition, key, payload, len,
+			headers, header_count);
+	}
+
+	return produce_hdrs(producer, topic, key, payload, len, headers, header_count);
+}
+
+static void pool_delivered(void *payload, const struct ast_kafka_delivery *report,
+	void *userdata);
+
+/*!
+ * \brief Hand a pooled payload over to the producer, to the partition picked by \c partitioner.
+ *
+ * pool_delivered() gets the buffer back with the delivery report. With
+ * \a respool and the spool enabled the key, topic and headers are kept with
+ * it, so a message the broker never acknowledged can still be spooled.
+ *
+ * \return 0 if the producer took the buffer, -1 if the caller still owns it.
+ */
+static int pool_produce(const struct cdr_kafka_global_conf *global,
+	struct ast_kafka_producer *producer, const char *topic, const char *key,
+	struct cdr_kafka_pool_buf *pool_buf, const struct ast_kafka_header *headers,
+	size_t header_count, int respool)
+{
+	pool_buf->respool = respool && global->spool;
+	pool_buf->headers_len = 0;
+	if (pool_buf->respool) {
+		size_t len = pool_buf->buf.len;
+
+		pool_buf->keyed = !!key;
+		if (key) {
+			ast_copy_string(pool_buf->key, key, sizeof(pool_buf->key));
+		}
+		ast_copy_string(pool_buf->topic, topic, sizeof(pool_buf->topic));
+		/* Past the payload, so the producer never sees them */
+		if (!headers_pack(&pool_buf->buf, headers, header_count)) {
+			pool_buf->headers_len = pool_buf->buf.len - len;
+		}
+		pool_buf->buf.len = len;
+	}
+	pool_buf->produced_ns = metrics_now();
+
+	return produce_report(producer, topic, message_partition(global, producer, topic, key),
+		key, pool_buf->buf.data, pool_buf->buf.len, headers, header_count,
+		pool_delivered, pool_buf);
+}
+
+#ifdef TEST_FRAMEWORK
+/*! \brief Queue state reported for every producer while \c test_stats_set is. */
+static struct ast_kafka_producer_stats test_stats;
+static int test_stats_set;
+#endif
+
+/*! \brief ast_kafka_producer_stats(), unless a test replaced it. */
+static int producer_stats(struct ast_kafka_producer *producer,
+	struct ast_kafka_producer_stats *stats)
+{
+#ifdef TEST_FRAMEWORK
+	if (__atomic_load_n(&test_stats_set, __ATOMIC_ACQUIRE)) {
+		stats->queue_len = __atomic_load_n(&test_stats.queue_len, __ATOMIC_RELAXED);
+		stats->queue_bytes = __atomic_load_n(&test_stats.queue_bytes, __ATOMIC_RELAXED);
+		stats->delivery_latency_us = __atomic_load_n(&test_stats.delivery_latency_us,
+			__ATOMIC_RELAXED);
+		return 0;
+	}
+	if (__atomic_load_n(&test_produce, __ATOMIC_ACQUIRE)) {
+		/* The placeholder producer is not a res_kafka one */
+		return -1;
+	}
+#endif
+
+	return ast_kafka_producer_stats(producer, stats);
+}
+
+/*! \brief Keeps hot queue indices and connection counters on separate cache lines. */
+#define CDR_KAFKA_CACHELINE 64
+
+/*! \brief How a connection's producer queue shapes publishing. */
+enum cdr_kafka_pressure {
+	/*! \brief Below backpressure_low: publish each CDR as it comes */
+	CDR_KAFKA_PRESSURE_NONE,
+	/*! \brief From backpressure_low: let async batches fill */
+	CDR_KAFKA_PRESSURE_BATCH,
+	/*! \brief From backpressure_high until below backpressure_low: spool */
+	CDR_KAFKA_PRESSURE_SPOOL,
+};
+
+/*! \brief How often a producer is asked for its queue state. */
+#define CDR_KAFKA_POLL_NS 100000000ULL
+
+/*!
+ * \brief Health of a connection, by its position in \c connection.
+ *
+ * Only updated with atomics, so the publish paths never lock for it.
+ */
+struct cdr_kafka_link {
+	/*! \brief Payloads handed over without copying and not released yet */
+	unsigned int inflight;
+	/*! \brief Produce calls that worked in the current window */
+	unsigned int sent;
+	/*! \brief Produce calls that failed in the current window */
+	unsigned int failed;
+	/*! \brief Start of the current window, from metrics_now() */
+	uint64_t window;
+	/*! \brief When the connection was last found unhealthy, 0 while healthy */
+	uint64_t unhealthy;
+	/*! \brief When the producer queue was last looked at, from metrics_now() */
+	uint64_t polled;
+	/*! \brief Producer queue length last reported */
+	size_t queue_len;
+	/*! \brief Producer queue bytes last reported */
+	size_t queue_bytes;
+	/*! \brief Delivery latency last reported, in microseconds */
+	uint64_t latency_us;
+	/*! \brief enum cdr_kafka_pressure of the connection */
+	unsigned int pressure;
+	/*! \brief Fanout copies the connection did not take */
+	unsigned int fanout_failed;
+} __attribute__((aligned(CDR_KAFKA_CACHELINE)));
+
+/*! \brief Health of the configured connections and the one failover uses. */
+struct cdr_kafka_links {
+	struct cdr_kafka_link link[CDR_KAFKA_CONNECTIONS_MAX];
+	/*! \brief Index of the connection failover publishes through */
+	unsigned int active;
+};
+
+/*!
+ * \brief Health of the live connections.
+ *
+ * Outlives every snapshot, so payloads still in flight after a reload
+ * can count themselves out.
+ */
+static struct cdr_kafka_links connection_links;
+
+/*!
+ * \brief The configuration and producers CDRs are published with.
+ *
+ * Immutable once published. The publish paths read it through
+ * snapshot_get(), which keeps a reference per thread and only goes back
+ * to the global object when \c snapshot_generation moves on, so the
+ * steady state takes no locks and touches no shared reference counts.
+ */
+struct cdr_kafka_snapshot {
+	struct cdr_kafka_conf *conf;
+	/*! \brief Producer of each connection, NULL if it could not be obtained */
+	struct ast_kafka_producer *producers[CDR_KAFKA_CONNECTIONS_MAX];
+	/*! \brief Name of each connection, pointing into \c names_buf */
+	const char *names[CDR_KAFKA_CONNECTIONS_MAX];
+	/*! \brief Number of configured connections */
+	unsigned int connection_count;
+	/*! \brief Number of non-NULL entries in \c producers */
+	unsigned int connected;
+	/*! \brief Health of the connections */
+	struct cdr_kafka_links *links;
+	/*! \brief When the snapshot was published, from metrics_now() */
+	uint64_t published;
+	unsigned int generation;
+	char *names_buf;
+};
+
+/*! \brief The current snapshot; empty before load and after unload. */
+static AO2_GLOBAL_OBJ_STATIC(current_snapshot);
+
+/*! \brief Generation of \c current_snapshot, bumped each time it is replaced. */
+static unsigned int snapshot_generation;
+
+static void snapshot_dtor(void *obj)
+{
+	struct cdr_kafka_snapshot *snap = obj;
+
+	unsigned int i;
+
+	ao2_cleanup(snap->conf);
+	for (i = 0; i < snap->connection_count; i++) {
+		ao2_cleanup(snap->producers[i]);
+	}
+	ast_free(snap->names_buf);
+}
+
+/*! \brief The snapshot a thread last used, with the reference it holds. */
+struct cdr_kafka_snapshot_tls {
+	struct cdr_kafka_tls link;
+	struct cdr_kafka_snapshot *snap;
+};
+
+static void snapshot_tls_release(struct cdr_kafka_tls *tls)
+{
+	ao2_cleanup(((struct cdr_kafka_snapshot_tls *) tls)->snap);
+}
+
+static int snapshot_tls_init(void *data);
+
+/*! \brief The snapshot last seen by each thread. */
+AST_THREADSTORAGE_CUSTOM(snapshot_tls, snapshot_tls_init, tls_cleanup);
+
+static int snapshot_tls_init(void *data)
+{
+	return tls_track(&snapshot_tls, data, snapshot_tls_release);
+}
+
+/*! \brief Serializes publish_snapshot() and snapshot_replace(). */
+AST_MUTEX_DEFINE_STATIC(snapshot_lock);
+
+/*!
+ * \brief Replace the current snapshot, or clear it if \a snap is NULL.
+ *
+ * \note Must be called with snapshot_lock held.
+ */
+static void snapshot_swap(struct cdr_kafka_snapshot *snap)
+{
+	unsigned int generation = snapshot_generation + 1;
+
+	if (snap) {
+		snap->generation = generation;
+		ao2_global_obj_replace_unref(current_snapshot, snap);
+	} else {
+		ao2_global_obj_release(current_snapshot);
+	}
+
+	/* Only now may readers notice, so that they find the new snapshot */
+	__atomic_store_n(&snapshot_generation, generation, __ATOMIC_RELEASE);
+}
+
+/*! \brief Replace the current snapshot, or clear it if \a snap is NULL. */
+static void snapshot_replace(struct cdr_kafka_snapshot *snap)
+{
+	ast_mutex_lock(&snapshot_lock);
+	snapshot_swap(snap);
+	ast_mutex_unlock(&snapshot_lock);
+}
+
+/*!
+ * \brief Split the \c connection list of \a global into \a snap.
+ *
+ * Empty entries are skipped and entries past CDR_KAFKA_CONNECTIONS_MAX
+ * are reported and left out.
+ *
+ * \return 0 on success, -1 on allocation failure.
+ */
+static int snapshot_names(struct cdr_kafka_snapshot *snap,
+	const struct cdr_kafka_global_conf *global)
+{
+	char *list;
+	char *name;
+
+	snap->names_buf = ast_strdup(global->connection);
+	if (!snap->names_buf) {
+		return -1;
+	}
+
+	list = snap->names_buf;
+	while ((name = strsep(&list, ","))) {
+		name = ast_strip(name);
+		if (ast_strlen_zero(name)) {
+			continue;
+		}
+		if (snap->connection_count == CDR_KAFKA_CONNECTIONS_MAX) {
+			ast_log(LOG_WARNING, "More than %d Kafka connections configured, ignoring '%s'\n",
+				CDR_KAFKA_CONNECTIONS_MAX, name);
+			continue;
+		}
+		snap->names[snap->connection_count++] = name;
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Start over with the health of the live connections.
+ *
+ * Payloads still in flight keep being counted out of \c inflight.
+ */
+static void links_reset(struct cdr_kafka_links *links)
+{
+	size_t i;
+
+	for (i = 0; i < CDR_KAFKA_CONNECTIONS_MAX; i++) {
+		__atomic_store_n(&links->link[i].sent, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&links->link[i].failed, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&links->link[i].window, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&links->link[i].unhealthy, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&links->link[i].polled, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&links->link[i].queue_len, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&links->link[i].pressure, CDR_KAFKA_PRESSURE_NONE, __ATOMIC_RELAXED);
+		__atomic_store_n(&links->link[i].fanout_failed, 0, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&links->active, 0, __ATOMIC_RELAXED);
+}
+
+/*!
+ * \brief Publish the loaded configuration together with its producers.
+ *
+ * The health of the connections is kept as long as the list of
+ * connections stays the same.
+ *
+ * Holds snapshot_lock from reading \c confs to publishing, so a reload
+ * racing a CDR thread that reconnects cannot have the older
+ * configuration published last.
+ *
+ * \return 0 on success.
+ * \return -1 if there is no usable producer; the configuration is
+ *         published anyway and the producers looked up again later.
+ */
+static int publish_snapshot(void)
+{
+	SCOPED_MUTEX(lock, &snapshot_lock);
+	RAII_VAR(struct cdr_kafka_snapshot *, snap, NULL, ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_snapshot *, old, NULL, ao2_cleanup);
+	unsigned int i;
+
+	snap = ao2_alloc_options(sizeof(*snap), snapshot_dtor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!snap) {
+		return -1;
+	}
+
+	snap->conf = ao2_global_obj_ref(confs);
+	if (!snap->conf || !snap->conf->global || snapshot_names(snap, snap->conf->global)) {
+		snapshot_swap(NULL);
+		return -1;
+	}
+	snap->links = &connection_links;
+	snap->published = metrics_now();
+
+	if (!snap->connection_count) {
+		ast_log(LOG_WARNING, "No Kafka connection configured\n");
+	}
+	for (i = 0; i < snap->connection_count; i++) {
+#ifdef TEST_FRAMEWORK
+		if (__atomic_load_n(&test_produce, __ATOMIC_ACQUIRE)) {
+			/* Never handed to res_kafka, see produce_hdrs() */
+			snap->producers[i] = ao2_alloc_options(1, NULL, AO2_ALLOC_OPT_LOCK_NOLOCK);
+		} else
+#endif
+		snap->producers[i] = snap->conf->global->idempotent
+			? ast_kafka_get_idempotent_producer(snap->names[i])
+			: ast_kafka_get_producer(snap->names[i]);
+		if (snap->producers[i]) {
+			snap->connected++;
+		} else {
+			ast_log(LOG_ERROR, "Failed to get Kafka producer for connection '%s'\n",
+				snap->names[i]);
+		}
+	}
+
+	old = ao2_global_obj_ref(current_snapshot);
+	if (!old || strcmp(old->conf->global->connection, snap->conf->global->connection)) {
+		links_reset(snap->links);
+	}
+
+	snapshot_swap(snap);
+
+	return snap->connected ? 0 : -1;
+}
+
+/*!
+ * \brief Get the current snapshot for the calling thread.
+ *
+ * The snapshot is borrowed: it stays valid until the next call on this
+ * thread and must not be released. The reference behind it is held by the
+ * thread storage, and released by tls_release() at unload.
+ *
+ * \return The snapshot, or NULL if the module is not configured.
+ */
+static struct cdr_kafka_snapshot *snapshot_get(void)
+{
+	struct cdr_kafka_snapshot_tls *cached = ast_threadstorage_get(&snapshot_tls, sizeof(*cached));
+	unsigned int generation = __atomic_load_n(&snapshot_generation, __ATOMIC_ACQUIRE);
+
+	if (!cached) {
+		return NULL;
+	}
+
+	if (!cached->snap || cached->snap->generation != generation) {
+		ao2_cleanup(cached->snap);
+		cached->snap = ao2_global_obj_ref(current_snapshot);
+	}
+
+	return cached->snap;
+}
+
+/*! \brief When producers missing from the current snapshot were last looked up. */
+static uint64_t snapshot_retried;
+
+/*!
+ * \brief Make sure a snapshot has producers to publish through.
+ *
+ * If it has none, because Kafka was not reachable when it was published,
+ * the producers are looked up again and a new snapshot is published when
+ * that works. If only some are missing, one thread looks them up again
+ * once every \c failover_recovery.
+ *
+ * \param[in,out] snap Snapshot, replaced by the new one if it was republished.
+ * \return 0 if the snapshot has at least one producer.
+ * \return -1 otherwise.
+ */
+static int snapshot_connect(struct cdr_kafka_snapshot **snap)
+{
+	if ((*snap)->connected < (*snap)->connection_count && (*snap)->connected) {
+		uint64_t now = metrics_now();
+		uint64_t retried = __atomic_load_n(&snapshot_retried, __ATOMIC_RELAXED);
+		uint64_t recovery = (uint64_t) (*snap)->conf->global->failover_recovery * 1000000;
+
+		if (now - (*snap)->published >= recovery && now - retried >= recovery
+			&& __atomic_compare_exchange_n(&snapshot_retried, &retried, now, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED)
+			&& !publish_snapshot()) {
+			*snap = snapshot_get();
+		}
+	} else if (!(*snap)->connected) {
+		if (publish_snapshot()) {
+			return -1;
+		}
+		*snap = snapshot_get();
+	}
+
+	return *snap && (*snap)->connected ? 0 : -1;
+}
+
+/*! \brief How long produce results are collected before a connection is judged. */
+#define CDR_KAFKA_HEALTH_WINDOW_NS 1000000000ULL
+
+/*! \brief Fewest produce results an error rate is judged on. */
+#define CDR_KAFKA_HEALTH_MIN_SAMPLES 10
+
+/*! \brief Whether a snapshot picks one of several connections per message. */
+static int snapshot_failover(const struct cdr_kafka_snapshot *snap)
+{
+	return snap->connection_count > 1
+		&& snap->conf->global->connection_mode == CDR_KAFKA_CONNECTIONS_FAILOVER;
+}
+
+static const char *pressure_names[] = {
+	[CDR_KAFKA_PRESSURE_NONE] = "direct",
+	[CDR_KAFKA_PRESSURE_BATCH] = "batching",
+	[CDR_KAFKA_PRESSURE_SPOOL] = "spooling",
+};
+
+/*!
+ * \brief Ask the producer of connection \a i for its queue state.
+ *
+ * At most one thread asks every \c CDR_KAFKA_POLL_NS; the others use
+ * what it stored. The pressure of the connection follows the queue
+ * length: from \c backpressure_low CDRs are batched, from
+ * \c backpressure_high they are spooled until the queue is below
+ * \c backpressure_low again.
+ *
+ * \return Producer queue length last reported.
+ */
+static size_t link_poll(const struct cdr_kafka_snapshot *snap, unsigned int i, uint64_t now)
+{
+	const struct cdr_kafka_global_conf *global = snap->conf->global;
+	struct cdr_kafka_link *link = &snap->links->link[i];
+	uint64_t polled = __atomic_load_n(&link->polled, __ATOMIC_RELAXED);
+	struct ast_kafka_producer_stats stats;
+	unsigned int pressure;
+	unsigned int was;
+
+	if (!snap->producers[i] || (polled && now - polled < CDR_KAFKA_POLL_NS)
+		|| !__atomic_compare_exchange_n(&link->polled, &polled, now, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED)
+		|| producer_stats(snap->producers[i], &stats)) {
+		return __atomic_load_n(&link->queue_len, __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&link->queue_len, stats.queue_len, __ATOMIC_RELAXED);
+	__atomic_store_n(&link->queue_bytes, stats.queue_bytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&link->latency_us, stats.delivery_latency_us, __ATOMIC_RELAXED);
+
+	was = __atomic_load_n(&link->pressure, __ATOMIC_RELAXED);
+	if (global->backpressure_high && (stats.queue_len >= global->backpressure_high
+		|| (was == CDR_KAFKA_PRESSURE_SPOOL && stats.queue_len >= global->backpressure_low))) {
+		pressure = CDR_KAFKA_PRESSURE_SPOOL;
+	} else if (global->backpressure_low && stats.queue_len >= global->backpressure_low) {
+		pressure = CDR_KAFKA_PRESSURE_BATCH;
+	} else {
+		pressure = CDR_KAFKA_PRESSURE_NONE;
+	}
+	if (pressure != was) {
+		__atomic_store_n(&link->pressure, pressure, __ATOMIC_RELAXED);
+		if (pressure > was) {
+			ast_log(LOG_WARNING, "Kafka connection '%s' has %zu messages queued, %s CDRs\n",
+				snap->names[i], stats.queue_len, pressure_names[pressure]);
+		} else {
+			ast_log(LOG_NOTICE, "Kafka connection '%s' is down to %zu messages queued, %s CDRs\n",
+				snap->names[i], stats.queue_len, pressure_names[pressure]);
+		}
+	}
+
+	return stats.queue_len;
+}
+
+/*!
+ * \brief How the producer queues say CDRs should be published now.
+ *
+ * Failover judges the connection in use, fanout the fullest one.
+ *
+ * \return enum cdr_kafka_pressure
+ */
+static unsigned int snapshot_pressure(const struct cdr_kafka_snapshot *snap)
+{
+	unsigned int pressure = CDR_KAFKA_PRESSURE_NONE;
+	uint64_t now;
+	unsigned int i;
+
+	if (!snap->conf->global->backpressure_low && !snap->conf->global->backpressure_high) {
+		return CDR_KAFKA_PRESSURE_NONE;
+	}
+
+	now = metrics_now();
+	if (snapshot_failover(snap)) {
+		i = __atomic_load_n(&snap->links->active, __ATOMIC_RELAXED);
+		if (i >= snap->connection_count) {
+			i = 0;
+		}
+		link_poll(snap, i, now);
+		return __atomic_load_n(&snap->links->link[i].pressure, __ATOMIC_RELAXED);
+	}
+
+	for (i = 0; i < snap->connection_count; i++) {
+		unsigned int level;
+
+		link_poll(snap, i, now);
+		level = __atomic_load_n(&snap->links->link[i].pressure, __ATOMIC_RELAXED);
+		if (level > pressure) {
+			pressure = level;
+		}
+	}
+
+	return pressure;
+}
+
+/*! \brief Whether CDRs go straight to the spool because Kafka is backed up. */
+static int snapshot_spooling(const struct cdr_kafka_snapshot *snap)
+{
+	return snap->conf->global->spool && snap->conf->global->backpressure_high
+		&& snapshot_pressure(snap) == CDR_KAFKA_PRESSURE_SPOOL;
+}
+
+/*! \brief Backlog of connection \a i judged against \c failover_queue_depth. */
+static size_t link_backlog(const struct cdr_kafka_snapshot *snap, unsigned int i, uint64_t now)
+{
+	size_t queued = link_poll(snap, i, now);
+	size_t inflight = __atomic_load_n(&snap->links->link[i].inflight, __ATOMIC_RELAXED);
+
+	return queued > inflight ? queued : inflight;
+}
+
+/*!
+ * \brief Whether connection \a i can take over.
+ *
+ * It needs a producer, a backlog below \c failover_queue_depth and, if
+ * it was unhealthy, to have been left alone for \c failover_recovery
+ * since.
+ */
+static int link_usable(const struct cdr_kafka_snapshot *snap, unsigned int i, uint64_t now)
+{
+	const struct cdr_kafka_global_conf *global = snap->conf->global;
+	struct cdr_kafka_link *link = &snap->links->link[i];
+	uint64_t unhealthy = __atomic_load_n(&link->unhealthy, __ATOMIC_RELAXED);
+
+	return snap->producers[i]
+		&& (!unhealthy || now - unhealthy >= (uint64_t) global->failover_recovery * 1000000)
+		&& (!global->failover_queue_depth
+			|| link_backlog(snap, i, now) < global->failover_queue_depth);
+}
+
+/*! \brief Make failover publish through connection \a i. */
+static void link_activate(struct cdr_kafka_links *links, unsigned int i, uint64_t now)
+{
+	__atomic_store_n(&links->link[i].unhealthy, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&links->link[i].sent, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&links->link[i].failed, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&links->link[i].window, now, __ATOMIC_RELAXED);
+	__atomic_store_n(&links->active, i, __ATOMIC_RELAXED);
+}
+
+/*!
+ * \brief Judge the connection in use and fail over, or back, if needed.
+ *
+ * A connection is unhealthy without a producer, with a backlog of
+ * \c failover_queue_depth messages queued in its producer or payloads
+ * in flight, or when at least
+ * \c failover_error_rate percent of its produce calls in the last window
+ * failed. Failover then moves to the first other connection that is
+ * usable. While a connection further down the list is in use, the first
+ * one before it that is usable again is switched back to: it gets no
+ * traffic meanwhile, so it is taken as healthy once its backlog has
+ * drained and \c failover_recovery has passed.
+ *
+ * \param active Connection in use.
+ * \param sent Produce calls that worked in the window just closed.
+ * \param failed Produce calls that failed in the window just closed.
+ */
+static void links_check(const struct cdr_kafka_snapshot *snap, unsigned int active,
+	unsigned int sent, unsigned int failed, uint64_t now)
+{
+	const struct cdr_kafka_global_conf *global = snap->conf->global;
+	struct cdr_kafka_link *link = &snap->links->link[active];
+	size_t backlog = link_backlog(snap, active, now);
+	unsigned int total = sent + failed;
+	unsigned int i;
+
+	if (!snap->producers[active]
+		|| (global->failover_queue_depth && backlog >= global->failover_queue_depth)
+		|| (global->failover_error_rate && total >= CDR_KAFKA_HEALTH_MIN_SAMPLES
+			&& (uint64_t) failed * 100 >= (uint64_t) global->failover_error_rate * total)) {
+		int reported = __atomic_exchange_n(&link->unhealthy, now, __ATOMIC_RELAXED) != 0;
+		char why[96] = "has no producer";
+
+		if (snap->producers[active]) {
+			snprintf(why, sizeof(why), "is unhealthy (%u of %u produce calls failed, "
+				"%zu messages queued)", failed, total, backlog);
+		}
+		for (i = 0; i < snap->connection_count; i++) {
+			if (i != active && link_usable(snap, i, now)) {
+				ast_log(LOG_WARNING, "Kafka connection '%s' %s, publishing CDRs through '%s'\n",
+					snap->names[active], why, snap->names[i]);
+				link_activate(snap->links, i, now);
+				return;
+			}
+		}
+		if (!reported) {
+			ast_log(LOG_WARNING, "Kafka connection '%s' %s, but no other connection is usable\n",
+				snap->names[active], why);
+		}
+		return;
+	}
+
+	for (i = 0; i < active; i++) {
+		if (link_usable(snap, i, now)) {
+			ast_log(LOG_NOTICE, "Kafka connection '%s' has recovered, publishing CDRs "
+				"through it again\n", snap->names[i]);
+			link_activate(snap->links, i, now);
+			return;
+		}
+	}
+}
+
+/*!
+ * \brief Pick the connection failover publishes through.
+ *
+ * \return Index of the connection; its producer is NULL if none is usable.
+ */
+static unsigned int links_pick(const struct cdr_kafka_snapshot *snap, uint64_t now)
+{
+	unsigned int active = __atomic_load_n(&snap->links->active, __ATOMIC_RELAXED);
+
+	if (active >= snap->connection_count) {
+		active = 0;
+	}
+	if (!snap->producers[active]) {
+		/* No point in waiting for the window to close */
+		links_check(snap, active, 0, 0, now);
+		active = __atomic_load_n(&snap->links->active, __ATOMIC_RELAXED);
+		if (active >= snap->connection_count) {
+			active = 0;
+		}
+	}
+
+	return active;
+}
+
+/*!
+ * \brief Count produce results against connection \a i.
+ *
+ * The thread that closes a window judges the connection with links_check().
+ */
+static void link_report(const struct cdr_kafka_snapshot *snap, unsigned int i,
+	unsigned int sent, unsigned int failed, uint64_t now)
+{
+	struct cdr_kafka_link *link = &snap->links->link[i];
+	uint64_t window;
+
+	if (sent) {
+		__atomic_add_fetch(&link->sent, sent, __ATOMIC_RELAXED);
+	}
+	if (failed) {
+		__atomic_add_fetch(&link->failed, failed, __ATOMIC_RELAXED);
+	}
+
+	window = __atomic_load_n(&link->window, __ATOMIC_RELAXED);
+	if (now - window < CDR_KAFKA_HEALTH_WINDOW_NS
+		|| !__atomic_compare_exchange_n(&link->window, &window, now, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	sent = __atomic_exchange_n(&link->sent, 0, __ATOMIC_RELAXED);
+	failed = __atomic_exchange_n(&link->failed, 0, __ATOMIC_RELAXED);
+	if (i == __atomic_load_n(&snap->links->active, __ATOMIC_RELAXED)) {
+		links_check(snap, i, sent, failed, now);
+	}
+}
+
+/*! \brief Count \a count fanout copies connection \a i did not take. */
+static void link_fanout_failed(const struct cdr_kafka_snapshot *snap, unsigned int i,
+	unsigned int count)
+{
+	unsigned int before = __atomic_fetch_add(&snap->links->link[i].fanout_failed, count,
+		__ATOMIC_RELAXED);
+
+	metrics_count(metrics_get(), CDR_KAFKA_COUNTER_FANOUT_FAILED, count);
+	if (!before || before / 1000 != (before + count) / 1000) {
+		ast_log(LOG_WARNING, "Kafka connection '%s' missed %u fanout copies\n",
+			snap->names[i], before + count);
+	}
+}
+
+/*!
+ * \brief Pick the next connection to retry a message on.
+ *
+ * \param tried Connections that did not take the message, as a bit mask.
+ * \return Index of the first other usable connection, or -1.
+ */
+static int links_fallback(const struct cdr_kafka_snapshot *snap, unsigned int tried,
+	uint64_t now)
+{
+	unsigned int i;
+
+	for (i = 0; i < snap->connection_count; i++) {
+		if (!(tried & (1U << i)) && link_usable(snap, i, now)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/*!
+ * \brief Hand a pooled payload to connection \a i and count the result.
+ *
+ * \return 0 if the connection took it, -1 if the caller still owns \a pool_buf.
+ */
+static int link_produce_owned(const struct cdr_kafka_snapshot *snap, unsigned int i,
+	const char *topic, const char *key, struct cdr_kafka_pool_buf *pool_buf,
+	const struct ast_kafka_header *hdrs, size_t hdr_count, uint64_t now)
+{
+	struct cdr_kafka_link *link = &snap->links->link[i];
+	int res;
+
+	/* Counted in before the producer can release it */
+	pool_buf->inflight = &link->inflight;
+	__atomic_add_fetch(&link->inflight, 1, __ATOMIC_RELAXED);
+	res = pool_produce(snap->conf->global, snap->producers[i], topic, key, pool_buf,
+		hdrs, hdr_count, 1);
+	if (res) {
+		__atomic_sub_fetch(&link->inflight, 1, __ATOMIC_RELAXED);
+		pool_buf->inflight = NULL;
+	}
+	link_report(snap, i, !res, !!res, now);
+
+	return res;
+}
+
+static int spool_message(const char *key, const char *topic,
+	const struct ast_kafka_header *hdrs, size_t hdr_count, const char *payload, size_t len);
+
+/*!
+ * \brief Produce a pooled payload through the connections of a snapshot.
+ *
+ * With failover the payload goes to the connection in use, and if that
+ * does not take it, to the other usable ones in turn. With fanout every other
+ * connection gets a copy first and the payload is then handed to the
+ * first one. A copy some connection did not take is spooled, before the
+ * first one owns the payload, and replayed through all of them.
+ *
+ * \return 0 if a connection took the message, or it was spooled; the
+ *         buffer is no longer the caller's.
+ * \return -1 if neither; the caller still owns \a pool_buf.
+ */
+static int snapshot_produce_owned(const struct cdr_kafka_snapshot *snap,
+	const char *topic, const char *key, struct cdr_kafka_pool_buf *pool_buf,
+	const struct ast_kafka_header *hdrs, size_t hdr_count)
+{
+	const struct cdr_kafka_global_conf *global = snap->conf->global;
+	uint64_t now;
+	unsigned int owner;
+	unsigned int tried;
+	unsigned int i;
+	int fallback;
+	int copied = 0;
+	int spooled = 0;
+
+	if (global->connection_mode == CDR_KAFKA_CONNECTIONS_FANOUT
+		&& snap->connection_count > 1) {
+		owner = 0;
+		while (owner < snap->connection_count && !snap->producers[owner]) {
+			owner++;
+		}
+		for (i = owner + 1; i < snap->connection_count; i++) {
+			if (!snap->producers[i]) {
+				continue;
+			}
+			if (!message_produce(global, snap->producers[i], topic, key,
+				pool_buf->buf.data, pool_buf->buf.len, hdrs, hdr_count)) {
+				copied = 1;
+			} else {
+				link_fanout_failed(snap, i, 1);
+				spooled = spooled || !spool_message(key, topic, hdrs, hdr_count,
+					pool_buf->buf.data, pool_buf->buf.len);
+			}
+		}
+		/* A copy that got through, or the spool, is enough; spooling would duplicate it */
+		if (owner < snap->connection_count && !pool_produce(global, snap->producers[owner],
+			topic, key, pool_buf, hdrs, hdr_count, !copied && !spooled)) {
+			return 0;
+		}
+		if (copied || spooled) {
+			if (owner < snap->connection_count) {
+				link_fanout_failed(snap, owner, 1);
+			}
+			if (!spooled) {
+				spool_message(key, topic, hdrs, hdr_count, pool_buf->buf.data,
+					pool_buf->buf.len);
+			}
+			pool_put(pool_buf);
+			return 0;
+		}
+		return -1;
+	}
+
+	if (!snapshot_failover(snap)) {
+		return pool_produce(global, snap->producers[0], topic, key, pool_buf,
+			hdrs, hdr_count, 1);
+	}
+
+	now = metrics_now();
+	i = links_pick(snap, now);
+	if (!snap->producers[i]) {
+		return -1;
+	}
+	tried = 1U << i;
+	while (link_produce_owned(snap, i, topic, key, pool_buf, hdrs, hdr_count, now)) {
+		if ((fallback = links_fallback(snap, tried, now)) < 0) {
+			return -1;
+		}
+		i = fallback;
+		tried |= 1U << i;
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Produce a copied payload through the connections of a snapshot.
+ *
+ * Failover and fanout work as for snapshot_produce_owned().
+ *
+ * \return 0 if a connection took the message.
+ * \return -1 if none did.
+ */
+static int snapshot_produce(const struct cdr_kafka_snapshot *snap,
+	const char *topic, const char *key, const void *payload, size_t len,
+	const struct ast_kafka_header *hdrs, size_t hdr_count)
+{
+	const struct cdr_kafka_global_conf *global = snap->conf->global;
+	uint64_t now;
+	unsigned int tried;
+	unsigned int i;
+	int fallback;
+	int res = -1;
+
+	if (!snapshot_failover(snap)) {
+		for (i = 0; i < snap->connection_count; i++) {
+			if (!snap->producers[i]) {
+				continue;
+			}
+			if (!message_produce(global, snap->producers[i], topic, key, payload, len,
+				hdrs, hdr_count)) {
+				res = 0;
+			} else if (snap->connection_count > 1) {
+				link_fanout_failed(snap, i, 1);
+			}
+		}
+		return res;
+	}
+
+	now = metrics_now();
+	i = links_pick(snap, now);
+	if (!snap->producers[i]) {
+		return -1;
+	}
+	tried = 1U << i;
+	for (;;) {
+		res = message_produce(global, snap->producers[i], topic, key, payload, len,
+			hdrs, hdr_count);
+		link_report(snap, i, !res, !!res, now);
+		if (!res || (fallback = links_fallback(snap, tried, now)) < 0) {
+			return res;
+		}
+		i = fallback;
+		tried |= 1U << i;
+	}
+}
+
+/*!
+ * \brief Produce a copy of a payload with a delivery report.
+ *
+ * Unlike snapshot_produce() the payload goes into a pooled buffer, so
+ * pool_delivered() spools it if the broker finally fails it.
+ *
+ * \return 0 if a connection took the message.
+ * \return -1 if none did.
+ */
+static int snapshot_produce_reported(const struct cdr_kafka_snapshot *snap,
+	const char *topic, const char *key, const void *payload, size_t len,
+	const struct ast_kafka_header *hdrs, size_t hdr_count)
+{
+	struct cdr_kafka_pool_buf *pool_buf = pool_get();
+
+	if (!pool_buf) {
+		return -1;
+	}
+	if (buf_append(&pool_buf->buf, payload, len)
+		|| snapshot_produce_owned(snap, topic, key, pool_buf, hdrs, hdr_count)) {
+		pool_put(pool_buf);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*! \brief Directory below ast_config_AST_SPOOL_DIR holding the spool segments. */
+#define CDR_KAFKA_SPOOL_SUBDIR "cdr_kafka"
+
+/*! \brief Marks a completely written spool entry ("CKSP"). */
+#define CDR_KAFKA_SPOOL_MAGIC 0x50534b43
+
+/*! \brief Entry flag set once the entry has been replayed. */
+#define CDR_KAFKA_SPOOL_REPLAYED (1 << 0)
+
+/*! \brief key_len of an entry without a key. */
+#define CDR_KAFKA_SPOOL_NO_KEY UINT32_MAX
+
+/*! \brief The active segment is handed to replay once idle this long... */
+#define CDR_KAFKA_SPOOL_IDLE_MS 1000
+
+/*! \brief ...or once it has been open this long. */
+#define CDR_KAFKA_SPOOL_MAX_AGE_MS 30000
+
+/*! \brief Bounds of the replay back-off after a failed produce. */
+#define CDR_KAFKA_SPOOL_RETRY_MIN_MS 1000
+#define CDR_KAFKA_SPOOL_RETRY_MAX_MS 30000
+
+/*!
+ * \brief On-disk header of a spooled message.
+ *
+ * Followed by the NUL terminated key (unless \c key_len is
+ * CDR_KAFKA_SPOOL_NO_KEY), the NUL terminated topic, the headers as
+ * headers_pack() writes them and the payload, padded to 8 bytes. \c crc
+ * covers \c key_len, \c len, the key, the topic, the headers and the
+ * payload; \c flags is left out so replay can update it in place.
+ */
+struct cdr_kafka_spool_entry {
+	uint32_t magic;
+	uint32_t flags;
+	uint32_t key_len;
+	uint32_t len;
+	uint32_t crc;
+	uint32_t topic_len;
+};
+
+/*!
+ * \brief Write-ahead spool for messages Kafka did not take.
+ *
+ * Messages are appended to memory-mapped segment files named after
+ * increasing sequence numbers. Only the newest segment is written to; the
+ * replay thread seals it once it goes idle and replays every sealed
+ * segment in order, oldest first, deleting each one when done.
+ */
+struct cdr_kafka_spool {
+	char dir[PATH_MAX];
+	/*! \brief Guards everything below and \c cond */
+	ast_mutex_t lock;
+	/*! \brief Signalled when the spool stops */
+	ast_cond_t cond;
+	pthread_t thread;
+	int stopping;
+	/*! \brief Set while unloading waits for payloads in flight; replay pauses */
+	int held;
+	/*! \brief Active segment, or -1 */
+	int fd;
+	char *map;
+	size_t size;
+	size_t used;
+	uint64_t active_seq;
+	struct timeval opened;
+	struct timeval last_write;
+	/*! \brief Oldest segment that may still need replaying */
+	uint64_t oldest_seq;
+	/*! \brief Sequence number of the next segment to open */
+	uint64_t next_seq;
+	size_t segment_size;
+	/*! \brief Replayed messages per second, 0 for unlimited */
+	unsigned int replay_rate;
+	/*! \brief Token bucket of the replay throttle */
+	double tokens;
+	struct timeval refilled;
+};
+
+static AO2_GLOBAL_OBJ_STATIC(cdr_spool);
+
+/*! \brief CRC-32 (IEEE 802.3) lookup table, one nibble at a time. */
+static const uint32_t crc32_nibble[16] = {
+	0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+	0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+	0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+	0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+	const unsigned char *pos = data;
+
+	crc = ~crc;
+	while (len--) {
+		crc ^= *pos++;
+		crc = (crc >> 4) ^ crc32_nibble[crc & 0x0f];
+		crc = (crc >> 4) ^ crc32_nibble[crc & 0x0f];
+	}
+
+	return ~crc;
+}
+
+static uint32_t spool_entry_crc(const struct cdr_kafka_spool_entry *entry,
+	const char *key, const char *topic, const char *headers, size_t headers_len,
+	const char *payload)
+{
+	uint32_t crc = crc32_update(0, &entry->key_len, sizeof(entry->key_len));
+
+	crc = crc32_update(crc, &entry->len, sizeof(entry->len));
+	if (entry->key_len != CDR_KAFKA_SPOOL_NO_KEY) {
+		crc = crc32_update(crc, key, entry->key_len + 1);
+	}
+	crc = crc32_update(crc, topic, entry->topic_len + 1);
+	crc = crc32_update(crc, headers, headers_len);
+	return crc32_update(crc, payload, entry->len);
+}
+
+/*! \brief Bytes taken by an entry with the given key, topic, headers and payload lengths. */
+static size_t spool_entry_size(uint32_t key_len, uint32_t topic_len, size_t headers_len,
+	size_t len)
+{
+	size_t size = sizeof(struct cdr_kafka_spool_entry) + topic_len + 1 + headers_len + len;
+
+	if (key_len != CDR_KAFKA_SPOOL_NO_KEY) {
+		size += (size_t) key_len + 1;
+	}
+
+	return (size + 7) & ~(size_t) 7;
+}
+
+static void spool_segment_path(const struct cdr_kafka_spool *spool, uint64_t seq,
+	char *path, size_t size)
+{
+	snprintf(path, size, "%s/%020" PRIu64 ".seg", spool->dir, seq);
+}
+
+/*! \brief Sleep up to \a ms milliseconds unless stopping. Lock must be held. */
+static void spool_wait(struct cdr_kafka_spool *spool, unsigned int ms)
+{
+	struct timeval tv;
+	struct timespec ts;
+
+	if (spool->stopping) {
+		return;
+	}
+
+	tv = ast_tvadd(ast_tvnow(), ast_samp2tv(ms, 1000));
+	ts.tv_sec = tv.tv_sec;
+	ts.tv_nsec = tv.tv_usec * 1000;
+	ast_cond_timedwait(&spool->cond, &spool->lock, &ts);
+}
+
+/*! \brief Create the next segment and make it active. Lock must be held. */
+static int spool_open_segment(struct cdr_kafka_spool *spool)
+{
+	char path[PATH_MAX];
+	void *map;
+	int fd;
+	int res;
+
+	spool_segment_path(spool, spool->next_seq, path, sizeof(path));
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0640);
+	if (fd < 0) {
+		ast_log(LOG_ERROR, "Failed to create CDR spool segment %s: %s\n",
+			path, strerror(errno));
+		return -1;
+	}
+
+	/* Allocate the blocks up front so a full disk fails here rather than
+	 * as SIGBUS when the mapping is written */
+	res = posix_fallocate(fd, 0, spool->segment_size);
+	if (res) {
+		ast_log(LOG_ERROR, "Failed to allocate CDR spool segment %s: %s\n",
+			path, strerror(res));
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	map = mmap(NULL, spool->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		ast_log(LOG_ERROR, "Failed to map CDR spool segment %s: %s\n",
+			path, strerror(errno));
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	spool->fd = fd;
+	spool->map = map;
+	spool->size = spool->segment_size;
+	spool->used = 0;
+	spool->active_seq = spool->next_seq++;
+	spool->opened = ast_tvnow();
+
+	ast_log(LOG_WARNING, "Spooling CDRs to %s\n", path);
+	return 0;
+}
+
+/*! \brief Close the active segment, trimmed to what was written. Lock must be held. */
+static void spool_seal(struct cdr_kafka_spool *spool)
+{
+	if (spool->fd < 0) {
+		return;
+	}
+
+	if (spool->used) {
+		msync(spool->map, spool->used, MS_ASYNC);
+	}
+	munmap(spool->map, spool->size);
+	if (ftruncate(spool->fd, spool->used)) {
+		ast_log(LOG_WARNING, "Failed to trim CDR spool segment: %s\n", strerror(errno));
+	}
+	close(spool->fd);
+
+	if (!spool->used) {
+		char path[PATH_MAX];
+
+		spool_segment_path(spool, spool->active_seq, path, sizeof(path));
+		unlink(path);
+	}
+
+	spool->fd = -1;
+	spool->map = NULL;
+}
+
+/*!
+ * \brief Append a message to the spool.
+ *
+ * \param spool The spool.
+ * \param key Message key (may be NULL).
+ * \param headers The message headers from headers_pack(), or NULL for none.
+ * \param headers_len Size of \a headers.
+ * \param payload The message payload.
+ * \param len Length of the payload.
+ * \return 0 on success.
+ * \return -1 on error.
+ */
+static int spool_write(struct cdr_kafka_spool *spool, const char *key,
+	const char *topic, const char *headers, size_t headers_len, const char *payload, size_t len)
+{
+	struct cdr_kafka_spool_entry entry = {
+		.key_len = key ? strlen(key) : CDR_KAFKA_SPOOL_NO_KEY,
+		.len = len,
+		.topic_len = strlen(topic),
+	};
+	size_t size;
+	char *pos;
+
+	if (!headers_len) {
+		/* The empty block headers_pack() writes for no headers */
+		headers = "";
+		headers_len = 1;
+	}
+	size = spool_entry_size(entry.key_len, entry.topic_len, headers_len, len);
+	entry.crc = spool_entry_crc(&entry, key, topic, headers, headers_len, payload);
+
+	ast_mutex_lock(&spool->lock);
+	if (spool->fd >= 0 && spool->used + size > spool->size) {
+		spool_seal(spool);
+	}
+	if (spool->fd < 0) {
+		if (size > spool->segment_size) {
+			ast_mutex_unlock(&spool->lock);
+			ast_log(LOG_ERROR, "CDR of %zu bytes does not fit in a spool segment\n", len);
+			return -1;
+		}
+		if (spool_open_segment(spool)) {
+			ast_mutex_unlock(&spool->lock);
+			return -1;
+		}
+	}
+
+	pos = spool->map + spool->used;
+	memcpy(pos, &entry, sizeof(entry));
+	pos += sizeof(entry);
+	if (key) {
+		memcpy(pos, key, entry.key_len + 1);
+		pos += entry.key_len + 1;
+	}
+	memcpy(pos, topic, entry.topic_len + 1);
+	pos += entry.topic_len + 1;
+	memcpy(pos, headers, headers_len);
+	pos += headers_len;
+	memcpy(pos, payload, len);
+	/* The magic goes in last, so a torn entry is never taken for a whole one */
+	__atomic_store_n(&((struct cdr_kafka_spool_entry *) (spool->map + spool->used))->magic,
+		CDR_KAFKA_SPOOL_MAGIC, __ATOMIC_RELEASE);
+	spool->used += size;
+	spool->last_write = ast_tvnow();
+	ast_mutex_unlock(&spool->lock);
+
+	return 0;
+}
+
+/*! \brief Wait for a token of the replay rate limit. */
+static void spool_throttle(struct cdr_kafka_spool *spool)
+{
+	ast_mutex_lock(&spool->lock);
+	while (spool->replay_rate && !spool->stopping) {
+		double burst = MAX(spool->replay_rate / 10.0, 1.0);
+		struct timeval now = ast_tvnow();
+
+		spool->tokens += ast_tvdiff_us(now, spool->refilled) * spool->replay_rate / 1000000.0;
+		spool->tokens = MIN(spool->tokens, burst);
+		spool->refilled = now;
+		if (spool->tokens >= 1.0) {
+			spool->tokens -= 1.0;
+			break;
+		}
+		spool_wait(spool, (1.0 - spool->tokens) * 1000 / spool->replay_rate + 1);
+	}
+	ast_mutex_unlock(&spool->lock);
+}
+
+/*!
+ * \brief Produce every entry of a sealed segment not replayed yet.
+ *
+ * Replayed entries are flagged in the file, so a segment that is retried
+ * after a failure or a restart does not produce them twice.
+ *
+ * \return 0 once the segment needs no more replaying.
+ * \return -1 if it has to be retried.
+ */
+static int spool_replay_segment(struct cdr_kafka_spool *spool, uint64_t seq)
+{
+	RAII_VAR(struct cdr_kafka_snapshot *, snap, ao2_global_obj_ref(current_snapshot), ao2_cleanup);
+	struct cdr_kafka_metrics *metrics = metrics_get();
+	char path[PATH_MAX];
+	struct stat st;
+	size_t replayed = 0;
+	size_t off = 0;
+	char *map;
+	int res = 0;
+	int fd;
+
+	if (snap && !snap->connected && !publish_snapshot()) {
+		ao2_ref(snap, -1);
+		snap = ao2_global_obj_ref(current_snapshot);
+	}
+	if (!snap || !snap->connected || snapshot_pressure(snap) != CDR_KAFKA_PRESSURE_NONE) {
+		return -1;
+	}
+
+	spool_segment_path(spool, seq, path, sizeof(path));
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			ast_log(LOG_ERROR, "Failed to open CDR spool segment %s: %s\n",
+				path, strerror(errno));
+		}
+		return 0;
+	}
+	if (fstat(fd, &st) || !st.st_size) {
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		ast_log(LOG_ERROR, "Failed to map CDR spool segment %s: %s\n",
+			path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	while (off + sizeof(struct cdr_kafka_spool_entry) <= (size_t) st.st_size) {
+		struct cdr_kafka_spool_entry *entry = (struct cdr_kafka_spool_entry *) (map + off);
+		struct ast_kafka_header hdr_buf[CDR_KAFKA_MAX_HEADERS];
+		const char *key = NULL;
+		const char *topic;
+		const char *headers = NULL;
+		const char *payload = (const char *) (entry + 1);
+		size_t headers_len = 0;
+		size_t hdr_count = 0;
+		size_t size;
+
+		/* A segment left behind by a crash ends with unwritten space */
+		if (entry->magic != CDR_KAFKA_SPOOL_MAGIC) {
+			break;
+		}
+
+		size = spool_entry_size(entry->key_len, entry->topic_len, 0, entry->len);
+		if (entry->key_len != CDR_KAFKA_SPOOL_NO_KEY) {
+			key = payload;
+			payload += entry->key_len + 1;
+		}
+		topic = payload;
+		payload += entry->topic_len + 1;
+		if (size <= st.st_size - off) {
+			headers = payload;
+			headers_len = headers_unpack(headers, map + st.st_size - headers - entry->len,
+				hdr_buf, &hdr_count);
+			payload += headers_len;
+			size = headers_len ? spool_entry_size(entry->key_len, entry->topic_len,
+				headers_len, entry->len) : SIZE_MAX;
+		}
+		if (size > st.st_size - off || (key && key[entry->key_len] != '\0')
+			|| !entry->topic_len || topic[entry->topic_len] != '\0'
+			|| entry->crc != spool_entry_crc(entry, key, topic, headers, headers_len, payload)) {
+			ast_log(LOG_WARNING, "Corrupt entry in CDR spool segment %s at offset %zu, "
+				"discarding the rest of the segment\n", path, off);
+			break;
+		}
+
+		if (!(entry->flags & CDR_KAFKA_SPOOL_REPLAYED)) {
+			spool_throttle(spool);
+			if (__atomic_load_n(&spool->stopping, __ATOMIC_RELAXED)
+				|| __atomic_load_n(&spool->held, __ATOMIC_RELAXED)
+				|| snapshot_pressure(snap) != CDR_KAFKA_PRESSURE_NONE) {
+				/* Leave the producer queue to the live CDRs */
+				res = -1;
+				break;
+			}
+
+			/* Flagged once the producer took it; a failed delivery is spooled again */
+			if (snapshot_produce_reported(snap, topic, key,
+				payload, entry->len, hdr_buf, hdr_count)) {
+				res = -1;
+				break;
+			}
+			entry->flags |= CDR_KAFKA_SPOOL_REPLAYED;
+			metrics_count(metrics, CDR_KAFKA_COUNTER_REPLAYED, 1);
+			replayed++;
+		}
+
+		off += size;
+	}
+
+	munmap(map, st.st_size);
+	close(fd);
+
+	if (replayed) {
+		ast_log(LOG_NOTICE, "Replayed %zu spooled CDRs from %s\n", replayed, path);
+	}
+
+	return res;
+}
+
+static void *spool_replay(void *data)
+{
+	struct cdr_kafka_spool *spool = data;
+	unsigned int retry_ms = CDR_KAFKA_SPOOL_RETRY_MIN_MS;
+
+	ast_mutex_lock(&spool->lock);
+	while (!spool->stopping) {
+		uint64_t end = spool->fd >= 0 ? spool->active_seq : spool->next_seq;
+		struct timeval now = ast_tvnow();
+
+		if (spool->oldest_seq < end) {
+			uint64_t seq = spool->oldest_seq;
+			int res;
+
+			ast_mutex_unlock(&spool->lock);
+			res = spool_replay_segment(spool, seq);
+			ast_mutex_lock(&spool->lock);
+
+			if (!res) {
+				char path[PATH_MAX];
+
+				spool_segment_path(spool, seq, path, sizeof(path));
+				unlink(path);
+				spool->oldest_seq = seq + 1;
+				retry_ms = CDR_KAFKA_SPOOL_RETRY_MIN_MS;
+			} else {
+				spool_wait(spool, retry_ms);
+				retry_ms = MIN(retry_ms * 2, CDR_KAFKA_SPOOL_RETRY_MAX_MS);
+			}
+			continue;
+		}
+
+		if (spool->fd >= 0 && spool->used
+			&& (ast_tvdiff_ms(now, spool->last_write) >= CDR_KAFKA_SPOOL_IDLE_MS
+				|| ast_tvdiff_ms(now, spool->opened) >= CDR_KAFKA_SPOOL_MAX_AGE_MS)) {
+			spool_seal(spool);
+			continue;
+		}
+
+		spool_wait(spool, CDR_KAFKA_SPOOL_IDLE_MS);
+	}
+	ast_mutex_unlock(&spool->lock);
+
+	return NULL;
+}
+
+/*! \brief Stop the replay thread and seal the active segment. */
+static void spool_stop(struct cdr_kafka_spool *spool)
+{
+	ast_mutex_lock(&spool->lock);
+	__atomic_store_n(&spool->stopping, 1, __ATOMIC_RELAXED);
+	ast_cond_broadcast(&spool->cond);
+	ast_mutex_unlock(&spool->lock);
+
+	if (spool->thread != AST_PTHREADT_NULL) {
+		pthread_join(spool->thread, NULL);
+		spool->thread = AST_PTHREADT_NULL;
+	}
+
+	ast_mutex_lock(&spool->lock);
+	spool_seal(spool);
+	ast_mutex_unlock(&spool->lock);
+}
+
+static void spool_dtor(void *obj)
+{
+	struct cdr_kafka_spool *spool = obj;
+
+	spool_seal(spool);
+	ast_mutex_destroy(&spool->lock);
+	ast_cond_destroy(&spool->cond);
+}
+
+/*! \brief Find the segments left over from a previous run. */
+static int spool_scan(struct cdr_kafka_spool *spool)
+{
+	uint64_t first = UINT64_MAX;
+	uint64_t last = 0;
+	size_t found = 0;
+	struct dirent *dent;
+	DIR *dir;
+
+	dir = opendir(spool->dir);
+	if (!dir) {
+		ast_log(LOG_ERROR, "Failed to open CDR spool directory %s: %s\n",
+			spool->dir, strerror(errno));
+		return -1;
+	}
+
+	while ((dent = readdir(dir))) {
+		uint64_t seq;
+		char end;
+
+		if (strlen(dent->d_name) != 24
+			|| sscanf(dent->d_name, "%20" SCNu64 ".se%c", &seq, &end) != 2 || end != 'g') {
+			continue;
+		}
+		first = MIN(first, seq);
+		last = MAX(last, seq);
+		found++;
+	}
+	closedir(dir);
+
+	spool->next_seq = last + 1;
+	spool->oldest_seq = found ? first : spool->next_seq;
+	if (found) {
+		ast_log(LOG_NOTICE, "Found %zu CDR spool segments in %s, replaying them\n",
+			found, spool->dir);
+	}
+
+	return 0;
+}
+
+static struct cdr_kafka_spool *spool_alloc(const struct cdr_kafka_global_conf *global)
+{
+	RAII_VAR(struct cdr_kafka_spool *, spool, NULL, ao2_cleanup);
+
+	spool = ao2_alloc_options(sizeof(*spool), spool_dtor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!spool) {
+		return NULL;
+	}
+	ast_mutex_init(&spool->lock);
+	ast_cond_init(&spool->cond, NULL);
+	spool->thread = AST_PTHREADT_NULL;
+	spool->fd = -1;
+	spool->segment_size = global->spool_segment_size;
+	spool->replay_rate = global->spool_replay_rate;
+	spool->refilled = ast_tvnow();
+
+	snprintf(spool->dir, sizeof(spool->dir), "%s/%s",
+		ast_config_AST_SPOOL_DIR, CDR_KAFKA_SPOOL_SUBDIR);
+	if (ast_mkdir(spool->dir, 0755)) {
+		ast_log(LOG_ERROR, "Failed to create CDR spool directory %s\n", spool->dir);
+		return NULL;
+	}
+	if (spool_scan(spool)) {
+		return NULL;
+	}
+
+	if (ast_pthread_create(&spool->thread, NULL, spool_replay, spool)) {
+		ast_log(LOG_ERROR, "Failed to start CDR spool replay thread\n");
+		spool->thread = AST_PTHREADT_NULL;
+		return NULL;
+	}
+
+	return ao2_bump(spool);
+}
+
+/*! \brief Start, update or stop the spool to match the configuration. */
+static void setup_spool(void)
+{
+	RAII_VAR(struct cdr_kafka_conf *, conf, ao2_global_obj_ref(confs), ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_spool *, old, ao2_global_obj_ref(cdr_spool), ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_spool *, spool, NULL, ao2_cleanup);
+
+	if (conf && conf->global && conf->global->spool) {
+		if (old) {
+			/* Takes effect with the next segment */
+			ast_mutex_lock(&old->lock);
+			old->segment_size = conf->global->spool_segment_size;
+			old->replay_rate = conf->global->spool_replay_rate;
+			ast_mutex_unlock(&old->lock);
+			return;
+		}
+
+		spool = spool_alloc(conf->global);
+		if (!spool) {
+			ast_log(LOG_ERROR, "Failed to set up the CDR spool, CDRs Kafka does not take will be lost\n");
+			return;
+		}
+		ao2_global_obj_replace_unref(cdr_spool, spool);
+		return;
+	}
+
+	if (old) {
+		ao2_global_obj_release(cdr_spool);
+		spool_stop(old);
+	}
+}
+
+/*!
+ * \brief Hold back or resume replay of the current spool.
+ *
+ * Messages are still spooled while replay is held back.
+ */
+static void spool_hold(int hold)
+{
+	struct cdr_kafka_spool *spool = ao2_global_obj_ref(cdr_spool);
+
+	if (spool) {
+		__atomic_store_n(&spool->held, hold, __ATOMIC_RELAXED);
+		ao2_ref(spool, -1);
+	}
+}
+
+/*! \brief Stop and release the spool. Segments left are replayed on next start. */
+static void shutdown_spool(void)
+{
+	RAII_VAR(struct cdr_kafka_spool *, spool, ao2_global_obj_ref(cdr_spool), ao2_cleanup);
+
+	ao2_global_obj_release(cdr_spool);
+	if (spool) {
+		spool_stop(spool);
+	}
+}
+
+/*!
+ * \brief Spool a message Kafka did not take.
+ *
+ * \param hdrs The headers the message was, or would have been, sent with,
+ *        kept so that replay sends the same ones; NULL for none.
+ * \return 0 if the message was spooled.
+ * \return -1 if spooling is disabled or failed.
+ */
+static int spool_message(const char *key, const char *topic,
+	const struct ast_kafka_header *hdrs, size_t hdr_count, const char *payload, size_t len)
+{
+	struct cdr_kafka_spool *spool = ao2_global_obj_ref(cdr_spool);
+	struct cdr_kafka_buf headers = { NULL, };
+	int res;
+
+	if (!spool) {
+		return -1;
+	}
+
+	res = headers_pack(&headers, hdrs, hdr_count);
+	if (!res) {
+		res = spool_write(spool, key, topic, headers.data, headers.len, payload, len);
+	}
+	ast_free(headers.data);
+	ao2_ref(spool, -1);
+	if (!res) {
+		metrics_count(metrics_get(), CDR_KAFKA_COUNTER_SPOOLED, 1);
+	}
+
+	return res;
+}
+
+/*!
+ * \brief Delivery callback of pooled payloads, called on res_kafka's thread.
+ *
+ * Records the delivery latency, spools a message the broker never
+ * acknowledged if pool_produce() kept its key and topic, and recycles the
+ * buffer last, so unloading waits for this to finish.
+ */
+static void pool_delivered(void *payload, const struct ast_kafka_delivery *report,
+	void *userdata)
+{
+	struct cdr_kafka_pool_buf *pool_buf = userdata;
+	uint64_t elapsed = metrics_now() - pool_buf->produced_ns;
+	enum cdr_kafka_counter outcome = CDR_KAFKA_COUNTER_FAILED;
+	struct cdr_kafka_spool *spool;
+
+	if (report->result && pool_buf->respool && (spool = ao2_global_obj_ref(cdr_spool))) {
+		if (!spool_write(spool, pool_buf->keyed ? pool_buf->key : NULL, pool_buf->topic,
+			pool_buf->headers_len ? pool_buf->buf.data + pool_buf->buf.len : NULL,
+			pool_buf->headers_len, payload, pool_buf->buf.len)) {
+			outcome = CDR_KAFKA_COUNTER_SPOOLED;
+		}
+		ao2_ref(spool, -1);
+	}
+	if (report->result) {
+		ast_debug(1, "Kafka did not deliver a CDR: %s\n", S_OR(report->error, "unknown error"));
+	}
+
+	AST_LIST_LOCK(&metrics_threads);
+	if (report->result) {
+		metric_add(&metrics_reported.counters[CDR_KAFKA_COUNTER_DELIVERY_FAILED], 1);
+		metric_add(&metrics_reported.counters[outcome], 1);
+	} else {
+		metric_add(&metrics_reported.counters[CDR_KAFKA_COUNTER_DELIVERED], 1);
+		hist_record(&metrics_reported.stages[CDR_KAFKA_STAGE_DELIVERY], elapsed);
+	}
+	AST_LIST_UNLOCK(&metrics_threads);
+	if (pool_buf->trace_seq) {
+		trace_delivered(pool_buf->trace_seq, elapsed);
+	}
+
+	pool_release(pool_buf);
+}
+
+/*!
+ * \brief Publish the summary record of \a cdr to \c summary_topic.
+ *
+ * Encoded into the thread's encoder buffer, which the full payload never
+ * occupies here, and produced as a copy under the key and headers of the
+ * full record. Summaries only feed live consumers: one Kafka does not
+ * take is counted and dropped, never spooled.
+ */
+static void summary_publish(const struct cdr_kafka_snapshot *snap, struct ast_cdr *cdr,
+	const char *key, const struct ast_kafka_header *hdrs, size_t hdr_count,
+	struct cdr_kafka_metrics *metrics)
+{
+	const struct cdr_kafka_global_conf *global = snap->conf->global;
+	struct cdr_kafka_buf *buf;
+
+	if (!global->summary) {
+		return;
+	}
+
+	buf = encoder_buf_get();
+	if (!buf) {
+		metrics_count(metrics, CDR_KAFKA_COUNTER_SUMMARY_FAILED, 1);
+		return;
+	}
+	/* Nothing is cut from a summary */
+	if (hdr_count && hdrs[hdr_count - 1].name == global->header_block->truncated) {
+		hdr_count--;
+	}
+	buf->len = 0;
+	if (encode_cdr_plan(buf, global->summary, cdr, global->timestamps, NULL)
+		|| payload_compress(buf, 0, global)
+		|| snapshot_produce(snap, global->summary_topic, key, buf->data, buf->len,
+			hdrs, hdr_count)) {
+		metrics_count(metrics, CDR_KAFKA_COUNTER_SUMMARY_FAILED, 1);
+		return;
+	}
+	metrics_count(metrics, CDR_KAFKA_COUNTER_SUMMARIES, 1);
+}
+
+/*!
+ * \brief Serialize a CDR and hand it to the Kafka producer.
+ *
+ * The CDR is encoded into a pooled buffer that the producer takes over,
+ * so it is not copied again. A CDR the producer does not take is spooled
+ * if the spool is enabled, as is every CDR while the producer queue is
+ * above \c backpressure_high.
+ *
+ * \param cdr CDR to publish.
+ * \param trace Trace of the CDR, or NULL if it is not sampled.
+ * \return 0 on success.
+ * \return -1 on error.
+ */
+static int cdr_kafka_publish(struct ast_cdr *cdr, struct cdr_kafka_trace *trace)
+{
+	struct cdr_kafka_snapshot *snap;
+	struct cdr_kafka_metrics *metrics = metrics_get();
+	struct cdr_kafka_pool_buf *pool_buf;
+	struct cdr_kafka_cuts cuts;
+	char key_buf[CDR_KAFKA_KEY_LEN];
+	char topic_buf[CDR_KAFKA_TOPIC_LEN + 1];
+	char ts_str[32] = "";
+	char dedupe_str[CDR_KAFKA_DEDUPE_LEN];
+	struct ast_kafka_header hdr_buf[CDR_KAFKA_MAX_HEADERS];
+	const struct ast_kafka_header *hdrs = NULL;
+	size_t hdr_count = 0;
+	const char *key;
+	const char *topic;
+	uint64_t start = metrics_now();
+	int connected;
+	uint64_t ref_ns;
+	uint64_t now;
+	size_t len;
+	int encoded;
+	int res = -1;
+
+	snap = snapshot_get();
+	if (!snap) {
+		metrics_count(metrics, CDR_KAFKA_COUNTER_FAILED, 1);
+		return -1;
+	}
+
+	now = metrics_now();
+	ref_ns = now - start;
+
+	pool_buf = pool_get();
+	encoded = pool_buf ? encode_cdr_bounded(&pool_buf->buf, 0, snap->conf->global, cdr,
+		&cuts, &topic, trace) : -1;
+	if (encoded) {
+		if (pool_buf) {
+			pool_put(pool_buf);
+		}
+		if (encoded > 0) {
+			return 0;
+		}
+		metrics_count(metrics, CDR_KAFKA_COUNTER_ENCODE_FAILED, 1);
+		ast_log(LOG_ERROR, "Failed to build JSON for CDR\n");
+		return -1;
+	}
+	len = pool_buf->buf.len;
+	key = cdr_kafka_key(snap->conf->global, cdr, key_buf);
+	if (!topic) {
+		topic = cdr_kafka_topic(snap->conf->global, cdr, topic_buf);
+	}
+
+	start = now;
+	now = metrics_now();
+	metrics_time(metrics, CDR_KAFKA_STAGE_ENCODE, now - start);
+	metrics_payload(metrics, len);
+
+	connected = !snapshot_connect(&snap);
+
+	start = now;
+	now = metrics_now();
+	metrics_time(metrics, CDR_KAFKA_STAGE_REF, ref_ns + now - start);
+	if (trace) {
+		trace->spans[CDR_KAFKA_SPAN_REF] = ref_ns + now - start;
+		pool_buf->trace_seq = trace->seq;
+	}
+
+	if (connected && !snapshot_spooling(snap)) {
+		uint64_t headers_ns = 0;
+		uint64_t end;
+
+		hdrs = headers_get(snap->conf->global->header_block, hdr_buf, ts_str, dedupe_str, cdr,
+			cuts.keys, &hdr_count);
+		if (trace) {
+			headers_ns = metrics_now();
+			trace->spans[CDR_KAFKA_SPAN_HEADERS] = headers_ns - now;
+		}
+
+		/* Once taken, the buffer belongs to the producer */
+		res = snapshot_produce_owned(snap,
+			topic,
+			key,
+			pool_buf,
+			hdrs, hdr_count);
+		end = metrics_now();
+		metrics_time(metrics, CDR_KAFKA_STAGE_PRODUCE, end - now);
+		if (trace) {
+			trace->spans[CDR_KAFKA_SPAN_PRODUCE] = end - headers_ns;
+		}
+		if (!res) {
+			summary_publish(snap, cdr, key, hdrs, hdr_count, metrics);
+		}
+	}
+	if (trace) {
+		trace_publish(trace, key, topic, len, !res);
+	}
+
+	if (res != 0) {
+		if (!hdrs && snap) {
+			hdrs = headers_get(snap->conf->global->header_block, hdr_buf, ts_str, dedupe_str,
+				cdr, cuts.keys, &hdr_count);
+		}
+		res = spool_message(key, topic, hdrs, hdr_count, pool_buf->buf.data, len);
+		pool_put(pool_buf);
+		if (!res) {
+			ast_debug(1, "Spooled CDR Kafka did not take\n");
+			return 0;
+		}
+		metrics_count(metrics, CDR_KAFKA_COUNTER_FAILED, 1);
+		ast_log(LOG_ERROR, "Error publishing CDR to Kafka\n");
+		return -1;
+	}
+
+	metrics_count(metrics, CDR_KAFKA_COUNTER_PUBLISHED, 1);
+	metrics_count(metrics, CDR_KAFKA_COUNTER_BYTES, len);
+
+	return 0;
+}
+
+/*! \brief How long an idle publisher thread sleeps before re-checking. */
+#define CDR_KAFKA_QUEUE_IDLE_MS 100
+
+/*! \brief Back-off while waiting for room in a full queue. */
+#define CDR_KAFKA_QUEUE_BACKOFF_US 200
+
+/*!
+ * \brief A CDR copied for asynchronous publishing.
+ *
+ * The fixed part of the CDR is copied as is. The variables are rebuilt as
+ * \c ast_var_t entries in the same allocation, as is the trace of a
+ * sampled CDR, so a record is a single block that is released with
+ * ast_free().
+ */
+struct cdr_kafka_record {
+	struct ast_cdr cdr;
+	/*! \brief Copy of the CDR's trace, NULL if it is not sampled */
+	struct cdr_kafka_trace *trace;
+};
+
+/*!
+ * \brief Copy \a cdr into a self-contained record.
+ *
+ * \param trace Trace carried along with the record, or NULL.
+ */
+static struct cdr_kafka_record *record_alloc(const struct ast_cdr *cdr,
+	const struct cdr_kafka_trace *trace)
+{
+	struct cdr_kafka_record *record;
+	struct ast_var_t *var;
+	size_t size = sizeof(*record) + (trace ? sizeof(*trace) : 0);
+	char *pos;
+
+	AST_LIST_TRAVERSE(&cdr->varshead, var, entries) {
+		size = ast_align_for(size, struct ast_var_t);
+		size += sizeof(*var) + strlen(var->name) + strlen(var->value) + 2;
+	}
+
+	TEST_COUNT_ALLOCATION();
+	record = ast_malloc(size);
+	if (!record) {
+		return NULL;
+	}
+
+	memcpy(&record->cdr, cdr, sizeof(*cdr));
+	AST_LIST_HEAD_INIT_NOLOCK(&record->cdr.varshead);
+	record->cdr.next = NULL;
+	record->trace = NULL;
+
+	pos = (char *) (record + 1);
+	if (trace) {
+		record->trace = (struct cdr_kafka_trace *) pos;
+		memcpy(record->trace, trace, sizeof(*trace));
+		pos += sizeof(*trace);
+	}
+	AST_LIST_TRAVERSE(&cdr->varshead, var, entries) {
+		struct ast_var_t *copy;
+		size_t name_len = strlen(var->name) + 1;
+		size_t value_len = strlen(var->value) + 1;
+
+		pos = (char *) record + ast_align_for(pos - (char *) record, struct ast_var_t);
+		copy = (struct ast_var_t *) pos;
+		memset(copy, 0, sizeof(*copy));
+		memcpy(copy->name, var->name, name_len);
+		copy->value = copy->name + name_len;
+		memcpy(copy->value, var->value, value_len);
+		AST_LIST_INSERT_TAIL(&record->cdr.varshead, copy, entries);
+		pos = copy->value + value_len;
+	}
+
+	return record;
+}
+
+/*! \brief A slot of the async ring buffer. */
+struct cdr_kafka_queue_slot {
+	/*! \brief Position this slot is ready for (see queue_push()/queue_pop()) */
+	size_t sequence;
+	struct cdr_kafka_record *record;
+};
+
+/*!
+ * \brief Bounded lock-free ring of records.
+ *
+ * The ring is the array-based MPMC queue by Dmitry Vyukov: every slot
+ * carries a sequence number telling producers and consumers whose turn it
+ * is, so pushing and popping only take a compare-and-swap on the shared
+ * index. CDR threads push; the worker owning the ring pops, as does a CDR
+ * thread dropping the oldest record.
+ */
+struct cdr_kafka_ring {
+	/*! \brief Ring storage */
+	struct cdr_kafka_queue_slot *slots;
+	/*! \brief Ring capacity - 1 (capacity is a power of two) */
+	size_t mask;
+	/*! \brief Next position to push to */
+	size_t enqueue_pos __attribute__((aligned(CDR_KAFKA_CACHELINE)));
+	/*! \brief Next position to pop from */
+	size_t dequeue_pos __attribute__((aligned(CDR_KAFKA_CACHELINE)));
+};
+
+struct cdr_kafka_queue;
+
+/*! \brief A publisher thread and the rings only it publishes from. */
+struct cdr_kafka_worker {
+	/*! \brief A ring per priority class, only the first without priority rules */
+	struct cdr_kafka_ring rings[CDR_KAFKA_PRIORITY_COUNT];
+	/*! \brief Queue the worker belongs to */
+	struct cdr_kafka_queue *queue;
+	pthread_t thread;
+	/*! \brief Whether \c thread was started */
+	int started;
+	/*! \brief CPU the thread is pinned to, -1 for none */
+	int cpu;
+	/*! \brief Ring the thread is draining, see worker_pop() */
+	size_t lane;
+	/*! \brief Records still to take from \c lane before moving on */
+	unsigned int credit;
+	/*! \brief Guards \c cond */
+	ast_mutex_t lock;
+	/*! \brief Signalled when records arrive or the queue stops */
+	ast_cond_t cond;
+	/*! \brief 1 while the thread waits on \c cond */
+	unsigned int sleepers __attribute__((aligned(CDR_KAFKA_CACHELINE)));
+};
+
+/*!
+ * \brief The async queue: one ring and publisher thread per worker.
+ *
+ * Records are sharded over the workers by a hash of their Kafka key, or
+ * of their linkedid without one, so the records of a key are published in
+ * order by a single thread while different keys are spread over all of
+ * them.
+ *
+ * With priority rules every worker has a ring per class instead. The rings
+ * of a worker share its part of queue_size, so a full worker makes room by
+ * shedding its least important records first, and the thread takes
+ * \c weights records from each class in turn.
+ */
+struct cdr_kafka_queue {
+	/*! \brief Cache line aligned array of \c worker_count workers */
+	struct cdr_kafka_worker *workers;
+	size_t worker_count;
+	/*! \brief queue_size the rings were sized for */
+	unsigned int queue_size;
+	/*! \brief Rings per worker: 1, or one per priority class */
+	size_t lanes;
+	/*! \brief Records taken from each class in turn */
+	unsigned int weights[CDR_KAFKA_PRIORITY_COUNT];
+	/*! \brief What to do when a ring is full */
+	enum cdr_kafka_overflow overflow;
+	/*! \brief Maximum records per batch */
+	unsigned int batch_size;
+	/*! \brief How long a partial batch waits for more records */
+	unsigned int batch_linger_ms;
+	/*! \brief publisher_cpus the workers were pinned with */
+	char *cpus;
+	/*!
+	 * \brief Keeps the counters below off the cache line of the settings above.
+	 *
+	 * Padding rather than an aligned member, since ao2 objects are only
+	 * aligned for their header, and an over-aligned member lets the
+	 * compiler use aligned vector stores on a misaligned object.
+	 */
+	char pad[CDR_KAFKA_CACHELINE];
+	/*! \brief CDR threads currently pushing */
+	unsigned int producers;
+	/*! \brief Set once the queue stops accepting records */
+	int stopping;
+	/*! \brief Records discarded because the queue was full */
+	unsigned int dropped;
+};
+
+static int ring_push(struct cdr_kafka_ring *ring, struct cdr_kafka_record *record)
+{
+	struct cdr_kafka_queue_slot *slot;
+	size_t pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+
+	for (;;) {
+		size_t seq;
+		intptr_t diff;
+
+		slot = &ring->slots[pos & ring->mask];
+		seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		diff = (intptr_t) seq - (intptr_t) pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->record = record;
+	__atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*! \return The oldest record, or NULL if the ring is empty. */
+static struct cdr_kafka_record *ring_pop(struct cdr_kafka_ring *ring)
+{
+	struct cdr_kafka_queue_slot *slot;
+	struct cdr_kafka_record *record;
+	size_t pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+
+	for (;;) {
+		size_t seq;
+		intptr_t diff;
+
+		slot = &ring->slots[pos & ring->mask];
+		seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		diff = (intptr_t) seq - (intptr_t) (pos + 1);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ring->dequeue_pos, &pos, pos + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	record = slot->record;
+	__atomic_store_n(&slot->sequence, pos + ring->mask + 1, __ATOMIC_RELEASE);
+	return record;
+}
+
+static int ring_empty(struct cdr_kafka_ring *ring)
+{
+	size_t pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_SEQ_CST);
+
+	return __atomic_load_n(&ring->slots[pos & ring->mask].sequence,
+		__ATOMIC_SEQ_CST) != pos + 1;
+}
+
+/*! \brief Number of records waiting in \a ring. */
+static size_t ring_depth(struct cdr_kafka_ring *ring)
+{
+	size_t dequeued = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+	size_t enqueued = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+
+	return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
+/*! \brief Wake the worker if it is sleeping. */
+static void worker_wake(struct cdr_kafka_worker *worker)
+{
+	/* Pairs with the sleepers increment in worker_wait() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&worker->sleepers, __ATOMIC_SEQ_CST)) {
+		ast_mutex_lock(&worker->lock);
+		ast_cond_signal(&worker->cond);
+		ast_mutex_unlock(&worker->lock);
+	}
+}
+
+/*! \brief Whether all rings of \a worker are empty. */
+static int worker_idle(struct cdr_kafka_worker *worker)
+{
+	size_t i;
+
+	for (i = 0; i < worker->queue->lanes; i++) {
+		if (!ring_empty(&worker->rings[i])) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*! \brief Records waiting on all rings of \a worker. */
+static size_t worker_depth(struct cdr_kafka_worker *worker)
+{
+	size_t depth = 0;
+	size_t i;
+
+	for (i = 0; i < worker->queue->lanes; i++) {
+		depth += ring_depth(&worker->rings[i]);
+	}
+
+	return depth;
+}
+
+/*!
+ * \brief Pop the next record for the thread of \a worker to publish.
+ *
+ * Takes up to \c weights records from each priority class in turn,
+ * moving on early when a class runs out, so a busy high class cannot
+ * starve the others and an idle one does not hold them up.
+ *
+ * \return The record, or NULL if all rings are empty.
+ */
+static struct cdr_kafka_record *worker_pop(struct cdr_kafka_worker *worker)
+{
+	struct cdr_kafka_queue *queue = worker->queue;
+	struct cdr_kafka_record *record;
+	size_t i;
+
+	if (queue->lanes == 1) {
+		return ring_pop(&worker->rings[0]);
+	}
+
+	/* One more turn than classes, so every ring is tried with fresh credit */
+	for (i = 0; i <= queue->lanes; i++) {
+		if (worker->credit && (record = ring_pop(&worker->rings[worker->lane]))) {
+			worker->credit--;
+			return record;
+		}
+		worker->lane = (worker->lane + 1) % queue->lanes;
+		worker->credit = queue->weights[worker->lane];
+	}
+
+	return NULL;
+}
+
+/*! \brief Sleep up to \a ms milliseconds unless records are waiting. */
+static void worker_wait(struct cdr_kafka_worker *worker, unsigned int ms)
+{
+	ast_mutex_lock(&worker->lock);
+	__atomic_add_fetch(&worker->sleepers, 1, __ATOMIC_SEQ_CST);
+	if (worker_idle(worker)
+		&& !__atomic_load_n(&worker->queue->stopping, __ATOMIC_SEQ_CST)) {
+		struct timeval tv = ast_tvadd(ast_tvnow(), ast_samp2tv(ms, 1000));
+		struct timespec ts = {
+			.tv_sec = tv.tv_sec,
+			.tv_nsec = tv.tv_usec * 1000,
+		};
+
+		ast_cond_timedwait(&worker->cond, &worker->lock, &ts);
+	}
+	__atomic_sub_fetch(&worker->sleepers, 1, __ATOMIC_SEQ_CST);
+	ast_mutex_unlock(&worker->lock);
+}
+
+/*!
+ * \brief Serialize a CDR straight into the spool.
+ *
+ * \return 0 if the CDR was spooled.
+ * \return -1 if spooling is disabled or failed.
+ */
+static int spool_cdr(struct ast_cdr *cdr)
+{
+	struct cdr_kafka_snapshot *snap = snapshot_get();
+	struct cdr_kafka_buf *buf = encoder_buf_get();
+	const struct cdr_kafka_global_conf *global;
+	struct cdr_kafka_cuts cuts;
+	char key[CDR_KAFKA_KEY_LEN];
+	char topic[CDR_KAFKA_TOPIC_LEN + 1];
+	char ts_str[32] = "";
+	char dedupe_str[CDR_KAFKA_DEDUPE_LEN];
+	struct ast_kafka_header hdr_buf[CDR_KAFKA_MAX_HEADERS];
+	const struct ast_kafka_header *hdrs;
+	const char *oversize;
+	size_t hdr_count;
+	int res;
+
+	if (!snap || !buf) {
+		return -1;
+	}
+	global = snap->conf->global;
+
+	buf->len = 0;
+	res = encode_cdr_bounded(buf, 0, global, cdr, &cuts, &oversize, NULL);
+	if (res) {
+		/* Dropped as oversized, or failed */
+		return res > 0 ? 0 : -1;
+	}
+
+	hdrs = headers_get(global->header_block, hdr_buf, ts_str, dedupe_str, cdr, cuts.keys,
+		&hdr_count);
+	return spool_message(cdr_kafka_key(global, cdr, key),
+		oversize ? oversize : cdr_kafka_topic(global, cdr, topic), hdrs, hdr_count,
+		buf->data, buf->len);
+}
+
+/*!
+ * \brief Worker that publishes \a cdr.
+ *
+ * The Kafka key is hashed, or the linkedid for CDRs without one, so every
+ * record of a key goes to the same worker and stays in order.
+ */
+static size_t queue_shard(const struct cdr_kafka_queue *queue, struct ast_cdr *cdr)
+{
+	struct cdr_kafka_snapshot *snap;
+	char key_buf[CDR_KAFKA_KEY_LEN];
+	const char *key = NULL;
+
+	if (queue->worker_count == 1) {
+		return 0;
+	}
+
+	snap = snapshot_get();
+	if (snap) {
+		key = cdr_kafka_key(snap->conf->global, cdr, key_buf);
+	}
+	if (ast_strlen_zero(key)) {
+		key = cdr->linkedid;
+	}
+
+	return murmur2(key, strlen(key)) % queue->worker_count;
+}
+
+/*! \brief Whether the producer queue is past \c backpressure_high. */
+static int queue_pressured(void)
+{
+	struct cdr_kafka_snapshot *snap = snapshot_get();
+
+	return snap && snap->conf->global->backpressure_high
+		&& snapshot_pressure(snap) == CDR_KAFKA_PRESSURE_SPOOL;
+}
+
+/*! \brief Count a record discarded because the queue had no room. */
+static void queue_dropped(struct cdr_kafka_queue *queue)
+{
+	unsigned int dropped = __atomic_add_fetch(&queue->dropped, 1, __ATOMIC_RELAXED);
+
+	metrics_count(metrics_get(), CDR_KAFKA_COUNTER_DROPPED, 1);
+	if (dropped == 1 || !(dropped % 1000)) {
+		ast_log(LOG_WARNING, "CDR Kafka queue full, %u records dropped\n", dropped);
+	}
+}
+
+/*!
+ * \brief Push \a record onto ring \a lane of \a worker.
+ *
+ * With priority rules the rings of a worker are full together, once they
+ * hold its share of queue_size.
+ *
+ * \return 0 on success, -1 if the worker is full.
+ */
+static int queue_push(struct cdr_kafka_queue *queue, struct cdr_kafka_worker *worker,
+	size_t lane, struct cdr_kafka_record *record)
+{
+	if (queue->lanes > 1 && worker_depth(worker) > worker->rings[0].mask) {
+		return -1;
+	}
+
+	return ring_push(&worker->rings[lane], record);
+}
+
+/*!
+ * \brief Make room on a full \a worker for \a record of class \a lane.
+ *
+ * Sheds the oldest record of the least important class below \a lane
+ * that has any, or with drop_oldest of \a lane too. When all queued
+ * records rank above that, \a record itself is shed. Shed records are
+ * spooled with overflow = spool and dropped otherwise, or when the spool
+ * refuses them.
+ *
+ * \return 0 if a queued record was shed and the push can be retried.
+ * \return 1 if \a record was shed.
+ */
+static int queue_shed(struct cdr_kafka_queue *queue, struct cdr_kafka_worker *worker,
+	size_t lane, struct cdr_kafka_record *record)
+{
+	size_t last = queue->overflow == CDR_KAFKA_OVERFLOW_DROP_OLDEST ? lane : lane + 1;
+	struct cdr_kafka_record *victim = NULL;
+	size_t i = queue->lanes;
+	int spooled;
+	int self;
+
+	while (!victim && i-- > last) {
+		victim = ring_pop(&worker->rings[i]);
+	}
+	if (!victim) {
+		victim = record;
+		i = lane;
+	}
+	self = victim == record;
+
+	spooled = queue->overflow == CDR_KAFKA_OVERFLOW_SPOOL && !spool_cdr(&victim->cdr);
+	if (!spooled) {
+		/* Waiting on a full or failing spool would stall the CDR thread */
+		queue_dropped(queue);
+	}
+	metrics_count(metrics_get(), CDR_KAFKA_COUNTER_SHED_HIGH + i, 1);
+	ast_free(victim);
+
+	return self;
+}
+
+/*!
+ * \brief Queue a copy of \a cdr for its publisher thread.
+ *
+ * \param priority Class of \a cdr, see priorities_class().
+ * \param trace Trace of \a cdr, copied into the record, or NULL.
+ * \return 0 if the record was queued (or dropped or spooled by policy).
+ * \return 1 if the queue is stopping and the caller must publish itself.
+ * \return -1 on error.
+ */
+static int queue_enqueue(struct cdr_kafka_queue *queue, struct ast_cdr *cdr,
+	enum cdr_kafka_priority priority, struct cdr_kafka_trace *trace)
+{
+	struct cdr_kafka_record *record;
+	struct cdr_kafka_worker *worker;
+	size_t lane = queue->lanes > 1 ? priority : 0;
+
+	if (trace) {
+		trace->queued_ns = metrics_now();
+	}
+	record = record_alloc(cdr, trace);
+	if (!record) {
+		return -1;
+	}
+	worker = &queue->workers[queue_shard(queue, cdr)];
+
+	/* Pairs with queue_stop(): either we see stopping, or the publisher
+	 * threads see us in flight and keep draining */
+	__atomic_add_fetch(&queue->producers, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&queue->stopping, __ATOMIC_SEQ_CST)) {
+		__atomic_sub_fetch(&queue->producers, 1, __ATOMIC_SEQ_CST);
+		ast_free(record);
+		return 1;
+	}
+
+	/* Keep the producer queue for the classes above while it is backed up */
+	if (lane == CDR_KAFKA_PRIORITY_LOW && queue_pressured()) {
+		if (spool_cdr(&record->cdr)) {
+			queue_dropped(queue);
+		}
+		metrics_count(metrics_get(), CDR_KAFKA_COUNTER_SHED_LOW, 1);
+		ast_free(record);
+		record = NULL;
+	}
+
+	while (record && queue_push(queue, worker, lane, record)) {
+		if (queue->lanes > 1 && queue->overflow != CDR_KAFKA_OVERFLOW_BLOCK) {
+			if (queue_shed(queue, worker, lane, record)) {
+				break;
+			}
+			continue;
+		} else if (queue->overflow == CDR_KAFKA_OVERFLOW_SPOOL) {
+			if (spool_cdr(&record->cdr)) {
+				/* Waiting for a full or failing spool would stall the CDR thread */
+				queue_dropped(queue);
+			}
+			ast_free(record);
+			break;
+		} else if (queue->overflow == CDR_KAFKA_OVERFLOW_DROP_OLDEST) {
+			struct cdr_kafka_record *oldest = ring_pop(&worker->rings[0]);
+
+			if (oldest) {
+				queue_dropped(queue);
+				ast_free(oldest);
+			}
+			continue;
+		}
+
+		worker_wake(worker);
+		usleep(CDR_KAFKA_QUEUE_BACKOFF_US);
+	}
+
+	__atomic_sub_fetch(&queue->producers, 1, __ATOMIC_SEQ_CST);
+	worker_wake(worker);
+	return 0;
+}
+
+/*!
+ * \brief Records popped by a publisher thread and the messages built from them.
+ *
+ * All payloads of a batch are encoded back to back into \c buf, followed
+ * by their composite key and expanded topic if there are any. \c offsets,
+ * \c key_offsets and \c topic_offsets remember where each one starts
+ * until the buffer stops growing.
+ */
+struct cdr_kafka_batch {
+	struct cdr_kafka_record **records;
+	struct ast_kafka_message *messages;
+	size_t *offsets;
+	/*! \brief SIZE_MAX when the key is not stored in \c buf */
+	size_t *key_offsets;
+	/*! \brief SIZE_MAX when the topic is not stored in \c buf */
+	size_t *topic_offsets;
+	/*! \brief Members cut from each payload, SIZE_MAX when none were */
+	size_t *cut_offsets;
+	/*! \brief Topic of each message */
+	const char **topics;
+	/*! \brief Partition of each message with partitioner = murmur2 */
+	int32_t *partitions;
+	/*! \brief Messages for one topic and partition when the batch spans several */
+	struct ast_kafka_message *group;
+	/*! \brief Message each entry of \c group was copied from */
+	size_t *group_indices;
+	/*! \brief Whether a message was put in a group already */
+	char *grouped;
+	/*! \brief Whether any connection took a message, for fanout */
+	char *taken;
+	/*! \brief Record each message was encoded from */
+	size_t *indices;
+	/*! \brief CDR_KAFKA_MAX_HEADERS headers per message */
+	struct ast_kafka_header *headers;
+	/*! \brief Dedupe ID header value of each message, CDR_KAFKA_DEDUPE_LEN bytes apart */
+	char *dedupe_ids;
+	/*! \brief Maximum number of records */
+	size_t capacity;
+	struct cdr_kafka_buf buf;
+};
+
+static int batch_init(struct cdr_kafka_batch *batch, size_t capacity)
+{
+	batch->records = ast_calloc(capacity, sizeof(*batch->records));
+	batch->messages = ast_calloc(capacity, sizeof(*batch->messages));
+	batch->offsets = ast_calloc(capacity, sizeof(*batch->offsets));
+	batch->key_offsets = ast_calloc(capacity, sizeof(*batch->key_offsets));
+	batch->topic_offsets = ast_calloc(capacity, sizeof(*batch->topic_offsets));
+	batch->cut_offsets = ast_calloc(capacity, sizeof(*batch->cut_offsets));
+	batch->topics = ast_calloc(capacity, sizeof(*batch->topics));
+	batch->partitions = ast_calloc(capacity, sizeof(*batch->partitions));
+	batch->group = ast_calloc(capacity, sizeof(*batch->group));
+	batch->group_indices = ast_calloc(capacity, sizeof(*batch->group_indices));
+	batch->grouped = ast_calloc(capacity, sizeof(*batch->grouped));
+	batch->taken = ast_calloc(capacity, sizeof(*batch->taken));
+	batch->indices = ast_calloc(capacity, sizeof(*batch->indices));
+	batch->headers = ast_calloc(capacity * CDR_KAFKA_MAX_HEADERS, sizeof(*batch->headers));
+	batch->dedupe_ids = ast_calloc(capacity, CDR_KAFKA_DEDUPE_LEN);
+	if (!batch->records || !batch->messages || !batch->offsets || !batch->key_offsets
+		|| !batch->topic_offsets || !batch->cut_offsets || !batch->topics || !batch->partitions || !batch->group
+		|| !batch->group_indices || !batch->grouped || !batch->taken
+		|| !batch->indices || !batch->headers || !batch->dedupe_ids) {
+		return -1;
+	}
+	batch->capacity = capacity;
+
+	return 0;
+}
+
+static void batch_destroy(struct cdr_kafka_batch *batch)
+{
+	ast_free(batch->records);
+	ast_free(batch->messages);
+	ast_free(batch->offsets);
+	ast_free(batch->key_offsets);
+	ast_free(batch->topic_offsets);
+	ast_free(batch->cut_offsets);
+	ast_free(batch->topics);
+	ast_free(batch->partitions);
+	ast_free(batch->group);
+	ast_free(batch->group_indices);
+	ast_free(batch->grouped);
+	ast_free(batch->taken);
+	ast_free(batch->indices);
+	ast_free(batch->headers);
+	ast_free(batch->dedupe_ids);
+	ast_free(batch->buf.data);
+}
+
+/*!
+ * \brief Pick the partition of every message of a batch for \a producer.
+ *
+ * Partition counts can differ between connections, so this is done per
+ * producer. Consecutive messages usually share their topic, which is then
+ * looked up once.
+ */
+static void batch_partition(struct ast_kafka_producer *producer,
+	struct cdr_kafka_batch *batch, size_t count)
+{
+	const char *topic = NULL;
+	int partitions = -1;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		const char *key = batch->messages[i].key;
+
+		if (!topic || (batch->topics[i] != topic && strcmp(batch->topics[i], topic))) {
+			topic = batch->topics[i];
+			partitions = partition_count(producer, topic);
+		}
+		batch->partitions[i] = key && partitions > 0
+			? key_partition(key, partitions) : AST_KAFKA_PARTITION_ANY;
+	}
+}
+
+/*!
+ * \brief Produce the messages of a batch with one call per topic, and
+ *        per partition if \a partitioned.
+ *
+ * Messages keep their order within each topic and partition.
+ *
+ * \return The number of messages enqueued.
+ */
+static size_t batch_produce_groups(struct ast_kafka_producer *producer,
+	struct cdr_kafka_batch *batch, size_t count, int partitioned)
+{
+	size_t sent = 0;
+	size_t i;
+	size_t j;
+
+	memset(batch->grouped, 0, count);
+	for (i = 0; i < count; i++) {
+		const char *topic = batch->topics[i];
+		int32_t partition = partitioned ? batch->partitions[i] : AST_KAFKA_PARTITION_ANY;
+		size_t group = 0;
+
+		if (batch->grouped[i]) {
+			continue;
+		}
+
+		for (j = i; j < count; j++) {
+			if (!batch->grouped[j]
+				&& (!partitioned || batch->partitions[j] == partition)
+				&& (batch->topics[j] == topic || !strcmp(batch->topics[j], topic))) {
+				batch->grouped[j] = 1;
+				batch->group_indices[group] = j;
+				batch->group[group++] = batch->messages[j];
+			}
+		}
+		if (group == count) {
+			/* Everything went to the same place after all */
+			return produce_batch_partition(producer, topic, partition, batch->messages, count);
+		}
+
+		sent += produce_batch_partition(producer, topic, partition, batch->group, group);
+		for (j = 0; j < group; j++) {
+			batch->messages[batch->group_indices[j]].result = batch->group[j].result;
+		}
+	}
+
+	return sent;
+}
+
+/*! \brief Produce the messages of a batch through one producer. */
+static size_t batch_send(struct ast_kafka_producer *producer,
+	const struct cdr_kafka_global_conf *global, struct cdr_kafka_batch *batch, size_t count)
+{
+	if (global->partitioner == CDR_KAFKA_PARTITIONER_MURMUR2) {
+		batch_partition(producer, batch, count);
+		return batch_produce_groups(producer, batch, count, 1);
+	}
+	if (global->topics->dynamic) {
+		return batch_produce_groups(producer, batch, count, 0);
+	}
+
+	return produce_batch(producer, global->topic, batch->messages, count);
+}
+
+/*!
+ * \brief Produce the messages of a batch through the connections of a snapshot.
+ *
+ * With failover, the messages the connection in use does not take are
+ * retried one by one on the other usable connections in turn. With fanout, a
+ * message counts as sent once any connection took it.
+ *
+ * \return The number of messages enqueued.
+ */
+static size_t snapshot_produce_batch(const struct cdr_kafka_snapshot *snap,
+	struct cdr_kafka_batch *batch, size_t count)
+{
+	const struct cdr_kafka_global_conf *global = snap->conf->global;
+	uint64_t now;
+	size_t sent = 0;
+	unsigned int tried;
+	unsigned int i;
+	int fallback;
+	size_t j;
+
+	if (!snapshot_failover(snap)) {
+		if (snap->connection_count == 1) {
+			return batch_send(snap->producers[0], global, batch, count);
+		}
+
+		memset(batch->taken, 0, count);
+		for (i = 0; i < snap->connection_count; i++) {
+			if (!snap->producers[i]) {
+				continue;
+			}
+			sent = batch_send(snap->producers[i], global, batch, count);
+			if (sent < count) {
+				link_fanout_failed(snap, i, count - sent);
+			}
+			for (j = 0; j < count; j++) {
+				batch->taken[j] |= !batch->messages[j].result;
+				batch->messages[j].result = -1;
+			}
+		}
+		sent = 0;
+		for (j = 0; j < count; j++) {
+			batch->messages[j].result = batch->taken[j] ? 0 : -1;
+			sent += batch->taken[j];
+		}
+		return sent;
+	}
+
+	now = metrics_now();
+	i = links_pick(snap, now);
+	if (!snap->producers[i]) {
+		return 0;
+	}
+	sent = batch_send(snap->producers[i], global, batch, count);
+	link_report(snap, i, sent, count - sent, now);
+	tried = 1U << i;
+	while (sent < count && (fallback = links_fallback(snap, tried, now)) >= 0) {
+		size_t retried = 0;
+		size_t taken = 0;
+
+		tried |= 1U << fallback;
+
+		for (j = 0; j < count; j++) {
+			struct ast_kafka_message *message = &batch->messages[j];
+
+			if (!message->result) {
+				continue;
+			}
+			message->result = message_produce(global, snap->producers[fallback],
+				batch->topics[j], message->key, message->payload, message->len,
+				message->headers, message->header_count);
+			retried++;
+			taken += !message->result;
+		}
+		link_report(snap, fallback, taken, retried - taken, now);
+		sent += taken;
+	}
+
+	return sent;
+}
+
+/*!
+ * \brief Produce the messages of a batch one by one, with delivery reports.
+ *
+ * Used instead of snapshot_produce_batch() when the spool is enabled:
+ * the batch calls copy the payloads and report nothing back, so a message
+ * the broker finally failed could not be spooled.
+ *
+ * \return The number of messages enqueued.
+ */
+static size_t snapshot_produce_batch_reported(const struct cdr_kafka_snapshot *snap,
+	struct cdr_kafka_batch *batch, size_t count)
+{
+	size_t sent = 0;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		struct ast_kafka_message *message = &batch->messages[i];
+
+		message->result = snapshot_produce_reported(snap, batch->topics[i], message->key,
+			message->payload, message->len, message->headers, message->header_count);
+		sent += !message->result;
+	}
+
+	return sent;
+}
+
+/*!
+ * \brief Serialize the records of a batch and produce them in one call
+ *        per topic.
+ *
+ * With the spool enabled they are produced one by one instead, each with
+ * a delivery report.
+ *
+ * \param batch Batch holding the records.
+ * \param count Number of records in the batch.
+ * \return 0 on success.
+ * \return -1 if any record could not be published.
+ */
+static int publish_batch(struct cdr_kafka_batch *batch, size_t count)
+{
+	struct cdr_kafka_snapshot *snap;
+	RAII_VAR(struct cdr_kafka_conf *, encoded_conf, NULL, ao2_cleanup);
+	struct cdr_kafka_global_conf *global;
+	struct cdr_kafka_metrics *metrics = metrics_get();
+	uint64_t start = metrics_now();
+	uint64_t ref_ns;
+	uint64_t now;
+	char ts_str[32] = "";
+	int connected = 0;
+	size_t failed = 0;
+	size_t sent;
+	size_t n = 0;
+	size_t i;
+
+	snap = snapshot_get();
+	if (!snap) {
+		metrics_count(metrics, CDR_KAFKA_COUNTER_FAILED, count);
+		return -1;
+	}
+	global = snap->conf->global;
+
+	now = metrics_now();
+	ref_ns = now - start;
+
+	batch->buf.len = 0;
+	for (i = 0; i < count; i++) {
+		struct ast_cdr *cdr = &batch->records[i]->cdr;
+		size_t start = batch->buf.len;
+		char key_buf[CDR_KAFKA_KEY_LEN];
+		char topic_buf[CDR_KAFKA_TOPIC_LEN + 1];
+		struct cdr_kafka_cuts cuts;
+		const char *oversize;
+		const char *key;
+		const char *topic;
+		int encoded;
+
+		encoded = encode_cdr_bounded(&batch->buf, start, global, cdr, &cuts, &oversize,
+			batch->records[i]->trace);
+		if (encoded) {
+			failed += encoded < 0;
+			continue;
+		}
+		batch->offsets[n] = start;
+		batch->indices[n] = i;
+		batch->messages[n].len = batch->buf.len - start;
+		metrics_payload(metrics, batch->messages[n].len);
+
+		key = cdr_kafka_key(global, cdr, key_buf);
+		if (key == key_buf) {
+			batch->key_offsets[n] = batch->buf.len;
+			if (buf_append(&batch->buf, key_buf, strlen(key_buf) + 1)) {
+				batch->buf.len = start;
+				failed++;
+				continue;
+			}
+		} else {
+			batch->key_offsets[n] = SIZE_MAX;
+			batch->messages[n].key = key;
+		}
+
+		if (cuts.len) {
+			batch->cut_offsets[n] = batch->buf.len;
+			if (buf_append(&batch->buf, cuts.keys, cuts.len + 1)) {
+				batch->buf.len = start;
+				failed++;
+				continue;
+			}
+		} else {
+			batch->cut_offsets[n] = SIZE_MAX;
+		}
+
+		topic = oversize ? oversize : cdr_kafka_topic(global, cdr, topic_buf);
+		if (topic == topic_buf) {
+			batch->topic_offsets[n] = batch->buf.len;
+			if (buf_append(&batch->buf, topic_buf, strlen(topic_buf) + 1)) {
+				batch->buf.len = start;
+				failed++;
+				continue;
+			}
+		} else {
+			batch->topic_offsets[n] = SIZE_MAX;
+			batch->topics[n] = topic;
+		}
+		n++;
+	}
+	if (failed) {
+		metrics_count(metrics, CDR_KAFKA_COUNTER_ENCODE_FAILED, failed);
+		ast_log(LOG_ERROR, "Failed to build JSON for %zu CDRs\n", failed);
+	}
+
+	start = now;
+	now = metrics_now();
+	if (count) {
+		/* Per record, to be comparable with unbatched publishing */
+		metrics_time(metrics, CDR_KAFKA_STAGE_ENCODE, (now - start) / count);
+	}
+
+	if (n && snap->connected < snap->connection_count) {
+		/* Topics may point into the configuration that is about to be replaced */
+		encoded_conf = ao2_bump(snap->conf);
+	}
+	if (n) {
+		connected = !snapshot_connect(&snap);
+	}
+	if (connected) {
+		/* The snapshot is replaced if it was missing producers */
+		global = snap->conf->global;
+	}
+
+	/* The buffer may have moved while growing, so point into it only now */
+	for (i = 0; i < n; i++) {
+		struct cdr_kafka_trace *trace = batch->records[batch->indices[i]]->trace;
+		const struct ast_kafka_header *hdrs = NULL;
+		uint64_t headers_ns = trace ? metrics_now() : 0;
+		size_t hdr_count;
+
+		batch->messages[i].payload = batch->buf.data + batch->offsets[i];
+		if (batch->key_offsets[i] != SIZE_MAX) {
+			batch->messages[i].key = batch->buf.data + batch->key_offsets[i];
+		}
+		if (batch->topic_offsets[i] != SIZE_MAX) {
+			batch->topics[i] = batch->buf.data + batch->topic_offsets[i];
+		}
+		if (i && !global->header_block->per_cdr) {
+			/* Same headers for the whole batch */
+			hdrs = batch->messages[0].headers;
+			hdr_count = batch->messages[0].header_count;
+		} else {
+			hdrs = headers_get(global->header_block,
+				&batch->headers[i * CDR_KAFKA_MAX_HEADERS], ts_str,
+				&batch->dedupe_ids[i * CDR_KAFKA_DEDUPE_LEN],
+				&batch->records[batch->indices[i]]->cdr,
+				batch->cut_offsets[i] != SIZE_MAX ? batch->buf.data + batch->cut_offsets[i] : NULL,
+				&hdr_count);
+		}
+		batch->messages[i].headers = hdrs;
+		batch->messages[i].header_count = hdr_count;
+		batch->messages[i].result = -1;
+		if (trace) {
+			trace->spans[CDR_KAFKA_SPAN_HEADERS] = metrics_now() - headers_ns;
+		}
+	}
+
+	start = now;
+	now = metrics_now();
+	ref_ns += now - start;
+	metrics_time(metrics, CDR_KAFKA_STAGE_REF, ref_ns);
+
+	if (connected && !snapshot_spooling(snap)) {
+		sent = global->spool ? snapshot_produce_batch_reported(snap, batch, n)
+			: snapshot_produce_batch(snap, batch, n);
+		start = now;
+		now = metrics_now();
+		metrics_time(metrics, CDR_KAFKA_STAGE_PRODUCE, now - start);
+	} else {
+		sent = 0;
+		start = now;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct cdr_kafka_trace *trace = batch->records[batch->indices[i]]->trace;
+
+		if (trace) {
+			/* Taking the snapshot and producing are shared by the whole batch */
+			trace->spans[CDR_KAFKA_SPAN_REF] = ref_ns;
+			trace->spans[CDR_KAFKA_SPAN_PRODUCE] = now - start;
+			trace_publish(trace, batch->messages[i].key, batch->topics[i],
+				batch->messages[i].len, !batch->messages[i].result);
+		}
+		if (!batch->messages[i].result) {
+			metrics_count(metrics, CDR_KAFKA_COUNTER_BYTES, batch->messages[i].len);
+			summary_publish(snap, &batch->records[batch->indices[i]]->cdr,
+				batch->messages[i].key, batch->messages[i].headers,
+				batch->messages[i].header_count, metrics);
+		}
+	}
+	metrics_count(metrics, CDR_KAFKA_COUNTER_PUBLISHED, sent);
+
+	if (sent < n) {
+		size_t lost = 0;
+
+		for (i = 0; i < n; i++) {
+			if (batch->messages[i].result && spool_message(batch->messages[i].key,
+				batch->topics[i], batch->messages[i].headers, batch->messages[i].header_count,
+				batch->messages[i].payload, batch->messages[i].len)) {
+				lost++;
+			}
+		}
+		metrics_count(metrics, CDR_KAFKA_COUNTER_FAILED, lost);
+		if (lost) {
+			ast_log(LOG_ERROR, "Error publishing %zu of %zu CDRs to Kafka\n", lost, n);
+			return -1;
+		}
+		ast_debug(1, "Spooled %zu of %zu CDRs Kafka did not take\n", n - sent, n);
+	}
+
+	return failed ? -1 : 0;
+}
+
+/*!
+ * \brief How long a partial batch may wait to fill.
+ *
+ * With backpressure watermarks set, batches only linger once the producer
+ * queue is above \c backpressure_low; below it records already queued are
+ * published at once.
+ */
+static unsigned int queue_linger(const struct cdr_kafka_queue *queue)
+{
+	struct cdr_kafka_snapshot *snap;
+
+	if (!queue->batch_linger_ms) {
+		return 0;
+	}
+	snap = snapshot_get();
+	if (snap && (snap->conf->global->backpressure_low || snap->conf->global->backpressure_high)
+		&& snapshot_pressure(snap) == CDR_KAFKA_PRESSURE_NONE) {
+		return 0;
+	}
+
+	return queue->batch_linger_ms;
+}
+
+/*!
+ * \brief Pop up to \a batch->capacity records off the rings of \a worker.
+ *
+ * Once the first record is in, waits up to the linger time for the batch
+ * to fill. A stopping queue is drained without lingering.
+ *
+ * \return Number of records popped.
+ */
+static size_t worker_collect(struct cdr_kafka_worker *worker, struct cdr_kafka_batch *batch)
+{
+	struct cdr_kafka_queue *queue = worker->queue;
+	struct timeval deadline = { 0, };
+	unsigned int linger = 0;
+	size_t count = 0;
+
+	while (count < batch->capacity) {
+		int64_t remaining;
+
+		batch->records[count] = worker_pop(worker);
+		if (batch->records[count]) {
+			if (!count++ && batch->capacity > 1 && (linger = queue_linger(queue))) {
+				deadline = ast_tvadd(ast_tvnow(), ast_samp2tv(linger, 1000));
+			}
+			continue;
+		}
+
+		if (!count || !linger
+			|| __atomic_load_n(&queue->stopping, __ATOMIC_SEQ_CST)) {
+			break;
+		}
+		remaining = ast_tvdiff_ms(deadline, ast_tvnow());
+		if (remaining <= 0) {
+			break;
+		}
+		worker_wait(worker, remaining);
+	}
+
+	return count;
+}
+
+/*! \brief Publish and release the \a count collected records, keeping their traces. */
+static void batch_publish(struct cdr_kafka_batch *batch, size_t count)
+{
+	uint64_t now = 0;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		struct cdr_kafka_trace *trace = batch->records[i]->trace;
+
+		if (trace) {
+			now = now ? now : metrics_now();
+			trace->spans[CDR_KAFKA_SPAN_QUEUE] = now - trace->queued_ns;
+		}
+	}
+
+	if (count == 1) {
+		cdr_kafka_publish(&batch->records[0]->cdr, batch->records[0]->trace);
+	} else {
+		publish_batch(batch, count);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (batch->records[i]->trace) {
+			trace_commit(batch->records[i]->trace);
+		}
+		ast_free(batch->records[i]);
+	}
+}
+
+/*! \brief Pin the calling thread to the CPU of \a worker, if it has one. */
+static void worker_pin(struct cdr_kafka_worker *worker)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	int res;
+
+	if (worker->cpu < 0) {
+		return;
+	}
+	CPU_ZERO(&set);
+	CPU_SET(worker->cpu, &set);
+	res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (res) {
+		ast_log(LOG_WARNING, "Failed to pin CDR Kafka publisher thread to CPU %d: %s\n",
+			worker->cpu, strerror(res));
+	}
+#else
+	if (worker->cpu >= 0) {
+		ast_log(LOG_WARNING, "publisher_cpus is not supported on this platform\n");
+	}
+#endif
+}
+
+static void *queue_publisher(void *data)
+{
+	struct cdr_kafka_worker *worker = data;
+	struct cdr_kafka_queue *queue = worker->queue;
+	struct cdr_kafka_batch batch = { 0, };
+	struct cdr_kafka_record *single;
+
+	worker_pin(worker);
+
+	if (queue->batch_size > 1 && batch_init(&batch, queue->batch_size)) {
+		ast_log(LOG_WARNING, "Failed to allocate CDR Kafka batch, publishing one CDR at a time\n");
+		batch_destroy(&batch);
+		memset(&batch, 0, sizeof(batch));
+	}
+	if (!batch.capacity) {
+		batch.records = &single;
+		batch.capacity = 1;
+	}
+
+	for (;;) {
+		size_t count = worker_collect(worker, &batch);
+
+		if (count) {
+			batch_publish(&batch, count);
+			continue;
+		}
+
+		/* Nobody can push any more once stopping is set and no producer is
+		 * in flight, so one last empty pop means we are done */
+		if (__atomic_load_n(&queue->stopping, __ATOMIC_SEQ_CST)
+			&& !__atomic_load_n(&queue->producers, __ATOMIC_SEQ_CST)) {
+			count = worker_collect(worker, &batch);
+			if (!count) {
+				break;
+			}
+			batch_publish(&batch, count);
+			continue;
+		}
+
+		worker_wait(worker, CDR_KAFKA_QUEUE_IDLE_MS);
+	}
+
+	if (batch.records == &single) {
+		batch.records = NULL;
+	}
+	batch_destroy(&batch);
+
+	return NULL;
+}
+
+/*! \brief Stop accepting records, flush the rings and join the threads. */
+static void queue_stop(struct cdr_kafka_queue *queue)
+{
+	size_t i;
+
+	__atomic_store_n(&queue->stopping, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < queue->worker_count; i++) {
+		ast_mutex_lock(&queue->workers[i].lock);
+		ast_cond_broadcast(&queue->workers[i].cond);
+		ast_mutex_unlock(&queue->workers[i].lock);
+	}
+
+	for (i = 0; i < queue->worker_count; i++) {
+		if (queue->workers[i].started) {
+			pthread_join(queue->workers[i].thread, NULL);
+			queue->workers[i].started = 0;
+		}
+	}
+}
+
+static void queue_dtor(void *obj)
+{
+	struct cdr_kafka_queue *queue = obj;
+	struct cdr_kafka_record *record;
+	size_t i;
+	size_t j;
+
+	for (i = 0; queue->workers && i < queue->worker_count; i++) {
+		struct cdr_kafka_worker *worker = &queue->workers[i];
+
+		for (j = 0; j < ARRAY_LEN(worker->rings); j++) {
+			if (!worker->rings[j].slots) {
+				continue;
+			}
+			while ((record = ring_pop(&worker->rings[j]))) {
+				ast_free(record);
+			}
+			ast_free(worker->rings[j].slots);
+		}
+		ast_mutex_destroy(&worker->lock);
+		ast_cond_destroy(&worker->cond);
+	}
+	ast_free(queue->workers);
+	ast_free(queue->cpus);
+}
+
+/*! \brief Smallest power of two that is >= \a size. */
+static size_t queue_capacity(unsigned int size)
+{
+	size_t capacity = 1;
+
+	while (capacity < size) {
+		capacity <<= 1;
+	}
+
+	return capacity;
+}
+
+static struct cdr_kafka_queue *queue_alloc(const struct cdr_kafka_global_conf *global)
+{
+	RAII_VAR(struct cdr_kafka_queue *, queue, NULL, ao2_cleanup);
+	/* The rings share queue_size between them */
+	size_t capacity = queue_capacity((global->queue_size + global->publisher_threads - 1)
+		/ global->publisher_threads);
+	int cpus[CDR_KAFKA_CPUS_MAX];
+	int cpu_count;
+	size_t i;
+	size_t j;
+	size_t k;
+
+	cpu_count = cpus_parse(global->publisher_cpus, cpus, ARRAY_LEN(cpus));
+	if (cpu_count < 0) {
+		return NULL;
+	}
+
+	queue = ao2_alloc_options(sizeof(*queue), queue_dtor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!queue) {
+		return NULL;
+	}
+	queue->queue_size = global->queue_size;
+	queue->lanes = global->priorities ? CDR_KAFKA_PRIORITY_COUNT : 1;
+	memcpy(queue->weights, global->priority_weights, sizeof(queue->weights));
+	queue->overflow = global->overflow;
+	if (queue->overflow == CDR_KAFKA_OVERFLOW_SPOOL && !global->spool) {
+		/* Without a spool every overflowed CDR would be lost, see setup_kafka() */
+		queue->overflow = CDR_KAFKA_OVERFLOW_BLOCK;
+	}
+	queue->batch_size = global->batch_size;
+	queue->batch_linger_ms = global->batch_linger_ms;
+
+	queue->cpus = ast_strdup(global->publisher_cpus);
+	queue->workers = ast_calloc_cache_align(global->publisher_threads, sizeof(*queue->workers));
+	if (!queue->cpus || !queue->workers) {
+		return NULL;
+	}
+	queue->worker_count = global->publisher_threads;
+	for (i = 0; i < queue->worker_count; i++) {
+		struct cdr_kafka_worker *worker = &queue->workers[i];
+
+		ast_mutex_init(&worker->lock);
+		ast_cond_init(&worker->cond, NULL);
+		worker->queue = queue;
+		worker->cpu = cpu_count ? cpus[i % cpu_count] : -1;
+		worker->credit = queue->weights[0];
+		/* Each class can take the whole share, whatever the others hold */
+		for (j = 0; j < queue->lanes; j++) {
+			struct cdr_kafka_ring *ring = &worker->rings[j];
+
+			ring->mask = capacity - 1;
+			ring->slots = ast_calloc(capacity, sizeof(*ring->slots));
+			if (!ring->slots) {
+				return NULL;
+			}
+			for (k = 0; k < capacity; k++) {
+				ring->slots[k].sequence = k;
+			}
+		}
+	}
+
+	return ao2_bump(queue);
+}
+
+/*! \brief Start the publisher threads of \a queue. */
+static int queue_start(struct cdr_kafka_queue *queue)
+{
+	size_t i;
+
+	for (i = 0; i < queue->worker_count; i++) {
+		if (ast_pthread_create(&queue->workers[i].thread, NULL, queue_publisher,
+			&queue->workers[i])) {
+			ast_log(LOG_ERROR, "Failed to start CDR Kafka publisher thread\n");
+			queue_stop(queue);
+			return -1;
+		}
+		queue->workers[i].started = 1;
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Start, restart or stop the async queue to match the configuration.
+ *
+ * A queue that is replaced is flushed before this returns.
+ */
+static void setup_async_queue(void)
+{
+	RAII_VAR(struct cdr_kafka_conf *, conf, ao2_global_obj_ref(confs), ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_queue *, old, ao2_global_obj_ref(async_queue), ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_queue *, queue, NULL, ao2_cleanup);
+
+	if (conf && conf->global && conf->global->async) {
+		if (old && old->queue_size == conf->global->queue_size
+			&& old->worker_count == conf->global->publisher_threads
+			&& !strcmp(old->cpus, conf->global->publisher_cpus)
+			&& old->lanes == (conf->global->priorities ? CDR_KAFKA_PRIORITY_COUNT : 1)
+			&& !memcmp(old->weights, conf->global->priority_weights, sizeof(old->weights))
+			&& old->overflow == conf->global->overflow
+			&& old->batch_size == conf->global->batch_size
+			&& old->batch_linger_ms == conf->global->batch_linger_ms) {
+			return;
+		}
+
+		queue = queue_alloc(conf->global);
+		if (queue && queue_start(queue)) {
+			ao2_ref(queue, -1);
+			queue = NULL;
+		}
+		if (!queue) {
+			ast_log(LOG_ERROR, "Failed to create CDR Kafka queue, publishing synchronously\n");
+		}
+	}
+
+	if (!queue && !old) {
+		return;
+	}
+
+	ao2_global_obj_replace_unref(async_queue, queue);
+	if (old) {
+		queue_stop(old);
+	}
+}
+
+/*! \brief Flush and release the async queue. */
+static void shutdown_async_queue(void)
+{
+	RAII_VAR(struct cdr_kafka_queue *, queue, ao2_global_obj_ref(async_queue), ao2_cleanup);
+
+	ao2_global_obj_release(async_queue);
+	if (queue) {
+		queue_stop(queue);
+	}
+}
+
+/*! \brief Buckets of the table of calls being aggregated. */
+#define CDR_KAFKA_AGGREGATE_BUCKETS 4096
+
+/*!
+ * \brief How long a call is kept after its LINKEDID_END event.
+ *
+ * Leaves time for CDRs of the call still on their way through the CDR
+ * engine.
+ */
+#define CDR_KAFKA_AGGREGATE_END_MS 500
+
+/*! \brief Longest the aggregation thread sleeps between checks. */
+#define CDR_KAFKA_AGGREGATE_IDLE_MS 1000
+
+/*! \brief Name of the CEL backend that watches for the end of calls. */
+#define CDR_KAFKA_CEL_NAME "cdr_kafka"
+
+/*! \brief CDRs of one call, published together as one message. */
+struct cdr_kafka_call {
+	/*! \brief Next call in the same bucket */
+	struct cdr_kafka_call *bucket_next;
+	/*! \brief Entry in the idle, ended or ready list */
+	AST_DLLIST_ENTRY(cdr_kafka_call) entry;
+	/*! \brief When the call is published if nothing else happens */
+	struct timeval deadline;
+	unsigned int hash;
+	/*!
+	 * \brief Whether the LINKEDID_END event was seen
+	 *
+	 * A call ended before its first CDR arrived has no legs and stays on
+	 * \c idle until that CDR comes, or its deadline passes.
+	 */
+	int ended;
+	size_t leg_count;
+	char linkedid[AST_MAX_UNIQUEID];
+	/*! \brief Copies of the CDRs, in the order they were logged */
+	struct cdr_kafka_record *legs[];
+};
+
+AST_DLLIST_HEAD_NOLOCK(cdr_kafka_call_list, cdr_kafka_call);
+
+/*!
+ * \brief Buffers the CDRs of each call until the call is over.
+ *
+ * Calls are found through a hash table on linkedid. Each call in the
+ * table is also on one of two lists, both ordered by deadline: \c idle,
+ * where a call moves to the end whenever it gets a CDR, and \c ended, for
+ * calls whose LINKEDID_END event was seen. A LINKEDID_END that comes
+ * before any CDR of the call leaves an empty call on \c idle, so that the
+ * first CDR moves the call to \c ended instead of waiting for
+ * \c timeout_ms. A call that reaches
+ * \c max_legs leaves the table for \c ready. A separate thread publishes
+ * ready calls and calls whose deadline has passed.
+ */
+struct cdr_kafka_aggregator {
+	/*! \brief Guards everything below and \c cond */
+	ast_mutex_t lock;
+	/*! \brief Signalled when a call is ready or the aggregator stops */
+	ast_cond_t cond;
+	pthread_t thread;
+	int started;
+	int stopping;
+	struct cdr_kafka_call *buckets[CDR_KAFKA_AGGREGATE_BUCKETS];
+	struct cdr_kafka_call_list idle;
+	struct cdr_kafka_call_list ended;
+	struct cdr_kafka_call_list ready;
+	/*! \brief Number of calls in the table */
+	size_t calls;
+	unsigned int timeout_ms;
+	unsigned int max_legs;
+};
+
+static AO2_GLOBAL_OBJ_STATIC(call_aggregator);
+
+static void call_free(struct cdr_kafka_call *call)
+{
+	size_t i;
+
+	for (i = 0; i < call->leg_count; i++) {
+		ast_free(call->legs[i]);
+	}
+	ast_free(call);
+}
+
+/*! \brief Find the call with \a linkedid. Called with the lock held. */
+static struct cdr_kafka_call *call_find(struct cdr_kafka_aggregator *agg,
+	const char *linkedid, unsigned int hash)
+{
+	struct cdr_kafka_call *call;
+
+	for (call = agg->buckets[hash & (CDR_KAFKA_AGGREGATE_BUCKETS - 1)]; call;
+		call = call->bucket_next) {
+		if (call->hash == hash && !strcmp(call->linkedid, linkedid)) {
+			return call;
+		}
+	}
+
+	return NULL;
+}
+
+/*! \brief Take \a call out of the table. Called with the lock held. */
+static void call_unlink(struct cdr_kafka_aggregator *agg, struct cdr_kafka_call *call)
+{
+	struct cdr_kafka_call **pos = &agg->buckets[call->hash & (CDR_KAFKA_AGGREGATE_BUCKETS - 1)];
+
+	while (*pos != call) {
+		pos = &(*pos)->bucket_next;
+	}
+	*pos = call->bucket_next;
+	agg->calls--;
+}
+
+/*!
+ * \brief Put a new call without CDRs in the table. Called with the lock held.
+ *
+ * \return The call, or NULL on allocation failure.
+ */
+static struct cdr_kafka_call *call_new(struct cdr_kafka_aggregator *agg,
+	const char *linkedid, unsigned int hash)
+{
+	struct cdr_kafka_call *call;
+
+	call = ast_calloc(1, sizeof(*call) + agg->max_legs * sizeof(call->legs[0]));
+	if (!call) {
+		return NULL;
+	}
+	ast_copy_string(call->linkedid, linkedid, sizeof(call->linkedid));
+	call->hash = hash;
+	call->bucket_next = agg->buckets[hash & (CDR_KAFKA_AGGREGATE_BUCKETS - 1)];
+	agg->buckets[hash & (CDR_KAFKA_AGGREGATE_BUCKETS - 1)] = call;
+	agg->calls++;
+
+	return call;
+}
+
+/*!
+ * \brief Add a CDR to the call it belongs to.
+ *
+ * \return 0 if the CDR was buffered.
+ * \return -1 on error.
+ */
+static int aggregator_add(struct cdr_kafka_aggregator *agg, struct ast_cdr *cdr)
+{
+	struct cdr_kafka_record *record = record_alloc(cdr, NULL);
+	unsigned int hash = ast_str_hash(cdr->linkedid);
+	struct cdr_kafka_call *call;
+
+	if (!record) {
+		return -1;
+	}
+
+	ast_mutex_lock(&agg->lock);
+	if (agg->stopping) {
+		ast_mutex_unlock(&agg->lock);
+		ast_free(record);
+		return -1;
+	}
+
+	call = call_find(agg, cdr->linkedid, hash);
+	if (!call) {
+		TEST_COUNT_ALLOCATION();
+		call = call_new(agg, cdr->linkedid, hash);
+		if (!call) {
+			ast_mutex_unlock(&agg->lock);
+			ast_free(record);
+			return -1;
+		}
+	} else if (!call->ended) {
+		AST_DLLIST_REMOVE(&agg->idle, call, entry);
+	} else if (!call->leg_count) {
+		/* Its end was seen already, so the call goes out like any ended one */
+		AST_DLLIST_REMOVE(&agg->idle, call, entry);
+		call->deadline = ast_tvadd(ast_tvnow(), ast_samp2tv(CDR_KAFKA_AGGREGATE_END_MS, 1000));
+		AST_DLLIST_INSERT_TAIL(&agg->ended, call, entry);
+		ast_cond_signal(&agg->cond);
+	}
+
+	call->legs[call->leg_count++] = record;
+	if (call->leg_count == agg->max_legs) {
+		/* Full, so it goes out now and a later CDR starts a new message */
+		if (call->ended) {
+			AST_DLLIST_REMOVE(&agg->ended, call, entry);
+		}
+		call_unlink(agg, call);
+		AST_DLLIST_INSERT_TAIL(&agg->ready, call, entry);
+		ast_cond_signal(&agg->cond);
+	} else if (!call->ended) {
+		call->deadline = ast_tvadd(ast_tvnow(), ast_samp2tv(agg->timeout_ms, 1000));
+		AST_DLLIST_INSERT_TAIL(&agg->idle, call, entry);
+	}
+	ast_mutex_unlock(&agg->lock);
+
+	return 0;
+}
+
+/*!
+ * \brief Publish the call \a linkedid shortly, as it is over.
+ *
+ * If no CDR of the call arrived yet, an empty call marked as ended waits
+ * on \c idle for the first one, for up to \c timeout_ms.
+ */
+static void aggregator_end(struct cdr_kafka_aggregator *agg, const char *linkedid)
+{
+	unsigned int hash = ast_str_hash(linkedid);
+	struct cdr_kafka_call *call;
+
+	ast_mutex_lock(&agg->lock);
+	call = call_find(agg, linkedid, hash);
+	if (!call && !agg->stopping) {
+		call = call_new(agg, linkedid, hash);
+		if (call) {
+			call->ended = 1;
+			call->deadline = ast_tvadd(ast_tvnow(), ast_samp2tv(agg->timeout_ms, 1000));
+			AST_DLLIST_INSERT_TAIL(&agg->idle, call, entry);
+		}
+	} else if (call && !call->ended) {
+		AST_DLLIST_REMOVE(&agg->idle, call, entry);
+		call->ended = 1;
+		call->deadline = ast_tvadd(ast_tvnow(), ast_samp2tv(CDR_KAFKA_AGGREGATE_END_MS, 1000));
+		AST_DLLIST_INSERT_TAIL(&agg->ended, call, entry);
+		ast_cond_signal(&agg->cond);
+	}
+	ast_mutex_unlock(&agg->lock);
+}
+
+/*!
+ * \brief Write the message carrying every CDR of \a call.
+ *
+ * field_limits and max_payload_size apply to each leg on its own; what is
+ * cut from all of them is collected in \a cuts.
+ */
+static int encode_call(struct cdr_kafka_buf *buf, const struct cdr_kafka_global_conf *global,
+	struct cdr_kafka_call *call, struct cdr_kafka_cuts *cuts)
+{
+	size_t i;
+
+	if (buf_append(buf, "{\"linkedid\":", 12)
+		|| json_append_string(buf, call->linkedid)
+		|| buf_append(buf, ",\"legs\":[", 9)) {
+		return -1;
+	}
+
+	for (i = 0; i < call->leg_count; i++) {
+		if ((i && buf_putc(buf, ',')) || encode_cdr(buf, global, &call->legs[i]->cdr, cuts)) {
+			return -1;
+		}
+	}
+
+	return buf_append(buf, "]}", 2);
+}
+
+/*!
+ * \brief Publish the CDRs of a call as one message.
+ *
+ * The key, topic and headers are those of the first CDR. A message the
+ * producer does not take is spooled if the spool is enabled.
+ */
+static void publish_call(struct cdr_kafka_call *call)
+{
+	struct cdr_kafka_snapshot *snap = snapshot_get();
+	struct cdr_kafka_metrics *metrics = metrics_get();
+	struct ast_cdr *first = &call->legs[0]->cdr;
+	struct cdr_kafka_global_conf *global;
+	struct cdr_kafka_pool_buf *pool_buf;
+	struct cdr_kafka_cuts cuts;
+	char key_buf[CDR_KAFKA_KEY_LEN];
+	char topic_buf[CDR_KAFKA_TOPIC_LEN + 1];
+	char ts_str[32] = "";
+	char dedupe_str[CDR_KAFKA_DEDUPE_LEN];
+	struct ast_kafka_header hdr_buf[CDR_KAFKA_MAX_HEADERS];
+	const struct ast_kafka_header *hdrs;
+	size_t hdr_count;
+	const char *key;
+	const char *topic;
+	size_t len;
+	size_t i;
+	int connected;
+	int res = -1;
+
+	if (!snap) {
+		metrics_count(metrics, CDR_KAFKA_COUNTER_FAILED, 1);
+		return;
+	}
+
+	cuts_init(&cuts);
+	pool_buf = pool_get();
+	if (!pool_buf || encode_call(&pool_buf->buf, snap->conf->global, call, &cuts)
+		|| payload_compress(&pool_buf->buf, 0, snap->conf->global)) {
+		if (pool_buf) {
+			pool_put(pool_buf);
+		}
+		metrics_count(metrics, CDR_KAFKA_COUNTER_ENCODE_FAILED, 1);
+		ast_log(LOG_ERROR, "Failed to build JSON for call %s\n", call->linkedid);
+		return;
+	}
+	len = pool_buf->buf.len;
+	metrics_payload(metrics, len);
+	if (cuts.oversized) {
+		metrics_count(metrics, CDR_KAFKA_COUNTER_OVERSIZED, 1);
+	}
+	if (cuts.len) {
+		metrics_count(metrics, CDR_KAFKA_COUNTER_TRUNCATED, 1);
+	}
+
+	connected = !snapshot_connect(&snap);
+	global = snap->conf->global;
+	key = cdr_kafka_key(global, first, key_buf);
+	topic = cdr_kafka_topic(global, first, topic_buf);
+
+	hdrs = headers_get(global->header_block, hdr_buf, ts_str, dedupe_str, first, cuts.keys,
+		&hdr_count);
+	if (connected && !snapshot_spooling(snap)) {
+		res = snapshot_produce_owned(snap, topic, key, pool_buf, hdrs, hdr_count);
+		for (i = 0; !res && global->summary && i < call->leg_count; i++) {
+			struct ast_cdr *leg = &call->legs[i]->cdr;
+
+			/* Each leg is summarized, under the key of the call */
+			hdrs = headers_get(global->header_block, hdr_buf, ts_str, dedupe_str, leg, NULL, &hdr_count);
+			summary_publish(snap, leg, key, hdrs, hdr_count, metrics);
+		}
+	}
+
+	if (res != 0) {
+		res = spool_message(key, topic, hdrs, hdr_count, pool_buf->buf.data, len);
+		pool_put(pool_buf);
+		if (res) {
+			metrics_count(metrics, CDR_KAFKA_COUNTER_FAILED, 1);
+			ast_log(LOG_ERROR, "Error publishing the %zu CDRs of call %s to Kafka\n",
+				call->leg_count, call->linkedid);
+			return;
+		}
+	} else {
+		metrics_count(metrics, CDR_KAFKA_COUNTER_PUBLISHED, 1);
+		metrics_count(metrics, CDR_KAFKA_COUNTER_BYTES, len);
+	}
+	metrics_count(metrics, CDR_KAFKA_COUNTER_AGGREGATED, call->leg_count);
+}
+
+/*!
+ * \brief Move the calls of \a list that are due to \a due.
+ *
+ * Called with the lock held.
+ */
+static void aggregator_expire(struct cdr_kafka_aggregator *agg, struct cdr_kafka_call_list *list,
+	struct timeval now, struct cdr_kafka_call_list *due)
+{
+	struct cdr_kafka_call *call;
+
+	while ((call = AST_DLLIST_FIRST(list))
+		&& (agg->stopping || ast_tvcmp(call->deadline, now) <= 0)) {
+		AST_DLLIST_REMOVE(list, call, entry);
+		call_unlink(agg, call);
+		AST_DLLIST_INSERT_TAIL(due, call, entry);
+	}
+}
+
+/*! \brief Wait until the next deadline. Called with the lock held. */
+static void aggregator_wait(struct cdr_kafka_aggregator *agg, struct timeval now)
+{
+	struct timeval wake = ast_tvadd(now, ast_samp2tv(CDR_KAFKA_AGGREGATE_IDLE_MS, 1000));
+	struct timespec ts;
+
+	if (AST_DLLIST_FIRST(&agg->idle)
+		&& ast_tvcmp(AST_DLLIST_FIRST(&agg->idle)->deadline, wake) < 0) {
+		wake = AST_DLLIST_FIRST(&agg->idle)->deadline;
+	}
+	if (AST_DLLIST_FIRST(&agg->ended)
+		&& ast_tvcmp(AST_DLLIST_FIRST(&agg->ended)->deadline, wake) < 0) {
+		wake = AST_DLLIST_FIRST(&agg->ended)->deadline;
+	}
+
+	ts.tv_sec = wake.tv_sec;
+	ts.tv_nsec = wake.tv_usec * 1000;
+	ast_cond_timedwait(&agg->cond, &agg->lock, &ts);
+}
+
+static void *aggregator_thread(void *data)
+{
+	struct cdr_kafka_aggregator *agg = data;
+	struct cdr_kafka_call_list due;
+	struct cdr_kafka_call *call;
+
+	AST_DLLIST_HEAD_INIT_NOLOCK(&due);
+
+	ast_mutex_lock(&agg->lock);
+	for (;;) {
+		struct timeval now = ast_tvnow();
+		int stopping = agg->stopping;
+
+		while ((call = AST_DLLIST_REMOVE_HEAD(&agg->ready, entry))) {
+			AST_DLLIST_INSERT_TAIL(&due, call, entry);
+		}
+		aggregator_expire(agg, &agg->ended, now, &due);
+		aggregator_expire(agg, &agg->idle, now, &due);
+
+		if (AST_DLLIST_FIRST(&due)) {
+			ast_mutex_unlock(&agg->lock);
+			while ((call = AST_DLLIST_REMOVE_HEAD(&due, entry))) {
+				/* Calls that ended before any CDR came have nothing to publish */
+				if (call->leg_count) {
+					publish_call(call);
+				}
+				call_free(call);
+			}
+			ast_mutex_lock(&agg->lock);
+			continue;
+		}
+
+		/* Nothing is added once stopping, so everything went out above */
+		if (stopping) {
+			break;
+		}
+		aggregator_wait(agg, now);
+	}
+	ast_mutex_unlock(&agg->lock);
+
+	return NULL;
+}
+
+/*! \brief Publish every buffered call and stop the aggregation thread. */
+static void aggregator_stop(struct cdr_kafka_aggregator *agg)
+{
+	ast_mutex_lock(&agg->lock);
+	agg->stopping = 1;
+	ast_cond_signal(&agg->cond);
+	ast_mutex_unlock(&agg->lock);
+
+	if (agg->started) {
+		pthread_join(agg->thread, NULL);
+		agg->started = 0;
+	}
+}
+
+static void aggregator_dtor(void *obj)
+{
+	struct cdr_kafka_aggregator *agg = obj;
+	struct cdr_kafka_call *call;
+
+	while ((call = AST_DLLIST_REMOVE_HEAD(&agg->ready, entry))) {
+		call_free(call);
+	}
+	while ((call = AST_DLLIST_REMOVE_HEAD(&agg->ended, entry))) {
+		call_free(call);
+	}
+	while ((call = AST_DLLIST_REMOVE_HEAD(&agg->idle, entry))) {
+		call_free(call);
+	}
+	ast_mutex_destroy(&agg->lock);
+	ast_cond_destroy(&agg->cond);
+}
+
+static struct cdr_kafka_aggregator *aggregator_alloc(const struct cdr_kafka_global_conf *global)
+{
+	RAII_VAR(struct cdr_kafka_aggregator *, agg, NULL, ao2_cleanup);
+
+	agg = ao2_alloc_options(sizeof(*agg), aggregator_dtor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!agg) {
+		return NULL;
+	}
+	ast_mutex_init(&agg->lock);
+	ast_cond_init(&agg->cond, NULL);
+	AST_DLLIST_HEAD_INIT_NOLOCK(&agg->idle);
+	AST_DLLIST_HEAD_INIT_NOLOCK(&agg->ended);
+	AST_DLLIST_HEAD_INIT_NOLOCK(&agg->ready);
+	agg->timeout_ms = global->aggregate_timeout;
+	agg->max_legs = global->aggregate_max_legs;
+
+	if (ast_pthread_create(&agg->thread, NULL, aggregator_thread, agg)) {
+		ast_log(LOG_ERROR, "Failed to start CDR Kafka aggregation thread\n");
+		return NULL;
+	}
+	agg->started = 1;
+
+	return ao2_bump(agg);
+}
+
+/*! \brief CEL backend callback, publishes a call once it is over. */
+static void aggregate_cel(struct ast_event *event)
+{
+	RAII_VAR(struct cdr_kafka_aggregator *, agg, NULL, ao2_cleanup);
+	struct ast_cel_event_record record = {
+		.version = AST_CEL_EVENT_RECORD_VERSION,
+	};
+
+	if (ast_cel_fill_record(event, &record) || record.event_type != AST_CEL_LINKEDID_END
+		|| ast_strlen_zero(record.linked_id)) {
+		return;
+	}
+
+	agg = ao2_global_obj_ref(call_aggregator);
+	if (agg) {
+		aggregator_end(agg, record.linked_id);
+	}
+}
+
+/*!
+ * \brief Start, restart or stop call aggregation to match the configuration.
+ *
+ * The calls of an aggregator that is replaced are published before this
+ * returns.
+ */
+static void setup_aggregator(void)
+{
+	RAII_VAR(struct cdr_kafka_conf *, conf, ao2_global_obj_ref(confs), ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_aggregator *, old, ao2_global_obj_ref(call_aggregator), ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_aggregator *, agg, NULL, ao2_cleanup);
+
+	if (conf && conf->global && conf->global->aggregate
+		&& conf->global->format == CDR_KAFKA_FORMAT_JSON) {
+		if (old && old->timeout_ms == conf->global->aggregate_timeout
+			&& old->max_legs == conf->global->aggregate_max_legs) {
+			return;
+		}
+
+		agg = aggregator_alloc(conf->global);
+		if (!agg) {
+			ast_log(LOG_ERROR, "Failed to set up call aggregation, publishing CDRs one by one\n");
+		}
+	}
+
+	if (!agg && !old) {
+		return;
+	}
+
+	ao2_global_obj_replace_unref(call_aggregator, agg);
+	if (agg && !old) {
+		if (ast_cel_backend_register(CDR_KAFKA_CEL_NAME, aggregate_cel)) {
+			ast_log(LOG_WARNING, "Could not watch CEL for the end of calls\n");
+		} else if (!ast_cel_track_event(AST_CEL_LINKEDID_END)) {
+			ast_log(LOG_NOTICE, "CEL does not track LINKEDID_END, calls are published "
+				"%u ms after their last CDR\n", agg->timeout_ms);
+		}
+	} else if (!agg) {
+		ast_cel_backend_unregister(CDR_KAFKA_CEL_NAME);
+	}
+	if (old) {
+		aggregator_stop(old);
+	}
+}
+
+/*! \brief Publish every buffered call and stop aggregating. */
+static void shutdown_aggregator(void)
+{
+	RAII_VAR(struct cdr_kafka_aggregator *, agg, ao2_global_obj_ref(call_aggregator), ao2_cleanup);
+
+	if (!agg) {
+		return;
+	}
+
+	ast_cel_backend_unregister(CDR_KAFKA_CEL_NAME);
+	ao2_global_obj_release(call_aggregator);
+	aggregator_stop(agg);
+}
+
+/*! \brief How often the warm-up checks for topic metadata. */
+#define CDR_KAFKA_WARMUP_POLL_MS 100
+
+/*! \brief Progress of a warm-up. */
+enum cdr_kafka_warmup_state {
+	/*! Waiting for the metadata of some topics */
+	CDR_KAFKA_WARMUP_RUNNING,
+	/*! Every producer knows every topic */
+	CDR_KAFKA_WARMUP_READY,
+	/*! \c warmup_timeout passed first */
+	CDR_KAFKA_WARMUP_TIMED_OUT,
+};
+
+static const char * const warmup_state_names[] = {
+	[CDR_KAFKA_WARMUP_RUNNING] = "warming up",
+	[CDR_KAFKA_WARMUP_READY] = "ready",
+	[CDR_KAFKA_WARMUP_TIMED_OUT] = "timed out",
+};
+
+/*!
+ * \brief Connections and topics of a snapshot prepared in the background.
+ *
+ * Every topic a CDR can go to without looking at its fields, the topic
+ * option or a route, is created if missing and has its metadata fetched
+ * on every connection, so the first CDRs after a start do not wait for
+ * librdkafka. Topics built from CDR fields are only known per CDR.
+ */
+struct cdr_kafka_warmup {
+	struct cdr_kafka_snapshot *snap;
+	/*! \brief Topic names, pointing into the snapshot's configuration */
+	const char **topics;
+	size_t topic_count;
+	/*! \brief Connection and topic pairs whose metadata is known */
+	size_t known;
+	/*! \brief Connection and topic pairs the warm-up waits for */
+	size_t total;
+	enum cdr_kafka_warmup_state state;
+	uint64_t started;
+	/*! \brief When the warm-up finished, 0 while it runs */
+	uint64_t finished;
+	pthread_t thread;
+	int started_thread;
+	int stopping;
+	ast_mutex_t lock;
+	ast_cond_t cond;
+};
+
+#ifdef TEST_FRAMEWORK
+/*! \brief Topics warm_topic() was asked for while a test replaced produce. */
+static unsigned int test_warmed;
+#endif
+
+/*! \brief Have \a topic created if missing and its metadata fetched. */
+static void warm_topic(struct ast_kafka_producer *producer, const char *topic,
+	const struct cdr_kafka_global_conf *global)
+{
+#ifdef TEST_FRAMEWORK
+	if (__atomic_load_n(&test_produce, __ATOMIC_ACQUIRE)) {
+		__atomic_add_fetch(&test_warmed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+#endif
+
+	if (ast_kafka_ensure_topic_async(producer, topic, global->partitions, global->replication)) {
+		ast_log(LOG_WARNING, "Could not have Kafka topic '%s' ensured\n", topic);
+	}
+	if (ast_kafka_preload_topic(producer, topic)) {
+		ast_log(LOG_WARNING, "Could not preload metadata of Kafka topic '%s'\n", topic);
+	}
+}
+
+/*! \brief Count the connection and topic pairs whose metadata has arrived. */
+static size_t warmup_known(const struct cdr_kafka_warmup *warmup)
+{
+	const struct cdr_kafka_snapshot *snap = warmup->snap;
+	size_t known = 0;
+	size_t i;
+	size_t j;
+
+	for (i = 0; i < snap->connection_count; i++) {
+		for (j = 0; snap->producers[i] && j < warmup->topic_count; j++) {
+			known += partition_count(snap->producers[i], warmup->topics[j]) > 0;
+		}
+	}
+
+	return known;
+}
+
+static void *warmup_thread(void *data)
+{
+	struct cdr_kafka_warmup *warmup = data;
+	const struct cdr_kafka_global_conf *global = warmup->snap->conf->global;
+	uint64_t deadline = warmup->started + (uint64_t) global->warmup_timeout * 1000000;
+	size_t i;
+	size_t j;
+
+	for (i = 0; i < warmup->snap->connection_count; i++) {
+		for (j = 0; warmup->snap->producers[i] && j < warmup->topic_count; j++) {
+			warm_topic(warmup->snap->producers[i], warmup->topics[j], global);
+		}
+	}
+
+	ast_mutex_lock(&warmup->lock);
+	while (!warmup->stopping) {
+		struct timeval tv;
+		struct timespec ts;
+		size_t known;
+		uint64_t now;
+
+		ast_mutex_unlock(&warmup->lock);
+		known = warmup_known(warmup);
+		now = metrics_now();
+		ast_mutex_lock(&warmup->lock);
+
+		warmup->known = known;
+		if (known == warmup->total || now >= deadline) {
+			warmup->state = known == warmup->total
+				? CDR_KAFKA_WARMUP_READY : CDR_KAFKA_WARMUP_TIMED_OUT;
+			warmup->finished = now;
+			break;
+		}
+
+		tv = ast_tvadd(ast_tvnow(), ast_samp2tv(CDR_KAFKA_WARMUP_POLL_MS, 1000));
+		ts.tv_sec = tv.tv_sec;
+		ts.tv_nsec = tv.tv_usec * 1000;
+		ast_cond_timedwait(&warmup->cond, &warmup->lock, &ts);
+	}
+	ast_mutex_unlock(&warmup->lock);
+
+	if (warmup->state == CDR_KAFKA_WARMUP_READY) {
+		ast_log(LOG_NOTICE, "CDR Kafka warm-up done: %zu topic%s on %u connection%s in %" PRIu64 " ms\n",
+			warmup->topic_count, ESS(warmup->topic_count), warmup->snap->connected,
+			ESS(warmup->snap->connected),
+			(warmup->finished - warmup->started) / 1000000);
+	} else if (warmup->state == CDR_KAFKA_WARMUP_TIMED_OUT) {
+		ast_log(LOG_WARNING, "CDR Kafka warm-up timed out with the metadata of %zu of %zu "
+			"topics known\n", warmup->known, warmup->total);
+	}
+
+	return NULL;
+}
+
+/*! \brief Stop a warm-up and wait for its thread. */
+static void warmup_stop(struct cdr_kafka_warmup *warmup)
+{
+	ast_mutex_lock(&warmup->lock);
+	warmup->stopping = 1;
+	ast_cond_signal(&warmup->cond);
+	ast_mutex_unlock(&warmup->lock);
+
+	if (warmup->started_thread) {
+		pthread_join(warmup->thread, NULL);
+		warmup->started_thread = 0;
+	}
+}
+
+static void warmup_dtor(void *obj)
+{
+	struct cdr_kafka_warmup *warmup = obj;
+
+	ao2_cleanup(warmup->snap);
+	ast_free(warmup->topics);
+	ast_mutex_destroy(&warmup->lock);
+	ast_cond_destroy(&warmup->cond);
+}
+
+/*! \brief Add \a topic to the topics of \a warmup unless it is there already. */
+static void warmup_add_topic(struct cdr_kafka_warmup *warmup, const char *topic)
+{
+	size_t i;
+
+	for (i = 0; i < warmup->topic_count; i++) {
+		if (!strcmp(warmup->topics[i], topic)) {
+			return;
+		}
+	}
+	warmup->topics[warmup->topic_count++] = topic;
+}
+
+/*! \brief Start warming up the connections and topics of \a snap. */
+static struct cdr_kafka_warmup *warmup_alloc(struct cdr_kafka_snapshot *snap)
+{
+	RAII_VAR(struct cdr_kafka_warmup *, warmup, NULL, ao2_cleanup);
+	const struct cdr_kafka_global_conf *global = snap->conf->global;
+	const struct cdr_kafka_topics *topics = global->topics;
+	size_t i;
+
+	warmup = ao2_alloc_options(sizeof(*warmup), warmup_dtor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!warmup) {
+		return NULL;
+	}
+	ast_mutex_init(&warmup->lock);
+	ast_cond_init(&warmup->cond, NULL);
+	warmup->snap = ao2_bump(snap);
+
+	/* Every route, the topic, the summary topic and the oversize topic */
+	warmup->topics = ast_calloc(topics->route_mask + 4, sizeof(*warmup->topics));
+	if (!warmup->topics) {
+		return NULL;
+	}
+	if (!topics->part_count) {
+		warmup_add_topic(warmup, global->topic);
+	}
+	if (global->summary) {
+		warmup_add_topic(warmup, global->summary_topic);
+	}
+	if (global->max_payload_size && !ast_strlen_zero(global->oversize_topic)) {
+		warmup_add_topic(warmup, global->oversize_topic);
+	}
+	for (i = 0; topics->routes && i <= topics->route_mask; i++) {
+		if (topics->routes[i].value) {
+			warmup_add_topic(warmup, topics->routes[i].topic);
+		}
+	}
+	if (topics->part_count) {
+		ast_debug(1, "Topic '%s' depends on the CDR, only its routes are warmed up\n",
+			global->topic);
+	}
+	warmup->total = warmup->topic_count * snap->connected;
+	warmup->started = metrics_now();
+
+	if (ast_pthread_create(&warmup->thread, NULL, warmup_thread, warmup)) {
+		ast_log(LOG_ERROR, "Failed to start CDR Kafka warm-up thread\n");
+		return NULL;
+	}
+	warmup->started_thread = 1;
+
+	return ao2_bump(warmup);
+}
+
+/*!
+ * \brief Warm up the current snapshot, or stop warming up, to match the configuration.
+ *
+ * Called after every publish_snapshot() of a load or reload, before CDRs
+ * are taken, and never waits for Kafka.
+ */
+static void setup_warmup(void)
+{
+	RAII_VAR(struct cdr_kafka_snapshot *, snap, ao2_global_obj_ref(current_snapshot), ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_warmup *, old, ao2_global_obj_ref(cdr_warmup), ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_warmup *, warmup, NULL, ao2_cleanup);
+
+	if (snap && snap->conf->global->warmup) {
+		if (!snap->connected) {
+			ast_log(LOG_WARNING, "No Kafka producer to warm up\n");
+		} else if (!(warmup = warmup_alloc(snap))) {
+			ast_log(LOG_ERROR, "Failed to set up the CDR Kafka warm-up\n");
+		}
+	}
+
+	ao2_global_obj_replace_unref(cdr_warmup, warmup);
+	if (old) {
+		warmup_stop(old);
+	}
+}
+
+/*! \brief Stop the warm-up on unload. */
+static void shutdown_warmup(void)
+{
+	RAII_VAR(struct cdr_kafka_warmup *, warmup, ao2_global_obj_ref(cdr_warmup), ao2_cleanup);
+
+	if (!warmup) {
+		return;
+	}
+
+	ao2_global_obj_release(cdr_warmup);
+	warmup_stop(warmup);
+}
+
+/*! \brief Number of records waiting in the async queue. */
+static size_t queue_depth(struct cdr_kafka_queue *queue)
+{
+	size_t depth = 0;
+	size_t i;
+
+	for (i = 0; i < queue->worker_count; i++) {
+		depth += worker_depth(&queue->workers[i]);
+	}
+
+	return depth;
+}
+
+/*! \brief Number of spool segments not replayed yet. */
+static size_t spool_pending(struct cdr_kafka_spool *spool)
+{
+	size_t pending;
+
+	ast_mutex_lock(&spool->lock);
+	pending = (spool->fd >= 0 ? spool->active_seq + 1 : spool->next_seq) - spool->oldest_seq;
+	ast_mutex_unlock(&spool->lock);
+
+	return pending;
+}
+
+static void cli_hist_row(int fd, const char *name, const struct cdr_kafka_hist *hist, double scale)
+{
+	ast_cli(fd, "%-12s %12" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, hist->count,
+		hist->count ? hist->sum / scale / hist->count : 0.0,
+		hist_percentile(hist, 0.5) / scale,
+		hist_percentile(hist, 0.99) / scale,
+		hist_percentile(hist, 0.999) / scale,
+		hist->max / scale);
+}
+
+static char *handle_cli_show_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	RAII_VAR(struct cdr_kafka_queue *, queue, NULL, ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_spool *, spool, NULL, ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_aggregator *, agg, NULL, ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_snapshot *, snap, NULL, ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_warmup *, warmup, NULL, ao2_cleanup);
+	struct cdr_kafka_metrics *total;
+	size_t pooled;
+	size_t i;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "cdr kafka show stats";
+		e->usage =
+			"Usage: cdr kafka show stats\n"
+			"       Shows the CDR Kafka publish counters and the latency of each\n"
+			"       stage of the publish path.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4) {
+		return CLI_SHOWUSAGE;
+	}
+
+	total = ast_malloc(sizeof(*total));
+	if (!total) {
+		return CLI_FAILURE;
+	}
+	metrics_snapshot(total);
+
+	for (i = 0; i < CDR_KAFKA_COUNTER_COUNT; i++) {
+		ast_cli(a->fd, "%-14s %" PRIu64 "\n", counter_names[i], total->counters[i]);
+	}
+
+	queue = ao2_global_obj_ref(async_queue);
+	if (queue) {
+		ast_cli(a->fd, "%-14s %zu of %zu\n", "Queued", queue_depth(queue),
+			queue->worker_count * (queue->workers[0].rings[0].mask + 1));
+		if (queue->lanes > 1) {
+			size_t depth[CDR_KAFKA_PRIORITY_COUNT] = { 0, };
+			size_t j;
+
+			for (i = 0; i < queue->worker_count; i++) {
+				for (j = 0; j < queue->lanes; j++) {
+					depth[j] += ring_depth(&queue->workers[i].rings[j]);
+				}
+			}
+			ast_cli(a->fd, "%-14s %zu high, %zu normal, %zu low\n", "Priorities",
+				depth[CDR_KAFKA_PRIORITY_HIGH], depth[CDR_KAFKA_PRIORITY_NORMAL],
+				depth[CDR_KAFKA_PRIORITY_LOW]);
+		}
+		for (i = 0; queue->worker_count > 1 && i < queue->worker_count; i++) {
+			char cpu[16] = "any CPU";
+
+			if (queue->workers[i].cpu >= 0) {
+				snprintf(cpu, sizeof(cpu), "CPU %d", queue->workers[i].cpu);
+			}
+			ast_cli(a->fd, "%-14s %zu: %zu queued, %s\n", "Worker", i,
+				worker_depth(&queue->workers[i]), cpu);
+		}
+	}
+	spool = ao2_global_obj_ref(cdr_spool);
+	if (spool) {
+		ast_cli(a->fd, "%-14s %zu segments\n", "Spool", spool_pending(spool));
+	}
+	agg = ao2_global_obj_ref(call_aggregator);
+	if (agg) {
+		size_t calls;
+
+		ast_mutex_lock(&agg->lock);
+		calls = agg->calls;
+		ast_mutex_unlock(&agg->lock);
+		ast_cli(a->fd, "%-14s %zu buffered\n", "Calls", calls);
+	}
+	AST_LIST_LOCK(&payload_pool);
+	pooled = payload_pool_free;
+	AST_LIST_UNLOCK(&payload_pool);
+	ast_cli(a->fd, "%-14s %u in flight, %zu pooled\n", "Buffers",
+		__atomic_load_n(&payload_pool_used, __ATOMIC_RELAXED), pooled);
+	warmup = ao2_global_obj_ref(cdr_warmup);
+	if (warmup) {
+		enum cdr_kafka_warmup_state state;
+		size_t known;
+		uint64_t ms;
+
+		ast_mutex_lock(&warmup->lock);
+		state = warmup->state;
+		known = warmup->known;
+		ms = ((warmup->finished ? warmup->finished : metrics_now()) - warmup->started) / 1000000;
+		ast_mutex_unlock(&warmup->lock);
+		ast_cli(a->fd, "%-14s %s, %zu of %zu topics known, %" PRIu64 " ms\n", "Warm-up",
+			warmup_state_names[state], known, warmup->total, ms);
+	}
+	snap = ao2_global_obj_ref(current_snapshot);
+	for (i = 0; snap && snap->connection_count > 1 && i < snap->connection_count; i++) {
+		const char *state = "fanout";
+
+		if (!snap->producers[i]) {
+			state = "unavailable";
+		} else if (snapshot_failover(snap)) {
+			if (i == __atomic_load_n(&snap->links->active, __ATOMIC_RELAXED)) {
+				state = "active";
+			} else if (__atomic_load_n(&snap->links->link[i].unhealthy, __ATOMIC_RELAXED)) {
+				state = "unhealthy";
+			} else {
+				state = "standby";
+			}
+		}
+		ast_cli(a->fd, "%-14s %s %s, %u in flight, %u fanout copies missed\n", "Connection",
+			snap->names[i], state,
+			__atomic_load_n(&snap->links->link[i].inflight, __ATOMIC_RELAXED),
+			__atomic_load_n(&snap->links->link[i].fanout_failed, __ATOMIC_RELAXED));
+	}
+	for (i = 0; snap && i < snap->connection_count; i++) {
+		struct cdr_kafka_link *link = &snap->links->link[i];
+
+		if (!snap->producers[i]) {
+			continue;
+		}
+		link_poll(snap, i, metrics_now());
+		ast_cli(a->fd, "%-14s %s %zu queued, %zu bytes, %" PRIu64 " us delivery, %s\n",
+			"Producer", snap->names[i],
+			__atomic_load_n(&link->queue_len, __ATOMIC_RELAXED),
+			__atomic_load_n(&link->queue_bytes, __ATOMIC_RELAXED),
+			__atomic_load_n(&link->latency_us, __ATOMIC_RELAXED),
+			pressure_names[__atomic_load_n(&link->pressure, __ATOMIC_RELAXED)]);
+	}
+
+	ast_cli(a->fd, "\n%-12s %12s %10s %10s %10s %10s %10s\n",
+		"Stage (us)", "Count", "Mean", "p50", "p99", "p99.9", "Max");
+	for (i = 0; i < CDR_KAFKA_STAGE_COUNT; i++) {
+		cli_hist_row(a->fd, stage_names[i], &total->stages[i], 1000.0);
+	}
+	ast_cli(a->fd, "\n%-12s %12s %10s %10s %10s %10s %10s\n",
+		"Size (bytes)", "Count", "Mean", "p50", "p99", "p99.9", "Max");
+	cli_hist_row(a->fd, "Payload", &total->payload, 1.0);
+
+	ast_free(total);
+
+	return CLI_SUCCESS;
+}
+
+/*! \brief Traces dumped unless a count is given. */
+#define CDR_KAFKA_TRACE_DUMP 10
+
+static char *cli_trace_dump(int fd, size_t count)
+{
+	struct cdr_kafka_trace *traces;
+	size_t total;
+	size_t i;
+	size_t j;
+
+	traces = ast_malloc(CDR_KAFKA_TRACE_SLOTS * sizeof(*traces));
+	if (!traces) {
+		return CLI_FAILURE;
+	}
+	total = trace_collect(traces);
+
+	ast_cli(fd, "%zu traces, sampling %s\n", total,
+		__atomic_load_n(&trace_every, __ATOMIC_RELAXED) ? "on" : "off");
+	ast_cli(fd, "\n%10s", "Total (us)");
+	for (j = 0; j < CDR_KAFKA_SPAN_COUNT; j++) {
+		ast_cli(fd, " %9s", span_names[j]);
+	}
+	ast_cli(fd, " %8s %-5s %s\n", "Bytes", "Taken", "Topic / Key");
+	for (i = 0; i < MIN(count, total); i++) {
+		ast_cli(fd, "%10.1f", traces[i].total_ns / 1000.0);
+		for (j = 0; j < CDR_KAFKA_SPAN_COUNT; j++) {
+			ast_cli(fd, " %9.1f", traces[i].spans[j] / 1000.0);
+		}
+		ast_cli(fd, " %8zu %-5s %s / %s\n", traces[i].len, AST_YESNO(traces[i].taken),
+			traces[i].topic, S_OR(traces[i].key, "(none)"));
+	}
+
+	ast_free(traces);
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_trace(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	static const char * const choices[] = { "off", "dump", NULL };
+	unsigned int count = CDR_KAFKA_TRACE_DUMP;
+	unsigned int every;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "cdr kafka trace";
+		e->usage =
+			"Usage: cdr kafka trace {1/<N>|off|dump [<count>]}\n"
+			"       1/<N> records the publish timeline of every Nth CDR into a\n"
+			"       ring of the last 1024 traces, starting with an empty ring;\n"
+			"       off stops sampling and keeps the traces. dump shows the\n"
+			"       <count> slowest ones (default 10), by time from the CDR\n"
+			"       engine handing the CDR over until the producer returned.\n";
+		return NULL;
+	case CLI_GENERATE:
+		if (a->pos == 3) {
+			return ast_cli_complete(a->word, choices, a->n);
+		}
+		return NULL;
+	}
+
+	if (a->argc < 4) {
+		return CLI_SHOWUSAGE;
+	}
+
+	if (!strcasecmp(a->argv[3], "dump")) {
+		if (a->argc > 5 || (a->argc == 5 && (sscanf(a->argv[4], "%u", &count) != 1
+			|| !count))) {
+			return CLI_SHOWUSAGE;
+		}
+		return cli_trace_dump(a->fd, count);
+	}
+	if (a->argc != 4) {
+		return CLI_SHOWUSAGE;
+	}
+
+	if (!strcasecmp(a->argv[3], "off")) {
+		trace_set(0);
+		ast_cli(a->fd, "CDR Kafka tracing off\n");
+	} else if (sscanf(a->argv[3], "1/%u", &every) == 1 && every) {
+		trace_set(every);
+		ast_cli(a->fd, "Tracing 1 in %u CDRs\n", every);
+	} else {
+		return CLI_SHOWUSAGE;
+	}
+
+	return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry cli_commands[] = {
+	AST_CLI_DEFINE(handle_cli_show_stats, "Show CDR Kafka publish statistics"),
+	AST_CLI_DEFINE(handle_cli_trace, "Trace sampled CDR Kafka publishes"),
+};
+
+static void manager_hist(struct mansession *s, const char *name, const struct cdr_kafka_hist *hist)
+{
+	astman_append(s,
+		"%sCount: %" PRIu64 "\r\n"
+		"%sMean: %" PRIu64 "\r\n"
+		"%sP50: %" PRIu64 "\r\n"
+		"%sP99: %" PRIu64 "\r\n"
+		"%sP999: %" PRIu64 "\r\n"
+		"%sMax: %" PRIu64 "\r\n",
+		name, hist->count,
+		name, hist->count ? hist->sum / hist->count : 0,
+		name, hist_percentile(hist, 0.5),
+		name, hist_percentile(hist, 0.99),
+		name, hist_percentile(hist, 0.999),
+		name, hist->max);
+}
+
+static int manager_cdr_kafka_stats(struct mansession *s, const struct message *m)
+{
+	const char *id = astman_get_header(m, "ActionID");
+	struct cdr_kafka_metrics *total;
+	size_t i;
+
+	total = ast_malloc(sizeof(*total));
+	if (!total) {
+		astman_send_error(s, m, "Internal failure");
+		return 0;
+	}
+	metrics_snapshot(total);
+
+	astman_append(s, "Response: Success\r\n");
+	if (!ast_strlen_zero(id)) {
+		astman_append(s, "ActionID: %s\r\n", id);
+	}
+	for (i = 0; i < CDR_KAFKA_COUNTER_COUNT; i++) {
+		astman_append(s, "%s: %" PRIu64 "\r\n", counter_names[i], total->counters[i]);
+	}
+	for (i = 0; i < CDR_KAFKA_STAGE_COUNT; i++) {
+		manager_hist(s, stage_names[i], &total->stages[i]);
+	}
+	manager_hist(s, "Payload", &total->payload);
+	astman_append(s, "\r\n");
+
+	ast_free(total);
+
+	return 0;
+}
+
+/*!
+ * \brief Log a CDR, see kafka_cdr_log().
+ *
+ * \param trace Trace of the CDR, or NULL if it is not sampled. Aggregated
+ *        CDRs are not traced; queued ones take a copy along.
+ */
+static int cdr_kafka_log(struct ast_cdr *cdr, struct cdr_kafka_trace *trace)
+{
+	struct cdr_kafka_snapshot *snap = snapshot_get();
+	struct cdr_kafka_queue *queue;
+	uint64_t start;
+	int res;
+
+	/* Before anything is copied or encoded */
+	if (snap && snap->conf->global->filters
+		&& filters_drop(snap->conf->global->filters, cdr)) {
+		metrics_count(metrics_get(), CDR_KAFKA_COUNTER_FILTERED, 1);
+		return 0;
+	}
+
+	if (!ast_strlen_zero(cdr->linkedid)) {
+		struct cdr_kafka_aggregator *agg = ao2_global_obj_ref(call_aggregator);
+
+		if (agg) {
+			res = aggregator_add(agg, cdr);
+			ao2_ref(agg, -1);
+			if (!res) {
+				return 0;
+			}
+		}
+	}
+
+	queue = ao2_global_obj_ref(async_queue);
+	if (!queue) {
+		return cdr_kafka_publish(cdr, trace);
+	}
+
+	start = metrics_now();
+	res = queue_enqueue(queue, cdr,
+		priorities_class(snap ? snap->conf->global->priorities : NULL, cdr), trace);
+	ao2_ref(queue, -1);
+	metrics_time(metrics_get(), CDR_KAFKA_STAGE_ENQUEUE, metrics_now() - start);
+	if (res > 0) {
+		return cdr_kafka_publish(cdr, trace);
+	}
+
+	return res;
+}
+
+/*! \brief Log a CDR while tracing is on, sampling it first. */
+static int cdr_kafka_log_traced(struct ast_cdr *cdr)
+{
+	struct cdr_kafka_trace trace;
+	int res;
+
+	if (!trace_sample(&trace)) {
+		return cdr_kafka_log(cdr, NULL);
+	}
+
+	res = cdr_kafka_log(cdr, &trace);
+	/* Not published here when a publisher thread took a copy */
+	trace_commit(&trace);
+
+	return res;
+}
+
+/*!
+ * \brief CDR handler for Kafka.
+ *
+ * CDRs the filter rules drop are counted and go no further. With
+ * aggregation on, the CDR is buffered with the other CDRs of its call. In
+ * async mode the CDR is copied onto the queue and published later by a
+ * publisher thread, otherwise it is published right away.
+ *
+ * \param cdr CDR to log.
+ * \return 0 on success.
+ * \return -1 on error.
+ */
+static int kafka_cdr_log(struct ast_cdr *cdr)
+{
+	/* All tracing costs while it is off */
+	if (__atomic_load_n(&trace_every, __ATOMIC_RELAXED)) {
+		return cdr_kafka_log_traced(cdr);
+	}
+
+	return cdr_kafka_log(cdr, NULL);
+}
+
+#ifdef TEST_FRAMEWORK
+/*!
+ * \brief Run a CDR through the backend, for the perf tests.
+ *
+ * \param cdr CDR to log.
+ * \return Result of the CDR handler.
+ */
+int cdr_kafka_test_log(struct ast_cdr *cdr);
+int cdr_kafka_test_log(struct ast_cdr *cdr)
+{
+	return kafka_cdr_log(cdr);
+}
+
+/*!
+ * \brief Publish a CDR right away, bypassing the async queue.
+ *
+ * \return Result of cdr_kafka_publish().
+ */
+int cdr_kafka_test_publish(struct ast_cdr *cdr);
+int cdr_kafka_test_publish(struct ast_cdr *cdr)
+{
+	return cdr_kafka_publish(cdr, NULL);
+}
+
+/*!
+ * \brief Route everything the module produces to \a produce instead of res_kafka.
+ *
+ * \param produce Stand-in producer, or NULL to go back to res_kafka.
+ * \return 0 on success, -1 on error.
+ */
+int cdr_kafka_test_set_produce(cdr_kafka_test_produce_fn produce);
+int cdr_kafka_test_set_produce(cdr_kafka_test_produce_fn produce)
+{
+	__atomic_store_n(&test_produce, produce, __ATOMIC_RELEASE);
+
+	/* Swaps the producer for a placeholder, or back */
+	publish_snapshot();
+
+	return 0;
+}
+
+/*! \brief A thread that caches a snapshot across a reload, see cdr_kafka_test_reload(). */
+struct test_reload {
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	/*! \brief 1 once \c before is set, 2 once reloaded, 3 once \c after is set */
+	int stage;
+	/*! \brief Snapshots the thread got before and after the reload */
+	struct cdr_kafka_snapshot *before;
+	struct cdr_kafka_snapshot *after;
+	/*! \brief Set if the thread got \c after again without going back to the global */
+	int cached;
+};
+
+static void test_reload_stage(struct test_reload *reload, int stage)
+{
+	ast_mutex_lock(&reload->lock);
+	reload->stage = stage;
+	ast_cond_signal(&reload->cond);
+	ast_mutex_unlock(&reload->lock);
+}
+
+static void test_reload_wait(struct test_reload *reload, int stage)
+{
+	ast_mutex_lock(&reload->lock);
+	while (reload->stage < stage) {
+		ast_cond_wait(&reload->cond, &reload->lock);
+	}
+	ast_mutex_unlock(&reload->lock);
+}
+
+static void *test_reload_thread(void *data)
+{
+	struct test_reload *reload = data;
+
+	reload->before = ao2_bump(snapshot_get());
+	test_reload_stage(reload, 1);
+
+	test_reload_wait(reload, 2);
+	reload->after = ao2_bump(snapshot_get());
+	reload->cached = snapshot_get() == reload->after;
+	test_reload_stage(reload, 3);
+
+	return NULL;
+}
+
+/*!
+ * \brief Republish the snapshot, as a reload does, under a thread that cached the old one.
+ *
+ * A test must have replaced produce first.
+ *
+ * \return 0 if the thread then gets the new snapshot, and keeps getting it
+ * from its cache.
+ * \return 1 if it does not.
+ * \return -1 on error.
+ */
+int cdr_kafka_test_reload(void);
+int cdr_kafka_test_reload(void)
+{
+	RAII_VAR(struct cdr_kafka_snapshot *, current, NULL, ao2_cleanup);
+	struct test_reload reload = { .stage = 0, };
+	pthread_t thread;
+	int res = -1;
+
+	ast_mutex_init(&reload.lock);
+	ast_cond_init(&reload.cond, NULL);
+
+	if (ast_pthread_create(&thread, NULL, test_reload_thread, &reload)) {
+		goto done;
+	}
+
+	test_reload_wait(&reload, 1);
+	if (publish_snapshot()) {
+		ast_log(LOG_WARNING, "Republishing the snapshot found no producer\n");
+	}
+	current = ao2_global_obj_ref(current_snapshot);
+	test_reload_stage(&reload, 2);
+	test_reload_wait(&reload, 3);
+	pthread_join(thread, NULL);
+
+	if (reload.before && current) {
+		res = reload.before != current && reload.after == current && reload.cached ? 0 : 1;
+	}
+
+done:
+	ao2_cleanup(reload.before);
+	ao2_cleanup(reload.after);
+	ast_cond_destroy(&reload.cond);
+	ast_mutex_destroy(&reload.lock);
+
+	return res;
+}
+
+/*!
+ * \brief Serialize a CDR with the given fields and variables settings.
+ *
+ * \return The NUL terminated payload, valid until the next call on this thread.
+ * \return NULL on error.
+ */
+const char *cdr_kafka_test_encode_plan(struct ast_cdr *cdr, const char *fields,
+	const char *variables, size_t *len);
+const char *cdr_kafka_test_encode_plan(struct ast_cdr *cdr, const char *fields,
+	const char *variables, size_t *len)
+{
+	RAII_VAR(struct cdr_kafka_global_conf *, global, conf_global_create(), ao2_cleanup);
+
+	if (!global
+		|| ast_string_field_set(global, fields, fields)
+		|| ast_string_field_set(global, variables, variables)
+		|| plan_compile(global)) {
+		return NULL;
+	}
+
+	return encode_cdr_tls(global, cdr, len);
+}
+
+/*!
+ * \brief Serialize the summary record of a CDR.
+ *
+ * \param fields Value of the summary_fields option, NULL for the default.
+ * \param timestamps Value of the timestamps option.
+ * \return The NUL terminated payload, valid until the next call on this thread.
+ * \return NULL on error.
+ */
+const char *cdr_kafka_test_summary(struct ast_cdr *cdr, const char *fields,
+	const char *timestamps, size_t *len);
+const char *cdr_kafka_test_summary(struct ast_cdr *cdr, const char *fields,
+	const char *timestamps, size_t *len)
+{
+	RAII_VAR(struct cdr_kafka_global_conf *, global, conf_global_create(), ao2_cleanup);
+	struct cdr_kafka_buf *buf = encoder_buf_get();
+	struct ast_variable var = { .name = "timestamps", .value = timestamps, };
+
+	if (!global || !buf
+		|| timestamps_handler(NULL, &var, global)
+		|| ast_string_field_set(global, summary_topic, "cdr_summary")
+		|| (fields && ast_string_field_set(global, summary_fields, fields))
+		|| summary_compile(global)) {
+		return NULL;
+	}
+
+	buf->len = 0;
+	if (encode_cdr_plan(buf, global->summary, cdr, global->timestamps, NULL)) {
+		return NULL;
+	}
+	buf->data[buf->len] = '\0';
+	*len = buf->len;
+
+	return buf->data;
+}
+
+/*!
+ * \brief Serialize a CDR with the given fields and variable settings.
+ *
+ * \return The NUL terminated payload, valid until the next call on this thread.
+ * \return NULL on error.
+ */
+const char *cdr_kafka_test_encode_vars(struct ast_cdr *cdr, const char *fields,
+	const char *variables, unsigned int max_variables, unsigned int max_variable_length,
+	int nest, size_t *len);
+const char *cdr_kafka_test_encode_vars(struct ast_cdr *cdr, const char *fields,
+	const char *variables, unsigned int max_variables, unsigned int max_variable_length,
+	int nest, size_t *len)
+{
+	RAII_VAR(struct cdr_kafka_global_conf *, global, conf_global_create(), ao2_cleanup);
+
+	if (!global
+		|| ast_string_field_set(global, fields, fields)
+		|| ast_string_field_set(global, variables, variables)) {
+		return NULL;
+	}
+	global->max_variables = max_variables;
+	global->max_variable_length = max_variable_length;
+	global->nest_variables = nest;
+	if (plan_compile(global)) {
+		return NULL;
+	}
+
+	return encode_cdr_tls(global, cdr, len);
+}
+
+/*!
+ * \brief Serialize a CDR in the default layout with the given timestamps.
+ *
+ * \param timestamps "iso8601", "epoch_ms" or "epoch_us".
+ * \return The NUL terminated payload, valid until the next call on this thread.
+ * \return NULL on error.
+ */
+const char *cdr_kafka_test_encode_timestamps(struct ast_cdr *cdr, const char *timestamps,
+	size_t *len);
+const char *cdr_kafka_test_encode_timestamps(struct ast_cdr *cdr, const char *timestamps,
+	size_t *len)
+{
+	RAII_VAR(struct cdr_kafka_global_conf *, global, conf_global_create(), ao2_cleanup);
+	struct ast_variable var = { .name = "timestamps", .value = timestamps, };
+
+	if (!global || timestamps_handler(NULL, &var, global)) {
+		return NULL;
+	}
+
+	return encode_cdr_tls(global, cdr, len);
+}
+
+/*!
+ * \brief Serialize a CDR in a binary format.
+ *
+ * \param format "avro" or "protobuf".
+ * \return The payload, valid until the next call on this thread.
+ * \return NULL on error.
+ */
+const char *cdr_kafka_test_encode_format(struct ast_cdr *cdr, const char *format,
+	unsigned int schema_id, int loguniqueid, int loguserfield, size_t *len);
+const char *cdr_kafka_test_encode_format(struct ast_cdr *cdr, const char *format,
+	unsigned int schema_id, int loguniqueid, int loguserfield, size_t *len)
+{
+	RAII_VAR(struct cdr_kafka_global_conf *, global, conf_global_create(), ao2_cleanup);
+	struct ast_variable var = { .name = "format", .value = format, };
+
+	if (!global || format_handler(NULL, &var, global)) {
+		return NULL;
+	}
+	global->schema_id = schema_id;
+	global->loguniqueid = loguniqueid;
+	global->loguserfield = loguserfield;
+
+	return encode_cdr_tls(global, cdr, len);
+}
+
+/*!
+ * \brief Serialize a CDR under field_limits and max_payload_size.
+ *
+ * \param oversize_topic Value of the oversize_topic option.
+ * \param[out] oversized Whether the record is sent to the oversize topic.
+ * \param out Receives the headers of the message as "name=value\n" lines.
+ * \param size Size of \a out.
+ * \return The payload, valid until the next call on this thread.
+ * \return An empty payload if the record was dropped.
+ * \return NULL on error.
+ */
+const char *cdr_kafka_test_encode_bounded(struct ast_cdr *cdr, const char *field_limits,
+	unsigned int max_payload_size, const char *oversize_topic, int *oversized,
+	char *out, size_t size, size_t *len);
+const char *cdr_kafka_test_encode_bounded(struct ast_cdr *cdr, const char *field_limits,
+	unsigned int max_payload_size, const char *oversize_topic, int *oversized,
+	char *out, size_t size, size_t *len)
+{
+	RAII_VAR(struct cdr_kafka_global_conf *, global, conf_global_create(), ao2_cleanup);
+	struct cdr_kafka_buf *buf = encoder_buf_get();
+	struct ast_kafka_header hdr_buf[CDR_KAFKA_MAX_HEADERS];
+	const struct ast_kafka_header *hdrs;
+	struct cdr_kafka_cuts cuts;
+	const char *topic;
+	char ts_str[32] = "";
+	char dedupe_str[CDR_KAFKA_DEDUPE_LEN];
+	size_t count;
+	size_t i;
+	int res;
+
+	if (!global || !buf
+		|| ast_string_field_set(global, field_limits, field_limits)
+		|| ast_string_field_set(global, oversize_topic, oversize_topic)
+		|| ast_string_field_set(global, headers, "entity_id")) {
+		return NULL;
+	}
+	global->max_payload_size = max_payload_size;
+	if (plan_compile(global) || headers_compile(global)) {
+		return NULL;
+	}
+
+	buf->len = 0;
+	res = encode_cdr_bounded(buf, 0, global, cdr, &cuts, &topic, NULL);
+	if (res < 0) {
+		return NULL;
+	}
+	buf->data[buf->len] = '\0';
+	*len = buf->len;
+	*oversized = !res && topic != NULL;
+	*out = '\0';
+	if (res) {
+		return buf->data;
+	}
+
+	hdrs = headers_get(global->header_block, hdr_buf, ts_str, dedupe_str, cdr, cuts.keys, &count);
+	for (i = 0; i < count; i++) {
+		ast_build_string(&out, &size, "%s=%s\n", hdrs[i].name, hdrs[i].value);
+	}
+
+	return buf->data;
+}
+
+/*! \brief A spool in a new temporary directory, without a replay thread. */
+static struct cdr_kafka_spool *test_spool_alloc(void)
+{
+	struct cdr_kafka_spool *spool;
+
+	spool = ao2_alloc_options(sizeof(*spool), spool_dtor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!spool) {
+		return NULL;
+	}
+	ast_mutex_init(&spool->lock);
+	ast_cond_init(&spool->cond, NULL);
+	spool->thread = AST_PTHREADT_NULL;
+	spool->fd = -1;
+	spool->segment_size = 65536;
+	spool->refilled = ast_tvnow();
+	ast_copy_string(spool->dir, "/tmp/cdr_kafka_spool.XXXXXX", sizeof(spool->dir));
+	if (!mkdtemp(spool->dir)) {
+		ao2_ref(spool, -1);
+		return NULL;
+	}
+
+	return spool;
+}
+
+/*! \brief Seal a test_spool_alloc() spool and delete its segments and directory. */
+static void test_spool_remove(struct cdr_kafka_spool *spool)
+{
+	char path[PATH_MAX];
+	uint64_t seq;
+
+	ast_mutex_lock(&spool->lock);
+	spool_seal(spool);
+	ast_mutex_unlock(&spool->lock);
+
+	for (seq = 0; seq < spool->next_seq; seq++) {
+		spool_segment_path(spool, seq, path, sizeof(path));
+		unlink(path);
+	}
+	rmdir(spool->dir);
+}
+
+/*!
+ * \brief Spool a CDR into a private spool and replay it.
+ *
+ * The CDR is encoded with lastdata capped, so it also carries a truncated
+ * header, and spooled under \a headers into a spool in a temporary
+ * directory that is removed again. Replay goes to the stand-in producer.
+ *
+ * \param headers Value of the headers option.
+ * \param out Receives the headers the CDR was spooled with as "name=value\n" lines.
+ * \param size Size of \a out.
+ * \return 0 if the CDR was replayed, -1 on error.
+ */
+int cdr_kafka_test_spool_replay(struct ast_cdr *cdr, const char *headers, char *out, size_t size);
+int cdr_kafka_test_spool_replay(struct ast_cdr *cdr, const char *headers, char *out, size_t size)
+{
+	RAII_VAR(struct cdr_kafka_global_conf *, global, conf_global_create(), ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_spool *, spool, NULL, ao2_cleanup);
+	struct cdr_kafka_buf *buf = encoder_buf_get();
+	struct cdr_kafka_buf packed = { NULL, };
+	struct ast_kafka_header hdr_buf[CDR_KAFKA_MAX_HEADERS];
+	const struct ast_kafka_header *hdrs;
+	struct cdr_kafka_cuts cuts;
+	const char *topic;
+	char ts_str[32] = "";
+	char dedupe_str[CDR_KAFKA_DEDUPE_LEN];
+	size_t count;
+	size_t i;
+	int res;
+
+	if (!global || !buf
+		|| ast_string_field_set(global, field_limits, "lastdata:3")
+		|| ast_string_field_set(global, headers, headers)
+		|| plan_compile(global) || headers_compile(global)) {
+		return -1;
+	}
+
+	spool = test_spool_alloc();
+	if (!spool) {
+		return -1;
+	}
+
+	*out = '\0';
+	buf->len = 0;
+	res = encode_cdr_bounded(buf, 0, global, cdr, &cuts, &topic, NULL) ? -1 : 0;
+	if (!res) {
+		hdrs = headers_get(global->header_block, hdr_buf, ts_str, dedupe_str, cdr, cuts.keys,
+			&count);
+		for (i = 0; i < count; i++) {
+			ast_build_string(&out, &size, "%s=%s\n", hdrs[i].name, hdrs[i].value);
+		}
+		res = headers_pack(&packed, hdrs, count);
+		if (!res) {
+			res = spool_write(spool, NULL, "cdr_kafka_test", packed.data, packed.len,
+				buf->data, buf->len);
+		}
+		ast_free(packed.data);
+	}
+
+	ast_mutex_lock(&spool->lock);
+	spool_seal(spool);
+	ast_mutex_unlock(&spool->lock);
+	if (!res) {
+		res = spool_replay_segment(spool, spool->active_seq);
+	}
+	test_spool_remove(spool);
+
+	return res;
+}
+
+/*!
+ * \brief Spool payloads, damage the segments and replay them as on the next start.
+ *
+ * The payloads go to a spool in a temporary directory, \a per_segment to
+ * a segment. The spool is then scanned with spool_scan() and its segments
+ * replayed oldest first through the stand-in producer.
+ *
+ * \param damage 0 for none; 1 to leave the last segment unsealed, as a
+ *        crash does; 2 to cut the segment of entry \a damaged short inside
+ *        it; 3 to flip the first payload byte of entry \a damaged.
+ * \return Number of segments found, or -1 on error.
+ */
+int cdr_kafka_test_spool_recover(const char **payloads, size_t count, size_t per_segment,
+	int damage, size_t damaged);
+int cdr_kafka_test_spool_recover(const char **payloads, size_t count, size_t per_segment,
+	int damage, size_t damaged)
+{
+	static const char topic[] = "cdr_kafka_test";
+	RAII_VAR(struct cdr_kafka_spool *, spool, test_spool_alloc(), ao2_cleanup);
+	struct cdr_kafka_buf packed = { NULL, };
+	char path[PATH_MAX];
+	uint64_t damaged_seq = 0;
+	size_t damaged_off = 0;
+	size_t headers_len;
+	uint64_t seq;
+	size_t i;
+	int res = 0;
+
+	if (!spool || !per_segment || headers_pack(&packed, NULL, 0)) {
+		ast_free(packed.data);
+		return -1;
+	}
+	headers_len = packed.len;
+
+	for (i = 0; i < count && !res; i++) {
+		ast_mutex_lock(&spool->lock);
+		if (i && !(i % per_segment)) {
+			spool_seal(spool);
+		}
+		if (i == damaged) {
+			/* Where spool_write() is about to put it */
+			damaged_seq = spool->fd >= 0 ? spool->active_seq : spool->next_seq;
+			damaged_off = spool->fd >= 0 ? spool->used : 0;
+		}
+		ast_mutex_unlock(&spool->lock);
+
+		res = spool_write(spool, NULL, topic, packed.data, headers_len, payloads[i],
+			strlen(payloads[i]));
+	}
+	ast_free(packed.data);
+
+	ast_mutex_lock(&spool->lock);
+	if (damage == 1 && spool->fd >= 0) {
+		/* Gone without trimming the segment to what was written */
+		munmap(spool->map, spool->size);
+		close(spool->fd);
+		spool->fd = -1;
+		spool->map = NULL;
+	}
+	spool_seal(spool);
+	ast_mutex_unlock(&spool->lock);
+
+	if (!res && (damage == 2 || damage == 3) && damaged < count) {
+		size_t size = spool_entry_size(CDR_KAFKA_SPOOL_NO_KEY, strlen(topic), headers_len,
+			strlen(payloads[damaged]));
+		off_t payload = damaged_off + sizeof(struct cdr_kafka_spool_entry) + sizeof(topic)
+			+ headers_len;
+		char byte;
+		int fd;
+
+		spool_segment_path(spool, damaged_seq, path, sizeof(path));
+		fd = open(path, O_RDWR);
+		if (fd < 0) {
+			res = -1;
+		} else if (damage == 2) {
+			res = ftruncate(fd, damaged_off + size / 2);
+		} else if (pread(fd, &byte, 1, payload) != 1) {
+			res = -1;
+		} else {
+			byte ^= 0x20;
+			res = pwrite(fd, &byte, 1, payload) == 1 ? 0 : -1;
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+
+	/* Found again as on the next start */
+	spool->oldest_seq = 0;
+	spool->next_seq = 0;
+	if (!res) {
+		res = spool_scan(spool);
+	}
+	for (seq = spool->oldest_seq; !res && seq < spool->next_seq; seq++) {
+		res = spool_replay_segment(spool, seq);
+	}
+	if (!res) {
+		res = spool->next_seq - spool->oldest_seq;
+	}
+	test_spool_remove(spool);
+
+	return res;
+}
+
+/*!
+ * \brief Render the headers a CDR would get as "name=value\n" lines.
+ *
+ * \param headers Value of the headers option.
+ * \param cdr CDR the headers are for, or NULL as for a spooled message.
+ * \param out Receives the headers.
+ * \param size Size of \a out.
+ * \return Number of headers, or -1 on error.
+ */
+int cdr_kafka_test_headers(const char *headers, struct ast_cdr *cdr, char *out, size_t size);
+int cdr_kafka_test_headers(const char *headers, struct ast_cdr *cdr, char *out, size_t size)
+{
+	RAII_VAR(struct cdr_kafka_global_conf *, global, conf_global_create(), ao2_cleanup);
+	struct ast_kafka_header hdr_buf[CDR_KAFKA_MAX_HEADERS];
+	const struct ast_kafka_header *hdrs;
+	char ts_str[32] = "";
+	char dedupe_str[CDR_KAFKA_DEDUPE_LEN];
+	size_t count;
+	size_t i;
+
+	if (!global
+		|| ast_string_field_set(global, headers, headers)
+		|| headers_compile(global)) {
+		return -1;
+	}
+
+	hdrs = headers_get(global->header_block, hdr_buf, ts_str, dedupe_str, cdr, NULL, &count);
+	*out = '\0';
+	for (i = 0; i < count; i++) {
+		ast_build_string(&out, &size, "%s=%s\n", hdrs[i].name, hdrs[i].value);
+	}
+
+	return count;
+}
+
+/*!
+ * \brief Build the headers of \a cdr \a iterations times, for the benchmarks.
+ *
+ * \param headers Value of the headers option, compiled once per call.
+ * \return Number of headers, or -1 on error.
+ */
+int cdr_kafka_test_headers_bench(const char *headers, struct ast_cdr *cdr,
+	unsigned int iterations);
+int cdr_kafka_test_headers_bench(const char *headers, struct ast_cdr *cdr,
+	unsigned int iterations)
+{
+	RAII_VAR(struct cdr_kafka_global_conf *, global, conf_global_create(), ao2_cleanup);
+	struct ast_kafka_header hdr_buf[CDR_KAFKA_MAX_HEADERS];
+	const struct ast_kafka_header * volatile hdrs;
+	char ts_str[32];
+	char dedupe_str[CDR_KAFKA_DEDUPE_LEN];
+	size_t count = 0;
+	unsigned int i;
+
+	if (!global
+		|| ast_string_field_set(global, headers, headers)
+		|| headers_compile(global)) {
+		return -1;
+	}
+
+	for (i = 0; i < iterations; i++) {
+		/* A new message each time, so the timestamp is formatted again */
+		*ts_str = '\0';
+		hdrs = headers_get(global->header_block, hdr_buf, ts_str, dedupe_str, cdr, NULL, &count);
+	}
+	(void) hdrs;
+
+	return count;
+}
+
+/*!
+ * \brief Serialize a CDR as JSON with \c compression = zstd.
+ *
+ * \param dictionary Value of the compression_dictionary option.
+ * \param headers Receives the headers the payload gets as "name=value\n" lines.
+ * \param size Size of \a headers.
+ * \return The payload, valid until the next call on this thread.
+ * \return NULL on error.
+ */
+const char *cdr_kafka_test_compress(struct ast_cdr *cdr, const char *dictionary, int level,
+	size_t *len, char *headers, size_t size);
+const char *cdr_kafka_test_compress(struct ast_cdr *cdr, const char *dictionary, int level,
+	size_t *len, char *headers, size_t size)
+{
+	RAII_VAR(struct cdr_kafka_global_conf *, global, conf_global_create(), ao2_cleanup);
+	struct ast_variable var = { .name = "compression", .value = "zstd", };
+	struct ast_kafka_header hdr_buf[CDR_KAFKA_MAX_HEADERS];
+	const struct ast_kafka_header *hdrs;
+	char ts_str[32] = "";
+	char dedupe_str[CDR_KAFKA_DEDUPE_LEN];
+	size_t count;
+	size_t i;
+
+	if (!global
+		|| compression_handler(NULL, &var, global)
+		|| ast_string_field_set(global, compression_dictionary, dictionary)
+		|| ast_string_field_set(global, headers, "")) {
+		return NULL;
+	}
+	global->compression_level = level;
+	if (zstd_compile(global) || headers_compile(global)) {
+		return NULL;
+	}
+
+	hdrs = headers_get(global->header_block, hdr_buf, ts_str, dedupe_str, cdr, NULL, &count);
+	*headers = '\0';
+	for (i = 0; i < count; i++) {
+		ast_build_string(&headers, &size, "%s=%s\n", hdrs[i].name, hdrs[i].value);
+	}
+
+	return encode_cdr_tls(global, cdr, len);
+}
+
+/*!
+ * \brief Copy the topic a CDR is published to into \a out.
+ *
+ * \param routes "value => topic" routes separated by newlines.
+ * \return 0 on success, -1 on error.
+ */
+int cdr_kafka_test_topic(const char *topic, const char *route_by, const char *routes,
+	struct ast_cdr *cdr, char *out, size_t size);
+int cdr_kafka_test_topic(const char *topic, const char *route_by, const char *routes,
+	struct ast_cdr *cdr, char *out, size_t size)
+{
+	RAII_VAR(struct cdr_kafka_global_conf *, global, conf_global_create(), ao2_cleanup);
+	char buf[CDR_KAFKA_TOPIC_LEN + 1];
+
+	if (!global
+		|| ast_string_field_set(global, topic, topic)
+		|| ast_string_field_set(global, route_by, route_by)
+		|| ast_string_field_set(global, routes, routes)
+		|| topics_compile(global)) {
+		return -1;
+	}
+
+	ast_copy_string(out, cdr_kafka_topic(global, cdr, buf), size);
+
+	return 0;
+}
+
+/*!
+ * \brief Run a CDR through filter rules.
+ *
+ * \param filter "conditions => action" rules separated by newlines.
+ * \return 1 if the CDR is dropped, 0 if it is kept, -1 on error.
+ */
+int cdr_kafka_test_filter(const char *filter, struct ast_cdr *cdr);
+int cdr_kafka_test_filter(const char *filter, struct ast_cdr *cdr)
+{
+	RAII_VAR(struct cdr_kafka_global_conf *, global, conf_global_create(), ao2_cleanup);
+
+	if (!global
+		|| ast_string_field_set(global, filter, filter)
+		|| filters_compile(global)) {
+		return -1;
+	}
+
+	return global->filters ? filters_drop(global->filters, cdr) : 0;
+}
+
+/*!
+ * \brief Aggregate CDRs with a private aggregator and publish the calls.
+ *
+ * The calls are published through the produce stand-in before this
+ * returns: calls that filled up first, then \a end_linkedid if given, then
+ * the others in the order they last got a CDR.
+ *
+ * \param end_linkedid Call marked as ended, or NULL.
+ * \param end_first Whether the call is marked as ended before the CDRs are
+ *        added rather than after.
+ * \return 0 on success, -1 on error.
+ */
+int cdr_kafka_test_aggregate(struct ast_cdr **cdrs, size_t count, unsigned int max_legs,
+	const char *end_linkedid, int end_first);
+int cdr_kafka_test_aggregate(struct ast_cdr **cdrs, size_t count, unsigned int max_legs,
+	const char *end_linkedid, int end_first)
+{
+	RAII_VAR(struct cdr_kafka_global_conf *, global, conf_global_create(), ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_aggregator *, agg, NULL, ao2_cleanup);
+	size_t i;
+	int res = 0;
+
+	if (!global) {
+		return -1;
+	}
+	/* Long enough that only stopping publishes the calls that are not full */
+	global->aggregate_timeout = 3600000;
+	global->aggregate_max_legs = max_legs;
+
+	agg = aggregator_alloc(global);
+	if (!agg) {
+		return -1;
+	}
+
+	if (end_linkedid && end_first) {
+		aggregator_end(agg, end_linkedid);
+	}
+	for (i = 0; i < count && !res; i++) {
+		res = aggregator_add(agg, cdrs[i]);
+	}
+	if (end_linkedid && !end_first) {
+		aggregator_end(agg, end_linkedid);
+	}
+	aggregator_stop(agg);
+
+	return res;
+}
+
+/*!
+ * \brief Run failover over dummy connections, one message per step.
+ *
+ * Step \c i is produced \a step_ms after the one before it, with the
+ * connections whose bit is set in \a failing[i] failing it. Messages sent
+ * to a connection whose bit is set in \a held[i] stay in flight until a
+ * step without that bit.
+ *
+ * \param connections Number of connections.
+ * \param missing Connections without a producer, as a bit mask.
+ * \param[out] used Connection each step was produced through, -1 for none.
+ * \return 0 on success, -1 on error.
+ */
+int cdr_kafka_test_failover(unsigned int connections, unsigned int missing,
+	unsigned int error_rate, unsigned int queue_depth, unsigned int recovery_ms,
+	const unsigned int *failing, const unsigned int *held, size_t steps,
+	unsigned int step_ms, int *used);
+int cdr_kafka_test_failover(unsigned int connections, unsigned int missing,
+	unsigned int error_rate, unsigned int queue_depth, unsigned int recovery_ms,
+	const unsigned int *failing, const unsigned int *held, size_t steps,
+	unsigned int step_ms, int *used)
 {
-	RAII_VAR(struct cdr_kafka_global_conf *, global, NULL, ao2_cleanup);
+	static const char *names[] = { "a", "b", "c", "d", };
+	RAII_VAR(struct cdr_kafka_snapshot *, snap, NULL, ao2_cleanup);
+	struct cdr_kafka_links links;
+	unsigned int holding[CDR_KAFKA_CONNECTIONS_MAX] = { 0, };
+	unsigned int i;
+	size_t step;
 
-	global = ao2_alloc(sizeof(*global), conf_global_dtor);
-	if (!global) {
-		return NULL;
+	if (!connections || connections > CDR_KAFKA_CONNECTIONS_MAX) {
+		return -1;
 	}
 
-	if (ast_string_field_init(global, 64) != 0) {
-		return NULL;
+	snap = ao2_alloc_options(sizeof(*snap), snapshot_dtor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!snap || !(snap->conf = conf_alloc())) {
+		return -1;
 	}
+	snap->conf->global->connection_mode = CDR_KAFKA_CONNECTIONS_FAILOVER;
+	snap->conf->global->failover_error_rate = error_rate;
+	snap->conf->global->failover_queue_depth = queue_depth;
+	snap->conf->global->failover_recovery = recovery_ms;
 
-	aco_set_defaults(&global_option, "global", global);
+	memset(&links, 0, sizeof(links));
+	snap->links = &links;
+	snap->connection_count = connections;
+	for (i = 0; i < connections; i++) {
+		snap->names[i] = names[i];
+		if (missing & (1U << i)) {
+			continue;
+		}
+		/* Never handed to res_kafka */
+		snap->producers[i] = ao2_alloc_options(1, NULL, AO2_ALLOC_OPT_LOCK_NOLOCK);
+		if (!snap->producers[i]) {
+			return -1;
+		}
+		snap->connected++;
+	}
 
-	return ao2_bump(global);
-}
+	for (step = 0; step < steps; step++) {
+		uint64_t now = (uint64_t) (step + 1) * step_ms * 1000000;
+		int res;
 
-/*! \brief The conf file that's processed for the module. */
-static struct aco_file conf_file = {
-	/*! The config file name. */
-	.filename = CONF_FILENAME,
-	/*! The mapping object types to be processed. */
-	.types = ACO_TYPES(&global_option),
-};
+		for (i = 0; i < connections; i++) {
+			if (holding[i] && !(held[step] & (1U << i))) {
+				links.link[i].inflight -= holding[i];
+				holding[i] = 0;
+			}
+		}
 
-static void conf_dtor(void *obj)
-{
-	struct cdr_kafka_conf *conf = obj;
+		i = links_pick(snap, now);
+		if (!snap->producers[i]) {
+			used[step] = -1;
+			continue;
+		}
+		used[step] = i;
+		res = failing[step] & (1U << i) ? -1 : 0;
+		if (!res && (held[step] & (1U << i))) {
+			links.link[i].inflight++;
+			holding[i]++;
+		}
+		link_report(snap, i, !res, !!res, now);
+	}
 
-	ao2_cleanup(conf->global);
+	return 0;
 }
 
-static void *conf_alloc(void)
+/*!
+ * \brief Produce one pooled payload over dummy fanout connections.
+ *
+ * A test must have replaced produce first. The copies are produced before
+ * the payload is handed to the first connection.
+ *
+ * \param[out] missed Fanout copies each connection missed.
+ * \return What snapshot_produce_owned() returned, or -1 on error.
+ */
+int cdr_kafka_test_fanout(unsigned int connections, const char *payload, unsigned int *missed);
+int cdr_kafka_test_fanout(unsigned int connections, const char *payload, unsigned int *missed)
 {
-	RAII_VAR(struct cdr_kafka_conf *, conf, NULL, ao2_cleanup);
+	static const char *names[] = { "a", "b", "c", "d", };
+	RAII_VAR(struct cdr_kafka_snapshot *, snap, NULL, ao2_cleanup);
+	struct cdr_kafka_pool_buf *pool_buf;
+	struct cdr_kafka_links links;
+	unsigned int i;
+	int res;
 
-	conf = ao2_alloc_options(sizeof(*conf), conf_dtor,
-		AO2_ALLOC_OPT_LOCK_NOLOCK);
-	if (!conf) {
-		return NULL;
+	if (!connections || connections > CDR_KAFKA_CONNECTIONS_MAX) {
+		return -1;
 	}
 
-	conf->global = conf_global_create();
-	if (!conf->global) {
-		return NULL;
+	snap = ao2_alloc_options(sizeof(*snap), snapshot_dtor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!snap || !(snap->conf = conf_alloc())) {
+		return -1;
 	}
+	snap->conf->global->connection_mode = CDR_KAFKA_CONNECTIONS_FANOUT;
 
-	return ao2_bump(conf);
-}
+	memset(&links, 0, sizeof(links));
+	snap->links = &links;
+	snap->connection_count = connections;
+	for (i = 0; i < connections; i++) {
+		snap->names[i] = names[i];
+		snap->producers[i] = ao2_alloc_options(1, NULL, AO2_ALLOC_OPT_LOCK_NOLOCK);
+		if (!snap->producers[i]) {
+			return -1;
+		}
+		snap->connected++;
+	}
 
-static int setup_kafka(void);
+	pool_buf = pool_get();
+	if (!pool_buf) {
+		return -1;
+	}
+	if (buf_append(&pool_buf->buf, payload, strlen(payload))) {
+		pool_put(pool_buf);
+		return -1;
+	}
+	res = snapshot_produce_owned(snap, "cdr", NULL, pool_buf, NULL, 0);
+	if (res) {
+		pool_put(pool_buf);
+	}
 
-CONFIG_INFO_STANDARD(cfg_info, confs, conf_alloc,
-	.files = ACO_FILES(&conf_file),
-	.pre_apply_config = setup_kafka,
-);
+	for (i = 0; i < connections; i++) {
+		missed[i] = links.link[i].fanout_failed;
+	}
 
-static int setup_kafka(void)
+	return res;
+}
+
+/*!
+ * \brief Warm up dummy producers for a topic and its routes.
+ *
+ * A test must have replaced produce first, and sets the partition count
+ * partition_count() reports, -1 for topics whose metadata never arrives.
+ *
+ * \param[out] warmed Number of topics warm_topic() was asked for.
+ * \return enum cdr_kafka_warmup_state the warm-up ended in, -1 on error.
+ */
+int cdr_kafka_test_warmup(const char *topic, const char *route_by, const char *routes,
+	unsigned int connections, int partitions, unsigned int timeout_ms, unsigned int *warmed);
+int cdr_kafka_test_warmup(const char *topic, const char *route_by, const char *routes,
+	unsigned int connections, int partitions, unsigned int timeout_ms, unsigned int *warmed)
 {
-	struct cdr_kafka_conf *conf = aco_pending_config(&cfg_info);
+	RAII_VAR(struct cdr_kafka_snapshot *, snap, NULL, ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_warmup *, warmup, NULL, ao2_cleanup);
+	struct cdr_kafka_global_conf *global;
+	enum cdr_kafka_warmup_state state;
+	unsigned int i;
 
-	if (!conf) {
-		return 0;
+	if (!__atomic_load_n(&test_produce, __ATOMIC_ACQUIRE)
+		|| !connections || connections > CDR_KAFKA_CONNECTIONS_MAX) {
+		return -1;
 	}
 
-	if (!conf->global) {
-		ast_log(LOG_ERROR, "Invalid cdr_kafka.conf\n");
+	snap = ao2_alloc_options(sizeof(*snap), snapshot_dtor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!snap || !(snap->conf = conf_alloc())) {
+		return -1;
+	}
+	global = snap->conf->global;
+	if (ast_string_field_set(global, topic, topic)
+		|| ast_string_field_set(global, route_by, route_by)
+		|| ast_string_field_set(global, routes, routes)
+		|| topics_compile(global)) {
+		return -1;
+	}
+	global->warmup_timeout = timeout_ms;
+	snap->connection_count = connections;
+	for (i = 0; i < connections; i++) {
+		/* Never handed to res_kafka */
+		snap->producers[i] = ao2_alloc_options(1, NULL, AO2_ALLOC_OPT_LOCK_NOLOCK);
+		if (!snap->producers[i]) {
+			return -1;
+		}
+		snap->connected++;
+	}
+
+	__atomic_store_n(&test_warmed, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&test_partitions, partitions, __ATOMIC_RELAXED);
+	warmup = warmup_alloc(snap);
+	if (!warmup) {
+		__atomic_store_n(&test_partitions, 0, __ATOMIC_RELAXED);
 		return -1;
 	}
+	do {
+		usleep(CDR_KAFKA_WARMUP_POLL_MS * 1000 / 4);
+		ast_mutex_lock(&warmup->lock);
+		state = warmup->state;
+		ast_mutex_unlock(&warmup->lock);
+	} while (state == CDR_KAFKA_WARMUP_RUNNING);
+	warmup_stop(warmup);
+	__atomic_store_n(&test_partitions, 0, __ATOMIC_RELAXED);
+	*warmed = __atomic_load_n(&test_warmed, __ATOMIC_RELAXED);
 
-	return 0;
+	return state;
 }
 
-static int setup_cached_producer(void)
+/*!
+ * \brief Feed producer queue lengths to the backpressure levels.
+ *
+ * Each step reports \a queue_lens[i] as the queue length of a dummy
+ * producer and polls it one poll interval after the step before.
+ *
+ * \param[out] levels enum cdr_kafka_pressure after each step.
+ * \return 0 on success, -1 on error.
+ */
+int cdr_kafka_test_pressure(unsigned int low, unsigned int high,
+	const size_t *queue_lens, size_t steps, int *levels);
+int cdr_kafka_test_pressure(unsigned int low, unsigned int high,
+	const size_t *queue_lens, size_t steps, int *levels)
 {
-	RAII_VAR(struct cdr_kafka_conf *, conf, ao2_global_obj_ref(confs), ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_snapshot *, snap, NULL, ao2_cleanup);
+	struct cdr_kafka_links links;
+	size_t step;
 
-	if (!conf || !conf->global || ast_strlen_zero(conf->global->connection)) {
-		ast_log(LOG_WARNING, "No Kafka connection configured\n");
+	snap = ao2_alloc_options(sizeof(*snap), snapshot_dtor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!snap || !(snap->conf = conf_alloc())) {
 		return -1;
 	}
+	snap->conf->global->backpressure_low = low;
+	snap->conf->global->backpressure_high = high;
 
-	struct ast_kafka_producer *producer = ast_kafka_get_producer(conf->global->connection);
-	if (!producer) {
-		ast_log(LOG_ERROR, "Failed to get Kafka producer for connection '%s'\n",
-			conf->global->connection);
+	memset(&links, 0, sizeof(links));
+	snap->links = &links;
+	snap->connection_count = 1;
+	snap->names[0] = "test";
+	/* Never handed to res_kafka */
+	snap->producers[0] = ao2_alloc_options(1, NULL, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	if (!snap->producers[0]) {
 		return -1;
 	}
+	snap->connected = 1;
+
+	memset(&test_stats, 0, sizeof(test_stats));
+	__atomic_store_n(&test_stats_set, 1, __ATOMIC_RELEASE);
+	for (step = 0; step < steps; step++) {
+		test_stats.queue_len = queue_lens[step];
+		test_stats.queue_bytes = queue_lens[step] * 100;
+		if (link_poll(snap, 0, (uint64_t) (step + 1) * CDR_KAFKA_POLL_NS) != queue_lens[step]) {
+			levels[step] = -1;
+			continue;
+		}
+		levels[step] = links.link[0].pressure;
+	}
+	__atomic_store_n(&test_stats_set, 0, __ATOMIC_RELEASE);
 
-	ao2_global_obj_replace_unref(cached_producer, producer);
-	ao2_cleanup(producer);
 	return 0;
 }
 
 /*!
- * \brief Extract the value of a named CDR field for use as Kafka key.
+ * \brief Push CDRs through an async queue of \a threads workers.
  *
- * \param cdr The CDR record.
- * \param field_name The CDR field name (e.g. "linkedid", "src").
- * \return The field value string, or NULL if field_name is empty/unknown.
+ * The records are published with the loaded configuration, through the
+ * stand-in producer, before this returns.
+ *
+ * \param[out] shards Worker each CDR was queued for.
+ * \return 0 on success, -1 on error.
  */
-const char *cdr_get_key_value(struct ast_cdr *cdr, const char *field_name);
-const char *cdr_get_key_value(struct ast_cdr *cdr, const char *field_name)
+int cdr_kafka_test_queue(struct ast_cdr **cdrs, size_t count, unsigned int threads,
+	unsigned int batch_size, size_t *shards);
+int cdr_kafka_test_queue(struct ast_cdr **cdrs, size_t count, unsigned int threads,
+	unsigned int batch_size, size_t *shards)
 {
-	if (ast_strlen_zero(field_name)) {
-		return NULL;
+	RAII_VAR(struct cdr_kafka_global_conf *, global, conf_global_create(), ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_queue *, queue, NULL, ao2_cleanup);
+	size_t i;
+	int res = 0;
+
+	if (!global) {
+		return -1;
 	}
+	global->publisher_threads = threads;
+	global->batch_size = batch_size;
 
-	if (!strcasecmp(field_name, "linkedid")) {
-		return cdr->linkedid;
-	} else if (!strcasecmp(field_name, "uniqueid")) {
-		return cdr->uniqueid;
-	} else if (!strcasecmp(field_name, "channel")) {
-		return cdr->channel;
-	} else if (!strcasecmp(field_name, "dstchannel")) {
-		return cdr->dstchannel;
-	} else if (!strcasecmp(field_name, "accountcode")) {
-		return cdr->accountcode;
-	} else if (!strcasecmp(field_name, "src")) {
-		return cdr->src;
-	} else if (!strcasecmp(field_name, "dst")) {
-		return cdr->dst;
-	} else if (!strcasecmp(field_name, "dcontext")) {
-		return cdr->dcontext;
-	} else if (!strcasecmp(field_name, "tenantid")) {
-		return cdr->tenantid;
-	} else if (!strcasecmp(field_name, "peertenantid")) {
-		return cdr->peertenantid;
+	queue = queue_alloc(global);
+	if (!queue || queue_start(queue)) {
+		return -1;
 	}
 
-	return NULL;
+	for (i = 0; i < count && !res; i++) {
+		shards[i] = queue_shard(queue, cdrs[i]);
+		res = queue_enqueue(queue, cdrs[i], CDR_KAFKA_PRIORITY_NORMAL, NULL);
+	}
+	queue_stop(queue);
+
+	return res;
 }
 
 /*!
- * \brief CDR handler for Kafka.
+ * \brief Push CDRs through a queue of one publisher thread under an overflow policy.
  *
- * \param cdr CDR to log.
- * \return 0 on success.
- * \return -1 on error.
+ * The records are published with the loaded configuration, through the
+ * stand-in producer, before this returns; a slow one fills the queue.
+ *
+ * \param overflow Value of the overflow option.
+ * \param spool Value of the spool option. If set, a spool in a temporary
+ *        directory stands in for the configured one meanwhile.
+ * \param queue_size Value of the queue_size option.
+ * \return Number of records the queue dropped, or -1 on error.
  */
-static int kafka_cdr_log(struct ast_cdr *cdr)
+int cdr_kafka_test_overflow(const char *overflow, int spool, unsigned int queue_size,
+	struct ast_cdr **cdrs, size_t count);
+int cdr_kafka_test_overflow(const char *overflow, int spool, unsigned int queue_size,
+	struct ast_cdr **cdrs, size_t count)
 {
-	RAII_VAR(struct cdr_kafka_conf *, conf, NULL, ao2_cleanup);
-	RAII_VAR(struct ast_json *, json, NULL, ast_json_unref);
-	RAII_VAR(char *, str, NULL, ast_json_free);
+	RAII_VAR(struct cdr_kafka_global_conf *, global, conf_global_create(), ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_queue *, queue, NULL, ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_spool *, configured, ao2_global_obj_ref(cdr_spool), ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_spool *, temp, NULL, ao2_cleanup);
+	struct ast_variable *var;
+	size_t i;
 	int res;
 
-	conf = ao2_global_obj_ref(confs);
+	var = ast_variable_new("overflow", overflow, "");
+	if (!global || !var) {
+		ast_variables_destroy(var);
+		return -1;
+	}
+	res = overflow_handler(NULL, var, global);
+	ast_variables_destroy(var);
+	if (res) {
+		return -1;
+	}
+	global->spool = spool;
+	global->queue_size = queue_size;
+	global->publisher_threads = 1;
+	global->batch_size = 1;
 
-	ast_assert(conf && conf->global && conf->global->connection);
+	if (spool && !(temp = test_spool_alloc())) {
+		return -1;
+	}
 
-	struct ast_kafka_producer *producer = ao2_global_obj_ref(cached_producer);
-	if (!producer) {
-		/* Fallback: try to acquire if not yet cached */
-		producer = ast_kafka_get_producer(conf->global->connection);
-		if (!producer) {
-			ast_log(LOG_ERROR, "Failed to get a Kafka producer\n");
-			return -1;
+	queue = queue_alloc(global);
+	if (!queue || queue_start(queue)) {
+		if (temp) {
+			test_spool_remove(temp);
 		}
+		return -1;
+	}
+
+	if (temp) {
+		ao2_global_obj_replace_unref(cdr_spool, temp);
 	}
+	for (i = 0; i < count && !res; i++) {
+		res = queue_enqueue(queue, cdrs[i], CDR_KAFKA_PRIORITY_NORMAL, NULL);
+	}
+	queue_stop(queue);
+	if (temp) {
+		ao2_global_obj_replace_unref(cdr_spool, configured);
+		test_spool_remove(temp);
+	}
+
+	return res ? -1 : (int) queue->dropped;
+}
 
-	json = ast_json_pack("{"
-		/* clid, src, dst, dcontext */
-		"s: s, s: s, s: s, s: s,"
-		/* channel, dstchannel, lastapp, lastdata */
-		"s: s, s: s, s: s, s: s,"
-		/* start, answer, end, duration */
-		"s: o, s: o, s: o, s: i"
-		/* billsec, disposition, accountcode, amaflags */
-		"s: i, s: s, s: s, s: s"
-		/* peeraccount, linkedid, sequence */
-		"s: s, s: s, s: i,"
-		/* tenantid, peertenantid */
-		"s: s, s: s }",
+/*!
+ * \brief Publish CDRs as one batch, with the loaded configuration.
+ *
+ * \param spool If set, a spool in a temporary directory stands in for the
+ *        configured one, and what the batch spooled is replayed from it
+ *        through the stand-in producer before this returns.
+ * \return What publish_batch() returned, or -2 on error.
+ */
+int cdr_kafka_test_batch(struct ast_cdr **cdrs, size_t count, int spool);
+int cdr_kafka_test_batch(struct ast_cdr **cdrs, size_t count, int spool)
+{
+	RAII_VAR(struct cdr_kafka_spool *, configured, ao2_global_obj_ref(cdr_spool), ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_spool *, temp, NULL, ao2_cleanup);
+	struct cdr_kafka_batch batch = { 0, };
+	uint64_t seq;
+	size_t i;
+	int res = -2;
+
+	if (batch_init(&batch, count)) {
+		goto done;
+	}
+	for (i = 0; i < count; i++) {
+		if (!(batch.records[i] = record_alloc(cdrs[i], NULL))) {
+			goto done;
+		}
+	}
+	if (spool && !(temp = test_spool_alloc())) {
+		goto done;
+	}
 
-		"clid", cdr->clid,
-		"src", cdr->src,
-		"dst", cdr->dst,
-		"dcontext", cdr->dcontext,
+	if (temp) {
+		ao2_global_obj_replace_unref(cdr_spool, temp);
+	}
+	res = publish_batch(&batch, count);
+	if (temp) {
+		ao2_global_obj_replace_unref(cdr_spool, configured);
+		ast_mutex_lock(&temp->lock);
+		spool_seal(temp);
+		ast_mutex_unlock(&temp->lock);
+		for (seq = 0; seq < temp->next_seq; seq++) {
+			if (spool_replay_segment(temp, seq)) {
+				res = -2;
+			}
+		}
+		test_spool_remove(temp);
+	}
 
-		"channel", cdr->channel,
-		"dstchannel", cdr->dstchannel,
-		"lastapp", cdr->lastapp,
-		"lastdata", cdr->lastdata,
+done:
+	for (i = 0; batch.records && i < count; i++) {
+		ast_free(batch.records[i]);
+	}
+	batch_destroy(&batch);
 
-		"start", ast_json_timeval(cdr->start, NULL),
-		"answer", ast_json_timeval(cdr->answer, NULL),
-		"end", ast_json_timeval(cdr->end, NULL),
-		"durationsec", cdr->duration,
+	return res;
+}
 
-		"billsec", cdr->billsec,
-		"disposition", ast_cdr_disp2str(cdr->disposition),
-		"accountcode", cdr->accountcode,
-		"amaflags", ast_channel_amaflags2string(cdr->amaflags),
+/*!
+ * \brief Queue CDRs under priority rules and drain them like a publisher thread.
+ *
+ * No publisher thread runs, so once \a queue_size records are queued the
+ * priority classes shed records as with overflow = drop_oldest.
+ *
+ * \param weights Records drained from each class in turn, high first.
+ * \param order Filled with the index in \a cdrs of every record drained, in order.
+ * \return Number of records drained, or -1 on error.
+ */
+int cdr_kafka_test_priority(const char *rules, const unsigned int *weights,
+	unsigned int queue_size, struct ast_cdr **cdrs, size_t count, size_t *order);
+int cdr_kafka_test_priority(const char *rules, const unsigned int *weights,
+	unsigned int queue_size, struct ast_cdr **cdrs, size_t count, size_t *order)
+{
+	RAII_VAR(struct cdr_kafka_global_conf *, global, conf_global_create(), ao2_cleanup);
+	RAII_VAR(struct cdr_kafka_queue *, queue, NULL, ao2_cleanup);
+	struct cdr_kafka_record *record;
+	size_t drained = 0;
+	size_t i;
 
-		"peeraccount", cdr->peeraccount,
-		"linkedid", cdr->linkedid,
-		"sequence", cdr->sequence,
+	if (!global
+		|| ast_string_field_set(global, priority, rules)
+		|| filters_compile(global)) {
+		return -1;
+	}
+	memcpy(global->priority_weights, weights, sizeof(global->priority_weights));
+	global->queue_size = queue_size;
+	global->overflow = CDR_KAFKA_OVERFLOW_DROP_OLDEST;
 
-		"tenantid", cdr->tenantid,
-		"peertenantid", cdr->peertenantid);
-	if (!json) {
-		ao2_cleanup(producer);
+	queue = queue_alloc(global);
+	if (!queue) {
 		return -1;
 	}
 
-	/* Inject system identification */
-	{
-		char eid_str[20];
-		ast_eid_to_str(eid_str, sizeof(eid_str), &ast_eid_default);
-		ast_json_object_set(json, "EntityID", ast_json_string_create(eid_str));
+	for (i = 0; i < count; i++) {
+		if (queue_enqueue(queue, cdrs[i], priorities_class(global->priorities, cdrs[i]), NULL)) {
+			return -1;
+		}
 	}
-	if (!ast_strlen_zero(ast_config_AST_SYSTEM_NAME)) {
-		ast_json_object_set(json, "SystemName",
-			ast_json_string_create(ast_config_AST_SYSTEM_NAME));
+
+	while ((record = worker_pop(&queue->workers[0]))) {
+		for (i = 0; i < count; i++) {
+			if (!strcmp(record->cdr.uniqueid, cdrs[i]->uniqueid)) {
+				break;
+			}
+		}
+		order[drained++] = i;
+		ast_free(record);
 	}
 
-	struct ast_var_t *var_entry;
+	return drained;
+}
 
-	AST_LIST_TRAVERSE(&cdr->varshead, var_entry, entries) {
-		ast_json_object_set(json,var_entry->name, ast_json_string_create(var_entry->value));
-        }
+/*!
+ * \brief Histogram bucket \a value is recorded in.
+ *
+ * \param[out] max Largest value recorded in that bucket.
+ */
+unsigned int cdr_kafka_test_hist_bucket(uint64_t value, uint64_t *max);
+unsigned int cdr_kafka_test_hist_bucket(uint64_t value, uint64_t *max)
+{
+	unsigned int bucket = hist_bucket(value);
 
-	/* Set optional fields */
-	if (conf->global->loguniqueid) {
-		ast_json_object_set(json,
-			"uniqueid", ast_json_string_create(cdr->uniqueid));
-	}
+	*max = hist_bucket_max(bucket);
+	return bucket;
+}
+
+/*! \return The \a fraction percentile of a histogram of \a values. */
+uint64_t cdr_kafka_test_hist_percentile(const uint64_t *values, size_t count, double fraction);
+uint64_t cdr_kafka_test_hist_percentile(const uint64_t *values, size_t count, double fraction)
+{
+	struct cdr_kafka_hist hist = { { 0, }, };
+	size_t i;
 
-	if (conf->global->loguserfield) {
-		ast_json_object_set(json,
-			"userfield", ast_json_string_create(cdr->userfield));
+	for (i = 0; i < count; i++) {
+		hist_record(&hist, values[i]);
 	}
 
-	/* Dump the JSON to a string for publication */
-	str = ast_json_dump_string(json);
-	if (!str) {
-		ast_log(LOG_ERROR, "Failed to build string from JSON\n");
-		ao2_cleanup(producer);
+	return hist_percentile(&hist, fraction);
+}
+
+/*!
+ * \brief Render the Kafka key of \a cdr under a \c key option.
+ *
+ * \param key Value of the key option.
+ * \param out Receives the key, empty if there is none.
+ * \return Number of fields the key was resolved to, or -1 on error.
+ */
+int cdr_kafka_test_key(const char *key, struct ast_cdr *cdr, char *out, size_t size);
+int cdr_kafka_test_key(const char *key, struct ast_cdr *cdr, char *out, size_t size)
+{
+	RAII_VAR(struct cdr_kafka_global_conf *, global, conf_global_create(), ao2_cleanup);
+	char buf[CDR_KAFKA_KEY_LEN];
+
+	if (!global || ast_string_field_set(global, key, key)) {
 		return -1;
 	}
+	resolve_key(global);
+	ast_copy_string(out, S_OR(cdr_kafka_key(global, cdr, buf), ""), size);
 
-	/* Build Kafka message headers */
-	{
-		char eid_str[20];
-		char ts_str[32];
-		struct ast_kafka_header hdrs[5];
-		size_t hdr_count = 0;
+	return global->key_field_count;
+}
+
+/*! \return murmur2 hash of \a data, as a Java int. */
+int32_t cdr_kafka_test_murmur2(const void *data, size_t len);
+int32_t cdr_kafka_test_murmur2(const void *data, size_t len)
+{
+	return (int32_t) murmur2(data, len);
+}
 
-		ast_eid_to_str(eid_str, sizeof(eid_str), &ast_eid_default);
-		snprintf(ts_str, sizeof(ts_str), "%ld", (long) time(NULL));
+/*!
+ * \brief Partition partitioner = murmur2 picks for \a key.
+ *
+ * \param partitions Partitions of the topic, 0 for unknown.
+ * \return The partition, or AST_KAFKA_PARTITION_ANY.
+ */
+int32_t cdr_kafka_test_partition(const char *key, int partitions);
+int32_t cdr_kafka_test_partition(const char *key, int partitions)
+{
+	RAII_VAR(struct cdr_kafka_global_conf *, global, conf_global_create(), ao2_cleanup);
+	int32_t partition;
 
-		hdrs[hdr_count].name = "entity_id";
-		hdrs[hdr_count].value = eid_str;
-		hdr_count++;
+	if (!global) {
+		return AST_KAFKA_PARTITION_ANY;
+	}
+	global->partitioner = CDR_KAFKA_PARTITIONER_MURMUR2;
 
-		if (!ast_strlen_zero(ast_config_AST_SYSTEM_NAME)) {
-			hdrs[hdr_count].name = "system_name";
-			hdrs[hdr_count].value = ast_config_AST_SYSTEM_NAME;
-			hdr_count++;
-		}
+	__atomic_store_n(&test_partitions, partitions > 0 ? partitions : -1, __ATOMIC_RELAXED);
+	partition = message_partition(global, NULL, "cdr", key);
+	__atomic_store_n(&test_partitions, 0, __ATOMIC_RELAXED);
 
-		hdrs[hdr_count].name = "asterisk_version";
-		hdrs[hdr_count].value = ast_get_version();
-		hdr_count++;
+	return partition;
+}
 
-		hdrs[hdr_count].name = "timestamp";
-		hdrs[hdr_count].value = ts_str;
-		hdr_count++;
+/*!
+ * \brief Read a counter of the statistics, summed over all threads.
+ *
+ * \param name Counter name as shown by cdr kafka show stats.
+ * \return The counter, or 0 if \a name is not one.
+ */
+uint64_t cdr_kafka_test_counter(const char *name);
+uint64_t cdr_kafka_test_counter(const char *name)
+{
+	struct cdr_kafka_metrics *total;
+	uint64_t value = 0;
+	size_t i;
 
-		hdrs[hdr_count].name = "hostname";
-		hdrs[hdr_count].value = cached_hostname;
-		hdr_count++;
+	total = ast_malloc(sizeof(*total));
+	if (!total) {
+		return 0;
+	}
 
-		res = ast_kafka_produce_hdrs(producer,
-			conf->global->topic,
-			cdr_get_key_value(cdr, conf->global->key),
-			str,
-			strlen(str),
-			hdrs, hdr_count);
+	metrics_snapshot(total);
+	for (i = 0; i < CDR_KAFKA_COUNTER_COUNT; i++) {
+		if (!strcasecmp(counter_names[i], name)) {
+			value = total->counters[i];
+		}
 	}
+	ast_free(total);
 
-	ao2_cleanup(producer);
+	return value;
+}
 
-	if (res != 0) {
-		ast_log(LOG_ERROR, "Error publishing CDR to Kafka\n");
+/*!
+ * \brief Turn tracing on as cdr kafka trace 1/\a every does, or off with 0.
+ */
+void cdr_kafka_test_trace(unsigned int every);
+void cdr_kafka_test_trace(unsigned int every)
+{
+	trace_set(every);
+}
+
+/*!
+ * \brief Render the slowest trace as "name=value\n" lines.
+ *
+ * \param out Receives the key, topic, len and taken lines.
+ * \param size Size of \a out.
+ * \return Number of traces in the ring, or -1 on error.
+ */
+int cdr_kafka_test_trace_slowest(char *out, size_t size);
+int cdr_kafka_test_trace_slowest(char *out, size_t size)
+{
+	struct cdr_kafka_trace *traces;
+	size_t count;
+
+	traces = ast_malloc(CDR_KAFKA_TRACE_SLOTS * sizeof(*traces));
+	if (!traces) {
 		return -1;
 	}
 
-	return 0;
+	count = trace_collect(traces);
+	*out = '\0';
+	if (count) {
+		ast_build_string(&out, &size, "key=%s\ntopic=%s\nlen=%zu\ntaken=%d\n",
+			traces[0].key, traces[0].topic, traces[0].len, traces[0].taken);
+	}
+	ast_free(traces);
+
+	return count;
 }
 
+/*! \return Number of allocations the publish path has made so far. */
+unsigned long cdr_kafka_test_allocations(void);
+unsigned long cdr_kafka_test_allocations(void)
+{
+	return __atomic_load_n(&test_allocations, __ATOMIC_RELAXED);
+}
+#endif
+
 
 static int load_config(int reload)
 {
@@ -453,11 +11645,52 @@ static int load_config(int reload)
 	return 0;
 }
 
+/*!
+ * \brief Stop the module's threads and release its configuration.
+ *
+ * Used by unload_module() once the backend is unregistered, and by
+ * load_module() when registering it fails.
+ *
+ * \return 0 once no payload is in flight.
+ * \return -1 if some still are; only the async queue and the aggregator
+ *         are stopped then, and setting them up again restores the module.
+ */
+static int shutdown_module(void)
+{
+	/* Flush whatever is still buffered while the producer is available */
+	shutdown_aggregator();
+	shutdown_async_queue();
+
+	/* The producer calls back into this module for payloads in flight, and
+	 * spools those it fails, so nothing else goes before they are back */
+	spool_hold(1);
+	if (pool_drain()) {
+		spool_hold(0);
+		return -1;
+	}
+
+	shutdown_spool();
+	shutdown_warmup();
+	snapshot_replace(NULL);
+	aco_info_destroy(&cfg_info);
+	ao2_global_obj_release(confs);
+
+	/* Also drops the snapshot references the CDR threads still hold */
+	tls_release();
+
+	return 0;
+}
+
 static int load_module(void)
 {
+	AST_LIST_LOCK(&tls_threads);
+	tls_released = 0;
+	AST_LIST_UNLOCK(&tls_threads);
+
 	if (gethostname(cached_hostname, sizeof(cached_hostname)) != 0) {
 		ast_copy_string(cached_hostname, "unknown", sizeof(cached_hostname));
 	}
+	ast_eid_to_str(cached_eid, sizeof(cached_eid), &ast_eid_default);
 
 	if (aco_info_init(&cfg_info) != 0) {
 		ast_log(LOG_ERROR, "Failed to initialize config");
@@ -474,38 +11707,190 @@ static int load_module(void)
 	aco_option_register(&cfg_info, "connection", ACO_EXACT,
 		global_options, "", OPT_STRINGFIELD_T, 0,
 		STRFLDSET(struct cdr_kafka_global_conf, connection));
+	aco_option_register_custom(&cfg_info, "connection_mode", ACO_EXACT,
+		global_options, "failover", connection_mode_handler, 0);
+	aco_option_register(&cfg_info, "idempotent", ACO_EXACT,
+		global_options, "no", OPT_BOOL_T, 1,
+		FLDSET(struct cdr_kafka_global_conf, idempotent));
+	aco_option_register(&cfg_info, "failover_queue_depth", ACO_EXACT,
+		global_options, "50000", OPT_UINT_T, 0,
+		FLDSET(struct cdr_kafka_global_conf, failover_queue_depth));
+	aco_option_register(&cfg_info, "failover_error_rate", ACO_EXACT,
+		global_options, "20", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_kafka_global_conf, failover_error_rate), 0, 100);
+	aco_option_register(&cfg_info, "failover_recovery", ACO_EXACT,
+		global_options, "30000", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_kafka_global_conf, failover_recovery), 1000, 3600000);
+	aco_option_register(&cfg_info, "backpressure_low", ACO_EXACT,
+		global_options, "0", OPT_UINT_T, 0,
+		FLDSET(struct cdr_kafka_global_conf, backpressure_low));
+	aco_option_register(&cfg_info, "backpressure_high", ACO_EXACT,
+		global_options, "0", OPT_UINT_T, 0,
+		FLDSET(struct cdr_kafka_global_conf, backpressure_high));
 	aco_option_register(&cfg_info, "topic", ACO_EXACT,
-		global_options, "asterisk_cdr", OPT_STRINGFIELD_T, 0,
+		global_options, CDR_KAFKA_DEFAULT_TOPIC, OPT_STRINGFIELD_T, 0,
 		STRFLDSET(struct cdr_kafka_global_conf, topic));
+	aco_option_register(&cfg_info, "route_by", ACO_EXACT,
+		global_options, "", OPT_STRINGFIELD_T, 0,
+		STRFLDSET(struct cdr_kafka_global_conf, route_by));
+	aco_option_register_custom(&cfg_info, "route", ACO_EXACT,
+		global_options, "", route_handler, 0);
+	aco_option_register_custom(&cfg_info, "filter", ACO_EXACT,
+		global_options, "", filter_handler, 0);
+	aco_option_register_custom(&cfg_info, "priority", ACO_EXACT,
+		global_options, "", priority_handler, 0);
+	aco_option_register_custom(&cfg_info, "priority_weights", ACO_EXACT,
+		global_options, CDR_KAFKA_PRIORITY_WEIGHTS, priority_weights_handler, 0);
 	aco_option_register(&cfg_info, "key", ACO_EXACT,
 		global_options, "", OPT_STRINGFIELD_T, 0,
 		STRFLDSET(struct cdr_kafka_global_conf, key));
+	aco_option_register_custom(&cfg_info, "partitioner", ACO_EXACT,
+		global_options, "default", partitioner_handler, 0);
+	aco_option_register_custom(&cfg_info, "compression", ACO_EXACT,
+		global_options, "none", compression_handler, 0);
+	aco_option_register(&cfg_info, "compression_level", ACO_EXACT,
+		global_options, "3", OPT_INT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_kafka_global_conf, compression_level), 1, 19);
+	aco_option_register(&cfg_info, "compression_dictionary", ACO_EXACT,
+		global_options, "", OPT_STRINGFIELD_T, 0,
+		STRFLDSET(struct cdr_kafka_global_conf, compression_dictionary));
+	aco_option_register(&cfg_info, "fields", ACO_EXACT,
+		global_options, "", OPT_STRINGFIELD_T, 0,
+		STRFLDSET(struct cdr_kafka_global_conf, fields));
+	aco_option_register(&cfg_info, "summary_topic", ACO_EXACT,
+		global_options, "", OPT_STRINGFIELD_T, 0,
+		STRFLDSET(struct cdr_kafka_global_conf, summary_topic));
+	aco_option_register(&cfg_info, "summary_fields", ACO_EXACT,
+		global_options, CDR_KAFKA_SUMMARY_FIELDS, OPT_STRINGFIELD_T, 0,
+		STRFLDSET(struct cdr_kafka_global_conf, summary_fields));
+	aco_option_register(&cfg_info, "variables", ACO_EXACT,
+		global_options, "*", OPT_STRINGFIELD_T, 0,
+		STRFLDSET(struct cdr_kafka_global_conf, variables));
+	aco_option_register(&cfg_info, "max_variables", ACO_EXACT,
+		global_options, "0", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_kafka_global_conf, max_variables), 0, 10000);
+	aco_option_register(&cfg_info, "max_variable_length", ACO_EXACT,
+		global_options, "0", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_kafka_global_conf, max_variable_length), 0, 1048576);
+	aco_option_register(&cfg_info, "nest_variables", ACO_EXACT,
+		global_options, "no", OPT_BOOL_T, 1,
+		FLDSET(struct cdr_kafka_global_conf, nest_variables));
+	aco_option_register(&cfg_info, "field_limits", ACO_EXACT,
+		global_options, "", OPT_STRINGFIELD_T, 0,
+		STRFLDSET(struct cdr_kafka_global_conf, field_limits));
+	aco_option_register(&cfg_info, "max_payload_size", ACO_EXACT,
+		global_options, "0", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_kafka_global_conf, max_payload_size), 0, 67108864);
+	aco_option_register(&cfg_info, "oversize_topic", ACO_EXACT,
+		global_options, "", OPT_STRINGFIELD_T, 0,
+		STRFLDSET(struct cdr_kafka_global_conf, oversize_topic));
+	aco_option_register_custom(&cfg_info, "format", ACO_EXACT,
+		global_options, "json", format_handler, 0);
+	aco_option_register_custom(&cfg_info, "timestamps", ACO_EXACT,
+		global_options, "iso8601", timestamps_handler, 0);
+	aco_option_register(&cfg_info, "schema_id", ACO_EXACT,
+		global_options, "0", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_kafka_global_conf, schema_id), 0, 2147483647);
+	aco_option_register(&cfg_info, "headers", ACO_EXACT,
+		global_options, CDR_KAFKA_DEFAULT_HEADERS, OPT_STRINGFIELD_T, 0,
+		STRFLDSET(struct cdr_kafka_global_conf, headers));
+	aco_option_register(&cfg_info, "async", ACO_EXACT,
+		global_options, "no", OPT_BOOL_T, 1,
+		FLDSET(struct cdr_kafka_global_conf, async));
+	aco_option_register(&cfg_info, "queue_size", ACO_EXACT,
+		global_options, "8192", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_kafka_global_conf, queue_size), 16, 1048576);
+	aco_option_register(&cfg_info, "publisher_cpus", ACO_EXACT,
+		global_options, "", OPT_STRINGFIELD_T, 0,
+		STRFLDSET(struct cdr_kafka_global_conf, publisher_cpus));
+	aco_option_register(&cfg_info, "publisher_threads", ACO_EXACT,
+		global_options, "1", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_kafka_global_conf, publisher_threads), 1, 64);
+	aco_option_register_custom(&cfg_info, "overflow", ACO_EXACT,
+		global_options, "block", overflow_handler, 0);
+	aco_option_register(&cfg_info, "batch_size", ACO_EXACT,
+		global_options, "1", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_kafka_global_conf, batch_size), 1, 10000);
+	aco_option_register(&cfg_info, "batch_linger_ms", ACO_EXACT,
+		global_options, "0", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_kafka_global_conf, batch_linger_ms), 0, 1000);
+	aco_option_register(&cfg_info, "spool", ACO_EXACT,
+		global_options, "no", OPT_BOOL_T, 1,
+		FLDSET(struct cdr_kafka_global_conf, spool));
+	aco_option_register(&cfg_info, "spool_segment_size", ACO_EXACT,
+		global_options, "16777216", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_kafka_global_conf, spool_segment_size), 65536, 1073741824);
+	aco_option_register(&cfg_info, "spool_replay_rate", ACO_EXACT,
+		global_options, "500", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_kafka_global_conf, spool_replay_rate), 0, 1000000);
+	aco_option_register(&cfg_info, "aggregate", ACO_EXACT,
+		global_options, "no", OPT_BOOL_T, 1,
+		FLDSET(struct cdr_kafka_global_conf, aggregate));
+	aco_option_register(&cfg_info, "aggregate_timeout", ACO_EXACT,
+		global_options, "30000", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_kafka_global_conf, aggregate_timeout), 100, 3600000);
+	aco_option_register(&cfg_info, "aggregate_max_legs", ACO_EXACT,
+		global_options, "64", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_kafka_global_conf, aggregate_max_legs), 2, 1024);
+	aco_option_register(&cfg_info, "warmup", ACO_EXACT,
+		global_options, "no", OPT_BOOL_T, 1,
+		FLDSET(struct cdr_kafka_global_conf, warmup));
+	aco_option_register(&cfg_info, "warmup_timeout", ACO_EXACT,
+		global_options, "10000", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_kafka_global_conf, warmup_timeout), 100, 600000);
+	aco_option_register(&cfg_info, "partitions", ACO_EXACT,
+		global_options, "1", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_kafka_global_conf, partitions), 1, 100000);
+	aco_option_register(&cfg_info, "replication", ACO_EXACT,
+		global_options, "1", OPT_UINT_T, PARSE_IN_RANGE,
+		FLDSET(struct cdr_kafka_global_conf, replication), 1, 32);
 
 	if (load_config(0) != 0) {
 		ast_log(LOG_WARNING, "Configuration failed to load\n");
 		return AST_MODULE_LOAD_DECLINE;
 	}
 
-	setup_cached_producer();
+	publish_snapshot();
+	setup_warmup();
+	setup_spool();
+	setup_async_queue();
+	setup_aggregator();
 
 	if (ast_cdr_register(CDR_NAME, ast_module_info->description, kafka_cdr_log) != 0) {
 		ast_log(LOG_ERROR, "Could not register CDR backend\n");
+		/* The threads started above must not outlive the module */
+		shutdown_module();
 		return AST_MODULE_LOAD_FAILURE;
 	}
 
+	ast_cli_register_multiple(cli_commands, ARRAY_LEN(cli_commands));
+	ast_manager_register_xml("CDRKafkaStats", EVENT_FLAG_SYSTEM | EVENT_FLAG_REPORTING,
+		manager_cdr_kafka_stats);
+
 	ast_log(LOG_NOTICE, "CDR Kafka logging enabled\n");
 	return AST_MODULE_LOAD_SUCCESS;
 }
 
 static int unload_module(void)
 {
-	ao2_global_obj_release(cached_producer);
-	aco_info_destroy(&cfg_info);
-	ao2_global_obj_release(confs);
 	if (ast_cdr_unregister(CDR_NAME) != 0) {
 		return -1;
 	}
 
+	ast_cli_unregister_multiple(cli_commands, ARRAY_LEN(cli_commands));
+	ast_manager_unregister("CDRKafkaStats");
+
+	if (shutdown_module()) {
+		/* Still configured, so keep publishing until the next attempt */
+		setup_async_queue();
+		setup_aggregator();
+		ast_cdr_register(CDR_NAME, ast_module_info->description, kafka_cdr_log);
+		ast_cli_register_multiple(cli_commands, ARRAY_LEN(cli_commands));
+		ast_manager_register_xml("CDRKafkaStats", EVENT_FLAG_SYSTEM | EVENT_FLAG_REPORTING,
+			manager_cdr_kafka_stats);
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -513,7 +11898,11 @@ static int reload_module(void)
 {
 	int res = load_config(1);
 	if (res == 0) {
-		setup_cached_producer();
+		publish_snapshot();
+		setup_warmup();
+		setup_spool();
+		setup_async_queue();
+		setup_aggregator();
 	}
 	return res;
 }
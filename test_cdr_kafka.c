@@ -30,20 +30,185 @@
 
 #include "asterisk.h"
 
+#include <ctype.h>
+#include <unistd.h>
+
 #include "asterisk/module.h"
 #include "asterisk/test.h"
 #include "asterisk/cdr.h"
+#include "asterisk/config.h"
 #include "asterisk/json.h"
 #include "asterisk/kafka.h"
 #include "asterisk/utils.h"
 #include "asterisk/strings.h"
+#include "asterisk/paths.h"
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #define TEST_CATEGORY "/cdr/kafka/"
+#define PERF_CATEGORY "/cdr/kafka/perf/"
+#define BENCH_CATEGORY "/cdr/kafka/bench/"
+
+/*! \brief CDRs logged by each thread of a perf run */
+#define PERF_RECORDS 20000
+
+/*! \brief How long an async queue gets to drain after a perf run */
+#define PERF_DRAIN_TIMEOUT_MS 30000
+
+/*! \brief Optional file overriding the benchmark iterations and budgets */
+#define BENCH_CONFIG "test_cdr_kafka.conf"
+
+/*! \brief Calls timed in each round of a benchmark, unless configured */
+#define BENCH_ITERATIONS 20000
+
+/*! \brief Rounds of a benchmark; the fastest one is compared to the budget */
+#define BENCH_ROUNDS 5
 
 /*! \brief Imported from cdr_kafka.c */
 extern const char *cdr_get_key_value(struct ast_cdr *cdr,
 	const char *field_name);
 
+/*! \brief Imported from cdr_kafka.c */
+extern const char *cdr_kafka_json_encode(struct ast_cdr *cdr,
+	int loguniqueid, int loguserfield, size_t *len);
+
+/*! \brief Stand-in producer signature, see cdr_kafka.c */
+typedef int (*cdr_kafka_test_produce_fn)(const char *topic, const char *key,
+	const void *payload, size_t len, const struct ast_kafka_header *headers,
+	size_t header_count);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int cdr_kafka_test_log(struct ast_cdr *cdr);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int cdr_kafka_test_set_produce(cdr_kafka_test_produce_fn produce);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int cdr_kafka_test_publish(struct ast_cdr *cdr);
+
+/*! \brief Imported from cdr_kafka.c */
+extern unsigned long cdr_kafka_test_allocations(void);
+
+/*! \brief Imported from cdr_kafka.c */
+extern const char *cdr_kafka_test_encode_format(struct ast_cdr *cdr,
+	const char *format, unsigned int schema_id, int loguniqueid,
+	int loguserfield, size_t *len);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int cdr_kafka_test_headers_bench(const char *headers, struct ast_cdr *cdr,
+	unsigned int iterations);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int cdr_kafka_test_headers(const char *headers, struct ast_cdr *cdr,
+	char *out, size_t size);
+
+/*! \brief Imported from cdr_kafka.c */
+extern const char *cdr_kafka_test_encode_plan(struct ast_cdr *cdr,
+	const char *fields, const char *variables, size_t *len);
+
+/*! \brief Imported from cdr_kafka.c */
+extern const char *cdr_kafka_test_summary(struct ast_cdr *cdr, const char *fields,
+	const char *timestamps, size_t *len);
+
+/*! \brief Imported from cdr_kafka.c */
+extern const char *cdr_kafka_test_encode_vars(struct ast_cdr *cdr, const char *fields,
+	const char *variables, unsigned int max_variables,
+	unsigned int max_variable_length, int nest, size_t *len);
+
+/*! \brief Imported from cdr_kafka.c */
+extern const char *cdr_kafka_test_encode_bounded(struct ast_cdr *cdr, const char *field_limits,
+	unsigned int max_payload_size, const char *oversize_topic, int *oversized,
+	char *out, size_t size, size_t *len);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int cdr_kafka_test_spool_replay(struct ast_cdr *cdr, const char *headers,
+	char *out, size_t size);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int cdr_kafka_test_spool_recover(const char **payloads, size_t count,
+	size_t per_segment, int damage, size_t damaged);
+
+/*! \brief Imported from cdr_kafka.c */
+extern const char *cdr_kafka_test_encode_timestamps(struct ast_cdr *cdr,
+	const char *timestamps, size_t *len);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int cdr_kafka_test_topic(const char *topic, const char *route_by,
+	const char *routes, struct ast_cdr *cdr, char *out, size_t size);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int cdr_kafka_test_filter(const char *filter, struct ast_cdr *cdr);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int cdr_kafka_test_aggregate(struct ast_cdr **cdrs, size_t count,
+	unsigned int max_legs, const char *end_linkedid, int end_first);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int cdr_kafka_test_fanout(unsigned int connections, const char *payload,
+	unsigned int *missed);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int cdr_kafka_test_failover(unsigned int connections, unsigned int missing,
+	unsigned int error_rate, unsigned int queue_depth, unsigned int recovery_ms,
+	const unsigned int *failing, const unsigned int *held, size_t steps,
+	unsigned int step_ms, int *used);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int cdr_kafka_test_pressure(unsigned int low, unsigned int high,
+	const size_t *queue_lens, size_t steps, int *levels);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int32_t cdr_kafka_test_murmur2(const void *data, size_t len);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int cdr_kafka_test_queue(struct ast_cdr **cdrs, size_t count, unsigned int threads,
+	unsigned int batch_size, size_t *shards);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int cdr_kafka_test_batch(struct ast_cdr **cdrs, size_t count, int spool);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int cdr_kafka_test_overflow(const char *overflow, int spool, unsigned int queue_size,
+	struct ast_cdr **cdrs, size_t count);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int cdr_kafka_test_priority(const char *rules, const unsigned int *weights,
+	unsigned int queue_size, struct ast_cdr **cdrs, size_t count, size_t *order);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int cdr_kafka_test_key(const char *key, struct ast_cdr *cdr, char *out, size_t size);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int32_t cdr_kafka_test_partition(const char *key, int partitions);
+
+/*! \brief Imported from cdr_kafka.c */
+extern uint64_t cdr_kafka_test_counter(const char *name);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int cdr_kafka_test_reload(void);
+
+/*! \brief Imported from cdr_kafka.c */
+extern unsigned int cdr_kafka_test_hist_bucket(uint64_t value, uint64_t *max);
+
+/*! \brief Imported from cdr_kafka.c */
+extern uint64_t cdr_kafka_test_hist_percentile(const uint64_t *values, size_t count, double fraction);
+
+/*! \brief Imported from cdr_kafka.c */
+extern void cdr_kafka_test_trace(unsigned int every);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int cdr_kafka_test_trace_slowest(char *out, size_t size);
+
+/*! \brief Imported from cdr_kafka.c */
+extern int cdr_kafka_test_warmup(const char *topic, const char *route_by, const char *routes,
+	unsigned int connections, int partitions, unsigned int timeout_ms, unsigned int *warmed);
+
+/*! \brief Imported from cdr_kafka.c */
+extern const char *cdr_kafka_test_compress(struct ast_cdr *cdr, const char *dictionary,
+	int level, size_t *len, char *headers, size_t size);
+
 /*!
  * \brief Build a fake CDR record with known values for testing.
  *
@@ -77,6 +242,94 @@ static void build_test_cdr(struct ast_cdr *cdr)
 	cdr->sequence = 1;
 }
 
+/*! \brief Append a CDR variable to a test CDR. */
+static void add_test_var(struct ast_cdr *cdr, const char *name, const char *value)
+{
+	struct ast_var_t *var = ast_var_assign(name, value);
+
+	if (var) {
+		AST_LIST_INSERT_TAIL(&cdr->varshead, var, entries);
+	}
+}
+
+/*! \brief Free the variables of a test CDR. */
+static void free_test_vars(struct ast_cdr *cdr)
+{
+	struct ast_var_t *var;
+
+	while ((var = AST_LIST_REMOVE_HEAD(&cdr->varshead, entries))) {
+		ast_var_delete(var);
+	}
+}
+
+/*!
+ * \brief Build the JSON payload the way cdr_kafka originally did.
+ *
+ * Used as the reference for the streaming encoder.
+ */
+static char *build_reference_json(struct ast_cdr *cdr, int loguniqueid,
+	int loguserfield)
+{
+	RAII_VAR(struct ast_json *, json, NULL, ast_json_unref);
+	struct ast_var_t *var_entry;
+	char eid_str[20];
+
+	json = ast_json_pack("{"
+		"s: s, s: s, s: s, s: s,"
+		"s: s, s: s, s: s, s: s,"
+		"s: o, s: o, s: o, s: i"
+		"s: i, s: s, s: s, s: s"
+		"s: s, s: s, s: i,"
+		"s: s, s: s }",
+		"clid", cdr->clid,
+		"src", cdr->src,
+		"dst", cdr->dst,
+		"dcontext", cdr->dcontext,
+		"channel", cdr->channel,
+		"dstchannel", cdr->dstchannel,
+		"lastapp", cdr->lastapp,
+		"lastdata", cdr->lastdata,
+		"start", ast_json_timeval(cdr->start, NULL),
+		"answer", ast_json_timeval(cdr->answer, NULL),
+		"end", ast_json_timeval(cdr->end, NULL),
+		"durationsec", cdr->duration,
+		"billsec", cdr->billsec,
+		"disposition", ast_cdr_disp2str(cdr->disposition),
+		"accountcode", cdr->accountcode,
+		"amaflags", ast_channel_amaflags2string(cdr->amaflags),
+		"peeraccount", cdr->peeraccount,
+		"linkedid", cdr->linkedid,
+		"sequence", cdr->sequence,
+		"tenantid", cdr->tenantid,
+		"peertenantid", cdr->peertenantid);
+	if (!json) {
+		return NULL;
+	}
+
+	ast_eid_to_str(eid_str, sizeof(eid_str), &ast_eid_default);
+	ast_json_object_set(json, "EntityID", ast_json_string_create(eid_str));
+	if (!ast_strlen_zero(ast_config_AST_SYSTEM_NAME)) {
+		ast_json_object_set(json, "SystemName",
+			ast_json_string_create(ast_config_AST_SYSTEM_NAME));
+	}
+
+	AST_LIST_TRAVERSE(&cdr->varshead, var_entry, entries) {
+		ast_json_object_set(json, var_entry->name,
+			ast_json_string_create(var_entry->value));
+	}
+
+	if (loguniqueid) {
+		ast_json_object_set(json, "uniqueid",
+			ast_json_string_create(cdr->uniqueid));
+	}
+	if (loguserfield) {
+		ast_json_object_set(json, "userfield",
+			ast_json_string_create(cdr->userfield));
+	}
+
+	return ast_json_dump_string(json);
+}
+
 /* ---- Key extraction tests ---- */
 
 AST_TEST_DEFINE(key_linkedid)
@@ -482,32 +735,3148 @@ AST_TEST_DEFINE(key_unknown_field)
 	return AST_TEST_PASS;
 }
 
-/* ---- CDR backend registration test ---- */
+AST_TEST_DEFINE(key_composite)
+{
+	static const struct {
+		const char *key;
+		int fields;
+		const char *expected;
+	} cases[] = {
+		{ "accountcode", 1, "acct-100" },
+		{ "src,dst", 2, "1001:2001" },
+		{ " tenantid , accountcode ", 2, "tenant-01:acct-100" },
+		/* Unknown fields are left out */
+		{ "src,bogus,dst", 2, "1001:2001" },
+		{ "bogus", 0, "" },
+		/* Only the first CDR_KAFKA_KEY_FIELDS_MAX (4) fields count */
+		{ "src,dst,accountcode,tenantid,uniqueid", 4, "1001:2001:acct-100:tenant-01" },
+		{ "", 0, "" },
+	};
+	enum ast_test_result_state res = AST_TEST_PASS;
+	struct ast_cdr cdr;
+	char out[256];
+	size_t i;
 
-AST_TEST_DEFINE(backend_registered)
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "key_composite";
+		info->category = TEST_CATEGORY;
+		info->summary = "Composite keys join their fields with ':'";
+		info->description =
+			"Verifies that a key of several CDR fields joins their values "
+			"with ':' in order, skips unknown fields, and ignores fields "
+			"past the fourth.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	build_test_cdr(&cdr);
+
+	for (i = 0; i < ARRAY_LEN(cases); i++) {
+		int fields = cdr_kafka_test_key(cases[i].key, &cdr, out, sizeof(out));
+
+		if (fields != cases[i].fields || strcmp(out, cases[i].expected)) {
+			ast_test_status_update(test, "Key '%s': %d fields '%s', expected %d fields '%s'\n",
+				cases[i].key, fields, out, cases[i].fields, cases[i].expected);
+			res = AST_TEST_FAIL;
+		}
+	}
+
+	return res;
+}
+
+AST_TEST_DEFINE(key_murmur2_partition)
 {
+	/* Hashes and partitions out of 12 from the Java client */
+	static const struct {
+		const char *key;
+		int32_t hash;
+		int32_t partition;
+	} cases[] = {
+		{ "21", -973932308, 0 },
+		{ "foobar", -790332482, 6 },
+		{ "a-little-bit-long-string", -985981536, 8 },
+		{ "a-little-bit-longer-string", -1486304829, 11 },
+		{ "lkjh234lh9fiuh90y23oiuhsafujhadof229phr9h19h89h8", -58897971, 5 },
+	};
+	static const char abc[] = { 'a', 'b', 'c' };
+	enum ast_test_result_state res = AST_TEST_PASS;
+	int32_t hash;
+	size_t i;
+
 	switch (cmd) {
 	case TEST_INIT:
-		info->name = "backend_registered";
+		info->name = "key_murmur2_partition";
 		info->category = TEST_CATEGORY;
-		info->summary = "CDR Kafka backend is registered";
+		info->summary = "murmur2 partitioning matches the Java client";
 		info->description =
-			"Verifies that the Kafka CDR backend is registered "
-			"by checking ast_cdr_is_enabled().";
+			"Verifies the murmur2 hash and the partitions picked from it "
+			"against values computed by the Java Kafka client, and that "
+			"unknown partition counts leave the choice to res_kafka.";
 		return AST_TEST_NOT_RUN;
 	case TEST_EXECUTE:
 		break;
 	}
 
-	if (!ast_cdr_is_enabled()) {
+	for (i = 0; i < ARRAY_LEN(cases); i++) {
+		hash = cdr_kafka_test_murmur2(cases[i].key, strlen(cases[i].key));
+		if (hash != cases[i].hash) {
+			ast_test_status_update(test, "murmur2('%s') = %d, expected %d\n",
+				cases[i].key, hash, cases[i].hash);
+			res = AST_TEST_FAIL;
+		}
+		if (cdr_kafka_test_partition(cases[i].key, 12) != cases[i].partition) {
+			ast_test_status_update(test, "Key '%s' not put in partition %d\n",
+				cases[i].key, cases[i].partition);
+			res = AST_TEST_FAIL;
+		}
+	}
+
+	hash = cdr_kafka_test_murmur2(abc, sizeof(abc));
+	if (hash != 479470107) {
+		ast_test_status_update(test, "murmur2(abc) = %d, expected 479470107\n", hash);
+		res = AST_TEST_FAIL;
+	}
+
+	if (cdr_kafka_test_partition("foobar", 0) != -1 || cdr_kafka_test_partition("foobar", 1) != 0) {
+		ast_test_status_update(test, "Partition count not honoured\n");
+		res = AST_TEST_FAIL;
+	}
+
+	return res;
+}
+
+/* ---- JSON encoder tests ---- */
+
+AST_TEST_DEFINE(json_encoder_matches_reference)
+{
+	struct ast_cdr cdr;
+	enum ast_test_result_state res = AST_TEST_PASS;
+	int flags;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "json_encoder_matches_reference";
+		info->category = TEST_CATEGORY;
+		info->summary = "Streaming encoder output equals ast_json output";
+		info->description =
+			"Verifies cdr_kafka_json_encode() produces the same bytes "
+			"as ast_json_pack() + ast_json_dump_string(), including "
+			"escaping, variables overriding core fields, duplicate "
+			"variables and the optional uniqueid/userfield members.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	build_test_cdr(&cdr);
+	cdr.start = ast_tv(1700000000, 123456);
+	cdr.answer = ast_tv(1700000005, 0);
+	cdr.end = ast_tv(1700000125, 999999);
+	ast_copy_string(cdr.lastdata, "PJSIP/2001,30,\"tT\"\n\x01", sizeof(cdr.lastdata));
+	ast_copy_string(cdr.userfield, "caf\xc3\xa9 \\ tab\t", sizeof(cdr.userfield));
+
+	add_test_var(&cdr, "X_QUEUE", "support");
+	add_test_var(&cdr, "src", "overridden");
+	add_test_var(&cdr, "X_NOTE", "line1\r\nline2 / \"quoted\"");
+	add_test_var(&cdr, "X_QUEUE", "sales");
+	add_test_var(&cdr, "uniqueid", "from-variable");
+	add_test_var(&cdr, "X_BAD", "\xff\xfe");
+
+	for (flags = 0; flags < 4; flags++) {
+		RAII_VAR(char *, expected, NULL, ast_json_free);
+		const char *actual;
+		size_t len = 0;
+
+		expected = build_reference_json(&cdr, flags & 1, flags & 2);
+		actual = cdr_kafka_json_encode(&cdr, flags & 1, flags & 2, &len);
+		if (!expected || !actual) {
+			ast_test_status_update(test, "Encoding failed (flags %d)\n", flags);
+			res = AST_TEST_FAIL;
+			break;
+		}
+		if (strcmp(expected, actual) || len != strlen(expected)) {
+			ast_test_status_update(test,
+				"Mismatch (flags %d)\nexpected: %s\nactual:   %s\n",
+				flags, expected, actual);
+			res = AST_TEST_FAIL;
+		}
+	}
+
+	free_test_vars(&cdr);
+	return res;
+}
+
+AST_TEST_DEFINE(json_encoder_timestamps)
+{
+	struct ast_cdr cdr;
+	enum ast_test_result_state res = AST_TEST_PASS;
+	const char *actual;
+	size_t len = 0;
+	int i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "json_encoder_timestamps";
+		info->category = TEST_CATEGORY;
+		info->summary = "Timestamp formats and the formatting cache";
+		info->description =
+			"Verifies cached ISO 8601 timestamps match ast_json_timeval() "
+			"across seconds, minutes and going back in time, and the "
+			"epoch_ms and epoch_us forms.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	build_test_cdr(&cdr);
+
+	/* Steps that land in the same second, the same minute, the next ones,
+	 * and earlier minutes that may still be cached */
+	for (i = 0; i < 2000 && res == AST_TEST_PASS; i++) {
+		RAII_VAR(char *, expected, NULL, ast_json_free);
+		long step = (i * 7919L) % 4000000 - 1000000;
+
+		cdr.start = ast_tv(1700000000 + step / 1000, (step % 1000 + 1000) % 1000 * 1000 + i % 1000);
+		cdr.answer = ast_tv(cdr.start.tv_sec + i % 3, 999999 - i);
+		cdr.end = ast_tv(cdr.answer.tv_sec + (i % 7) * 13, (i * 433) % 1000000);
+		if (i % 11 == 0) {
+			cdr.answer = ast_tv(0, 0);
+		}
+
+		expected = build_reference_json(&cdr, 0, 0);
+		actual = cdr_kafka_test_encode_timestamps(&cdr, "iso8601", &len);
+		if (!expected || !actual || strcmp(expected, actual)) {
+			ast_test_status_update(test, "Mismatch at step %d\nexpected: %s\nactual:   %s\n",
+				i, S_OR(expected, "(null)"), S_OR(actual, "(null)"));
+			res = AST_TEST_FAIL;
+		}
+	}
+
+	cdr.start = ast_tv(1700000000, 123456);
+	cdr.answer = ast_tv(0, 0);
+	cdr.end = ast_tv(1700000125, 999999);
+
+	actual = cdr_kafka_test_encode_timestamps(&cdr, "epoch_ms", &len);
+	if (!actual || !strstr(actual, "\"start\":1700000000123,\"answer\":0,\"end\":1700000125999,")) {
+		ast_test_status_update(test, "Unexpected epoch_ms payload: %s\n", S_OR(actual, "(null)"));
+		res = AST_TEST_FAIL;
+	}
+	actual = cdr_kafka_test_encode_timestamps(&cdr, "epoch_us", &len);
+	if (!actual || !strstr(actual, "\"start\":1700000000123456,\"answer\":0,\"end\":1700000125999999,")) {
+		ast_test_status_update(test, "Unexpected epoch_us payload: %s\n", S_OR(actual, "(null)"));
+		res = AST_TEST_FAIL;
+	}
+	if (cdr_kafka_test_encode_timestamps(&cdr, "rfc3339", &len)) {
+		ast_test_status_update(test, "Invalid timestamps value accepted\n");
+		res = AST_TEST_FAIL;
+	}
+
+	return res;
+}
+
+AST_TEST_DEFINE(json_encoder_invalid_utf8)
+{
+	struct ast_cdr cdr;
+	size_t len = 0;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "json_encoder_invalid_utf8";
+		info->category = TEST_CATEGORY;
+		info->summary = "Invalid UTF-8 in a core field fails the record";
+		info->description =
+			"Verifies cdr_kafka_json_encode() rejects a CDR whose core "
+			"fields are not valid UTF-8, as ast_json_pack() did.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	build_test_cdr(&cdr);
+	ast_copy_string(cdr.clid, "\xc3\x28", sizeof(cdr.clid));
+
+	if (cdr_kafka_json_encode(&cdr, 0, 0, &len)) {
 		ast_test_status_update(test,
-			"CDR system is not enabled\n");
+			"Expected NULL for invalid UTF-8 clid\n");
 		return AST_TEST_FAIL;
 	}
 
 	return AST_TEST_PASS;
 }
 
+AST_TEST_DEFINE(json_encoder_plan)
+{
+	static const struct {
+		const char *fields;
+		const char *variables;
+		const char *expected;
+	} cases[] = {
+		{ "linkedid:call, src, billsec, disposition", "",
+			"{\"call\":\"1700000000.1\",\"src\":\"1001\",\"billsec\":115,\"disposition\":\"ANSWERED\"}" },
+		{ "DST,userfield,nosuchfield,dst", "X_QUEUE:queue,X_MISSING",
+			"{\"dst\":\"2001\",\"userfield\":\"custom-data\",\"queue\":\"sales\"}" },
+		{ "src", "*",
+			"{\"src\":\"1001\",\"X_QUEUE\":\"sales\",\"dst\":\"overridden\"}" },
+		{ "clid:src,src", "",
+			"{\"src\":\"\\\"Test User\\\" <1001>\"}" },
+	};
+	struct ast_cdr cdr;
+	enum ast_test_result_state res = AST_TEST_PASS;
+	size_t i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "json_encoder_plan";
+		info->category = TEST_CATEGORY;
+		info->summary = "Field projection and renames";
+		info->description =
+			"Verifies the fields and variables options select, order "
+			"and rename payload members, and that unknown fields and "
+			"duplicate keys are left out.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	build_test_cdr(&cdr);
+	add_test_var(&cdr, "X_QUEUE", "support");
+	add_test_var(&cdr, "dst", "overridden");
+	add_test_var(&cdr, "src", "ignored");
+	add_test_var(&cdr, "X_QUEUE", "sales");
+
+	for (i = 0; i < ARRAY_LEN(cases); i++) {
+		const char *actual;
+		size_t len = 0;
+
+		actual = cdr_kafka_test_encode_plan(&cdr, cases[i].fields,
+			cases[i].variables, &len);
+		if (!actual || strcmp(actual, cases[i].expected)
+			|| len != strlen(cases[i].expected)) {
+			ast_test_status_update(test,
+				"Mismatch for fields '%s'\nexpected: %s\nactual:   %s\n",
+				cases[i].fields, cases[i].expected, S_OR(actual, "(null)"));
+			res = AST_TEST_FAIL;
+		}
+	}
+
+	free_test_vars(&cdr);
+	return res;
+}
+
+AST_TEST_DEFINE(summary_record)
+{
+	static const struct {
+		const char *fields;
+		const char *expected;
+	} cases[] = {
+		{ NULL,
+			"{\"disposition\":\"ANSWERED\",\"billsec\":115,\"tenantid\":\"tenant-01\","
+			"\"accountcode\":\"acct-100\",\"start\":1700000000123,\"answer\":1700000005000,"
+			"\"end\":0}" },
+		{ "linkedid:call, disposition:d, billsec:b, nosuchfield, X_QUEUE",
+			"{\"call\":\"1700000000.1\",\"d\":\"ANSWERED\",\"b\":115}" },
+	};
+	struct ast_cdr cdr;
+	enum ast_test_result_state res = AST_TEST_PASS;
+	size_t len;
+	size_t i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "summary_record";
+		info->category = TEST_CATEGORY;
+		info->summary = "Compact summary records";
+		info->description =
+			"Verifies summary records carry the default dashboard fields "
+			"or the summary_fields list, renamed as asked, and never the "
+			"CDR variables.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	build_test_cdr(&cdr);
+	cdr.start = ast_tv(1700000000, 123456);
+	cdr.answer = ast_tv(1700000005, 0);
+	add_test_var(&cdr, "X_QUEUE", "support");
+	add_test_var(&cdr, "disposition", "overridden");
+
+	for (i = 0; i < ARRAY_LEN(cases); i++) {
+		const char *actual = cdr_kafka_test_summary(&cdr, cases[i].fields, "epoch_ms", &len);
+
+		if (!actual || strcmp(actual, cases[i].expected) || len != strlen(cases[i].expected)) {
+			ast_test_status_update(test,
+				"Mismatch for summary_fields '%s'\nexpected: %s\nactual:   %s\n",
+				S_OR(cases[i].fields, "(default)"), cases[i].expected, S_OR(actual, "(null)"));
+			res = AST_TEST_FAIL;
+		}
+	}
+
+	if (cdr_kafka_test_summary(&cdr, "nosuchfield", "epoch_ms", &len)) {
+		ast_test_status_update(test, "A summary without fields was accepted\n");
+		res = AST_TEST_FAIL;
+	}
+
+	free_test_vars(&cdr);
+	return res;
+}
+
+AST_TEST_DEFINE(json_encoder_variable_limits)
+{
+	static const struct {
+		const char *variables;
+		unsigned int max_variables;
+		unsigned int max_variable_length;
+		int nest;
+		const char *expected;
+	} cases[] = {
+		{ "X_*", 0, 0, 0,
+			"{\"src\":\"1001\",\"X_QUEUE\":\"sales\",\"X_NOTE\":\"a\u00e9b\"}" },
+		{ "X_*,X_QUEUE:queue", 0, 0, 0,
+			"{\"src\":\"1001\",\"X_NOTE\":\"a\u00e9b\",\"queue\":\"sales\"}" },
+		{ "*", 2, 0, 0,
+			"{\"src\":\"1001\",\"X_QUEUE\":\"sales\",\"dst\":\"overridden\"}" },
+		{ "X_QUEUE,X_NOTE", 0, 2, 0,
+			"{\"src\":\"1001\",\"X_QUEUE\":\"sa\",\"X_NOTE\":\"a\"}" },
+		{ "*", 0, 0, 1,
+			"{\"src\":\"1001\",\"vars\":{\"X_QUEUE\":\"sales\",\"dst\":\"overridden\","
+			"\"src\":\"ignored\",\"X_NOTE\":\"a\u00e9b\"}}" },
+		{ "", 0, 0, 1,
+			"{\"src\":\"1001\",\"vars\":{}}" },
+	};
+	struct ast_cdr cdr;
+	enum ast_test_result_state res = AST_TEST_PASS;
+	size_t i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "json_encoder_variable_limits";
+		info->category = TEST_CATEGORY;
+		info->summary = "Variable prefixes, limits and nesting";
+		info->description =
+			"Verifies prefix items in variables, max_variables, "
+			"max_variable_length cutting on a UTF-8 boundary, and "
+			"nest_variables keeping variables apart from the fields.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	build_test_cdr(&cdr);
+	add_test_var(&cdr, "X_QUEUE", "support");
+	add_test_var(&cdr, "dst", "overridden");
+	add_test_var(&cdr, "src", "ignored");
+	add_test_var(&cdr, "X_QUEUE", "sales");
+	add_test_var(&cdr, "X_NOTE", "a\xc3\xa9" "b");
+
+	for (i = 0; i < ARRAY_LEN(cases); i++) {
+		const char *actual;
+		size_t len = 0;
+
+		actual = cdr_kafka_test_encode_vars(&cdr, "src", cases[i].variables,
+			cases[i].max_variables, cases[i].max_variable_length, cases[i].nest, &len);
+		if (!actual || strcmp(actual, cases[i].expected)
+			|| len != strlen(cases[i].expected)) {
+			ast_test_status_update(test,
+				"Mismatch for variables '%s'\nexpected: %s\nactual:   %s\n",
+				cases[i].variables, cases[i].expected, S_OR(actual, "(null)"));
+			res = AST_TEST_FAIL;
+		}
+	}
+
+	free_test_vars(&cdr);
+	return res;
+}
+
+AST_TEST_DEFINE(json_payload_budget)
+{
+	struct ast_cdr cdr;
+	enum ast_test_result_state res = AST_TEST_PASS;
+	char big[201];
+	char full[2048];
+	char headers[256];
+	const char *actual;
+	uint64_t oversized;
+	uint64_t dropped;
+	size_t full_len = 0;
+	size_t len = 0;
+	int sent_whole;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "json_payload_budget";
+		info->category = TEST_CATEGORY;
+		info->summary = "Field caps, payload budget and oversized records";
+		info->description =
+			"Verifies that field_limits cuts text fields, that max_payload_size "
+			"leaves out the variables that do not fit and keeps the rest, that "
+			"the truncated header lists what was cut, and that a record whose "
+			"fields alone are too large goes whole to oversize_topic, or is "
+			"dropped without one.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	build_test_cdr(&cdr);
+	memset(big, 'x', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+	add_test_var(&cdr, "X_BIG", big);
+	add_test_var(&cdr, "X_SMALL", "ok");
+	add_test_var(&cdr, "X_NOTE", "a\xc3\xa9" "b");
+
+	actual = cdr_kafka_test_encode_bounded(&cdr, "", 0, "", &sent_whole,
+		headers, sizeof(headers), &full_len);
+	if (!actual || full_len >= sizeof(full) || strstr(headers, "truncated=")) {
+		ast_test_status_update(test, "Unlimited payload failed or was marked truncated\n");
+		free_test_vars(&cdr);
+		return AST_TEST_FAIL;
+	}
+	memcpy(full, actual, full_len + 1);
+
+	actual = cdr_kafka_test_encode_bounded(&cdr, "lastdata:5, dstchannel:9, billsec:2", 0, "",
+		&sent_whole, headers, sizeof(headers), &len);
+	if (!actual || !strstr(actual, "\"lastdata\":\"PJSIP\",")
+		|| !strstr(actual, "\"dstchannel\":\"PJSIP/200\",")
+		|| !strstr(actual, "\"billsec\":115,") || !strstr(actual, big)
+		|| !strstr(headers, "truncated=dstchannel,lastdata\n")) {
+		ast_test_status_update(test, "field_limits not applied\npayload: %s\nheaders: %s\n",
+			S_OR(actual, "(null)"), headers);
+		res = AST_TEST_FAIL;
+	}
+
+	/* Room for everything but the large variable */
+	actual = cdr_kafka_test_encode_bounded(&cdr, "", full_len - 100, "", &sent_whole,
+		headers, sizeof(headers), &len);
+	if (!actual || len > full_len - 100 || strstr(actual, "X_BIG")
+		|| !strstr(actual, "\"X_SMALL\":\"ok\",\"X_NOTE\":\"a\xc3\xa9" "b\"}")
+		|| !strstr(headers, "truncated=X_BIG\n") || sent_whole) {
+		ast_test_status_update(test, "Budget not applied\npayload: %s\nheaders: %s\n",
+			S_OR(actual, "(null)"), headers);
+		res = AST_TEST_FAIL;
+	}
+
+	oversized = cdr_kafka_test_counter("Oversized");
+	dropped = cdr_kafka_test_counter("OversizeDrop");
+	actual = cdr_kafka_test_encode_bounded(&cdr, "", 100, "", &sent_whole,
+		headers, sizeof(headers), &len);
+	if (!actual || len || sent_whole
+		|| cdr_kafka_test_counter("OversizeDrop") - dropped != 1) {
+		ast_test_status_update(test, "Oversized record not dropped\npayload: %s\n",
+			S_OR(actual, "(null)"));
+		res = AST_TEST_FAIL;
+	}
+	actual = cdr_kafka_test_encode_bounded(&cdr, "lastdata:5", 100, "cdr_oversize", &sent_whole,
+		headers, sizeof(headers), &len);
+	if (!actual || len != full_len || strcmp(actual, full) || !sent_whole
+		|| strstr(headers, "truncated=")) {
+		ast_test_status_update(test, "Oversized record not sent whole\npayload: %s\nheaders: %s\n",
+			S_OR(actual, "(null)"), headers);
+		res = AST_TEST_FAIL;
+	}
+	if (cdr_kafka_test_counter("Oversized") - oversized != 2) {
+		ast_test_status_update(test, "Oversized records not counted\n");
+		res = AST_TEST_FAIL;
+	}
+
+	free_test_vars(&cdr);
+	return res;
+}
+
+/*! \brief Read a varint, or return -1 at the end of the input. */
+static int read_varint(const unsigned char **pos, const unsigned char *end, uint64_t *value)
+{
+	int shift = 0;
+
+	*value = 0;
+	while (*pos < end && shift < 64) {
+		unsigned char byte = *(*pos)++;
+
+		*value |= (uint64_t) (byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			return 0;
+		}
+		shift += 7;
+	}
+
+	return -1;
+}
+
+/*! \brief Read an Avro long. */
+static int read_avro_long(const unsigned char **pos, const unsigned char *end, int64_t *value)
+{
+	uint64_t raw;
+
+	if (read_varint(pos, end, &raw)) {
+		return -1;
+	}
+	*value = (int64_t) (raw >> 1) ^ -(int64_t) (raw & 1);
+	return 0;
+}
+
+/*! \brief Read an Avro string into \a out (NUL terminated, truncated to \a size). */
+static int read_avro_string(const unsigned char **pos, const unsigned char *end,
+	char *out, size_t size)
+{
+	int64_t len;
+
+	if (read_avro_long(pos, end, &len) || len < 0 || len > end - *pos) {
+		return -1;
+	}
+	snprintf(out, size, "%.*s", (int) len, (const char *) *pos);
+	*pos += len;
+	return 0;
+}
+
+AST_TEST_DEFINE(binary_formats)
+{
+	/* Field types of schemas/cdr.avsc: string, timestamp, long, int, optional string */
+	static const char avro_layout[] = "sssssssstttllsssssisssooo";
+	struct ast_cdr cdr;
+	const unsigned char *pos;
+	const unsigned char *end;
+	const char *payload;
+	char text[256];
+	char clid[256] = "";
+	int64_t number;
+	int64_t billsec = 0;
+	int64_t entries = -1;
+	int64_t uniqueid_branch = -1;
+	uint64_t tag;
+	uint64_t value;
+	int pb_variables = 0;
+	int pb_uniqueid = 0;
+	size_t len = 0;
+	size_t i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "binary_formats";
+		info->category = TEST_CATEGORY;
+		info->summary = "Avro and protobuf payloads";
+		info->description =
+			"Verifies format = avro and format = protobuf produce the "
+			"Confluent wire format header and a payload that decodes "
+			"according to the shipped schemas, with the CDR variables "
+			"in a map.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	build_test_cdr(&cdr);
+	cdr.start = ast_tv(1700000000, 123456);
+	add_test_var(&cdr, "X_QUEUE", "support");
+	add_test_var(&cdr, "X_NOTE", "hello");
+	add_test_var(&cdr, "X_QUEUE", "sales");
+
+	payload = cdr_kafka_test_encode_format(&cdr, "avro", 0x01020304, 1, 0, &len);
+	if (!payload || len < 5 || memcmp(payload, "\x00\x01\x02\x03\x04", 5)) {
+		ast_test_status_update(test, "Missing Avro wire format header\n");
+		goto fail;
+	}
+	pos = (const unsigned char *) payload + 5;
+	end = (const unsigned char *) payload + len;
+	for (i = 0; i < ARRAY_LEN(avro_layout) - 1; i++) {
+		int res;
+
+		switch (avro_layout[i]) {
+		case 's':
+			res = read_avro_string(&pos, end, i ? text : clid, sizeof(text));
+			break;
+		case 'o':
+			res = read_avro_long(&pos, end, &number);
+			if (!res && i == ARRAY_LEN(avro_layout) - 3) {
+				uniqueid_branch = number;
+			}
+			if (!res && number == 1) {
+				res = read_avro_string(&pos, end, text, sizeof(text));
+			}
+			break;
+		default:
+			res = read_avro_long(&pos, end, &number);
+			if (i == 12) {
+				billsec = number;
+			}
+			break;
+		}
+		if (res) {
+			ast_test_status_update(test, "Avro payload ends early at field %zu\n", i);
+			goto fail;
+		}
+	}
+	while (!read_avro_long(&pos, end, &number) && number) {
+		entries = number;
+		while (number--) {
+			if (read_avro_string(&pos, end, text, sizeof(text))
+				|| read_avro_string(&pos, end, text, sizeof(text))) {
+				goto fail;
+			}
+		}
+	}
+	if (pos != end || strcmp(clid, cdr.clid) || billsec != 115
+		|| uniqueid_branch != 1 || entries != 2 || strcmp(text, "hello")) {
+		ast_test_status_update(test, "Unexpected Avro payload\n");
+		goto fail;
+	}
+
+	payload = cdr_kafka_test_encode_format(&cdr, "protobuf", 7, 0, 0, &len);
+	if (!payload || len < 6 || memcmp(payload, "\x00\x00\x00\x00\x07\x00", 6)) {
+		ast_test_status_update(test, "Missing protobuf wire format header\n");
+		goto fail;
+	}
+	pos = (const unsigned char *) payload + 6;
+	end = (const unsigned char *) payload + len;
+	while (pos < end) {
+		if (read_varint(&pos, end, &tag)) {
+			goto fail;
+		}
+		if ((tag & 7) == 0) {
+			if (read_varint(&pos, end, &value)) {
+				goto fail;
+			}
+			if ((tag >> 3) == 13) {
+				billsec = value;
+			}
+		} else if ((tag & 7) == 2) {
+			if (read_varint(&pos, end, &value) || value > (uint64_t) (end - pos)) {
+				goto fail;
+			}
+			if ((tag >> 3) == 1) {
+				snprintf(clid, sizeof(clid), "%.*s", (int) value, (const char *) pos);
+			}
+			pb_variables += (tag >> 3) == 26;
+			pb_uniqueid += (tag >> 3) == 24;
+			pos += value;
+		} else {
+			ast_test_status_update(test, "Unexpected protobuf wire type\n");
+			goto fail;
+		}
+	}
+	if (strcmp(clid, cdr.clid) || billsec != 115 || pb_variables != 2 || pb_uniqueid) {
+		ast_test_status_update(test, "Unexpected protobuf payload\n");
+		goto fail;
+	}
+
+	free_test_vars(&cdr);
+	return AST_TEST_PASS;
+
+fail:
+	free_test_vars(&cdr);
+	return AST_TEST_FAIL;
+}
+
+/* ---- Kafka header tests ---- */
+
+AST_TEST_DEFINE(headers_configured)
+{
+	struct ast_cdr cdr;
+	char expected[512];
+	char actual[512];
+	char eid_str[20];
+	int count;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "headers_configured";
+		info->category = TEST_CATEGORY;
+		info->summary = "Configured Kafka headers";
+		info->description =
+			"Verifies the headers option selects built-in headers, "
+			"adds headers taken from CDR fields, renames them, "
+			"leaves the CDR field headers out of messages without a CDR, and "
+			"ignores the headers past the 16th.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	build_test_cdr(&cdr);
+	ast_eid_to_str(eid_str, sizeof(eid_str), &ast_eid_default);
+
+	count = cdr_kafka_test_headers("entity_id, disposition, tenantid:tenant, "
+		"nosuchfield, billsec, accountcode, peeraccount:tenant", &cdr, actual, sizeof(actual));
+	snprintf(expected, sizeof(expected),
+		"entity_id=%s\ndisposition=ANSWERED\ntenant=tenant-01\naccountcode=acct-100\n",
+		eid_str);
+	if (count != 4 || strcmp(actual, expected)) {
+		ast_test_status_update(test, "Mismatch\nexpected: %s\nactual:   %s\n",
+			expected, actual);
+		return AST_TEST_FAIL;
+	}
+
+	count = cdr_kafka_test_headers("hostname:host,accountcode", NULL, actual, sizeof(actual));
+	if (count != 1 || strncmp(actual, "host=", 5)) {
+		ast_test_status_update(test, "Unexpected headers without a CDR: %s\n", actual);
+		return AST_TEST_FAIL;
+	}
+
+	if (cdr_kafka_test_headers("", &cdr, actual, sizeof(actual)) != 0) {
+		ast_test_status_update(test, "Expected no headers\n");
+		return AST_TEST_FAIL;
+	}
+
+	/* More than 16 items: the rest are ignored and nothing is overwritten */
+	count = cdr_kafka_test_headers("disposition,timestamp:t1,timestamp:t2,timestamp:t3,"
+		"timestamp:t4,timestamp:t5,timestamp:t6,timestamp:t7,timestamp:t8,timestamp:t9,"
+		"timestamp:t10,timestamp:t11,timestamp:t12,timestamp:t13,timestamp:t14,"
+		"timestamp:t15,entity_id:e16,entity_id:e17,hostname:h18", &cdr, actual, sizeof(actual));
+	if (count != 16 || strncmp(actual, "disposition=ANSWERED\nt1=", 25)
+		|| strstr(actual, "e16=") || strstr(actual, "h18=")) {
+		ast_test_status_update(test, "Unexpected capped headers: %s\n", actual);
+		return AST_TEST_FAIL;
+	}
+
+	return AST_TEST_PASS;
+}
+
+AST_TEST_DEFINE(headers_dedupe)
+{
+	struct ast_cdr cdr;
+	char first[64];
+	char actual[64];
+	size_t i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "headers_dedupe";
+		info->category = TEST_CATEGORY;
+		info->summary = "Dedupe ID header";
+		info->description =
+			"Verifies the dedupe_id header is 16 hex digits, the same "
+			"every time a CDR is published, different for another "
+			"uniqueid or sequence, and left out of messages without a CDR.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	build_test_cdr(&cdr);
+
+	if (cdr_kafka_test_headers("dedupe_id", &cdr, first, sizeof(first)) != 1
+		|| strncmp(first, "dedupe_id=", 10) || strlen(first) != 10 + 16 + 1) {
+		ast_test_status_update(test, "Unexpected dedupe header: %s\n", first);
+		return AST_TEST_FAIL;
+	}
+	for (i = 10; i < 26; i++) {
+		if (!isxdigit((unsigned char) first[i])) {
+			ast_test_status_update(test, "Dedupe ID is not hex: %s\n", first);
+			return AST_TEST_FAIL;
+		}
+	}
+
+	cdr_kafka_test_headers("dedupe_id", &cdr, actual, sizeof(actual));
+	if (strcmp(actual, first)) {
+		ast_test_status_update(test, "Dedupe ID changed for the same CDR: %s vs %s\n",
+			first, actual);
+		return AST_TEST_FAIL;
+	}
+
+	cdr.sequence++;
+	cdr_kafka_test_headers("dedupe_id", &cdr, actual, sizeof(actual));
+	if (!strcmp(actual, first)) {
+		ast_test_status_update(test, "Dedupe ID ignores the sequence\n");
+		return AST_TEST_FAIL;
+	}
+
+	cdr.sequence--;
+	ast_copy_string(cdr.uniqueid, "1700000000.2", sizeof(cdr.uniqueid));
+	cdr_kafka_test_headers("dedupe_id", &cdr, actual, sizeof(actual));
+	if (!strcmp(actual, first)) {
+		ast_test_status_update(test, "Dedupe ID ignores the uniqueid\n");
+		return AST_TEST_FAIL;
+	}
+
+	if (cdr_kafka_test_headers("dedupe_id", NULL, actual, sizeof(actual)) != 0) {
+		ast_test_status_update(test, "Expected no dedupe ID without a CDR\n");
+		return AST_TEST_FAIL;
+	}
+
+	return AST_TEST_PASS;
+}
+
+/*! \brief Headers of the last message replay_produce() got, as "name=value\n" lines */
+static char replayed_headers[512];
+
+/*! \brief Stand-in producer keeping the headers of what it is given. */
+static int replay_produce(const char *topic, const char *key, const void *payload,
+	size_t len, const struct ast_kafka_header *headers, size_t header_count)
+{
+	char *pos = replayed_headers;
+	size_t size = sizeof(replayed_headers);
+	size_t i;
+
+	*pos = '\0';
+	for (i = 0; i < header_count; i++) {
+		ast_build_string(&pos, &size, "%s=%s\n", headers[i].name, headers[i].value);
+	}
+
+	return 0;
+}
+
+AST_TEST_DEFINE(spool_replay_headers)
+{
+	struct ast_cdr cdr;
+	char spooled[512];
+	char dedupe[64];
+	int res;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "spool_replay_headers";
+		info->category = TEST_CATEGORY;
+		info->summary = "Spooled messages keep their headers";
+		info->description =
+			"Verifies a spooled CDR is replayed with the headers it was "
+			"spooled with, including its dedupe_id, the headers taken "
+			"from CDR fields and the truncated header.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	build_test_cdr(&cdr);
+	if (cdr_kafka_test_headers("dedupe_id", &cdr, dedupe, sizeof(dedupe)) != 1
+		|| cdr_kafka_test_set_produce(replay_produce)) {
+		return AST_TEST_FAIL;
+	}
+
+	replayed_headers[0] = '\0';
+	res = cdr_kafka_test_spool_replay(&cdr, "dedupe_id,accountcode", spooled, sizeof(spooled));
+	cdr_kafka_test_set_produce(NULL);
+
+	if (res || strncmp(spooled, dedupe, strlen(dedupe))
+		|| !strstr(spooled, "\naccountcode=acct-100\ntruncated=lastdata\n")) {
+		ast_test_status_update(test, "Spooling failed or unexpected headers: %s\n", spooled);
+		return AST_TEST_FAIL;
+	}
+	if (strcmp(replayed_headers, spooled)) {
+		ast_test_status_update(test, "Replayed headers differ\nspooled:  %s\nreplayed: %s\n",
+			spooled, replayed_headers);
+		return AST_TEST_FAIL;
+	}
+
+	return AST_TEST_PASS;
+}
+
+#define SPOOL_ENTRIES 9
+
+/*! \brief Ways cdr_kafka_test_spool_recover() damages the spool. */
+#define SPOOL_INTACT 0
+#define SPOOL_CRASHED 1
+#define SPOOL_TRUNCATED 2
+#define SPOOL_CORRUPT 3
+
+/*! \brief Entries recover_produce() got, in order. */
+static int recovered[SPOOL_ENTRIES];
+static size_t recovered_count;
+
+/*! \brief Stand-in producer noting which of the "{\"n\":N}" payloads it got. */
+static int recover_produce(const char *topic, const char *key, const void *payload,
+	size_t len, const struct ast_kafka_header *headers, size_t header_count)
+{
+	char json[32];
+	int n;
+
+	ast_copy_string(json, payload, MIN(len + 1, sizeof(json)));
+	if (sscanf(json, "{\"n\":%d}", &n) != 1 || recovered_count == ARRAY_LEN(recovered)) {
+		return -1;
+	}
+	recovered[recovered_count++] = n;
+
+	return 0;
+}
+
+/*! \brief Spool the test entries 3 to a segment, damage them and check what comes back. */
+static int check_recovery(struct ast_test *test, int damage, size_t damaged,
+	size_t count, const int *expected, size_t expected_count)
+{
+	char payloads[SPOOL_ENTRIES][16];
+	const char *entries[SPOOL_ENTRIES];
+	int segments;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		snprintf(payloads[i], sizeof(payloads[i]), "{\"n\":%zu}", i);
+		entries[i] = payloads[i];
+	}
+
+	recovered_count = 0;
+	segments = cdr_kafka_test_spool_recover(entries, count, 3, damage, damaged);
+	if (segments != (int) (count + 2) / 3) {
+		ast_test_status_update(test, "Damage %d: %d segments found, expected %zu\n",
+			damage, segments, (count + 2) / 3);
+		return -1;
+	}
+	if (recovered_count != expected_count
+		|| memcmp(recovered, expected, expected_count * sizeof(*expected))) {
+		ast_test_status_update(test, "Damage %d: %zu entries replayed, expected %zu\n",
+			damage, recovered_count, expected_count);
+		for (i = 0; i < recovered_count; i++) {
+			ast_test_status_update(test, "  %zu: entry %d\n", i, recovered[i]);
+		}
+		return -1;
+	}
+
+	return 0;
+}
+
+AST_TEST_DEFINE(spool_recovery)
+{
+	static const int all[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, };
+	/* The rest of the damaged segment is lost, later segments are not */
+	static const int damaged[] = { 0, 1, 2, 3, 6, 7, 8, };
+	enum ast_test_result_state res = AST_TEST_PASS;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "spool_recovery";
+		info->category = TEST_CATEGORY;
+		info->summary = "Spool segments are found and replayed in order";
+		info->description =
+			"Verifies that spooled entries left over from a previous run "
+			"are replayed oldest segment first and in the order they were "
+			"written, that an unsealed segment left by a crash replays up "
+			"to its last entry, and that a truncated or corrupt entry "
+			"discards the rest of its segment only.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	if (cdr_kafka_test_set_produce(recover_produce)) {
+		return AST_TEST_FAIL;
+	}
+	if (check_recovery(test, SPOOL_INTACT, SIZE_MAX, 9, all, 9)
+		|| check_recovery(test, SPOOL_CRASHED, SIZE_MAX, 8, all, 8)
+		|| check_recovery(test, SPOOL_TRUNCATED, 4, 9, damaged, ARRAY_LEN(damaged))
+		|| check_recovery(test, SPOOL_CORRUPT, 4, 9, damaged, ARRAY_LEN(damaged))) {
+		res = AST_TEST_FAIL;
+	}
+	cdr_kafka_test_set_produce(NULL);
+
+	return res;
+}
+
+/* ---- Compression test ---- */
+
+/*!
+ * \brief Check a CDR compressed as zstd frame decompresses to its JSON payload.
+ *
+ * \param dict Raw content dictionary at \a dictionary, or NULL for none.
+ */
+static int check_compress(struct ast_test *test, struct ast_cdr *cdr, const char *dictionary,
+	const char *dict, size_t dict_len)
+{
+	char headers[256];
+	char *plain;
+	const char *payload;
+	size_t plain_len = 0;
+	size_t len = 0;
+
+	payload = cdr_kafka_json_encode(cdr, 0, 0, &plain_len);
+	if (!payload) {
+		return -1;
+	}
+	plain = ast_strdupa(payload);
+
+	payload = cdr_kafka_test_compress(cdr, dictionary, 3, &len, headers, sizeof(headers));
+	if (!payload) {
+		ast_test_status_update(test, "Failed to compress with dictionary '%s'\n", dictionary);
+		return -1;
+	}
+
+#ifdef HAVE_ZSTD
+	{
+		ZSTD_DCtx *dctx = ZSTD_createDCtx();
+		char out[4096];
+		size_t res;
+
+		if (!dctx) {
+			return -1;
+		}
+		res = ZSTD_decompress_usingDict(dctx, out, sizeof(out), payload, len, dict, dict_len);
+		ZSTD_freeDCtx(dctx);
+		if (ZSTD_isError(res) || res != plain_len || memcmp(out, plain, plain_len)) {
+			ast_test_status_update(test, "Payload does not decompress to the JSON payload\n");
+			return -1;
+		}
+		if (len >= plain_len) {
+			ast_test_status_update(test, "Compressed payload is %zu bytes, JSON is %zu\n",
+				len, plain_len);
+			return -1;
+		}
+	}
+	if (strcmp(headers, "content_encoding=zstd\n")) {
+		ast_test_status_update(test, "Unexpected headers: %s\n", headers);
+		return -1;
+	}
+#else
+	/* Built without zstd, compression = zstd falls back to none */
+	if (len != plain_len || memcmp(payload, plain, plain_len) || *headers) {
+		ast_test_status_update(test, "Expected the uncompressed payload\n");
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
+AST_TEST_DEFINE(zstd_compression)
+{
+	char dictionary[] = "/tmp/test_cdr_kafka_dict_XXXXXX";
+	char dict[2048];
+	const char *payload;
+	struct ast_cdr cdr;
+	size_t dict_len = 0;
+	int fd;
+	int res = 0;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "zstd_compression";
+		info->category = TEST_CATEGORY;
+		info->summary = "Payloads compressed with zstd";
+		info->description =
+			"Verifies compression = zstd turns each payload into a zstd "
+			"frame, with and without a dictionary, that decompresses to "
+			"the JSON payload and is marked by a content_encoding header.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	build_test_cdr(&cdr);
+
+	/* A raw content dictionary made of a CDR much like the one compressed */
+	payload = cdr_kafka_json_encode(&cdr, 0, 0, &dict_len);
+	if (!payload) {
+		return AST_TEST_FAIL;
+	}
+	ast_copy_string(dict, payload, sizeof(dict));
+	dict_len = strlen(dict);
+	fd = mkstemp(dictionary);
+	if (fd < 0) {
+		ast_test_status_update(test, "Cannot create %s\n", dictionary);
+		return AST_TEST_FAIL;
+	}
+	if (write(fd, dict, dict_len) != (ssize_t) dict_len) {
+		res = -1;
+	}
+	close(fd);
+
+	res |= check_compress(test, &cdr, "", NULL, 0);
+	res |= check_compress(test, &cdr, dictionary, dict, dict_len);
+	unlink(dictionary);
+
+	return res ? AST_TEST_FAIL : AST_TEST_PASS;
+}
+
+/* ---- Topic routing tests ---- */
+
+/*! \brief Check the topic \a cdr is routed to. */
+static int check_topic(struct ast_test *test, const char *topic, const char *route_by,
+	const char *routes, struct ast_cdr *cdr, const char *expected)
+{
+	char actual[256];
+
+	if (cdr_kafka_test_topic(topic, route_by, routes, cdr, actual, sizeof(actual))) {
+		ast_test_status_update(test, "Failed to compile topic '%s'\n", topic);
+		return -1;
+	}
+	if (strcmp(actual, expected)) {
+		ast_test_status_update(test, "Topic '%s': expected '%s', got '%s'\n",
+			topic, expected, actual);
+		return -1;
+	}
+
+	return 0;
+}
+
+AST_TEST_DEFINE(topic_routing)
+{
+	static const char routes[] = "acct-100 => billing\n acct-300=>cdr.acct-300 \nbogus";
+	struct ast_cdr cdr;
+	int res = 0;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "topic_routing";
+		info->category = TEST_CATEGORY;
+		info->summary = "Per-record topic selection";
+		info->description =
+			"Verifies topic templates expand CDR fields, replace characters "
+			"Kafka does not allow, and that route_by routes take precedence.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	build_test_cdr(&cdr);
+
+	res |= check_topic(test, "plain", "", "", &cdr, "plain");
+	res |= check_topic(test, "cdr_${tenantid}", "", "", &cdr, "cdr_tenant-01");
+	res |= check_topic(test, "cdr.${accountcode}.${disposition}", "", "", &cdr,
+		"cdr.acct-100.ANSWERED");
+	res |= check_topic(test, "cdr_${nosuchfield}_${billsec}", "", "", &cdr, "cdr__");
+	res |= check_topic(test, "cdr_${tenantid}", "", "", NULL, "cdr_");
+	res |= check_topic(test, "cdr_${tenantid}", "accountcode", routes, &cdr, "billing");
+
+	ast_copy_string(cdr.accountcode, "acct-300", sizeof(cdr.accountcode));
+	res |= check_topic(test, "cdr_${tenantid}", "accountcode", routes, &cdr, "cdr.acct-300");
+
+	ast_copy_string(cdr.accountcode, "acct-400", sizeof(cdr.accountcode));
+	res |= check_topic(test, "cdr_${tenantid}", "accountcode", routes, &cdr, "cdr_tenant-01");
+	res |= check_topic(test, "fixed", "accountcode", routes, &cdr, "fixed");
+
+	ast_copy_string(cdr.tenantid, "a b/c:d", sizeof(cdr.tenantid));
+	res |= check_topic(test, "cdr_${tenantid}", "", "", &cdr, "cdr_a_b_c_d");
+
+	cdr.tenantid[0] = '\0';
+	res |= check_topic(test, "${tenantid}", "", "", &cdr, "asterisk_cdr");
+
+	return res ? AST_TEST_FAIL : AST_TEST_PASS;
+}
+
+/* ---- Warm-up test ---- */
+
+/*! \brief States cdr_kafka_test_warmup() ends in */
+#define WARMUP_READY 1
+#define WARMUP_TIMED_OUT 2
+
+static int warmup_produce(const char *topic, const char *key, const void *payload,
+	size_t len, const struct ast_kafka_header *headers, size_t header_count)
+{
+	return 0;
+}
+
+/*! \brief Check a warm-up ends in \a state after warming \a warmed topics. */
+static int check_warmup(struct ast_test *test, const char *topic, const char *routes,
+	unsigned int connections, int partitions, int state, unsigned int warmed)
+{
+	unsigned int actual_warmed = 0;
+	int actual = cdr_kafka_test_warmup(topic, "accountcode", routes, connections, partitions,
+		200, &actual_warmed);
+
+	if (actual != state || actual_warmed != warmed) {
+		ast_test_status_update(test, "Topic '%s' on %u connections: state %d after %u topics, "
+			"expected %d after %u\n", topic, connections, actual, actual_warmed, state, warmed);
+		return -1;
+	}
+
+	return 0;
+}
+
+AST_TEST_DEFINE(topic_warmup)
+{
+	static const char routes[] = "acct-100 => billing\nacct-200 => billing\nacct-300 => cdr";
+	int res = 0;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "topic_warmup";
+		info->category = TEST_CATEGORY;
+		info->summary = "Topics are prepared on every connection";
+		info->description =
+			"Verifies the warm-up asks every connection for the topic and "
+			"each distinct route, skips a topic built from CDR fields, is "
+			"ready once all metadata is known and times out otherwise.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	if (cdr_kafka_test_set_produce(warmup_produce)) {
+		return AST_TEST_FAIL;
+	}
+
+	res |= check_warmup(test, "cdr", routes, 2, 6, WARMUP_READY, 4);
+	res |= check_warmup(test, "cdr_${tenantid}", routes, 1, 6, WARMUP_READY, 2);
+	res |= check_warmup(test, "cdr", "", 1, -1, WARMUP_TIMED_OUT, 1);
+
+	cdr_kafka_test_set_produce(NULL);
+
+	return res ? AST_TEST_FAIL : AST_TEST_PASS;
+}
+
+/* ---- Filter rules test ---- */
+
+/*! \brief Check whether \a filter drops \a cdr. */
+static int check_filter(struct ast_test *test, const char *filter, struct ast_cdr *cdr,
+	int dropped)
+{
+	int res = cdr_kafka_test_filter(filter, cdr);
+
+	if (res != dropped) {
+		ast_test_status_update(test, "Filter '%s' gave %d, expected %d\n", filter, res, dropped);
+		return -1;
+	}
+
+	return 0;
+}
+
+AST_TEST_DEFINE(filter_rules)
+{
+	static const char ring_group[] =
+		"disposition = NO ANSWER & billsec = 0 => drop\n"
+		"channel ^= Local/ => drop";
+	enum ast_test_result_state res = AST_TEST_PASS;
+	struct ast_cdr cdr;
+	int kept = 0;
+	int i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "filter_rules";
+		info->category = TEST_CATEGORY;
+		info->summary = "Filter rules drop and sample CDRs";
+		info->description =
+			"Verifies text, prefix and numeric conditions, first match "
+			"ordering, invalid rules being ignored, and sampling by linkedid.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	build_test_cdr(&cdr);
+
+	if (check_filter(test, ring_group, &cdr, 0)
+		|| check_filter(test, "", &cdr, 0)
+		|| check_filter(test, "dcontext = from-internal => drop", &cdr, 1)
+		|| check_filter(test, "dcontext != from-internal => drop", &cdr, 0)
+		|| check_filter(test, "channel ^= PJSIP/ & billsec >= 115 => drop", &cdr, 1)
+		|| check_filter(test, "channel ^= PJSIP/ & billsec > 115 => drop", &cdr, 0)
+		|| check_filter(test, "durationsec < 121 & sequence <= 1 => drop", &cdr, 1)
+		|| check_filter(test, "accountcode = acct-100 => keep\nsrc = 1001 => drop", &cdr, 0)
+		|| check_filter(test, "bogus = 1 => drop\nbillsec ^= 1 => drop\nsrc < 5 => drop", &cdr, 0)
+		|| check_filter(test, "src = 1001 => discard", &cdr, 0)
+		|| check_filter(test, "src = 1001 => sample 0", &cdr, 1)
+		|| check_filter(test, "src = 1001 => sample 100%", &cdr, 0)) {
+		res = AST_TEST_FAIL;
+	}
+
+	cdr.disposition = AST_CDR_NOANSWER;
+	cdr.billsec = 0;
+	if (check_filter(test, ring_group, &cdr, 1)) {
+		res = AST_TEST_FAIL;
+	}
+	cdr.billsec = 3;
+	ast_copy_string(cdr.channel, "Local/2001@queue-0001;2", sizeof(cdr.channel));
+	if (check_filter(test, ring_group, &cdr, 1)) {
+		res = AST_TEST_FAIL;
+	}
+
+	/* Sampling keeps about the requested share, the same calls every time */
+	for (i = 0; i < 1000; i++) {
+		snprintf(cdr.linkedid, sizeof(cdr.linkedid), "1700000000.%d", i);
+		if (!cdr_kafka_test_filter("src = 1001 => sample 25", &cdr)) {
+			kept++;
+			if (cdr_kafka_test_filter("src = 1001 => sample 25", &cdr)) {
+				ast_test_status_update(test, "Sampling of %s changed\n", cdr.linkedid);
+				res = AST_TEST_FAIL;
+			}
+		}
+	}
+	if (kept < 200 || kept > 300) {
+		ast_test_status_update(test, "Sampling 25%% kept %d of 1000 calls\n", kept);
+		res = AST_TEST_FAIL;
+	}
+
+	return res;
+}
+
+/* ---- Payload pool test ---- */
+
+/*! \brief Payload seen by pool_produce() */
+static const void *pool_payload;
+
+/*! \brief Whether pool_produce() accepts the message */
+static int pool_accept;
+
+static int pool_produce(const char *topic, const char *key, const void *payload,
+	size_t len, const struct ast_kafka_header *headers, size_t header_count)
+{
+	pool_payload = payload;
+	return pool_accept ? 0 : -1;
+}
+
+AST_TEST_DEFINE(payload_pool)
+{
+	enum ast_test_result_state res = AST_TEST_PASS;
+	const void *first;
+	unsigned long allocations;
+	struct ast_cdr cdr;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "payload_pool";
+		info->category = TEST_CATEGORY;
+		info->summary = "Payload buffers are recycled";
+		info->description =
+			"Verifies a payload buffer released by the producer, or not "
+			"taken by it, is reused for the next CDR without allocating.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	build_test_cdr(&cdr);
+	pool_accept = 1;
+	if (cdr_kafka_test_set_produce(pool_produce)) {
+		return AST_TEST_FAIL;
+	}
+
+	cdr_kafka_test_publish(&cdr);
+	first = pool_payload;
+	allocations = cdr_kafka_test_allocations();
+
+	if (cdr_kafka_test_publish(&cdr) || pool_payload != first) {
+		ast_test_status_update(test, "Delivered payload buffer was not reused\n");
+		res = AST_TEST_FAIL;
+	}
+
+	pool_accept = 0;
+	cdr_kafka_test_publish(&cdr);
+	pool_accept = 1;
+	if (cdr_kafka_test_publish(&cdr) || pool_payload != first) {
+		ast_test_status_update(test, "Rejected payload buffer was not reused\n");
+		res = AST_TEST_FAIL;
+	}
+
+	if (cdr_kafka_test_allocations() != allocations) {
+		ast_test_status_update(test, "%lu allocations after warm-up\n",
+			cdr_kafka_test_allocations() - allocations);
+		res = AST_TEST_FAIL;
+	}
+
+	cdr_kafka_test_set_produce(NULL);
+
+	return res;
+}
+
+/* ---- Delivery report test ---- */
+
+/*! \brief What delivery_produce() returns: 0 delivers, 1 fails the delivery */
+static int delivery_result;
+
+static int delivery_produce(const char *topic, const char *key, const void *payload,
+	size_t len, const struct ast_kafka_header *headers, size_t header_count)
+{
+	pool_payload = payload;
+	return delivery_result;
+}
+
+AST_TEST_DEFINE(delivery_reports)
+{
+	enum ast_test_result_state res = AST_TEST_PASS;
+	uint64_t delivered;
+	uint64_t delivery_failed;
+	uint64_t lost;
+	const void *first;
+	unsigned long allocations;
+	struct ast_cdr cdr;
+	int i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "delivery_reports";
+		info->category = TEST_CATEGORY;
+		info->summary = "Delivery reports recycle, count and spool payloads";
+		info->description =
+			"Verifies the delivery report of a pooled payload counts it as "
+			"delivered or failed, records its delivery latency, spools or "
+			"counts a payload that was taken but never delivered, and "
+			"returns the buffer to the pool either way.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	build_test_cdr(&cdr);
+	delivery_result = 0;
+	if (cdr_kafka_test_set_produce(delivery_produce)) {
+		return AST_TEST_FAIL;
+	}
+
+	cdr_kafka_test_publish(&cdr);
+	first = pool_payload;
+	allocations = cdr_kafka_test_allocations();
+	delivered = cdr_kafka_test_counter("Delivered");
+	delivery_failed = cdr_kafka_test_counter("DeliveryFailed");
+	lost = cdr_kafka_test_counter("Failed") + cdr_kafka_test_counter("Spooled");
+
+	for (i = 0; i < 3; i++) {
+		cdr_kafka_test_publish(&cdr);
+	}
+	delivery_result = 1;
+	for (i = 0; i < 2; i++) {
+		if (cdr_kafka_test_publish(&cdr)) {
+			ast_test_status_update(test, "A CDR taken by the producer was reported failed\n");
+			res = AST_TEST_FAIL;
+		}
+	}
+	delivered = cdr_kafka_test_counter("Delivered") - delivered;
+	delivery_failed = cdr_kafka_test_counter("DeliveryFailed") - delivery_failed;
+
+	if (delivered != 3 || delivery_failed != 2) {
+		ast_test_status_update(test, "%" PRIu64 " delivered and %" PRIu64 " failed, expected 3 and 2\n",
+			delivered, delivery_failed);
+		res = AST_TEST_FAIL;
+	}
+	if (cdr_kafka_test_counter("Failed") + cdr_kafka_test_counter("Spooled") - lost != 2) {
+		ast_test_status_update(test, "Undelivered CDRs were neither spooled nor counted as failed\n");
+		res = AST_TEST_FAIL;
+	}
+	if (pool_payload != first || cdr_kafka_test_allocations() != allocations) {
+		ast_test_status_update(test, "Reported payload buffers were not reused\n");
+		res = AST_TEST_FAIL;
+	}
+
+	cdr_kafka_test_set_produce(NULL);
+
+	return res;
+}
+
+/* ---- Reload test ---- */
+
+static int reload_produce(const char *topic, const char *key, const void *payload,
+	size_t len, const struct ast_kafka_header *headers, size_t header_count)
+{
+	return 0;
+}
+
+AST_TEST_DEFINE(snapshot_reload)
+{
+	enum ast_test_result_state res = AST_TEST_PASS;
+	int i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "snapshot_reload";
+		info->category = TEST_CATEGORY;
+		info->summary = "Threads pick up the snapshot of a reload";
+		info->description =
+			"Verifies that a thread holding the snapshot it last published with "
+			"gets the one republished by a reload on its next publish, rather "
+			"than the one it cached, and then keeps getting it from its cache.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	if (cdr_kafka_test_set_produce(reload_produce)) {
+		return AST_TEST_FAIL;
+	}
+
+	/* Each time with the generation the last one left behind */
+	for (i = 0; i < 3; i++) {
+		int reloaded = cdr_kafka_test_reload();
+
+		if (reloaded) {
+			ast_test_status_update(test, "Reload %d: %s\n", i + 1, reloaded < 0
+				? "no snapshot, is the module configured?"
+				: "the thread kept its cached snapshot");
+			res = AST_TEST_FAIL;
+			break;
+		}
+	}
+
+	cdr_kafka_test_set_produce(NULL);
+
+	return res;
+}
+
+/* ---- Metrics histogram test ---- */
+
+/*!
+ * \brief Check that \a value lands in a bucket that holds it, is no wider than a
+ * quarter of it and starts right after the bucket of \a value - 1.
+ */
+static int check_hist_bucket(struct ast_test *test, uint64_t value)
+{
+	uint64_t max;
+	uint64_t prev_max = 0;
+	unsigned int bucket = cdr_kafka_test_hist_bucket(value, &max);
+	unsigned int prev = bucket;
+
+	if (value) {
+		prev = cdr_kafka_test_hist_bucket(value - 1, &prev_max);
+	}
+	if (max < value || max - value > value / 4
+		|| (value && prev != bucket && (prev + 1 != bucket || prev_max != value - 1))) {
+		ast_test_status_update(test, "%" PRIu64 " in bucket %u up to %" PRIu64
+			", %" PRIu64 " in bucket %u up to %" PRIu64 "\n",
+			value, bucket, max, value - 1, prev, prev_max);
+		return -1;
+	}
+
+	return 0;
+}
+
+AST_TEST_DEFINE(metrics_histogram)
+{
+	enum ast_test_result_state res = AST_TEST_PASS;
+	static const struct {
+		double fraction;
+		uint64_t expected;
+	} percentiles[] = {
+		/* Rank 1 is 1, which has a bucket of its own */
+		{ 0.0, 1 },
+		/* Rank 500 is in the bucket 448 to 511 */
+		{ 0.5, 511 },
+		/* Rank 990 is in the bucket 896 to 1023, cut to the largest value */
+		{ 0.99, 1000 },
+		{ 1.0, 1000 },
+	};
+	uint64_t values[1000];
+	uint64_t max;
+	uint64_t got;
+	unsigned int bucket;
+	unsigned int shift;
+	size_t i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "metrics_histogram";
+		info->category = TEST_CATEGORY;
+		info->summary = "Latency histogram buckets and percentiles";
+		info->description =
+			"Verifies that every value lands in a histogram bucket that holds it "
+			"and is no wider than a quarter of it, that buckets follow each other "
+			"without gaps up to the largest 64-bit value, and that percentiles "
+			"report the top of the bucket they fall in, cut to the largest value "
+			"recorded.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	for (i = 0; i < 4; i++) {
+		bucket = cdr_kafka_test_hist_bucket(i, &max);
+		if (bucket != i || max != i) {
+			ast_test_status_update(test, "%zu in bucket %u up to %" PRIu64 "\n", i, bucket, max);
+			res = AST_TEST_FAIL;
+		}
+	}
+	for (i = 0; i < 4096; i++) {
+		if (check_hist_bucket(test, i)) {
+			res = AST_TEST_FAIL;
+		}
+	}
+	for (shift = 12; shift < 64; shift++) {
+		if (check_hist_bucket(test, (uint64_t) 1 << shift)
+			|| check_hist_bucket(test, ((uint64_t) 1 << shift) - 1)
+			|| check_hist_bucket(test, ((uint64_t) 1 << shift) + 1)
+			|| check_hist_bucket(test, ((uint64_t) 3 << (shift - 1)) + 1)) {
+			res = AST_TEST_FAIL;
+		}
+	}
+	bucket = cdr_kafka_test_hist_bucket(UINT64_MAX, &max);
+	if (check_hist_bucket(test, UINT64_MAX) || max != UINT64_MAX) {
+		ast_test_status_update(test, "largest value in bucket %u up to %" PRIu64 "\n", bucket, max);
+		res = AST_TEST_FAIL;
+	}
+
+	if ((got = cdr_kafka_test_hist_percentile(NULL, 0, 0.5)) != 0) {
+		ast_test_status_update(test, "median of nothing is %" PRIu64 "\n", got);
+		res = AST_TEST_FAIL;
+	}
+	values[0] = 5;
+	if ((got = cdr_kafka_test_hist_percentile(values, 1, 0.99)) != 5) {
+		ast_test_status_update(test, "99th percentile of 5 is %" PRIu64 "\n", got);
+		res = AST_TEST_FAIL;
+	}
+
+	for (i = 0; i < ARRAY_LEN(values); i++) {
+		values[i] = i + 1;
+	}
+	for (i = 0; i < ARRAY_LEN(percentiles); i++) {
+		got = cdr_kafka_test_hist_percentile(values, ARRAY_LEN(values), percentiles[i].fraction);
+		if (got != percentiles[i].expected) {
+			ast_test_status_update(test, "%g percentile of 1 to 1000 is %" PRIu64 ", expected %" PRIu64 "\n",
+				percentiles[i].fraction * 100, got, percentiles[i].expected);
+			res = AST_TEST_FAIL;
+		}
+	}
+
+	return res;
+}
+
+/* ---- Tracing test ---- */
+
+/*! \brief How long the traces of queued CDRs get to show up */
+#define TRACE_WAIT_MS 5000
+
+/*! \brief Topic and size of the last message seen by trace_produce() */
+static char trace_topic[256];
+static size_t trace_len;
+
+AST_MUTEX_DEFINE_STATIC(trace_lock);
+
+static int trace_produce(const char *topic, const char *key, const void *payload,
+	size_t len, const struct ast_kafka_header *headers, size_t header_count)
+{
+	ast_mutex_lock(&trace_lock);
+	ast_copy_string(trace_topic, topic, sizeof(trace_topic));
+	trace_len = len;
+	ast_mutex_unlock(&trace_lock);
+
+	return 0;
+}
+
+/*! \brief Wait for \a expected traces, which queued CDRs only get once published. */
+static int trace_wait(size_t expected, char *out, size_t size)
+{
+	int waited = 0;
+	int count;
+
+	while ((count = cdr_kafka_test_trace_slowest(out, size)) >= 0
+		&& (size_t) count < expected && waited < TRACE_WAIT_MS) {
+		usleep(10000);
+		waited += 10;
+	}
+
+	return count;
+}
+
+AST_TEST_DEFINE(trace_sampling)
+{
+	enum ast_test_result_state res = AST_TEST_PASS;
+	struct ast_cdr cdr;
+	char slowest[512];
+	char expected[300];
+	int count;
+	int i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "trace_sampling";
+		info->category = TEST_CATEGORY;
+		info->summary = "Sampled publishes are traced";
+		info->description =
+			"Verifies that tracing 1 in 2 CDRs through the loaded configuration "
+			"keeps a trace of every second one with its topic and payload size, "
+			"that nothing is traced while tracing is off, and that turning it "
+			"on again starts with no traces.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	build_test_cdr(&cdr);
+	if (cdr_kafka_test_set_produce(trace_produce)) {
+		return AST_TEST_FAIL;
+	}
+
+	cdr_kafka_test_trace(2);
+	for (i = 0; i < 10; i++) {
+		cdr_kafka_test_log(&cdr);
+	}
+	cdr_kafka_test_trace(0);
+
+	count = trace_wait(5, slowest, sizeof(slowest));
+	ast_mutex_lock(&trace_lock);
+	snprintf(expected, sizeof(expected), "topic=%s\nlen=%zu\ntaken=1\n", trace_topic, trace_len);
+	ast_mutex_unlock(&trace_lock);
+	if (count != 5 || !strstr(slowest, expected)) {
+		ast_test_status_update(test, "%d traces, expected 5\nslowest:\n%sexpected:\n%s",
+			count, slowest, expected);
+		res = AST_TEST_FAIL;
+	}
+
+	for (i = 0; i < 10; i++) {
+		cdr_kafka_test_log(&cdr);
+	}
+	/* Give queued CDRs time to be published, traced or not */
+	usleep(100000);
+	count = cdr_kafka_test_trace_slowest(slowest, sizeof(slowest));
+	if (count != 5) {
+		ast_test_status_update(test, "%d traces after logging with tracing off\n", count);
+		res = AST_TEST_FAIL;
+	}
+
+	cdr_kafka_test_trace(1);
+	count = cdr_kafka_test_trace_slowest(slowest, sizeof(slowest));
+	cdr_kafka_test_trace(0);
+	if (count != 0) {
+		ast_test_status_update(test, "%d traces left after tracing was turned on again\n", count);
+		res = AST_TEST_FAIL;
+	}
+
+	cdr_kafka_test_set_produce(NULL);
+
+	return res;
+}
+
+/* ---- Call aggregation test ---- */
+
+#define AGGREGATE_MESSAGES_MAX 8
+
+/*! \brief Linkedid and number of legs of each message seen by aggregate_produce() */
+static struct {
+	char linkedid[AST_MAX_UNIQUEID];
+	int legs;
+} aggregate_messages[AGGREGATE_MESSAGES_MAX];
+
+static size_t aggregate_message_count;
+
+/*! \brief Count the objects in the "legs" array of a call message. */
+static int count_legs(const char *payload, size_t len)
+{
+	const char *end = payload + len;
+	const char *pos = strstr(payload, "\"legs\":[");
+	int depth = 0;
+	int legs = 0;
+
+	if (!pos) {
+		return -1;
+	}
+
+	for (pos += 8; pos < end; pos++) {
+		if (*pos == '"') {
+			for (pos++; pos < end && *pos != '"'; pos++) {
+				pos += *pos == '\\';
+			}
+		} else if (*pos == '{') {
+			legs += !depth++;
+		} else if (*pos == '}') {
+			depth--;
+		} else if (*pos == ']' && !depth) {
+			return legs;
+		}
+	}
+
+	return -1;
+}
+
+static int aggregate_produce(const char *topic, const char *key, const void *payload,
+	size_t len, const struct ast_kafka_header *headers, size_t header_count)
+{
+	char *copy = ast_strndup(payload, len);
+	char linkedid[AST_MAX_UNIQUEID] = "";
+
+	if (!copy || aggregate_message_count == AGGREGATE_MESSAGES_MAX) {
+		ast_free(copy);
+		return -1;
+	}
+
+	sscanf(copy, "{\"linkedid\":\"%31[^\"]\"", linkedid);
+	ast_copy_string(aggregate_messages[aggregate_message_count].linkedid, linkedid,
+		sizeof(aggregate_messages[0].linkedid));
+	aggregate_messages[aggregate_message_count++].legs = count_legs(copy, len);
+	ast_free(copy);
+
+	return 0;
+}
+
+/*! \brief Check message \a i went to call \a linkedid with \a legs legs. */
+static int check_call(struct ast_test *test, size_t i, const char *linkedid, int legs)
+{
+	if (i >= aggregate_message_count) {
+		ast_test_status_update(test, "Message %zu missing\n", i);
+		return -1;
+	}
+	if (strcmp(aggregate_messages[i].linkedid, linkedid) || aggregate_messages[i].legs != legs) {
+		ast_test_status_update(test, "Message %zu is call '%s' with %d legs, expected '%s' with %d\n",
+			i, aggregate_messages[i].linkedid, aggregate_messages[i].legs, linkedid, legs);
+		return -1;
+	}
+
+	return 0;
+}
+
+AST_TEST_DEFINE(call_aggregation)
+{
+	enum ast_test_result_state res = AST_TEST_PASS;
+	struct ast_cdr legs[4];
+	struct ast_cdr *cdrs[ARRAY_LEN(legs)];
+	static const char * const linkedids[] = { "call-a", "call-b", "call-a", "call-a" };
+	size_t i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "call_aggregation";
+		info->category = TEST_CATEGORY;
+		info->summary = "CDRs of a call are published together";
+		info->description =
+			"Verifies CDRs sharing a linkedid go out as one message, a call "
+			"reaching aggregate_max_legs goes out at once and a later CDR "
+			"starts a new message, and an ended call goes out first, also "
+			"when its end was seen before its CDRs.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	for (i = 0; i < ARRAY_LEN(legs); i++) {
+		build_test_cdr(&legs[i]);
+		ast_copy_string(legs[i].linkedid, linkedids[i], sizeof(legs[i].linkedid));
+		cdrs[i] = &legs[i];
+	}
+
+	if (cdr_kafka_test_set_produce(aggregate_produce)) {
+		return AST_TEST_FAIL;
+	}
+
+	aggregate_message_count = 0;
+	if (cdr_kafka_test_aggregate(cdrs, ARRAY_LEN(cdrs), 2, NULL, 0)
+		|| aggregate_message_count != 3
+		|| check_call(test, 0, "call-a", 2)
+		|| check_call(test, 1, "call-b", 1)
+		|| check_call(test, 2, "call-a", 1)) {
+		ast_test_status_update(test, "Idle calls not published as expected\n");
+		res = AST_TEST_FAIL;
+	}
+
+	aggregate_message_count = 0;
+	if (cdr_kafka_test_aggregate(cdrs, ARRAY_LEN(cdrs), 2, "call-a", 0)
+		|| aggregate_message_count != 3
+		|| check_call(test, 0, "call-a", 2)
+		|| check_call(test, 1, "call-a", 1)
+		|| check_call(test, 2, "call-b", 1)) {
+		ast_test_status_update(test, "Ended call not published first\n");
+		res = AST_TEST_FAIL;
+	}
+
+	aggregate_message_count = 0;
+	if (cdr_kafka_test_aggregate(cdrs, ARRAY_LEN(cdrs), 64, NULL, 0)
+		|| aggregate_message_count != 2
+		|| check_call(test, 0, "call-b", 1)
+		|| check_call(test, 1, "call-a", 3)) {
+		ast_test_status_update(test, "Calls not merged\n");
+		res = AST_TEST_FAIL;
+	}
+
+	aggregate_message_count = 0;
+	if (cdr_kafka_test_aggregate(cdrs, ARRAY_LEN(cdrs), 64, "call-a", 1)
+		|| aggregate_message_count != 2
+		|| check_call(test, 0, "call-a", 3)
+		|| check_call(test, 1, "call-b", 1)) {
+		ast_test_status_update(test, "Call ended before its CDRs not published as ended\n");
+		res = AST_TEST_FAIL;
+	}
+
+	aggregate_message_count = 0;
+	if (cdr_kafka_test_aggregate(cdrs, ARRAY_LEN(cdrs), 64, "call-z", 1)
+		|| aggregate_message_count != 2) {
+		ast_test_status_update(test, "Call ended without CDRs was published\n");
+		res = AST_TEST_FAIL;
+	}
+
+	cdr_kafka_test_set_produce(NULL);
+
+	return res;
+}
+
+/* ---- CDR backend registration test ---- */
+
+/*! \brief Steps of the failover test, 100 ms apart. */
+#define FAILOVER_STEPS 350
+
+/*! \brief First step in [from, to) produced through \a connection, or -1. */
+static int failover_first(const int *used, int from, int to, int connection)
+{
+	int i;
+
+	for (i = from; i < to; i++) {
+		if (used[i] == connection) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/*! \brief Check every step in [from, to) was produced through \a connection. */
+static int failover_all(struct ast_test *test, const int *used, int from, int to,
+	int connection)
+{
+	int i;
+
+	for (i = from; i < to; i++) {
+		if (used[i] != connection) {
+			ast_test_status_update(test, "Step %d went to connection %d, expected %d\n",
+				i, used[i], connection);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*! \brief Check the first step in [from, to) using \a connection is in [lo, hi]. */
+static int failover_switch(struct ast_test *test, const int *used, int from, int to,
+	int connection, int lo, int hi)
+{
+	int first = failover_first(used, from, to, connection);
+
+	if (first < lo || first > hi) {
+		ast_test_status_update(test, "Switched to connection %d at step %d, expected %d to %d\n",
+			connection, first, lo, hi);
+		return -1;
+	}
+
+	return 0;
+}
+
+AST_TEST_DEFINE(connection_failover)
+{
+	enum ast_test_result_state res = AST_TEST_PASS;
+	unsigned int failing[FAILOVER_STEPS] = { 0, };
+	unsigned int held[FAILOVER_STEPS] = { 0, };
+	int used[FAILOVER_STEPS];
+	int i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "connection_failover";
+		info->category = TEST_CATEGORY;
+		info->summary = "Failover between connections follows their health";
+		info->description =
+			"Verifies failing over on errors and on a backlog, switching back "
+			"only after the recovery time, and skipping missing connections.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	/* The first connection fails for 3 s, then backs up from 16 s to 30 s */
+	for (i = 30; i < 60; i++) {
+		failing[i] = 1;
+	}
+	for (i = 160; i < 300; i++) {
+		held[i] = 1;
+	}
+	if (cdr_kafka_test_failover(3, 0, 50, 5, 10000, failing, held, FAILOVER_STEPS, 100, used)) {
+		return AST_TEST_FAIL;
+	}
+	if (failover_all(test, used, 0, 30, 0)
+		|| failover_switch(test, used, 30, 60, 1, 31, 50)
+		|| failover_all(test, used, failover_first(used, 30, 60, 1), 60, 1)
+		/* Not before the recovery time has passed */
+		|| failover_switch(test, used, 60, 160, 0, 130, 150)
+		|| failover_switch(test, used, 160, 300, 1, 165, 180)
+		|| failover_all(test, used, failover_first(used, 160, 300, 1), 300, 1)
+		|| failover_switch(test, used, 300, FAILOVER_STEPS, 0, 300, 320)) {
+		res = AST_TEST_FAIL;
+	}
+
+	/* Failures alone do not count with error_rate = 0 */
+	memset(failing, 0xff, sizeof(failing));
+	memset(held, 0, sizeof(held));
+	if (cdr_kafka_test_failover(2, 0, 0, 5, 10000, failing, held, 100, 100, used)
+		|| failover_all(test, used, 0, 100, 0)) {
+		res = AST_TEST_FAIL;
+	}
+
+	/* Nowhere to go, so stay */
+	if (cdr_kafka_test_failover(2, 2, 50, 5, 10000, failing, held, 100, 100, used)
+		|| failover_all(test, used, 0, 100, 0)) {
+		res = AST_TEST_FAIL;
+	}
+
+	/* A connection without a producer is skipped at once */
+	memset(failing, 0, sizeof(failing));
+	if (cdr_kafka_test_failover(2, 1, 50, 5, 10000, failing, held, 100, 100, used)
+		|| failover_all(test, used, 0, 100, 1)) {
+		res = AST_TEST_FAIL;
+	}
+	if (cdr_kafka_test_failover(2, 3, 50, 5, 10000, failing, held, 10, 100, used)
+		|| failover_all(test, used, 0, 10, -1)) {
+		res = AST_TEST_FAIL;
+	}
+
+	return res;
+}
+
+static unsigned int fanout_calls;
+
+/*! \brief Fails the first message it is given, takes the others. */
+static int fanout_produce(const char *topic, const char *key, const void *payload,
+	size_t len, const struct ast_kafka_header *headers, size_t header_count)
+{
+	return fanout_calls++ ? 0 : -1;
+}
+
+AST_TEST_DEFINE(fanout_missed_copy)
+{
+	enum ast_test_result_state res = AST_TEST_PASS;
+	unsigned int missed[3];
+	uint64_t failed;
+	int produced;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "fanout_missed_copy";
+		info->category = TEST_CATEGORY;
+		info->summary = "A fanout copy a connection missed is counted";
+		info->description =
+			"Verifies that with fanout over three connections a copy the "
+			"second one does not take is counted against it and as "
+			"FanoutFailed, while the message still counts as produced.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	fanout_calls = 0;
+	failed = cdr_kafka_test_counter("FanoutFailed");
+	if (cdr_kafka_test_set_produce(fanout_produce)) {
+		return AST_TEST_FAIL;
+	}
+	produced = cdr_kafka_test_fanout(ARRAY_LEN(missed), "{}", missed);
+	cdr_kafka_test_set_produce(NULL);
+
+	if (produced) {
+		ast_test_status_update(test, "Message not produced\n");
+		res = AST_TEST_FAIL;
+	}
+	if (fanout_calls != ARRAY_LEN(missed)) {
+		ast_test_status_update(test, "%u produce calls, expected %zu\n",
+			fanout_calls, ARRAY_LEN(missed));
+		res = AST_TEST_FAIL;
+	}
+	/* Copies go out before the first connection gets the payload */
+	if (missed[0] || missed[1] != 1 || missed[2]) {
+		ast_test_status_update(test, "Missed copies %u/%u/%u, expected 0/1/0\n",
+			missed[0], missed[1], missed[2]);
+		res = AST_TEST_FAIL;
+	}
+	if (cdr_kafka_test_counter("FanoutFailed") != failed + 1) {
+		ast_test_status_update(test, "FanoutFailed counter did not count the miss\n");
+		res = AST_TEST_FAIL;
+	}
+
+	return res;
+}
+
+/*! \brief Check the backpressure levels \a queue_lens lead to. */
+static int check_pressure(struct ast_test *test, unsigned int low, unsigned int high,
+	const size_t *queue_lens, const int *expected, size_t steps)
+{
+	int levels[16];
+	size_t i;
+
+	if (steps > ARRAY_LEN(levels) || cdr_kafka_test_pressure(low, high, queue_lens, steps, levels)) {
+		return -1;
+	}
+	for (i = 0; i < steps; i++) {
+		if (levels[i] != expected[i]) {
+			ast_test_status_update(test, "Queue of %zu with watermarks %u/%u gave level %d, "
+				"expected %d\n", queue_lens[i], low, high, levels[i], expected[i]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+AST_TEST_DEFINE(producer_backpressure)
+{
+	/* 0 publishes directly, 1 batches, 2 spools */
+	static const size_t queue_lens[] = { 0, 50, 100, 999, 1000, 500, 100, 99, 2000, 0, };
+	static const int both[] = { 0, 0, 1, 1, 2, 2, 2, 0, 2, 0, };
+	static const int low_only[] = { 0, 0, 1, 1, 1, 1, 1, 0, 1, 0, };
+	static const int none[] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, };
+	enum ast_test_result_state res = AST_TEST_PASS;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "producer_backpressure";
+		info->category = TEST_CATEGORY;
+		info->summary = "Producer queue length switches publishing modes";
+		info->description =
+			"Verifies that backpressure_low starts batching, that backpressure_high "
+			"spools until the queue is back below backpressure_low, and that "
+			"nothing changes without watermarks.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	if (check_pressure(test, 100, 1000, queue_lens, both, ARRAY_LEN(queue_lens))
+		|| check_pressure(test, 100, 0, queue_lens, low_only, ARRAY_LEN(queue_lens))
+		|| check_pressure(test, 0, 0, queue_lens, none, ARRAY_LEN(queue_lens))) {
+		res = AST_TEST_FAIL;
+	}
+
+	return res;
+}
+
+/*! \brief Calls and CDRs per call of the sharded queue test */
+#define SHARD_CALLS 32
+#define SHARD_LEGS 16
+
+/*! \brief What shard_produce() saw of each call */
+static struct {
+	/*! \brief Sequence of the last CDR published */
+	int last;
+	/*! \brief CDRs published */
+	int seen;
+	/*! \brief Thread that published them */
+	pthread_t thread;
+} shard_calls[SHARD_CALLS];
+
+/*! \brief CDRs published out of order or by a second thread */
+static int shard_errors;
+
+AST_MUTEX_DEFINE_STATIC(shard_lock);
+
+static int shard_produce(const char *topic, const char *key, const void *payload,
+	size_t len, const struct ast_kafka_header *headers, size_t header_count)
+{
+	char *copy = ast_strndup(payload, len);
+	const char *linkedid;
+	const char *sequence;
+	int call;
+	int seq;
+
+	if (!copy) {
+		return -1;
+	}
+	linkedid = strstr(copy, "\"linkedid\":\"call-");
+	sequence = strstr(copy, "\"sequence\":");
+	if (!linkedid || !sequence || sscanf(linkedid, "\"linkedid\":\"call-%d", &call) != 1
+		|| sscanf(sequence, "\"sequence\":%d", &seq) != 1
+		|| call < 0 || call >= SHARD_CALLS) {
+		ast_free(copy);
+		return -1;
+	}
+	ast_free(copy);
+
+	ast_mutex_lock(&shard_lock);
+	if (seq != shard_calls[call].last + 1
+		|| (shard_calls[call].seen && !pthread_equal(shard_calls[call].thread, pthread_self()))) {
+		shard_errors++;
+	}
+	shard_calls[call].last = seq;
+	shard_calls[call].thread = pthread_self();
+	shard_calls[call].seen++;
+	ast_mutex_unlock(&shard_lock);
+
+	return 0;
+}
+
+AST_TEST_DEFINE(async_key_order)
+{
+	enum ast_test_result_state res = AST_TEST_PASS;
+	struct ast_cdr *records[SHARD_CALLS * SHARD_LEGS];
+	struct ast_cdr *cdrs;
+	size_t shards[SHARD_CALLS * SHARD_LEGS];
+	size_t used[4] = { 0, };
+	size_t workers = 0;
+	size_t i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "async_key_order";
+		info->category = TEST_CATEGORY;
+		info->summary = "Several publisher threads keep the order of each call";
+		info->description =
+			"Verifies that with four publisher threads every CDR of a call "
+			"is queued for the same worker and published in order by it, "
+			"while the calls are spread over the workers.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	cdrs = ast_calloc(ARRAY_LEN(records), sizeof(*cdrs));
+	if (!cdrs) {
+		return AST_TEST_FAIL;
+	}
+	/* Interleaved like concurrent calls */
+	for (i = 0; i < ARRAY_LEN(records); i++) {
+		build_test_cdr(&cdrs[i]);
+		snprintf(cdrs[i].linkedid, sizeof(cdrs[i].linkedid), "call-%02zu", i % SHARD_CALLS);
+		cdrs[i].sequence = i / SHARD_CALLS + 1;
+		records[i] = &cdrs[i];
+	}
+
+	memset(shard_calls, 0, sizeof(shard_calls));
+	shard_errors = 0;
+	if (cdr_kafka_test_set_produce(shard_produce)) {
+		ast_free(cdrs);
+		return AST_TEST_FAIL;
+	}
+	if (cdr_kafka_test_queue(records, ARRAY_LEN(records), ARRAY_LEN(used), 8, shards)) {
+		ast_test_status_update(test, "Failed to queue the CDRs\n");
+		res = AST_TEST_FAIL;
+	}
+	cdr_kafka_test_set_produce(NULL);
+
+	for (i = 0; i < ARRAY_LEN(records); i++) {
+		if (shards[i] != shards[i % SHARD_CALLS]) {
+			ast_test_status_update(test, "CDRs of call %zu queued for several workers\n",
+				i % SHARD_CALLS);
+			res = AST_TEST_FAIL;
+			break;
+		}
+		if (shards[i] < ARRAY_LEN(used) && !used[shards[i]]++) {
+			workers++;
+		}
+	}
+	for (i = 0; i < SHARD_CALLS; i++) {
+		if (shard_calls[i].seen != SHARD_LEGS) {
+			ast_test_status_update(test, "Call %zu: %d of %d CDRs published\n",
+				i, shard_calls[i].seen, SHARD_LEGS);
+			res = AST_TEST_FAIL;
+		}
+	}
+	if (shard_errors) {
+		ast_test_status_update(test, "%d CDRs published out of order\n", shard_errors);
+		res = AST_TEST_FAIL;
+	}
+	if (workers < 2) {
+		ast_test_status_update(test, "All calls went to one worker\n");
+		res = AST_TEST_FAIL;
+	}
+
+	ast_free(cdrs);
+
+	return res;
+}
+
+/* ---- Batch test ---- */
+
+#define BATCH_CDRS 8
+
+/*! \brief Produce calls for each CDR of the batch, by linkedid. */
+static unsigned int batch_attempts[BATCH_CDRS];
+
+/*! \brief Fails the first attempt of every odd CDR. */
+static int batch_produce(const char *topic, const char *key, const void *payload,
+	size_t len, const struct ast_kafka_header *headers, size_t header_count)
+{
+	char *copy = ast_strndup(payload, len);
+	const char *linkedid;
+	int cdr;
+
+	if (!copy) {
+		return -1;
+	}
+	linkedid = strstr(copy, "\"linkedid\":\"batch-");
+	if (!linkedid || sscanf(linkedid, "\"linkedid\":\"batch-%d", &cdr) != 1
+		|| cdr < 0 || cdr >= BATCH_CDRS) {
+		ast_free(copy);
+		return -1;
+	}
+	ast_free(copy);
+
+	return batch_attempts[cdr]++ || !(cdr % 2) ? 0 : -1;
+}
+
+AST_TEST_DEFINE(batch_partial_failure)
+{
+	enum ast_test_result_state res = AST_TEST_PASS;
+	struct ast_cdr *records[BATCH_CDRS];
+	struct ast_cdr *cdrs;
+	uint64_t published;
+	uint64_t failed;
+	uint64_t spooled;
+	int spool;
+	int batch_res;
+	size_t i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "batch_partial_failure";
+		info->category = TEST_CATEGORY;
+		info->summary = "Members of a batch the producer refused are spooled";
+		info->description =
+			"Verifies that when the producer takes only some records of a "
+			"batch, the others count as Failed without a spool, and with "
+			"one are spooled and replayed, each exactly once.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	cdrs = ast_calloc(ARRAY_LEN(records), sizeof(*cdrs));
+	if (!cdrs) {
+		return AST_TEST_FAIL;
+	}
+	for (i = 0; i < ARRAY_LEN(records); i++) {
+		build_test_cdr(&cdrs[i]);
+		snprintf(cdrs[i].linkedid, sizeof(cdrs[i].linkedid), "batch-%02zu", i);
+		records[i] = &cdrs[i];
+	}
+
+	if (cdr_kafka_test_set_produce(batch_produce)) {
+		ast_free(cdrs);
+		return AST_TEST_FAIL;
+	}
+	for (spool = 0; spool <= 1; spool++) {
+		memset(batch_attempts, 0, sizeof(batch_attempts));
+		published = cdr_kafka_test_counter("Published");
+		failed = cdr_kafka_test_counter("Failed");
+		spooled = cdr_kafka_test_counter("Spooled");
+
+		batch_res = cdr_kafka_test_batch(records, ARRAY_LEN(records), spool);
+
+		published = cdr_kafka_test_counter("Published") - published;
+		failed = cdr_kafka_test_counter("Failed") - failed;
+		spooled = cdr_kafka_test_counter("Spooled") - spooled;
+		if (batch_res != (spool ? 0 : -1)) {
+			ast_test_status_update(test, "Batch with spool = %d returned %d\n", spool, batch_res);
+			res = AST_TEST_FAIL;
+		}
+		if (published != BATCH_CDRS / 2 || failed != (spool ? 0 : BATCH_CDRS / 2)
+			|| spooled != (spool ? BATCH_CDRS / 2 : 0)) {
+			ast_test_status_update(test, "Batch with spool = %d: %" PRIu64 " published, %"
+				PRIu64 " failed, %" PRIu64 " spooled\n", spool, published, failed, spooled);
+			res = AST_TEST_FAIL;
+		}
+		/* Odd CDRs come back once from the spool, even ones are never retried */
+		for (i = 0; i < ARRAY_LEN(batch_attempts); i++) {
+			unsigned int expected = i % 2 && spool ? 2 : 1;
+
+			if (batch_attempts[i] != expected) {
+				ast_test_status_update(test, "Batch with spool = %d: CDR %zu produced "
+					"%u times, expected %u\n", spool, i, batch_attempts[i], expected);
+				res = AST_TEST_FAIL;
+			}
+		}
+	}
+	cdr_kafka_test_set_produce(NULL);
+
+	ast_free(cdrs);
+
+	return res;
+}
+
+/* ---- Queue overflow test ---- */
+
+#define OVERFLOW_CDRS 32
+
+static unsigned int overflow_produced;
+
+/*! \brief Slower than the CDR thread, so a small queue fills up. */
+static int overflow_produce(const char *topic, const char *key, const void *payload,
+	size_t len, const struct ast_kafka_header *headers, size_t header_count)
+{
+	usleep(1000);
+	__atomic_add_fetch(&overflow_produced, 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/*!
+ * \brief Push OVERFLOW_CDRS CDRs through a queue of 4 under \a overflow.
+ *
+ * \param[out] produced CDRs the stand-in producer got.
+ * \param[out] dropped Change of the Dropped counter.
+ * \param[out] spooled Change of the Spooled counter.
+ * \return Number of records the queue dropped, or -1 on error.
+ */
+static int overflow_run(struct ast_test *test, const char *overflow, int spool,
+	unsigned int *produced, uint64_t *dropped, uint64_t *spooled)
+{
+	struct ast_cdr *records[OVERFLOW_CDRS];
+	struct ast_cdr *cdrs;
+	uint64_t dropped_before = cdr_kafka_test_counter("Dropped");
+	uint64_t spooled_before = cdr_kafka_test_counter("Spooled");
+	size_t i;
+	int res;
+
+	cdrs = ast_calloc(ARRAY_LEN(records), sizeof(*cdrs));
+	if (!cdrs) {
+		return -1;
+	}
+	for (i = 0; i < ARRAY_LEN(records); i++) {
+		build_test_cdr(&cdrs[i]);
+		snprintf(cdrs[i].uniqueid, sizeof(cdrs[i].uniqueid), "overflow-%02zu", i);
+		records[i] = &cdrs[i];
+	}
+
+	__atomic_store_n(&overflow_produced, 0, __ATOMIC_RELAXED);
+	if (cdr_kafka_test_set_produce(overflow_produce)) {
+		ast_free(cdrs);
+		return -1;
+	}
+	res = cdr_kafka_test_overflow(overflow, spool, 4, records, ARRAY_LEN(records));
+	cdr_kafka_test_set_produce(NULL);
+	ast_free(cdrs);
+
+	*produced = __atomic_load_n(&overflow_produced, __ATOMIC_RELAXED);
+	*dropped = cdr_kafka_test_counter("Dropped") - dropped_before;
+	*spooled = cdr_kafka_test_counter("Spooled") - spooled_before;
+	if (res < 0) {
+		ast_test_status_update(test, "Failed to queue the CDRs with overflow = %s\n", overflow);
+	}
+
+	return res;
+}
+
+AST_TEST_DEFINE(queue_overflow_modes)
+{
+	enum ast_test_result_state res = AST_TEST_PASS;
+	unsigned int produced;
+	uint64_t dropped;
+	uint64_t spooled;
+	int queue_dropped;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "queue_overflow_modes";
+		info->category = TEST_CATEGORY;
+		info->summary = "A full async queue blocks, drops or spools";
+		info->description =
+			"Verifies that a queue drained by a slow publisher thread "
+			"publishes every CDR with overflow = block, drops the oldest "
+			"ones with drop_oldest, and spools the new ones with spool, "
+			"while every CDR is accounted for once.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	queue_dropped = overflow_run(test, "block", 0, &produced, &dropped, &spooled);
+	if (queue_dropped || produced != OVERFLOW_CDRS || dropped || spooled) {
+		ast_test_status_update(test, "block: %u published, %d dropped, %" PRIu64
+			" spooled\n", produced, queue_dropped, spooled);
+		res = AST_TEST_FAIL;
+	}
+
+	queue_dropped = overflow_run(test, "drop_oldest", 0, &produced, &dropped, &spooled);
+	if (queue_dropped <= 0 || produced + queue_dropped != OVERFLOW_CDRS
+		|| dropped != (uint64_t) queue_dropped || spooled) {
+		ast_test_status_update(test, "drop_oldest: %u published, %d dropped (counter %"
+			PRIu64 "), %" PRIu64 " spooled\n", produced, queue_dropped, dropped, spooled);
+		res = AST_TEST_FAIL;
+	}
+
+	queue_dropped = overflow_run(test, "spool", 1, &produced, &dropped, &spooled);
+	if (queue_dropped || !spooled || produced + spooled != OVERFLOW_CDRS || dropped) {
+		ast_test_status_update(test, "spool: %u published, %d dropped, %" PRIu64
+			" spooled\n", produced, queue_dropped, spooled);
+		res = AST_TEST_FAIL;
+	}
+
+	return res;
+}
+
+AST_TEST_DEFINE(queue_overflow_spool_disabled)
+{
+	enum ast_test_result_state res = AST_TEST_PASS;
+	unsigned int produced;
+	uint64_t dropped;
+	uint64_t spooled;
+	int queue_dropped;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "queue_overflow_spool_disabled";
+		info->category = TEST_CATEGORY;
+		info->summary = "overflow = spool blocks when spooling is disabled";
+		info->description =
+			"Verifies that a full queue with overflow = spool and spool = no "
+			"waits for the publisher thread, so every CDR is published "
+			"and none is dropped.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	queue_dropped = overflow_run(test, "spool", 0, &produced, &dropped, &spooled);
+	if (queue_dropped || produced != OVERFLOW_CDRS || dropped || spooled) {
+		ast_test_status_update(test, "%u published, %d dropped, %" PRIu64 " spooled\n",
+			produced, queue_dropped, spooled);
+		res = AST_TEST_FAIL;
+	}
+
+	return res;
+}
+
+/* ---- Priority lanes test ---- */
+
+#define PRIORITY_RULES \
+	"disposition = ANSWERED & billsec > 0 => high\n" \
+	"disposition = NO ANSWER => low\n" \
+	"billsec = 0 => bogus"
+
+/*! \brief Give \a cdr the fields PRIORITY_RULES rank as \a class. */
+static void priority_cdr(struct ast_cdr *cdr, size_t index, char class)
+{
+	build_test_cdr(cdr);
+	snprintf(cdr->uniqueid, sizeof(cdr->uniqueid), "1700000000.%zu", index);
+	switch (class) {
+	case 'h':
+		cdr->disposition = AST_CDR_ANSWERED;
+		cdr->billsec = 30;
+		break;
+	case 'n':
+		cdr->disposition = AST_CDR_BUSY;
+		cdr->billsec = 0;
+		break;
+	default:
+		cdr->disposition = AST_CDR_NOANSWER;
+		cdr->billsec = 0;
+		break;
+	}
+}
+
+/*!
+ * \brief Queue CDRs of the classes in \a classes and check the drain order.
+ *
+ * \param expected Indexes in \a classes of the records drained, in order.
+ */
+static int check_priority(struct ast_test *test, const char *classes,
+	const unsigned int *weights, unsigned int queue_size, const size_t *expected,
+	size_t expected_count)
+{
+	struct ast_cdr cdrs[16];
+	struct ast_cdr *records[ARRAY_LEN(cdrs)];
+	size_t order[ARRAY_LEN(cdrs)];
+	size_t count = strlen(classes);
+	int drained;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		priority_cdr(&cdrs[i], i, classes[i]);
+		records[i] = &cdrs[i];
+	}
+
+	drained = cdr_kafka_test_priority(PRIORITY_RULES, weights, queue_size, records, count,
+		order);
+	if (drained != (int) expected_count) {
+		ast_test_status_update(test, "Queueing '%s' drained %d records, expected %zu\n",
+			classes, drained, expected_count);
+		return -1;
+	}
+	for (i = 0; i < expected_count; i++) {
+		if (order[i] != expected[i]) {
+			ast_test_status_update(test, "Queueing '%s' drained record %zu as #%zu, "
+				"expected record %zu\n", classes, order[i], i, expected[i]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+AST_TEST_DEFINE(priority_lanes)
+{
+	static const unsigned int weighted[] = { 2, 1, 1 };
+	static const unsigned int defaults[] = { 8, 4, 1 };
+	/* h = ANSWERED with billsec, n = no rule matches, l = NO ANSWER */
+	static const size_t weighted_order[] = { 2, 5, 1, 0, 8, 11, 4, 3, 7, 6, 10, 9 };
+	static const size_t shed_order[] = { 4, 5, 8, 7 };
+	enum ast_test_result_state res = AST_TEST_PASS;
+	uint64_t shed_low;
+	uint64_t shed_normal;
+	uint64_t shed_high;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "priority_lanes";
+		info->category = TEST_CATEGORY;
+		info->summary = "Priority classes are drained by weight and shed lowest first";
+		info->description =
+			"Verifies that priority rules sort CDRs into classes, that the "
+			"classes are drained by weight without one starving the others, "
+			"and that a full queue sheds the oldest record of the least "
+			"important class and counts it.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	if (check_priority(test, "lnhlnhlnhlnh", weighted, 64, weighted_order,
+		ARRAY_LEN(weighted_order))) {
+		res = AST_TEST_FAIL;
+	}
+
+	shed_high = cdr_kafka_test_counter("ShedHigh");
+	shed_normal = cdr_kafka_test_counter("ShedNormal");
+	shed_low = cdr_kafka_test_counter("ShedLow");
+	/* Room for four: the high records push out the low ones, then a late
+	 * low record is shed itself, and the normal ones make room among them */
+	if (check_priority(test, "llnnhhlnh", defaults, 4, shed_order, ARRAY_LEN(shed_order))) {
+		res = AST_TEST_FAIL;
+	}
+	if (cdr_kafka_test_counter("ShedLow") - shed_low != 3
+		|| cdr_kafka_test_counter("ShedNormal") - shed_normal != 2
+		|| cdr_kafka_test_counter("ShedHigh") != shed_high) {
+		ast_test_status_update(test, "Shed %" PRIu64 " high, %" PRIu64 " normal and %" PRIu64
+			" low records, expected 0, 2 and 3\n",
+			cdr_kafka_test_counter("ShedHigh") - shed_high,
+			cdr_kafka_test_counter("ShedNormal") - shed_normal,
+			cdr_kafka_test_counter("ShedLow") - shed_low);
+		res = AST_TEST_FAIL;
+	}
+
+	return res;
+}
+
+AST_TEST_DEFINE(backend_registered)
+{
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "backend_registered";
+		info->category = TEST_CATEGORY;
+		info->summary = "CDR Kafka backend is registered";
+		info->description =
+			"Verifies that the Kafka CDR backend is registered "
+			"by checking ast_cdr_is_enabled().";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	if (!ast_cdr_is_enabled()) {
+		ast_test_status_update(test,
+			"CDR system is not enabled\n");
+		return AST_TEST_FAIL;
+	}
+
+	return AST_TEST_PASS;
+}
+
+/* ---- Performance tests ---- */
+
+/*! \brief Messages taken by perf_produce() */
+static unsigned long perf_produced;
+
+static int perf_produce(const char *topic, const char *key, const void *payload,
+	size_t len, const struct ast_kafka_header *headers, size_t header_count)
+{
+	__atomic_add_fetch(&perf_produced, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static uint64_t perf_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*!
+ * \brief Build a CDR shaped like a real answered call.
+ *
+ * Adds the kind of variables a typical dialplan sets, with realistic
+ * lengths.
+ */
+static void build_perf_cdr(struct ast_cdr *cdr, size_t worker)
+{
+	struct timeval now = ast_tvnow();
+
+	build_test_cdr(cdr);
+	cdr->start = ast_tvsub(now, ast_samp2tv(120, 1));
+	cdr->answer = ast_tvsub(now, ast_samp2tv(115, 1));
+	cdr->end = now;
+	snprintf(cdr->linkedid, sizeof(cdr->linkedid), "1700000000.%zu", worker);
+
+	add_test_var(cdr, "SIPCALLID", "a84b4c76e66710@pc33.atlanta.example.com-5060");
+	add_test_var(cdr, "X_TENANT", "tenant-01");
+	add_test_var(cdr, "X_CUSTOMER_ID", "c0a80101-7f3e-4a8e-9b1a-2f6d3c9e4b70");
+	add_test_var(cdr, "FROM_DID", "+5511987654321");
+	add_test_var(cdr, "TO_DID", "+5511912345678");
+	add_test_var(cdr, "DIALSTATUS", "ANSWER");
+	add_test_var(cdr, "HANGUPCAUSE", "16");
+	add_test_var(cdr, "QUEUE", "support-level-1");
+	add_test_var(cdr, "AGENT", "PJSIP/agent-4711");
+	add_test_var(cdr, "RECORDING", "/var/spool/asterisk/monitor/2026/10/14/rec-1700000000.1.wav");
+}
+
+/*! \brief One thread of a perf run. */
+struct perf_worker {
+	pthread_t thread;
+	size_t index;
+	/*! \brief Time spent in the CDR handler for each record, in ns */
+	uint64_t *latencies;
+	size_t failures;
+};
+
+static void *perf_worker_run(void *data)
+{
+	struct perf_worker *worker = data;
+	struct ast_cdr cdr;
+	size_t i;
+
+	build_perf_cdr(&cdr, worker->index);
+	for (i = 0; i < PERF_RECORDS; i++) {
+		uint64_t start;
+
+		snprintf(cdr.uniqueid, sizeof(cdr.uniqueid), "1700000000.%zu", i);
+		start = perf_now();
+		if (cdr_kafka_test_log(&cdr)) {
+			worker->failures++;
+		}
+		worker->latencies[i] = perf_now() - start;
+	}
+	free_test_vars(&cdr);
+
+	return NULL;
+}
+
+static int perf_latency_cmp(const void *a, const void *b)
+{
+	uint64_t left = *(const uint64_t *) a;
+	uint64_t right = *(const uint64_t *) b;
+
+	return left < right ? -1 : left > right;
+}
+
+/*!
+ * \brief Log PERF_RECORDS CDRs from each of \a threads threads and report.
+ *
+ * The clock stops once the stand-in producer has seen every record, so
+ * an async queue is measured up to the point it is drained.
+ */
+static enum ast_test_result_state perf_run(struct ast_test *test, size_t threads)
+{
+	size_t total = threads * PERF_RECORDS;
+	struct perf_worker *workers;
+	uint64_t *latencies;
+	unsigned long allocations;
+	size_t failures = 0;
+	uint64_t start;
+	uint64_t elapsed;
+	size_t started;
+	size_t i;
+	enum ast_test_result_state res = AST_TEST_PASS;
+
+	workers = ast_calloc(threads, sizeof(*workers));
+	latencies = ast_calloc(total, sizeof(*latencies));
+	if (!workers || !latencies) {
+		ast_free(workers);
+		ast_free(latencies);
+		return AST_TEST_FAIL;
+	}
+
+	__atomic_store_n(&perf_produced, 0, __ATOMIC_RELAXED);
+	allocations = cdr_kafka_test_allocations();
+	start = perf_now();
+
+	for (started = 0; started < threads; started++) {
+		workers[started].index = started;
+		workers[started].latencies = latencies + started * PERF_RECORDS;
+		if (ast_pthread_create(&workers[started].thread, NULL, perf_worker_run,
+			&workers[started])) {
+			ast_test_status_update(test, "Failed to start perf thread\n");
+			res = AST_TEST_FAIL;
+			break;
+		}
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+		failures += workers[i].failures;
+	}
+	if (res != AST_TEST_PASS) {
+		goto cleanup;
+	}
+
+	while (__atomic_load_n(&perf_produced, __ATOMIC_RELAXED) < total
+		&& perf_now() - start < (uint64_t) PERF_DRAIN_TIMEOUT_MS * 1000000) {
+		usleep(1000);
+	}
+	elapsed = perf_now() - start;
+	allocations = cdr_kafka_test_allocations() - allocations;
+
+	qsort(latencies, total, sizeof(*latencies), perf_latency_cmp);
+	ast_test_status_update(test,
+		"%2zu threads: %9.0f records/s, latency p50 %.1f us, p99 %.1f us, "
+		"p99.9 %.1f us, %.2f allocations/record\n",
+		threads, total / (elapsed / 1e9),
+		latencies[total / 2] / 1e3,
+		latencies[total * 99 / 100] / 1e3,
+		latencies[total * 999 / 1000] / 1e3,
+		(double) allocations / total);
+
+	if (failures) {
+		ast_test_status_update(test, "%zu records failed\n", failures);
+		res = AST_TEST_FAIL;
+	}
+	if (__atomic_load_n(&perf_produced, __ATOMIC_RELAXED) != total) {
+		ast_test_status_update(test, "Producer got %lu of %zu records\n",
+			__atomic_load_n(&perf_produced, __ATOMIC_RELAXED), total);
+		res = AST_TEST_FAIL;
+	}
+
+cleanup:
+	ast_free(workers);
+	ast_free(latencies);
+
+	return res;
+}
+
+AST_TEST_DEFINE(perf_throughput)
+{
+	static const size_t thread_counts[] = { 1, 2, 4, 8 };
+	enum ast_test_result_state res = AST_TEST_PASS;
+	size_t i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "throughput";
+		info->category = PERF_CATEGORY;
+		info->summary = "Publish throughput and latency";
+		info->description =
+			"Logs synthetic CDRs through the Kafka CDR handler from 1, 2, "
+			"4 and 8 threads against a stand-in producer, using the "
+			"loaded cdr_kafka.conf, and reports records/sec, handler "
+			"latency percentiles and allocations per record.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	if (cdr_kafka_test_set_produce(perf_produce)) {
+		return AST_TEST_FAIL;
+	}
+
+	for (i = 0; i < ARRAY_LEN(thread_counts) && res == AST_TEST_PASS; i++) {
+		res = perf_run(test, thread_counts[i]);
+	}
+
+	cdr_kafka_test_set_produce(NULL);
+
+	return res;
+}
+
+/* ---- Benchmarks ---- */
+
+/*! \brief Keeps the compiler from dropping the benchmarked calls */
+static volatile uintptr_t bench_sink;
+
+/*! \brief Run a benchmarked function \a iterations times. */
+typedef void (*bench_fn)(void *data, unsigned int iterations);
+
+/*!
+ * \brief Read a number from \a category of BENCH_CONFIG.
+ *
+ * \return The configured value, or \a def if it is missing or invalid.
+ */
+static double bench_setting(struct ast_config *cfg, const char *category, const char *name,
+	double def)
+{
+	const char *value;
+	double res;
+
+	if (!cfg || !(value = ast_variable_retrieve(cfg, category, name))) {
+		return def;
+	}
+	if (sscanf(value, "%30lf", &res) != 1 || res < 0) {
+		ast_log(LOG_WARNING, "Invalid %s = %s in %s, using %g\n", name, value, BENCH_CONFIG, def);
+		return def;
+	}
+
+	return res;
+}
+
+/*!
+ * \brief Time \a fn and check it against its budget.
+ *
+ * Calls \a fn for a warm-up round, then BENCH_ROUNDS timed rounds. The
+ * fastest round gives the ns/op, so a busy machine does not fail the
+ * run; allocations are those the module counts over all timed rounds.
+ * The budgets are \a ns_budget and no allocations unless BENCH_CONFIG
+ * sets "<name>_ns" or "<name>_allocs" in its [budgets] section.
+ *
+ * \param ops Operations \a fn performs per iteration.
+ * \return 0 within budget, -1 otherwise.
+ */
+static int bench_run(struct ast_test *test, const char *name, bench_fn fn, void *data,
+	unsigned int ops, double ns_budget)
+{
+	struct ast_flags flags = { 0 };
+	struct ast_config *cfg = ast_config_load(BENCH_CONFIG, flags);
+	char setting[64];
+	unsigned int iterations;
+	unsigned long allocations;
+	double allocs_budget;
+	double ns_per_op;
+	double allocs_per_op;
+	uint64_t best = UINT64_MAX;
+	int i;
+
+	if (cfg == CONFIG_STATUS_FILEINVALID) {
+		ast_test_status_update(test, "%s is invalid, using the default budgets\n", BENCH_CONFIG);
+		cfg = NULL;
+	}
+	iterations = bench_setting(cfg, "general", "iterations", BENCH_ITERATIONS);
+	snprintf(setting, sizeof(setting), "%s_ns", name);
+	ns_budget = bench_setting(cfg, "budgets", setting, ns_budget);
+	snprintf(setting, sizeof(setting), "%s_allocs", name);
+	allocs_budget = bench_setting(cfg, "budgets", setting, 0);
+	if (cfg) {
+		ast_config_destroy(cfg);
+	}
+	if (!iterations) {
+		iterations = 1;
+	}
+
+	/* Grows the thread's buffers, so they are not counted below */
+	fn(data, iterations);
+
+	allocations = cdr_kafka_test_allocations();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		uint64_t start = perf_now();
+
+		fn(data, iterations);
+		best = MIN(best, perf_now() - start);
+	}
+	allocations = cdr_kafka_test_allocations() - allocations;
+
+	ns_per_op = (double) best / ((double) iterations * ops);
+	allocs_per_op = (double) allocations / ((double) iterations * ops * BENCH_ROUNDS);
+	ast_test_status_update(test, "%-14s %9.1f ns/op (budget %.1f), %.3f allocs/op (budget %.3f)\n",
+		name, ns_per_op, ns_budget, allocs_per_op, allocs_budget);
+
+	if (ns_per_op > ns_budget || allocs_per_op > allocs_budget) {
+		ast_test_status_update(test, "%s is over budget\n", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*! \brief The CDR fields that can make up the Kafka key. */
+static const char * const bench_key_fields[] = {
+	"linkedid", "uniqueid", "channel", "dstchannel", "accountcode",
+	"src", "dst", "dcontext", "tenantid", "peertenantid",
+};
+
+static void bench_key_value(void *data, unsigned int iterations)
+{
+	struct ast_cdr *cdr = data;
+	unsigned int i;
+	size_t j;
+
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < ARRAY_LEN(bench_key_fields); j++) {
+			bench_sink += (uintptr_t) cdr_get_key_value(cdr, bench_key_fields[j]);
+		}
+	}
+}
+
+AST_TEST_DEFINE(bench_key_lookup)
+{
+	struct ast_cdr cdr;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "key_lookup";
+		info->category = BENCH_CATEGORY;
+		info->summary = "cdr_get_key_value() cost";
+		info->description =
+			"Looks up each of the ten key fields with cdr_get_key_value() "
+			"and fails if one lookup takes longer, or allocates more, "
+			"than its budget in test_cdr_kafka.conf (default 100 ns, "
+			"no allocations).";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	build_test_cdr(&cdr);
+
+	return bench_run(test, "key_lookup", bench_key_value, &cdr,
+		ARRAY_LEN(bench_key_fields), 100) ? AST_TEST_FAIL : AST_TEST_PASS;
+}
+
+static void bench_json(void *data, unsigned int iterations)
+{
+	struct ast_cdr *cdr = data;
+	unsigned int i;
+	size_t len;
+
+	for (i = 0; i < iterations; i++) {
+		bench_sink += (uintptr_t) cdr_kafka_json_encode(cdr, 1, 1, &len) + len;
+	}
+}
+
+AST_TEST_DEFINE(bench_json_encode)
+{
+	static const struct {
+		const char *name;
+		size_t variables;
+		double ns_budget;
+	} cases[] = {
+		{ "json_vars_0", 0, 5000 },
+		{ "json_vars_10", 10, 10000 },
+		{ "json_vars_50", 50, 60000 },
+	};
+	struct ast_cdr cdr;
+	int res = 0;
+	size_t i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "json_encode";
+		info->category = BENCH_CATEGORY;
+		info->summary = "JSON encoder cost by variable count";
+		info->description =
+			"Encodes a CDR with 0, 10 and 50 CDR variables as JSON and "
+			"fails if a payload takes longer, or allocates more, than "
+			"its budget in test_cdr_kafka.conf (default 5, 10 and "
+			"60 us, no allocations).";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	for (i = 0; i < ARRAY_LEN(cases); i++) {
+		char name[32];
+		char value[64];
+		size_t j;
+
+		build_test_cdr(&cdr);
+		for (j = 0; j < cases[i].variables; j++) {
+			snprintf(name, sizeof(name), "X_BENCH_%zu", j);
+			snprintf(value, sizeof(value), "value-%zu-of-a-typical-dialplan-variable", j);
+			add_test_var(&cdr, name, value);
+		}
+		res |= bench_run(test, cases[i].name, bench_json, &cdr, 1, cases[i].ns_budget);
+		free_test_vars(&cdr);
+	}
+
+	return res ? AST_TEST_FAIL : AST_TEST_PASS;
+}
+
+/*! \brief The default headers plus two taken from CDR fields. */
+#define BENCH_HEADERS "entity_id,system_name,asterisk_version,timestamp,hostname," \
+	"disposition,tenantid"
+
+static void bench_headers(void *data, unsigned int iterations)
+{
+	bench_sink += cdr_kafka_test_headers_bench(BENCH_HEADERS, data, iterations);
+}
+
+AST_TEST_DEFINE(bench_header_build)
+{
+	struct ast_cdr cdr;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "header_build";
+		info->category = BENCH_CATEGORY;
+		info->summary = "Kafka header construction cost";
+		info->description =
+			"Builds the default Kafka headers plus two taken from CDR "
+			"fields, as done for every message, and fails if that takes "
+			"longer, or allocates more, than its budget in "
+			"test_cdr_kafka.conf (default 1 us, no allocations).";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	build_test_cdr(&cdr);
+	if (cdr_kafka_test_headers_bench(BENCH_HEADERS, &cdr, 1) < 0) {
+		ast_test_status_update(test, "Failed to compile the headers\n");
+		return AST_TEST_FAIL;
+	}
+
+	return bench_run(test, "header_build", bench_headers, &cdr, 1, 1000)
+		? AST_TEST_FAIL : AST_TEST_PASS;
+}
+
 /* ---- Module lifecycle ---- */
 
 static int load_module(void)
@@ -524,7 +3893,43 @@ static int load_module(void)
 	AST_TEST_REGISTER(key_case_insensitive);
 	AST_TEST_REGISTER(key_empty_field);
 	AST_TEST_REGISTER(key_unknown_field);
+	AST_TEST_REGISTER(key_composite);
+	AST_TEST_REGISTER(key_murmur2_partition);
+	AST_TEST_REGISTER(json_encoder_matches_reference);
+	AST_TEST_REGISTER(json_encoder_invalid_utf8);
+	AST_TEST_REGISTER(json_encoder_timestamps);
+	AST_TEST_REGISTER(json_encoder_plan);
+	AST_TEST_REGISTER(summary_record);
+	AST_TEST_REGISTER(json_encoder_variable_limits);
+	AST_TEST_REGISTER(json_payload_budget);
+	AST_TEST_REGISTER(headers_configured);
+	AST_TEST_REGISTER(headers_dedupe);
+	AST_TEST_REGISTER(spool_replay_headers);
+	AST_TEST_REGISTER(spool_recovery);
+	AST_TEST_REGISTER(zstd_compression);
+	AST_TEST_REGISTER(topic_routing);
+	AST_TEST_REGISTER(topic_warmup);
+	AST_TEST_REGISTER(payload_pool);
+	AST_TEST_REGISTER(delivery_reports);
+	AST_TEST_REGISTER(snapshot_reload);
+	AST_TEST_REGISTER(metrics_histogram);
+	AST_TEST_REGISTER(trace_sampling);
+	AST_TEST_REGISTER(call_aggregation);
+	AST_TEST_REGISTER(filter_rules);
+	AST_TEST_REGISTER(connection_failover);
+	AST_TEST_REGISTER(fanout_missed_copy);
+	AST_TEST_REGISTER(producer_backpressure);
+	AST_TEST_REGISTER(async_key_order);
+	AST_TEST_REGISTER(batch_partial_failure);
+	AST_TEST_REGISTER(queue_overflow_modes);
+	AST_TEST_REGISTER(queue_overflow_spool_disabled);
+	AST_TEST_REGISTER(priority_lanes);
+	AST_TEST_REGISTER(binary_formats);
 	AST_TEST_REGISTER(backend_registered);
+	AST_TEST_REGISTER(perf_throughput);
+	AST_TEST_REGISTER(bench_key_lookup);
+	AST_TEST_REGISTER(bench_json_encode);
+	AST_TEST_REGISTER(bench_header_build);
 
 	return AST_MODULE_LOAD_SUCCESS;
 }
@@ -543,7 +3948,43 @@ static int unload_module(void)
 	AST_TEST_UNREGISTER(key_case_insensitive);
 	AST_TEST_UNREGISTER(key_empty_field);
 	AST_TEST_UNREGISTER(key_unknown_field);
+	AST_TEST_UNREGISTER(key_composite);
+	AST_TEST_UNREGISTER(key_murmur2_partition);
+	AST_TEST_UNREGISTER(json_encoder_matches_reference);
+	AST_TEST_UNREGISTER(json_encoder_invalid_utf8);
+	AST_TEST_UNREGISTER(json_encoder_timestamps);
+	AST_TEST_UNREGISTER(json_encoder_plan);
+	AST_TEST_UNREGISTER(summary_record);
+	AST_TEST_UNREGISTER(json_encoder_variable_limits);
+	AST_TEST_UNREGISTER(json_payload_budget);
+	AST_TEST_UNREGISTER(headers_configured);
+	AST_TEST_UNREGISTER(headers_dedupe);
+	AST_TEST_UNREGISTER(spool_replay_headers);
+	AST_TEST_UNREGISTER(spool_recovery);
+	AST_TEST_UNREGISTER(zstd_compression);
+	AST_TEST_UNREGISTER(topic_routing);
+	AST_TEST_UNREGISTER(topic_warmup);
+	AST_TEST_UNREGISTER(payload_pool);
+	AST_TEST_UNREGISTER(delivery_reports);
+	AST_TEST_UNREGISTER(snapshot_reload);
+	AST_TEST_UNREGISTER(metrics_histogram);
+	AST_TEST_UNREGISTER(trace_sampling);
+	AST_TEST_UNREGISTER(call_aggregation);
+	AST_TEST_UNREGISTER(filter_rules);
+	AST_TEST_UNREGISTER(connection_failover);
+	AST_TEST_UNREGISTER(fanout_missed_copy);
+	AST_TEST_UNREGISTER(producer_backpressure);
+	AST_TEST_UNREGISTER(async_key_order);
+	AST_TEST_UNREGISTER(batch_partial_failure);
+	AST_TEST_UNREGISTER(queue_overflow_modes);
+	AST_TEST_UNREGISTER(queue_overflow_spool_disabled);
+	AST_TEST_UNREGISTER(priority_lanes);
+	AST_TEST_UNREGISTER(binary_formats);
 	AST_TEST_UNREGISTER(backend_registered);
+	AST_TEST_UNREGISTER(perf_throughput);
+	AST_TEST_UNREGISTER(bench_key_lookup);
+	AST_TEST_UNREGISTER(bench_json_encode);
+	AST_TEST_UNREGISTER(bench_header_build);
 
 	return 0;
 }